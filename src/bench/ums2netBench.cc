@@ -0,0 +1,515 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <string>
+#include <map>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#include "../main.h"
+#include "../servantThread.h"
+#include "../metrics.h"
+#include "../trace.h"
+#include "../ums2netconfrecord.h"
+
+volatile int quitFlag = 0;
+
+/** the data every client sends, repeated */
+#define BENCH_PATTERN_SIZE (4 * 1024 * 1024)
+
+/**
+ * One port of a run: a loopback client and the servant which writes its
+ * data to the sink.
+ */
+struct BenchPort {
+  int serverSocket; ///< listening socket on 127.0.0.1
+  int port; ///< TCP port of serverSocket
+  std::map<std::string, std::string> ddParameters; ///< operands of the servant
+  PortMetrics *metrics; ///< counters of the servant
+  const char *pattern; ///< data to send
+  long long bytes; ///< number of bytes to send
+  long long written; ///< bytes written by the servant
+  long long cpuNsec; ///< CPU time of the servant
+  long long syscalls; ///< syscalls of the servant, -1 if unknown
+  std::vector<long long> latency; ///< duration of each block write
+  pthread_t servant;
+  pthread_t client;
+};
+
+static int tracepointID = -2;
+
+/**
+ * open a perf counter of the calling thread and the threads it creates.
+ *
+ * @param type the PERF_TYPE_*.
+ * @param config the event.
+ *
+ * @return the counter, -1 if it is not available.
+ */
+static int openCounter(unsigned type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.inherit = 1;
+  attr.disabled = 1;
+  attr.exclude_hv = 1;
+  int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  return fd;
+}
+
+/**
+ * read and close a perf counter.
+ *
+ * @param fd the counter, or -1.
+ *
+ * @return the count, -1 if unknown.
+ */
+static long long closeCounter(int fd) {
+  if (fd < 0) {
+    return -1;
+  }
+  unsigned long long value;
+  long long result = -1;
+  if (read(fd, &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+    result = (long long)value;
+  }
+  close(fd);
+  return result;
+}
+
+/**
+ * get the id of the raw_syscalls:sys_enter tracepoint.
+ *
+ * @return the id, -1 if tracefs is not mounted.
+ */
+static int getTracepointID() {
+  const char *paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+  };
+  for (int i=0; i<2; i++) {
+    FILE *fp = fopen(paths[i], "r");
+    if (fp == NULL) {
+      continue;
+    }
+    int id = -1;
+    if (fscanf(fp, "%d", &id) != 1) {
+      id = -1;
+    }
+    fclose(fp);
+    if (id >= 0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+/**
+ * the servant side of a port: accept the client and write its data.
+ *
+ * CPU time and syscalls are counted for the servant thread and the
+ * threads the engine starts. Block write latency is taken from the trace
+ * spans of the session.
+ *
+ * @param data the pointer of BenchPort
+ *
+ * @return NULL.
+ */
+static void* benchServant(void *data) {
+  BenchPort *p = (BenchPort *)(data);
+  int clientSocket = accept(p->serverSocket, NULL, NULL);
+  if (clientSocket < 0) {
+    return NULL;
+  }
+
+  TraceRing ring;
+  memset(&ring, 0, sizeof(ring));
+  ring.events = (TraceEvent *)malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+  SessionMetrics sm;
+  metricsSessionStart(p->metrics, &sm);
+  traceRing = (ring.events != NULL) ? &ring : NULL;
+  int cpuFD = openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+  int syscallFD = (tracepointID >= 0) ? openCounter(PERF_TYPE_TRACEPOINT, (unsigned long long)tracepointID) : -1;
+  struct timespec cpuStart;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+
+  clientServant(clientSocket, p->ddParameters);
+
+  /* without perf only the servant thread itself is counted */
+  struct timespec cpuEnd;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+  p->syscalls = closeCounter(syscallFD);
+  p->cpuNsec = closeCounter(cpuFD);
+  if (p->cpuNsec < 0) {
+    p->cpuNsec = (cpuEnd.tv_sec - cpuStart.tv_sec) * 1000000000LL + (cpuEnd.tv_nsec - cpuStart.tv_nsec);
+  }
+  traceRing = NULL;
+  p->written = sm.bytesWritten;
+  metricsSessionEnd(p->metrics, &sm, 0);
+  close(clientSocket);
+
+  unsigned long long head = ring.head;
+  unsigned long long begin = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+  for (unsigned long long n=begin; n<head; n++) {
+    TraceEvent *event = &ring.events[n & (TRACE_RING_EVENTS - 1)];
+    if (strcmp(event->name, "write") == 0) {
+      p->latency.push_back(event->dur);
+    }
+  }
+  free(ring.events);
+  return NULL;
+}
+
+/**
+ * the client side of a port: send the data and wait for the servant to
+ * close the connection.
+ *
+ * @param data the pointer of BenchPort
+ *
+ * @return NULL.
+ */
+static void* benchClient(void *data) {
+  BenchPort *p = (BenchPort *)(data);
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)p->port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (s < 0 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (s >= 0) {
+      close(s);
+    }
+    return NULL;
+  }
+  long long sent = 0;
+  while (sent < p->bytes) {
+    long long len = std::min(p->bytes - sent, (long long)BENCH_PATTERN_SIZE);
+    ssize_t s1 = send(s, p->pattern, (size_t)len, 0);
+    if (s1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (s1 <= 0) {
+      break;
+    }
+    sent += s1;
+  }
+  shutdown(s, SHUT_WR);
+  char buf[4096];
+  while (recv(s, buf, sizeof(buf), 0) > 0) {
+  }
+  close(s);
+  return NULL;
+}
+
+/**
+ * open a listening socket on an ephemeral loopback port.
+ *
+ * @param port the port is stored here.
+ *
+ * @return the socket, -1 on error.
+ */
+static int openLoopbackSocket(int *port) {
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLen = sizeof(addr);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 1) < 0 ||
+      getsockname(s, (struct sockaddr *)&addr, &addrLen) < 0) {
+    close(s);
+    return -1;
+  }
+  *port = ntohs(addr.sin_port);
+  return s;
+}
+
+/**
+ * get a percentile.
+ *
+ * @param sorted the sorted values.
+ * @param percent the percentile.
+ *
+ * @return the value, -1 if there are none.
+ */
+static long long percentile(const std::vector<long long> &sorted, int percent) {
+  if (sorted.empty()) {
+    return -1;
+  }
+  size_t index = (sorted.size() * (size_t)percent + 99) / 100;
+  return sorted[index > 0 ? index - 1 : 0];
+}
+
+/**
+ * format a measurement, or null if it is unknown.
+ *
+ * @param value the value.
+ * @param known false if the value is unknown.
+ *
+ * @return the JSON value.
+ */
+static std::string jsonNumber(double value, bool known) {
+  if (!known) {
+    return std::string("null");
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.3f", value);
+  return std::string(buf);
+}
+
+/**
+ * run one configuration and print its result as a line of JSON.
+ *
+ * Regular files get one file per port; devices are shared by the ports.
+ *
+ * @param sink the file or device written to.
+ * @param engine the engine= operand.
+ * @param bs the bs= operand.
+ * @param nPorts the number of ports served at the same time.
+ * @param bytes the number of bytes each client sends.
+ * @param pattern the data the clients send.
+ * @param metrics the counters of each port.
+ *
+ * @return 0 if every byte reached the sink, -1 otherwise.
+ */
+static int runBench(const std::string &sink, const std::string &engine, const std::string &bs, int nPorts,
+		    long long bytes, const char *pattern, std::vector<PortMetrics *> &metrics) {
+  struct stat st;
+  bool regular = (stat(sink.c_str(), &st) < 0 || S_ISREG(st.st_mode));
+  std::vector<BenchPort> ports(nPorts);
+  for (int i=0; i<nPorts; i++) {
+    BenchPort *p = &ports[i];
+    std::string of = sink;
+    if (regular) {
+      std::stringstream name;
+      name << sink << "." << i;
+      of = name.str();
+      int fd = open(of.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd < 0) {
+	std::cerr << "Cannot create " << of << ": " << strerror(errno) << std::endl;
+	return -1;
+      }
+      close(fd);
+    }
+    p->ddParameters[std::string("of")] = of;
+    p->ddParameters[std::string("engine")] = engine;
+    p->ddParameters[std::string("bs")] = bs;
+    p->serverSocket = openLoopbackSocket(&p->port);
+    if (p->serverSocket < 0) {
+      std::cerr << "Cannot listen on the loopback: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    p->metrics = metrics[i];
+    p->pattern = pattern;
+    p->bytes = bytes;
+    p->written = 0;
+    p->cpuNsec = 0;
+    p->syscalls = -1;
+  }
+
+  long long start = metricsNow();
+  for (int i=0; i<nPorts; i++) {
+    pthread_create(&ports[i].servant, NULL, benchServant, &ports[i]);
+    pthread_create(&ports[i].client, NULL, benchClient, &ports[i]);
+  }
+  for (int i=0; i<nPorts; i++) {
+    pthread_join(ports[i].client, NULL);
+    pthread_join(ports[i].servant, NULL);
+  }
+  double seconds = (double)(metricsNow() - start) / 1e9;
+
+  long long written = 0;
+  long long cpuNsec = 0;
+  long long syscalls = 0;
+  std::vector<long long> latency;
+  for (int i=0; i<nPorts; i++) {
+    BenchPort *p = &ports[i];
+    close(p->serverSocket);
+    if (regular) {
+      unlink(p->ddParameters.at(std::string("of")).c_str());
+    }
+    written += p->written;
+    cpuNsec += p->cpuNsec;
+    syscalls = (syscalls < 0 || p->syscalls < 0) ? -1 : syscalls + p->syscalls;
+    latency.insert(latency.end(), p->latency.begin(), p->latency.end());
+  }
+  std::sort(latency.begin(), latency.end());
+  double gigabytes = (double)written / 1e9;
+  long long p50 = percentile(latency, 50);
+  long long p99 = percentile(latency, 99);
+  bool ok = (written == bytes * nPorts);
+
+  long long bsValue = 0;
+  parseDDNumber(bs, &bsValue);
+  std::cout << "{\"sink\":\"" << sink << "\",\"engine\":\"" << engine << "\",\"bs\":" << bsValue
+	    << ",\"ports\":" << nPorts << ",\"bytes\":" << written
+	    << ",\"seconds\":" << jsonNumber(seconds, true)
+	    << ",\"mb_per_s\":" << jsonNumber((double)written / 1e6 / seconds, seconds > 0)
+	    << ",\"cpu_s_per_gb\":" << jsonNumber((double)cpuNsec / 1e9 / gigabytes, written > 0)
+	    << ",\"syscalls_per_gb\":" << jsonNumber((double)syscalls / gigabytes, written > 0 && syscalls >= 0)
+	    << ",\"p50_us\":" << jsonNumber((double)p50 / 1e3, p50 >= 0)
+	    << ",\"p99_us\":" << jsonNumber((double)p99 / 1e3, p99 >= 0)
+	    << ",\"ok\":" << (ok ? "true" : "false") << "}" << std::endl;
+  return ok ? 0 : -1;
+}
+
+/**
+ * split a comma separated list.
+ *
+ * @param str the list.
+ *
+ * @return the items.
+ */
+static std::vector<std::string> splitList(const std::string &str) {
+  std::vector<std::string> items;
+  std::stringstream in(str);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    if (item.length() > 0) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+/**
+ * print usage
+ *
+ * @param prog the program name.
+ */
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [-s <sink>]... [-e <engines>] [-b <blockSizes>] [-j <maxPorts>] [-n <bytes>] [-d]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> sinks;
+  std::vector<std::string> engines = splitList(std::string("loop,splice,direct,uring"));
+  std::vector<std::string> blockSizes = splitList(std::string("64K,1M,4M"));
+  int maxPorts = 4;
+  long long bytes = 256LL * 1024 * 1024;
+  int debug = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:e:b:j:n:d")) != -1) {
+    switch(opt) {
+    case 's':
+      sinks.push_back(std::string(optarg));
+      break;
+    case 'e':
+      engines = splitList(std::string(optarg));
+      break;
+    case 'b':
+      blockSizes = splitList(std::string(optarg));
+      break;
+    case 'j':
+      maxPorts = atoi(optarg);
+      break;
+    case 'n':
+      if (!parseDDNumber(std::string(optarg), &bytes) || bytes <= 0) {
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'd':
+      debug = 1;
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (maxPorts < 1 || engines.empty() || blockSizes.empty()) {
+    usage(argv[0]);
+    exit(1);
+  }
+  if (sinks.empty()) {
+    sinks.push_back(std::string("/dev/null"));
+    sinks.push_back(std::string("/tmp/ums2net-bench"));
+    if (access("/dev/shm", W_OK) == 0) {
+      sinks.push_back(std::string("/dev/shm/ums2net-bench"));
+    }
+  }
+  openlog("ums2net-bench", LOG_PID | (debug ? LOG_PERROR : 0), LOG_USER);
+  signal(SIGPIPE, SIG_IGN);
+
+  tracepointID = getTracepointID();
+  if (tracepointID < 0) {
+    std::cerr << "tracefs is not available, syscalls are not counted" << std::endl;
+  }
+
+  /* the data is not zero, so zero blocks are never skipped */
+  char *pattern = (char *)malloc(BENCH_PATTERN_SIZE);
+  if (pattern == NULL) {
+    std::cerr << "Cannot allocate the data" << std::endl;
+    exit(1);
+  }
+  unsigned int seed = 1;
+  for (int i=0; i<BENCH_PATTERN_SIZE; i++) {
+    pattern[i] = (char)(rand_r(&seed) | 1);
+  }
+  std::vector<PortMetrics *> metrics;
+  for (int i=0; i<maxPorts; i++) {
+    metrics.push_back(metricsRegisterPort(i, std::string("bench")));
+  }
+
+  int failures = 0;
+  for (int s=0; s<(int)sinks.size(); s++) {
+    for (int e=0; e<(int)engines.size(); e++) {
+      for (int b=0; b<(int)blockSizes.size(); b++) {
+	for (int nPorts=1; nPorts<=maxPorts; nPorts*=2) {
+	  if (runBench(sinks[s], engines[e], blockSizes[b], nPorts, bytes, pattern, metrics) < 0) {
+	    failures++;
+	  }
+	}
+      }
+    }
+  }
+  free(pattern);
+  return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,352 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "blockIndex.h"
+#include "metrics.h"
+#include "trace.h"
+
+/**
+ * hash a block with MurmurHash64A.
+ *
+ * @param buf the block.
+ * @param len the length of the block.
+ *
+ * @return the hash, never 0.
+ */
+uint64_t blockHash(const char *buf, size_t len) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = 0x5553324e4554ULL ^ (len * m);
+  size_t i;
+  for (i=0; i + 8 <= len; i += 8) {
+    uint64_t k;
+    memcpy(&k, buf + i, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  if (i < len) {
+    uint64_t k = 0;
+    memcpy(&k, buf + i, len - i);
+    h ^= k;
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return (h == 0) ? 1 : h;
+}
+
+/**
+ * turn a device path into a file name.
+ *
+ * Characters other than letters, digits, '.', '-' and '_' in the device
+ * path are written as %XX, so every path has its own file name.
+ *
+ * @param devFilename the device path, usually under /dev/disk/by-id/.
+ *
+ * @return the file name.
+ */
+std::string escapeDevicePath(const std::string &devFilename) {
+  std::string name;
+  for (std::size_t i=0; i<devFilename.length(); i++) {
+    unsigned char c = (unsigned char)devFilename[i];
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_') {
+      name += (char)c;
+    } else {
+      char hex[4];
+      snprintf(hex, sizeof(hex), "%%%02X", c);
+      name += hex;
+    }
+  }
+  return name;
+}
+
+/**
+ * get the index file of a device.
+ *
+ * @param dir the directory of the index files.
+ * @param devFilename the device path.
+ *
+ * @return the path of the index file.
+ */
+std::string getBlockIndexPath(const std::string &dir, const std::string &devFilename) {
+  return dir + std::string("/") + escapeDevicePath(devFilename) + std::string(".idx");
+}
+
+/**
+ * get what identifies the state of a device.
+ *
+ * @param devFD the device.
+ * @param size the size of the device.
+ * @param mtime the mtime of a regular file, 0 for devices.
+ */
+void getDeviceIdentity(int devFD, uint64_t *size, int64_t *mtime) {
+  struct stat statbuf;
+  *size = 0;
+  *mtime = 0;
+  if (fstat(devFD, &statbuf) != 0) {
+    return;
+  }
+  if (S_ISBLK(statbuf.st_mode)) {
+    if (ioctl(devFD, BLKGETSIZE64, size) != 0) {
+      *size = 0;
+    }
+  } else {
+    *size = (uint64_t)statbuf.st_size;
+    *mtime = (int64_t)statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+  }
+}
+
+/**
+ * map the copy with room for nBlocks hashes.
+ *
+ * @param index the index.
+ * @param nBlocks the number of hashes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int blockIndexMap(BlockIndex *index, uint64_t nBlocks) {
+  size_t mapSize = sizeof(BlockIndexHeader) + nBlocks * sizeof(uint64_t);
+  if (index->header != NULL) {
+    munmap(index->header, index->mapSize);
+    index->header = NULL;
+    index->hashes = NULL;
+  }
+  if (ftruncate(index->fd, mapSize) < 0) {
+    return -1;
+  }
+  void *p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  index->header = (BlockIndexHeader *)p;
+  index->hashes = (uint64_t *)((char *)p + sizeof(BlockIndexHeader));
+  index->mapSize = mapSize;
+  index->header->nBlocks = nBlocks;
+  return 0;
+}
+
+/**
+ * open the index of a device for this session.
+ *
+ * The saved index is only used if it was made with the same block size
+ * and the device still has the size (and, for regular files, the mtime)
+ * it had when the index was saved. Otherwise the session starts with an
+ * empty index.
+ *
+ * @param index the index.
+ * @param dir the directory of the index files.
+ * @param devFilename the device path.
+ * @param devFD the device.
+ * @param blockSize the size of each indexed block.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blockIndexOpen(BlockIndex *index, const std::string &dir, const std::string &devFilename, int devFD, int blockSize) {
+  uint64_t deviceSize;
+  int64_t deviceMTime;
+  getDeviceIdentity(devFD, &deviceSize, &deviceMTime);
+
+  index->path = getBlockIndexPath(dir, devFilename);
+  index->header = NULL;
+  index->hashes = NULL;
+  index->mapSize = 0;
+  index->matched = 0;
+  /* a copy of its own for each session, so that sessions never share one */
+  std::string tmpTemplate = index->path + std::string(".XXXXXX");
+  std::vector<char> tmpPath(tmpTemplate.begin(), tmpTemplate.end());
+  tmpPath.push_back('\0');
+  index->fd = mkostemp(tmpPath.data(), O_CLOEXEC);
+  index->tmpPath = std::string(tmpPath.data());
+  if (index->fd >= 0 && fchmod(index->fd, 0644) < 0) {
+    syslog(LOG_DEBUG, "Cannot change the mode of index %s", index->tmpPath.c_str());
+  }
+  if (index->fd < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create index %s (%s)", index->tmpPath.c_str(), errstr);
+    return -1;
+  }
+
+  /* read the saved index */
+  uint64_t nBlocks = deviceSize / blockSize;
+  int oldFD = open(index->path.c_str(), O_RDONLY | O_CLOEXEC);
+  void *old = MAP_FAILED;
+  size_t oldSize = 0;
+  BlockIndexHeader *oldHeader = NULL;
+  if (oldFD >= 0) {
+    struct stat statbuf;
+    if (fstat(oldFD, &statbuf) == 0 && statbuf.st_size >= (off_t)sizeof(BlockIndexHeader)) {
+      oldSize = (size_t)statbuf.st_size;
+      old = mmap(NULL, oldSize, PROT_READ, MAP_PRIVATE, oldFD, 0);
+    }
+    close(oldFD);
+  }
+  if (old != MAP_FAILED) {
+    oldHeader = (BlockIndexHeader *)old;
+    if (memcmp(oldHeader->magic, BLOCK_INDEX_MAGIC, sizeof(oldHeader->magic)) != 0
+	|| oldHeader->blockSize != (uint32_t)blockSize
+	|| sizeof(BlockIndexHeader) + oldHeader->nBlocks * sizeof(uint64_t) > oldSize) {
+      syslog(LOG_INFO, "Index %s does not match bs=%d, start a new one", index->path.c_str(), blockSize);
+      oldHeader = NULL;
+    } else if (oldHeader->deviceSize != deviceSize || oldHeader->deviceMTime != deviceMTime) {
+      syslog(LOG_INFO, "%s has changed since the index was saved, start a new one", devFilename.c_str());
+      oldHeader = NULL;
+    } else if (oldHeader->nBlocks > nBlocks) {
+      nBlocks = oldHeader->nBlocks;
+    }
+  }
+
+  int result = blockIndexMap(index, nBlocks);
+  if (result == 0) {
+    memcpy(index->header->magic, BLOCK_INDEX_MAGIC, sizeof(index->header->magic));
+    index->header->blockSize = (uint32_t)blockSize;
+    index->header->reserved = 0;
+    if (oldHeader != NULL) {
+      memcpy(index->hashes, (const char *)old + sizeof(BlockIndexHeader), oldHeader->nBlocks * sizeof(uint64_t));
+    }
+  } else {
+    syslog(LOG_ERR, "Cannot map index %s", index->tmpPath.c_str());
+  }
+  if (old != MAP_FAILED) {
+    munmap(old, oldSize);
+  }
+  if (result < 0) {
+    close(index->fd);
+    unlink(index->tmpPath.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * check if a block is already on the device.
+ *
+ * @param index the index.
+ * @param offset the device offset of the block.
+ * @param len the length of the block.
+ * @param hash the blockHash() of the block.
+ *
+ * @return 1 if the index has the same hash for the block, otherwise 0.
+ */
+int blockIndexMatch(BlockIndex *index, off_t offset, size_t len, uint64_t hash) {
+  uint64_t blockSize = index->header->blockSize;
+  if (len != blockSize || offset % blockSize != 0) {
+    return 0;
+  }
+  uint64_t n = (uint64_t)offset / blockSize;
+  if (n >= index->header->nBlocks || index->hashes[n] != hash) {
+    return 0;
+  }
+  index->matched += (long long)len;
+  return 1;
+}
+
+/**
+ * record what is now on the device.
+ *
+ * Blocks which are not exactly one indexed block are recorded as unknown.
+ *
+ * @param index the index.
+ * @param offset the device offset of the block.
+ * @param len the length of the block.
+ * @param hash the blockHash() of the block, 0 if unknown.
+ */
+void blockIndexUpdate(BlockIndex *index, off_t offset, size_t len, uint64_t hash) {
+  uint64_t blockSize = index->header->blockSize;
+  if (len == 0) {
+    return;
+  }
+  if (len != blockSize || offset % blockSize != 0) {
+    hash = 0;
+  }
+  uint64_t first = (uint64_t)offset / blockSize;
+  uint64_t last = ((uint64_t)offset + len - 1) / blockSize;
+  if (last >= index->header->nBlocks) {
+    /* a regular file grows */
+    if (hash == 0) {
+      last = index->header->nBlocks - 1;
+      if (index->header->nBlocks == 0 || first > last) {
+	return;
+      }
+    } else if (blockIndexMap(index, last + 1) < 0) {
+      return;
+    }
+  }
+  for (uint64_t n=first; n<=last; n++) {
+    index->hashes[n] = hash;
+  }
+}
+
+/**
+ * save the index of this session in place of the old one.
+ *
+ * The identity of the device is taken after the session, so the next
+ * session can tell if something else has written it since.
+ *
+ * @param index the index.
+ * @param devFD the device, after all writes are done.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blockIndexCommit(BlockIndex *index, int devFD) {
+  int result = 0;
+  long long syncStart = metricsNow();
+  int synced = fdatasync(devFD);
+  traceSpan("fsync", syncStart, metricsNow());
+  if (synced < 0) {
+    result = -1;
+  }
+  getDeviceIdentity(devFD, &(index->header->deviceSize), &(index->header->deviceMTime));
+  if (msync(index->header, index->mapSize, MS_SYNC) < 0 || fsync(index->fd) < 0) {
+    result = -1;
+  }
+  munmap(index->header, index->mapSize);
+  index->header = NULL;
+  index->hashes = NULL;
+  close(index->fd);
+  if (result == 0 && rename(index->tmpPath.c_str(), index->path.c_str()) < 0) {
+    result = -1;
+  }
+  if (result < 0) {
+    syslog(LOG_ERR, "Cannot save index %s, remove it", index->path.c_str());
+    unlink(index->tmpPath.c_str());
+    unlink(index->path.c_str());
+  }
+  return result;
+}
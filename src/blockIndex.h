@@ -0,0 +1,66 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_BLOCK_INDEX_HEAD1_H
+#define _HEADER_UMS2NET_BLOCK_INDEX_HEAD1_H
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BLOCK_INDEX_MAGIC "UMS2IDX1"
+
+/**
+ * The header of an index file. The hashes follow it, one uint64_t per
+ * block; 0 means the block is unknown.
+ */
+struct BlockIndexHeader {
+  char magic[8]; ///< BLOCK_INDEX_MAGIC
+  uint32_t blockSize; ///< the size of each indexed block
+  uint32_t reserved;
+  uint64_t deviceSize; ///< the size of the device when the index was saved
+  int64_t deviceMTime; ///< the mtime of a regular file, 0 for devices
+  uint64_t nBlocks; ///< the number of hashes
+};
+
+/**
+ * The hash of every block last written to a device, kept in a file across
+ * sessions.
+ *
+ * Each session works on a memory-mapped copy with a unique name, which
+ * replaces the index file with rename() in blockIndexCommit().
+ */
+struct BlockIndex {
+  std::string path; ///< the index file
+  std::string tmpPath; ///< the copy being updated
+  int fd; ///< the copy
+  BlockIndexHeader *header; ///< the mapping of the copy
+  uint64_t *hashes; ///< the hashes in the mapping
+  size_t mapSize; ///< the size of the mapping
+  long long matched; ///< bytes found unchanged in this session
+};
+
+uint64_t blockHash(const char *buf, size_t len);
+std::string escapeDevicePath(const std::string &devFilename);
+void getDeviceIdentity(int devFD, uint64_t *size, int64_t *mtime);
+std::string getBlockIndexPath(const std::string &dir, const std::string &devFilename);
+int blockIndexOpen(BlockIndex *index, const std::string &dir, const std::string &devFilename, int devFD, int blockSize);
+int blockIndexMatch(BlockIndex *index, off_t offset, size_t len, uint64_t hash);
+void blockIndexUpdate(BlockIndex *index, off_t offset, size_t len, uint64_t hash);
+int blockIndexCommit(BlockIndex *index, int devFD);
+
+#endif /* _HEADER_UMS2NET_BLOCK_INDEX_HEAD1_H */
@@ -0,0 +1,249 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "checkpoint.h"
+#include "blockIndex.h"
+#include "metrics.h"
+#include "trace.h"
+
+/**
+ * check if a connection starts with a resume header, without consuming it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ *
+ * @return 1 if it does, otherwise 0.
+ */
+int sniffResumeHeader(int clientSocket) {
+  unsigned char magic[8];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  return (r1 == (ssize_t)sizeof(magic) && memcmp(magic, RESUME_HEADER_MAGIC, sizeof(magic)) == 0);
+}
+
+/**
+ * parse the header of a resumable upload.
+ *
+ * The header is the magic followed by the upload id and the image size,
+ * both little-endian uint64_t.
+ *
+ * @param buf the first bytes of the connection.
+ * @param len the number of bytes in buf.
+ * @param uploadId the upload id is stored here on success.
+ * @param imageSize the image size is stored here on success.
+ *
+ * @return 1 if success, 0 if buf is not a valid header.
+ */
+int parseResumeHeader(const unsigned char *buf, size_t len, uint64_t *uploadId, uint64_t *imageSize) {
+  if (len < RESUME_HEADER_SIZE || memcmp(buf, RESUME_HEADER_MAGIC, 8) != 0) {
+    return 0;
+  }
+  *uploadId = 0;
+  *imageSize = 0;
+  for (int i=7; i>=0; i--) {
+    *uploadId = (*uploadId << 8) | buf[8 + i];
+    *imageSize = (*imageSize << 8) | buf[16 + i];
+  }
+  return 1;
+}
+
+/**
+ * get the checkpoint file of a device.
+ *
+ * @param dir the directory of the checkpoint files.
+ * @param devFilename the device path.
+ *
+ * @return the path of the checkpoint file.
+ */
+std::string getCheckpointPath(const std::string &dir, const std::string &devFilename) {
+  return dir + std::string("/") + escapeDevicePath(devFilename) + std::string(".ckpt");
+}
+
+/**
+ * open the checkpoint of a device for an image.
+ *
+ * The saved offset is only used if it was saved for the same upload id
+ * and image size, and the device still has the size (and, for regular
+ * files, the mtime) it had when the checkpoint was saved.
+ *
+ * @param c the checkpoint.
+ * @param dir the directory of the checkpoint files, empty to keep none.
+ * @param devFilename the device path.
+ * @param outFD the device.
+ * @param uploadId the identity of the image.
+ * @param imageSize the size of the image.
+ *
+ * @return the offset to resume from.
+ */
+off_t checkpointOpen(Checkpoint *c, const std::string &dir, const std::string &devFilename, int outFD, uint64_t uploadId, uint64_t imageSize) {
+  c->outFD = outFD;
+  c->uploadId = uploadId;
+  c->imageSize = imageSize;
+  c->durable = 0;
+  c->interval = 64*1024*1024;
+  c->path = std::string();
+  if (dir.length() == 0) {
+    return 0;
+  }
+  c->path = getCheckpointPath(dir, devFilename);
+
+  FILE *fp = fopen(c->path.c_str(), "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  unsigned long long savedId, savedSize, savedOffset, savedDeviceSize;
+  long long savedMTime;
+  int n = fscanf(fp, "UMS2CKP1 %llx %llu %llu %llu %lld", &savedId, &savedSize, &savedOffset, &savedDeviceSize, &savedMTime);
+  fclose(fp);
+
+  uint64_t deviceSize;
+  int64_t deviceMTime;
+  getDeviceIdentity(outFD, &deviceSize, &deviceMTime);
+  if (n != 5 || savedId != uploadId || savedSize != imageSize || savedOffset > imageSize) {
+    syslog(LOG_INFO, "No checkpoint of upload %llx on %s, start from 0", (unsigned long long)uploadId, devFilename.c_str());
+    return 0;
+  }
+  if (savedDeviceSize != deviceSize || savedMTime != deviceMTime) {
+    syslog(LOG_INFO, "%s has changed since the checkpoint was saved, start from 0", devFilename.c_str());
+    return 0;
+  }
+  c->durable = (off_t)savedOffset;
+  return c->durable;
+}
+
+/**
+ * make the device durable up to an offset and save it as the checkpoint.
+ *
+ * The checkpoint file is replaced with rename(), so a crash leaves either
+ * the old or the new checkpoint.
+ *
+ * @param c the checkpoint.
+ * @param offset the image is written up to this offset.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int checkpointSave(Checkpoint *c, off_t offset) {
+  long long syncStart = metricsNow();
+  int synced = fdatasync(c->outFD);
+  traceSpan("fsync", syncStart, metricsNow());
+  if (synced < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot sync the device for a checkpoint (%s)", errstr);
+    return -1;
+  }
+  c->durable = offset;
+  if (c->path.length() == 0) {
+    return 0;
+  }
+
+  uint64_t deviceSize;
+  int64_t deviceMTime;
+  getDeviceIdentity(c->outFD, &deviceSize, &deviceMTime);
+  std::string tmpPath = c->path + std::string(".tmp");
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (fp == NULL) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create checkpoint %s (%s)", tmpPath.c_str(), errstr);
+    return -1;
+  }
+  fprintf(fp, "UMS2CKP1 %llx %llu %llu %llu %lld\n", (unsigned long long)c->uploadId, (unsigned long long)c->imageSize,
+	  (unsigned long long)offset, (unsigned long long)deviceSize, (long long)deviceMTime);
+  int result = 0;
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+    result = -1;
+  }
+  if (fclose(fp) != 0) {
+    result = -1;
+  }
+  if (result == 0 && rename(tmpPath.c_str(), c->path.c_str()) < 0) {
+    result = -1;
+  }
+  if (result < 0) {
+    syslog(LOG_ERR, "Cannot save checkpoint %s", c->path.c_str());
+    unlink(tmpPath.c_str());
+  }
+  return result;
+}
+
+/**
+ * answer the resume header of a client.
+ *
+ * Reads the header, looks up the checkpoint and replies with the magic
+ * and the offset to resume from as a little-endian uint64_t. The client
+ * then sends the image from that offset, and the device is positioned
+ * there.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param c the checkpoint of the session.
+ * @param dir the directory of the checkpoint files, empty to keep none.
+ * @param devFilename the device path.
+ * @param outFD the device.
+ *
+ * @return the offset to resume from, -1 on error.
+ */
+off_t resumeHandshake(int clientSocket, Checkpoint *c, const std::string &dir, const std::string &devFilename, int outFD) {
+  unsigned char buf[RESUME_HEADER_SIZE];
+  uint64_t uploadId;
+  uint64_t imageSize;
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, buf, sizeof(buf), MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 != (ssize_t)sizeof(buf) || !parseResumeHeader(buf, sizeof(buf), &uploadId, &imageSize)) {
+    syslog(LOG_ERR, "Invalid resume header for %s", devFilename.c_str());
+    return -1;
+  }
+  off_t offset = checkpointOpen(c, dir, devFilename, outFD, uploadId, imageSize);
+  if (lseek(outFD, offset, SEEK_SET) < 0) {
+    syslog(LOG_ERR, "Cannot seek %s to %lld", devFilename.c_str(), (long long)offset);
+    return -1;
+  }
+
+  unsigned char reply[16];
+  memcpy(reply, RESUME_HEADER_MAGIC, 8);
+  for (int i=0; i<8; i++) {
+    reply[8 + i] = (unsigned char)(((uint64_t)offset >> (8 * i)) & 0xff);
+  }
+  if (send(clientSocket, reply, sizeof(reply), MSG_NOSIGNAL) != (ssize_t)sizeof(reply)) {
+    syslog(LOG_ERR, "Cannot send the resume offset to the client");
+    return -1;
+  }
+  if (offset > 0) {
+    syslog(LOG_INFO, "Resume upload %llx to %s from %lld of %llu bytes", (unsigned long long)uploadId,
+	   devFilename.c_str(), (long long)offset, (unsigned long long)imageSize);
+  }
+  return offset;
+}
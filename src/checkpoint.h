@@ -0,0 +1,48 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_CHECKPOINT_HEAD1_H
+#define _HEADER_UMS2NET_CHECKPOINT_HEAD1_H
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RESUME_HEADER_MAGIC "UMS2RES1"
+#define RESUME_HEADER_SIZE 24
+
+/**
+ * How far an image is durably written to a device, kept in a file across
+ * sessions so that an interrupted upload can be resumed.
+ */
+struct Checkpoint {
+  std::string path; ///< the checkpoint file, empty if not kept
+  int outFD; ///< the device
+  uint64_t uploadId; ///< the identity of the image, chosen by the client
+  uint64_t imageSize; ///< the size of the image
+  off_t durable; ///< the image is on the device up to this offset
+  off_t interval; ///< bytes written between two checkpoints
+};
+
+int sniffResumeHeader(int clientSocket);
+int parseResumeHeader(const unsigned char *buf, size_t len, uint64_t *uploadId, uint64_t *imageSize);
+std::string getCheckpointPath(const std::string &dir, const std::string &devFilename);
+off_t checkpointOpen(Checkpoint *c, const std::string &dir, const std::string &devFilename, int outFD, uint64_t uploadId, uint64_t imageSize);
+int checkpointSave(Checkpoint *c, off_t offset);
+off_t resumeHandshake(int clientSocket, Checkpoint *c, const std::string &dir, const std::string &devFilename, int outFD);
+
+#endif /* _HEADER_UMS2NET_CHECKPOINT_HEAD1_H */
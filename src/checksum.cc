@@ -0,0 +1,278 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <syslog.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "include/config.h"
+
+#if defined(HAVE_OPENSSL_EVP_H) && defined(HAVE_LIBCRYPTO)
+#define UMS2NET_SHA256 1
+#include <openssl/evp.h>
+#endif
+
+#include "checksum.h"
+
+/**
+ * the CRC32C lookup tables for slicing by 8 bytes.
+ */
+struct Crc32cTable {
+  uint32_t t[8][256];
+
+  Crc32cTable() {
+    for (int i=0; i<256; i++) {
+      uint32_t c = (uint32_t)i;
+      for (int k=0; k<8; k++) {
+	c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+      }
+      t[0][i] = c;
+    }
+    for (int i=0; i<256; i++) {
+      for (int k=1; k<8; k++) {
+	t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+      }
+    }
+  }
+};
+
+/**
+ * compute CRC32C with lookup tables, 8 bytes at a time.
+ *
+ * @param crc the inverted CRC so far.
+ * @param buf the data.
+ * @param len the length of the data.
+ *
+ * @return the inverted CRC.
+ */
+static uint32_t crc32cGeneric(uint32_t crc, const char *buf, size_t len) {
+  static const Crc32cTable table;
+  const unsigned char *p = (const unsigned char *)buf;
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo ^= crc;
+    crc = table.t[7][lo & 0xff] ^ table.t[6][(lo >> 8) & 0xff]
+      ^ table.t[5][(lo >> 16) & 0xff] ^ table.t[4][lo >> 24]
+      ^ table.t[3][hi & 0xff] ^ table.t[2][(hi >> 8) & 0xff]
+      ^ table.t[1][(hi >> 16) & 0xff] ^ table.t[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = (crc >> 8) ^ table.t[0][(crc ^ *p) & 0xff];
+    p++;
+    len--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * compute CRC32C with the SSE4.2 crc32 instruction.
+ *
+ * @param crc the inverted CRC so far.
+ * @param buf the data.
+ * @param len the length of the data.
+ *
+ * @return the inverted CRC.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const char *buf, size_t len) {
+  uint64_t c = crc;
+  while (len > 0 && ((uintptr_t)buf % sizeof(uint64_t)) != 0) {
+    c = _mm_crc32_u8((uint32_t)c, (unsigned char)*buf);
+    buf++;
+    len--;
+  }
+  while (len >= 8) {
+    c = _mm_crc32_u64(c, *(const uint64_t *)buf);
+    buf += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    c = _mm_crc32_u8((uint32_t)c, (unsigned char)*buf);
+    buf++;
+    len--;
+  }
+  return (uint32_t)c;
+}
+#endif
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const char *, size_t);
+
+/**
+ * pick the fastest implementation of crc32c() for this CPU.
+ *
+ * @return the implementation.
+ */
+static Crc32cFunc selectCrc32c() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32cSSE42;
+  }
+#endif
+  return crc32cGeneric;
+}
+
+/**
+ * update a CRC32C (Castagnoli) with more data.
+ *
+ * The implementation is chosen at the first call by the CPU features.
+ *
+ * @param crc the CRC so far, 0 for the first call.
+ * @param buf the data.
+ * @param len the length of the data.
+ *
+ * @return the CRC including the data.
+ */
+uint32_t crc32c(uint32_t crc, const char *buf, size_t len) {
+  static const Crc32cFunc func = selectCrc32c();
+  return ~func(~crc, buf, len);
+}
+
+/**
+ * parse the value of the checksum= operand.
+ *
+ * @param str the value: none, crc32c or sha256.
+ * @param type the ChecksumType is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseChecksum(const std::string &str, int *type) {
+  static const struct {
+    const char *name;
+    int type;
+  } types[] = {
+    { "none", CHECKSUM_NONE },
+    { "crc32c", CHECKSUM_CRC32C },
+    { "sha256", CHECKSUM_SHA256 },
+  };
+  for (int i=0; i<(int)(sizeof(types)/sizeof(types[0])); i++) {
+    if (str.compare(types[i].name) == 0) {
+      *type = types[i].type;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * check if this build can compute a checksum.
+ *
+ * @param type the ChecksumType.
+ *
+ * @return 1 if supported, otherwise 0.
+ */
+int isChecksumSupported(int type) {
+  switch (type) {
+  case CHECKSUM_NONE:
+  case CHECKSUM_CRC32C:
+    return 1;
+#ifdef UMS2NET_SHA256
+  case CHECKSUM_SHA256:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+ * start a checksum.
+ *
+ * @param c the checksum.
+ * @param type the ChecksumType.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int checksumInit(Checksum *c, int type) {
+  c->type = type;
+  c->crc = 0;
+  c->sha256 = NULL;
+  c->length = 0;
+  if (type == CHECKSUM_SHA256) {
+#ifdef UMS2NET_SHA256
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+      syslog(LOG_ERR, "Cannot initialize SHA-256");
+      EVP_MD_CTX_free(ctx);
+      return -1;
+    }
+    c->sha256 = ctx;
+#else
+    return -1;
+#endif
+  }
+  return 0;
+}
+
+/**
+ * add data to a checksum.
+ *
+ * @param c the checksum.
+ * @param buf the data.
+ * @param len the length of the data.
+ */
+void checksumUpdate(Checksum *c, const char *buf, size_t len) {
+  c->crc = crc32c(c->crc, buf, len);
+  c->length += (long long)len;
+#ifdef UMS2NET_SHA256
+  if (c->sha256 != NULL) {
+    EVP_DigestUpdate((EVP_MD_CTX *)c->sha256, buf, len);
+  }
+#endif
+}
+
+/**
+ * finish a checksum and free its resources.
+ *
+ * @param c the checksum.
+ *
+ * @return the digests, e.g. "crc32c=e3069283 sha256=15e2b0d3...".
+ */
+std::string checksumFinish(Checksum *c) {
+  char hex[2*64+1];
+  snprintf(hex, sizeof(hex), "%08x", c->crc);
+  std::string result = std::string("crc32c=") + hex;
+#ifdef UMS2NET_SHA256
+  if (c->sha256 != NULL) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    EVP_MD_CTX *ctx = (EVP_MD_CTX *)c->sha256;
+    if (EVP_DigestFinal_ex(ctx, md, &mdLen) == 1) {
+      for (unsigned int i=0; i<mdLen && i<64; i++) {
+	snprintf(hex + 2*i, 3, "%02x", md[i]);
+      }
+      result += std::string(" sha256=") + hex;
+    }
+    EVP_MD_CTX_free(ctx);
+    c->sha256 = NULL;
+  }
+#endif
+  return result;
+}
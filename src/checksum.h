@@ -0,0 +1,51 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_CHECKSUM_HEAD1_H
+#define _HEADER_UMS2NET_CHECKSUM_HEAD1_H
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The checksum computed over the data written to the device.
+ */
+enum ChecksumType {
+  CHECKSUM_NONE = 0, ///< no checksum
+  CHECKSUM_CRC32C, ///< CRC32C
+  CHECKSUM_SHA256, ///< CRC32C and SHA-256
+};
+
+/**
+ * A running checksum of the stream.
+ */
+struct Checksum {
+  int type; ///< the ChecksumType
+  uint32_t crc; ///< the CRC32C so far
+  void *sha256; ///< the SHA-256 context, NULL if not computed
+  long long length; ///< bytes added so far
+};
+
+uint32_t crc32c(uint32_t crc, const char *buf, size_t len);
+int parseChecksum(const std::string &, int *);
+int isChecksumSupported(int type);
+int checksumInit(Checksum *c, int type);
+void checksumUpdate(Checksum *c, const char *buf, size_t len);
+std::string checksumFinish(Checksum *c);
+
+#endif /* _HEADER_UMS2NET_CHECKSUM_HEAD1_H */
@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "compareReader.h"
+
+/**
+ * the reading thread of a CompareReader.
+ *
+ * @param data the pointer of CompareReader
+ *
+ * @return NULL.
+ */
+static void* compareReaderThread(void *data) {
+  CompareReader *r = (CompareReader *)(data);
+  while (1) {
+    int index;
+    pthread_mutex_lock(&r->mutex);
+    while (r->freeChunks.empty() && !r->stop) {
+      pthread_cond_wait(&r->cond, &r->mutex);
+    }
+    if (r->stop) {
+      pthread_mutex_unlock(&r->mutex);
+      break;
+    }
+    index = r->freeChunks.front();
+    r->freeChunks.pop_front();
+    pthread_mutex_unlock(&r->mutex);
+
+    ssize_t r1;
+    do {
+      r1 = pread(r->fd, r->chunks[index], r->chunkSize, r->readOffset);
+    } while (r1 < 0 && errno == EINTR);
+    if (r1 < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "read from device ended (%s)", errstr);
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    if (r1 > 0) {
+      r->lengths[index] = r1;
+      r->readOffset += r1;
+      r->filledChunks.push_back(index);
+    } else {
+      r->freeChunks.push_back(index);
+    }
+    if (r1 < (ssize_t)r->chunkSize) {
+      r->eof = 1;
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    if (r1 < (ssize_t)r->chunkSize) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * start reading the device ahead.
+ *
+ * @param r the reader.
+ * @param fd the device. Only pread() is used, so its position is kept.
+ * @param offset where the incoming data starts on the device.
+ * @param chunkSize the size of each read.
+ * @param nChunks the number of reads in flight.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int compareReaderStart(CompareReader *r, int fd, off_t offset, size_t chunkSize, int nChunks) {
+  r->fd = fd;
+  r->chunkSize = chunkSize;
+  r->readOffset = offset;
+  r->eof = 0;
+  r->stop = 0;
+  r->current = -1;
+  r->currentPos = 0;
+  if (nChunks < 2) {
+    nChunks = 2;
+  }
+  for (int i=0; i<nChunks; i++) {
+    void *buf = NULL;
+    /* aligned, so that it also works with O_DIRECT */
+    if (posix_memalign(&buf, 4096, chunkSize) != 0) {
+      syslog(LOG_ERR, "Malloc buffer for %d bytes failed", (int)chunkSize);
+      for (int j=0; j<(int)r->chunks.size(); j++) {
+	free(r->chunks[j]);
+      }
+      r->chunks.clear();
+      return -1;
+    }
+    r->chunks.push_back((char *)buf);
+    r->lengths.push_back(0);
+    r->freeChunks.push_back(i);
+  }
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  int result = pthread_create(&r->thread, NULL, compareReaderThread, r);
+  if (result != 0) {
+    syslog(LOG_ERR, "Cannot create compare thread (%s)", strerror(result));
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    for (int i=0; i<(int)r->chunks.size(); i++) {
+      free(r->chunks[i]);
+    }
+    r->chunks.clear();
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * compare the next len bytes of the device with a block.
+ *
+ * The bytes are consumed from the read-ahead even if they differ, so the
+ * next call compares the following block.
+ *
+ * @param r the reader.
+ * @param buf the block.
+ * @param len the length of the block.
+ *
+ * @return 1 if the device holds the same data, otherwise 0.
+ */
+int compareReaderMatch(CompareReader *r, const char *buf, size_t len) {
+  int same = 1;
+  while (len > 0) {
+    if (r->current < 0) {
+      pthread_mutex_lock(&r->mutex);
+      while (r->filledChunks.empty() && !r->eof) {
+	pthread_cond_wait(&r->cond, &r->mutex);
+      }
+      if (r->filledChunks.empty()) {
+	/* the device is shorter than the data */
+	pthread_mutex_unlock(&r->mutex);
+	return 0;
+      }
+      r->current = r->filledChunks.front();
+      r->filledChunks.pop_front();
+      r->currentPos = 0;
+      pthread_mutex_unlock(&r->mutex);
+    }
+    size_t available = (size_t)r->lengths[r->current] - r->currentPos;
+    size_t n = (len < available) ? len : available;
+    if (same && memcmp(r->chunks[r->current] + r->currentPos, buf, n) != 0) {
+      same = 0;
+    }
+    r->currentPos += n;
+    buf += n;
+    len -= n;
+    if (r->currentPos == (size_t)r->lengths[r->current]) {
+      pthread_mutex_lock(&r->mutex);
+      r->freeChunks.push_back(r->current);
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->mutex);
+      r->current = -1;
+    }
+  }
+  return same;
+}
+
+/**
+ * stop reading ahead and free the buffers.
+ *
+ * @param r the reader.
+ */
+void compareReaderStop(CompareReader *r) {
+  pthread_mutex_lock(&r->mutex);
+  r->stop = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+  pthread_join(r->thread, NULL);
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->mutex);
+  for (int i=0; i<(int)r->chunks.size(); i++) {
+    free(r->chunks[i]);
+  }
+  r->chunks.clear();
+}
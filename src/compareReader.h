@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_COMPARE_READER_HEAD1_H
+#define _HEADER_UMS2NET_COMPARE_READER_HEAD1_H
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * Reads the device ahead of the writer, so incoming blocks can be compared
+ * with what is already on the device.
+ *
+ * A thread fills chunks with pread() from the start offset onwards; the
+ * writer consumes them in the same order with compareReaderMatch().
+ */
+struct CompareReader {
+  pthread_t thread; ///< the reading thread
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int fd; ///< the device
+  size_t chunkSize; ///< the size of each read
+  std::vector<char *> chunks; ///< the buffers
+  std::vector<ssize_t> lengths; ///< number of valid bytes in each buffer
+  std::deque<int> freeChunks; ///< buffers ready to be read into
+  std::deque<int> filledChunks; ///< buffers waiting to be compared
+  off_t readOffset; ///< the device offset of the next read
+  int eof; ///< set by the thread at the end of the device
+  int stop; ///< set to stop the thread
+  int current; ///< the buffer being compared, -1 if none
+  size_t currentPos; ///< bytes of current already compared
+};
+
+int compareReaderStart(CompareReader *r, int fd, off_t offset, size_t chunkSize, int nChunks);
+int compareReaderMatch(CompareReader *r, const char *buf, size_t len);
+void compareReaderStop(CompareReader *r);
+
+#endif /* _HEADER_UMS2NET_COMPARE_READER_HEAD1_H */
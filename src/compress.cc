@@ -0,0 +1,412 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "compress.h"
+#include "include/config.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define UMS2NET_WITH_GZIP 1
+#include <zlib.h>
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#define UMS2NET_WITH_XZ 1
+#include <lzma.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define UMS2NET_WITH_ZSTD 1
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BUF_SIZE (256*1024)
+
+/**
+ * receive some data to compress.
+ *
+ * @param c the compressor.
+ * @param buf the buffer.
+ * @param len the size of the buffer.
+ *
+ * @return the number of bytes, 0 if EOF, -1 if error.
+ */
+static ssize_t compressRecv(Compressor *c, void *buf, size_t len) {
+  while (1) {
+    ssize_t r1 = recv(c->inFD, buf, len, 0);
+    if (r1 < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    c->inLen += r1;
+    return r1;
+  }
+}
+
+/**
+ * send compressed data to the client.
+ *
+ * @param c the compressor.
+ * @param buf the data.
+ * @param len the length of the data.
+ *
+ * @return 0 on success, -1 if the client has gone away.
+ */
+static int compressSend(Compressor *c, const void *buf, size_t len) {
+  const char *bufC = (const char *)(buf);
+  while (len > 0) {
+    ssize_t w1 = send(c->outFD, bufC, len, MSG_NOSIGNAL);
+    if (w1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to client socket ended (%s)", errstr);
+      return -1;
+    }
+    c->outLen += w1;
+    bufC += w1;
+    len -= (size_t)w1;
+  }
+  return 0;
+}
+
+#ifdef UMS2NET_WITH_GZIP
+/**
+ * compress to gzip at the fastest level.
+ *
+ * @param c the compressor.
+ * @param inBuf buffer for the data.
+ * @param outBuf buffer for compressed data.
+ */
+static void compressGzip(Compressor *c, unsigned char *inBuf, unsigned char *outBuf) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    syslog(LOG_ERR, "Cannot initialize gzip encoder");
+    c->error = 1;
+    return;
+  }
+  int flush = Z_NO_FLUSH;
+  while (!quitFlag) {
+    if (zs.avail_in == 0 && flush == Z_NO_FLUSH) {
+      ssize_t r1 = compressRecv(c, inBuf, COMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	c->error = 1;
+	break;
+      } else if (r1 == 0) {
+	flush = Z_FINISH;
+      }
+      zs.next_in = inBuf;
+      zs.avail_in = (uInt)r1;
+    }
+    zs.next_out = outBuf;
+    zs.avail_out = COMPRESS_BUF_SIZE;
+    int ret = deflate(&zs, flush);
+    size_t produced = COMPRESS_BUF_SIZE - zs.avail_out;
+    if (produced > 0 && compressSend(c, outBuf, produced) < 0) {
+      c->error = 1;
+      break;
+    }
+    if (ret == Z_STREAM_END) {
+      break;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      syslog(LOG_ERR, "gzip encoder failed (%d)", ret);
+      c->error = 1;
+      break;
+    }
+  }
+  deflateEnd(&zs);
+}
+#endif
+
+#ifdef UMS2NET_WITH_XZ
+/**
+ * compress to xz with preset 0, the fastest one.
+ *
+ * @param c the compressor.
+ * @param inBuf buffer for the data.
+ * @param outBuf buffer for compressed data.
+ */
+static void compressXz(Compressor *c, unsigned char *inBuf, unsigned char *outBuf) {
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_CRC64);
+  if (ret != LZMA_OK) {
+    syslog(LOG_ERR, "Cannot initialize xz encoder (%d)", (int)ret);
+    c->error = 1;
+    return;
+  }
+  lzma_action action = LZMA_RUN;
+  while (!quitFlag) {
+    if (strm.avail_in == 0 && action == LZMA_RUN) {
+      ssize_t r1 = compressRecv(c, inBuf, COMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	c->error = 1;
+	break;
+      } else if (r1 == 0) {
+	action = LZMA_FINISH;
+      }
+      strm.next_in = inBuf;
+      strm.avail_in = (size_t)r1;
+    }
+    strm.next_out = outBuf;
+    strm.avail_out = COMPRESS_BUF_SIZE;
+    ret = lzma_code(&strm, action);
+    size_t produced = COMPRESS_BUF_SIZE - strm.avail_out;
+    if (produced > 0 && compressSend(c, outBuf, produced) < 0) {
+      c->error = 1;
+      break;
+    }
+    if (ret == LZMA_STREAM_END) {
+      break;
+    } else if (ret != LZMA_OK) {
+      syslog(LOG_ERR, "xz encoder failed (%d)", (int)ret);
+      c->error = 1;
+      break;
+    }
+  }
+  lzma_end(&strm);
+}
+#endif
+
+#ifdef UMS2NET_WITH_ZSTD
+/**
+ * compress to zstd at level 1.
+ *
+ * @param c the compressor.
+ * @param inBuf buffer for the data.
+ * @param outBuf buffer for compressed data.
+ */
+static void compressZstd(Compressor *c, unsigned char *inBuf, unsigned char *outBuf) {
+  ZSTD_CStream *zcs = ZSTD_createCStream();
+  if (zcs == NULL || ZSTD_isError(ZSTD_initCStream(zcs, 1))) {
+    syslog(LOG_ERR, "Cannot initialize zstd encoder");
+    c->error = 1;
+    ZSTD_freeCStream(zcs);
+    return;
+  }
+  ZSTD_inBuffer in = { inBuf, 0, 0 };
+  int finish = 0;
+  while (!quitFlag) {
+    if (in.pos == in.size && !finish) {
+      ssize_t r1 = compressRecv(c, inBuf, COMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	c->error = 1;
+	break;
+      } else if (r1 == 0) {
+	finish = 1;
+      }
+      in.size = (size_t)r1;
+      in.pos = 0;
+    }
+    ZSTD_outBuffer out = { outBuf, COMPRESS_BUF_SIZE, 0 };
+    size_t ret = finish ? ZSTD_endStream(zcs, &out) : ZSTD_compressStream(zcs, &out, &in);
+    if (ZSTD_isError(ret)) {
+      syslog(LOG_ERR, "zstd encoder failed (%s)", ZSTD_getErrorName(ret));
+      c->error = 1;
+      break;
+    }
+    if (out.pos > 0 && compressSend(c, outBuf, out.pos) < 0) {
+      c->error = 1;
+      break;
+    }
+    if (finish && ret == 0) {
+      break;
+    }
+  }
+  ZSTD_freeCStream(zcs);
+}
+#endif
+
+/**
+ * compress a buffer into one complete gzip member, xz stream or zstd
+ * frame, at the level of the Compressor. Chunks compressed this way can
+ * be concatenated, and are decompressed as one stream.
+ *
+ * @param compression the Compression.
+ * @param buf the data.
+ * @param len the size of the data.
+ * @param out the compressed data is stored here.
+ *
+ * @return 0 on success, -1 on error or if the compression is not supported.
+ */
+int compressChunk(int compression, const char *buf, size_t len, std::string *out) {
+  out->clear();
+  switch (compression) {
+#ifdef UMS2NET_WITH_GZIP
+  case COMP_GZIP: {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return -1;
+    }
+    /* the bound does not include the gzip header and trailer */
+    out->resize(deflateBound(&zs, (uLong)len) + 32);
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)&(*out)[0];
+    zs.avail_out = (uInt)out->size();
+    int ret = deflate(&zs, Z_FINISH);
+    out->resize(out->size() - zs.avail_out);
+    deflateEnd(&zs);
+    return (ret == Z_STREAM_END) ? 0 : -1;
+  }
+#endif
+#ifdef UMS2NET_WITH_XZ
+  case COMP_XZ: {
+    size_t outPos = 0;
+    out->resize(lzma_stream_buffer_bound(len));
+    lzma_ret ret = lzma_easy_buffer_encode(0, LZMA_CHECK_CRC64, NULL, (const uint8_t *)buf, len,
+					   (uint8_t *)&(*out)[0], &outPos, out->size());
+    out->resize(outPos);
+    return (ret == LZMA_OK) ? 0 : -1;
+  }
+#endif
+#ifdef UMS2NET_WITH_ZSTD
+  case COMP_ZSTD: {
+    out->resize(ZSTD_compressBound(len));
+    size_t ret = ZSTD_compress(&(*out)[0], out->size(), buf, len, 1);
+    if (ZSTD_isError(ret)) {
+      out->clear();
+      return -1;
+    }
+    out->resize(ret);
+    return 0;
+  }
+#endif
+  default:
+    break;
+  }
+  return -1;
+}
+
+/**
+ * the compressing thread.
+ *
+ * @param data the pointer of Compressor
+ *
+ * @return NULL.
+ */
+static void* compressThread(void *data) {
+  Compressor *c = (Compressor *)(data);
+  unsigned char *inBuf = (unsigned char *)malloc(COMPRESS_BUF_SIZE);
+  unsigned char *outBuf = (unsigned char *)malloc(COMPRESS_BUF_SIZE);
+  if (inBuf == NULL || outBuf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", COMPRESS_BUF_SIZE);
+    c->error = 1;
+  } else {
+    switch (c->compression) {
+#ifdef UMS2NET_WITH_GZIP
+    case COMP_GZIP:
+      compressGzip(c, inBuf, outBuf);
+      break;
+#endif
+#ifdef UMS2NET_WITH_XZ
+    case COMP_XZ:
+      compressXz(c, inBuf, outBuf);
+      break;
+#endif
+#ifdef UMS2NET_WITH_ZSTD
+    case COMP_ZSTD:
+      compressZstd(c, inBuf, outBuf);
+      break;
+#endif
+    default:
+      c->error = 1;
+      break;
+    }
+  }
+  free(inBuf);
+  free(outBuf);
+
+  /* if the thread stopped early, the read servant stops writing too */
+  close(c->inFD);
+  c->inFD = -1;
+  return NULL;
+}
+
+/**
+ * start compressing what is sent to the client in a new thread.
+ *
+ * @param c the compressor.
+ * @param clientSocket the socket which is connected to the client.
+ * @param compression the Compression of the stream.
+ *
+ * @return the file descriptor to write instead of the client socket, -1 on
+ *   error.
+ */
+int startCompressor(Compressor *c, int clientSocket, int compression) {
+  int fds[2];
+  c->compression = compression;
+  c->outFD = clientSocket;
+  c->error = 0;
+  c->inLen = 0;
+  c->outLen = 0;
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create socketpair for compression (%s)", errstr);
+    return -1;
+  }
+  c->inFD = fds[0];
+  c->writeFD = fds[1];
+  shutdown(c->inFD, SHUT_WR);
+  shutdown(c->writeFD, SHUT_RD);
+  int result = pthread_create(&(c->thread), NULL, compressThread, c);
+  if (result != 0) {
+    syslog(LOG_ERR, "Cannot create compression thread (%s)", strerror(result));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  return c->writeFD;
+}
+
+/**
+ * end the stream and wait for the compressing thread to send all of it.
+ *
+ * @param c the compressor.
+ *
+ * @return 0 if the whole stream was sent, -1 otherwise.
+ */
+int finishCompressor(Compressor *c) {
+  /* the thread sees EOF and finishes the stream */
+  close(c->writeFD);
+  c->writeFD = -1;
+  pthread_join(c->thread, NULL);
+  syslog(LOG_INFO, "Compressed %s: %lld bytes read, %lld bytes sent",
+	 getCompressionName(c->compression), c->inLen, c->outLen);
+  return c->error ? -1 : 0;
+}
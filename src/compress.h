@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_COMPRESS_HEAD1_H
+#define _HEADER_UMS2NET_COMPRESS_HEAD1_H
+
+#include <string>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "decompress.h"
+
+/**
+ * A thread which compresses what is written to one end of a socketpair
+ * and sends it to the client. The read servant writes the device data to
+ * the other end as if it was the client.
+ */
+struct Compressor {
+  pthread_t thread; ///< the compressing thread
+  int compression; ///< the Compression
+  int inFD; ///< read by the thread
+  int writeFD; ///< written by the read servant
+  int outFD; ///< the client socket
+  int error; ///< set if the stream cannot be completed
+  long long inLen; ///< bytes compressed
+  long long outLen; ///< compressed bytes sent
+};
+
+int startCompressor(Compressor *c, int clientSocket, int compression);
+int finishCompressor(Compressor *c);
+int compressChunk(int compression, const char *buf, size_t len, std::string *out);
+
+#endif /* _HEADER_UMS2NET_COMPRESS_HEAD1_H */
@@ -19,12 +19,22 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <set>
+#include <cstring>
+
+#include <glob.h>
+#include <fnmatch.h>
+#include <syslog.h>
 
 #include "configReader.h"
 
 /**
  * read config from file.
  *
+ * A line is a TCP port, or a range of them such as 30000-30099, and the
+ * operands. The operands are checked here; the lines which are not valid
+ * are reported and skipped.
+ *
  * @param filename the file name of the config file.
  *
  * @return the vector of UMS2NETConfRecord represents the config.
@@ -36,7 +46,9 @@ std::vector<UMS2NETConfRecord> getConfig(const std::string &filename) {
   file.open(filename, std::ios::in);
 
   std::string line;
+  int lineNumber = 0;
   while (std::getline(file, line)) {
+    lineNumber++;
     if (line[0] == '#' || line[0] == ';') {
       continue;
     }
@@ -46,14 +58,127 @@ std::vector<UMS2NETConfRecord> getConfig(const std::string &filename) {
     }
     std::string portS = line.substr(0,found);
     std::string ddS = line.substr(found+1);
-    std::istringstream istr(portS);
+    std::size_t dash = portS.find('-');
+    std::istringstream istr(portS.substr(0, dash));
     int port;
     istr >> port;
     if (istr.fail()) {
       continue;
     }
-    UMS2NETConfRecord r1 = UMS2NETConfRecord(port, ddS);
+    int lastPort = port;
+    if (dash != std::string::npos) {
+      std::istringstream istrLast(portS.substr(dash+1));
+      istrLast >> lastPort;
+      if (istrLast.fail()) {
+	syslog(LOG_ERR, "Skip line %d of %s: bad TCP port range %s", lineNumber, filename.c_str(), portS.c_str());
+	continue;
+      }
+    }
+    UMS2NETConfRecord r1 = UMS2NETConfRecord(port, lastPort, ddS);
+    std::string error;
+    std::vector<std::string> warnings;
+    int valid = r1.validate(error, warnings);
+    for (int i=0; i<(int)warnings.size(); i++) {
+      syslog(LOG_WARNING, "Line %d of %s: %s", lineNumber, filename.c_str(), warnings[i].c_str());
+    }
+    if (!valid) {
+      syslog(LOG_ERR, "Skip line %d of %s: %s", lineNumber, filename.c_str(), error.c_str());
+      continue;
+    }
     ret.push_back(r1);
   }
   return ret;
 }
+
+/**
+ * bind the port ranges to the devices which match their patterns.
+ *
+ * A device which matches the pattern of a record takes the lowest free
+ * port of its range and keeps it while the device is gone for a while, so
+ * a board which is power cycled comes back on the same port. Only when a
+ * range is full, a new device takes the lowest port of the devices which
+ * are gone. A binding which no longer matches any record is dropped. The
+ * devices which are found at once are bound in sorted order. Records
+ * without a pattern are returned as they are.
+ *
+ * @param records the records read by getConfig().
+ * @param bindings the device to port bindings of the last call, updated.
+ *
+ * @return the records of the ports which are bound, one device each.
+ */
+std::vector<UMS2NETConfRecord> expandConfig(const std::vector<UMS2NETConfRecord> &records, std::map<std::string, int> &bindings) {
+  std::vector<UMS2NETConfRecord> ret;
+  std::set<int> used;
+  for (int i=0; i<(int)records.size(); i++) {
+    if (!records[i].isTemplate()) {
+      ret.push_back(records[i]);
+      used.insert(records[i].getPort());
+    }
+  }
+
+  std::map<std::string, int> kept;
+  for (int i=0; i<(int)records.size(); i++) {
+    if (!records[i].isTemplate()) {
+      continue;
+    }
+    std::string pattern = records[i].getDevicePattern();
+    int first = records[i].getPort();
+    int last = records[i].getLastPort();
+    std::map<std::string, int> bound;
+
+    /* the devices bound before keep their ports */
+    for (std::map<std::string, int>::iterator it=bindings.begin(); it!=bindings.end(); ++it) {
+      if (kept.find(it->first) == kept.end() && it->second >= first && it->second <= last &&
+	  used.find(it->second) == used.end() &&
+	  fnmatch(pattern.c_str(), it->first.c_str(), FNM_PATHNAME) == 0) {
+	bound[it->first] = it->second;
+	kept[it->first] = it->second;
+	used.insert(it->second);
+      }
+    }
+
+    glob_t matches;
+    memset(&matches, 0, sizeof(matches));
+    if (glob(pattern.c_str(), 0, NULL, &matches) == 0) {
+      std::set<std::string> present(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+      int port = first;
+      for (int j=0; j<(int)matches.gl_pathc; j++) {
+	std::string path(matches.gl_pathv[j]);
+	if (kept.find(path) != kept.end()) {
+	  continue;
+	}
+	while (port <= last && used.find(port) != used.end()) {
+	  port++;
+	}
+	if (port > last) {
+	  /* the range is full, take the port of a device which is gone */
+	  std::string gone;
+	  for (std::map<std::string, int>::iterator it=bound.begin(); it!=bound.end(); ++it) {
+	    if (present.find(it->first) == present.end() && (gone.empty() || it->second < bound[gone])) {
+	      gone = it->first;
+	    }
+	  }
+	  if (gone.empty()) {
+	    syslog(LOG_WARNING, "No free TCP port in %d-%d for %s", first, last, path.c_str());
+	    break;
+	  }
+	  port = bound[gone];
+	  syslog(LOG_INFO, "Unbind TCP port %d from %s, which is gone", port, gone.c_str());
+	  bound.erase(gone);
+	  kept.erase(gone);
+	}
+	syslog(LOG_INFO, "Bind TCP port %d to %s", port, path.c_str());
+	bound[path] = port;
+	kept[path] = port;
+	used.insert(port);
+      }
+    }
+    globfree(&matches);
+
+    for (std::map<std::string, int>::iterator it=bound.begin(); it!=bound.end(); ++it) {
+      ret.push_back(records[i].bindDevice(it->second, it->first));
+    }
+  }
+  bindings = kept;
+  return ret;
+}
@@ -18,8 +18,11 @@
 #ifndef _HEADER_UMS2NET_CONFIG_READER_HEAD1_H
 #define _HEADER_UMS2NET_CONFIG_READER_HEAD1_H
 
+#include <map>
+
 #include "ums2netconfrecord.h"
 
 std::vector<UMS2NETConfRecord> getConfig(const std::string &);
+std::vector<UMS2NETConfRecord> expandConfig(const std::vector<UMS2NETConfRecord> &, std::map<std::string, int> &);
 
 #endif /* _HEADER_UMS2NET_CONFIG_READER_HEAD1_H */
@@ -0,0 +1,390 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#include "main.h"
+#include "copyEngine.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hubScheduler.h"
+
+/**
+ * recv len bytes exactly
+ *
+ * @param sockfd socket file descriptor
+ * @param buf the buffer
+ * @param len the length of the buffer
+ * @param flags the flags
+ *
+ * @return -1 if error, even after part of the data. 0 or less than len is
+ * EOF
+ */
+ssize_t recvn(int sockfd, void *buf, size_t len, int flags) {
+  ssize_t ret = 0;
+  char *bufC = (char *)(buf);
+  while ((size_t)ret < len) {
+    ssize_t r1 = recv(sockfd, &(bufC[ret]), len-((size_t)ret), flags);
+    if (r1 < 0) {
+      /* some error */
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      } else if (errsv == EAGAIN) {
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(sockfd, &readfds);
+	long long selectStart = metricsNow();
+	select(sockfd+1, &readfds, NULL, NULL, NULL);
+	traceSpan("select", selectStart, metricsNow());
+	continue;
+      } else if (errsv == EWOULDBLOCK) {
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(sockfd, &readfds);
+	long long selectStart = metricsNow();
+	select(sockfd+1, &readfds, NULL, NULL, NULL);
+	traceSpan("select", selectStart, metricsNow());
+	continue;
+      }
+      /* the data received so far is incomplete, so it is not returned */
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_ERR, "recvn() error (%s)", errstr);
+      errno = errsv;
+      return -1;
+    } else if (r1 == 0) {
+      /* EOF */
+      break;
+    }
+    ret += (ssize_t)(r1);
+  }
+  return ret;
+}
+
+/**
+ * copy data from socket to device through a userspace buffer.
+ *
+ * Each block is received with recvn() and then written with write().
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param outFD the file descriptor of the device.
+ * @param bufSize the size of each block.
+ * @param zero if not NULL, blocks are written through it.
+ * @param wb if not NULL, the written data is streamed to the device.
+ * @param sizer if not NULL, the size of each block is chosen by it, up to
+ *        its maxSize, instead of bufSize.
+ * @param error set to 1 if the copy stops before the end of the data,
+ *        otherwise 0.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copyLoop(int clientSocket, int outFD, int bufSize, ZeroWriter *zero, Writeback *wb, IOSizer *sizer, int *error) {
+  char *buf=NULL;
+  ssize_t bufLen;
+  ssize_t totalLen=0;
+  int eof = 0;
+
+  *error = 1;
+
+  /* allocate buffer */
+  int allocSize = (sizer != NULL) ? sizer->maxSize : bufSize;
+  buf = (char *)malloc(sizeof(char)*allocSize);
+  if (buf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", allocSize);
+    return 0;
+  }
+
+  /* copy data from socket to device */
+  while (!quitFlag) {
+    ssize_t writeBufLen = 0;
+    if (sizer != NULL) {
+      bufSize = sizer->size;
+    }
+    long long recvStart = metricsNow();
+    bufLen = recvn(clientSocket, buf, bufSize, 0);
+    if (bufLen == 0) {
+      syslog(LOG_DEBUG, "read from client socket ended");
+      eof = 1;
+      break;
+    } else if (bufLen < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
+      metricsError(METRICS_ERROR_RECV);
+      break;
+    }
+    long long writeStart = metricsNow();
+    metricsAddRecv(bufLen, writeStart - recvStart);
+    traceSpan("recv", recvStart, writeStart);
+    if (zero != NULL) {
+      writeBufLen = zeroWriterWrite(zero, buf, bufLen);
+      if (writeBufLen < 0) {
+	metricsError(METRICS_ERROR_WRITE);
+	break;
+      }
+    } else {
+      /* a short write is continued, not dropped */
+      ssize_t w1 = 0;
+      while (writeBufLen < bufLen) {
+	w1 = write(outFD, buf + writeBufLen, bufLen - writeBufLen);
+	if (w1 < 0 && errno == EINTR) {
+	  continue;
+	} else if (w1 <= 0) {
+	  break;
+	}
+	writeBufLen += w1;
+      }
+      if (w1 < 0) {
+	writeBufLen = -1;
+      } else if (writeBufLen < bufLen) {
+	errno = EIO;
+	writeBufLen = -1;
+      }
+    }
+    if (writeBufLen < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+      metricsError(METRICS_ERROR_WRITE);
+      break;
+    }
+    totalLen += writeBufLen;
+    if (wb != NULL && writebackAdd(wb, writeBufLen) < 0) {
+      metricsError(METRICS_ERROR_WRITE);
+      break;
+    }
+    /* waiting for the writeback is part of the cost of the write */
+    long long writeEnd = metricsNow();
+    long long writeNsec = writeEnd - writeStart;
+    metricsAddWrite(writeBufLen, writeNsec);
+    traceSpan("write", writeStart, writeEnd);
+    hubThrottle(writeBufLen);
+    if (sizer != NULL) {
+      ioSizerUpdate(sizer, (size_t)writeBufLen, writeNsec);
+    }
+    if (bufLen < bufSize) {
+      eof = 1;
+      break;
+    }
+  }
+  /* stopped by a failure or by a signal before the end of the data */
+  if (eof) {
+    *error = 0;
+  }
+
+  /* free the buf */
+  free(buf);
+  buf=NULL;
+
+  return totalLen;
+}
+
+/**
+ * move the data left in a pipe to the device with read() and write().
+ *
+ * Used when the device side of splice() turns out to be unsupported after
+ * some data has already been spliced from the socket into the pipe.
+ *
+ * @param pipeFD the read end of the pipe.
+ * @param outFD the file descriptor of the device.
+ * @param len the number of bytes in the pipe.
+ *
+ * @return the number of bytes written to the device, less than len on error.
+ */
+static ssize_t drainPipe(int pipeFD, int outFD, size_t len) {
+  char buf[65536];
+  ssize_t totalLen = 0;
+  while (len > 0) {
+    ssize_t r1 = read(pipeFD, buf, (len < sizeof(buf)) ? len : sizeof(buf));
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    } else if (r1 <= 0) {
+      break;
+    }
+    ssize_t done = 0;
+    while (done < r1) {
+      ssize_t w1 = write(outFD, buf + done, r1 - done);
+      if (w1 < 0 && errno == EINTR) {
+	continue;
+      } else if (w1 <= 0) {
+	int errsv = (w1 < 0) ? errno : EIO;
+	char errbuf[1024];
+	char *errstr;
+	errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+	syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+	return totalLen;
+      }
+      done += w1;
+      totalLen += w1;
+    }
+    len -= r1;
+  }
+  return totalLen;
+}
+
+/**
+ * copy data from socket to device with splice().
+ *
+ * The data moves socket -> pipe -> device inside the kernel without being
+ * copied to userspace. If the kernel refuses to splice the socket or the
+ * device, *unsupported is set to 1 and the caller should continue with
+ * copyLoop(). Whatever has already been taken from the socket is written to
+ * the device before returning, so no data is lost.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param outFD the file descriptor of the device.
+ * @param pipeSize the requested size of the pipe buffer (F_SETPIPE_SZ).
+ * @param unsupported set to 1 if splice() is not supported, otherwise 0.
+ * @param wb if not NULL, the written data is streamed to the device.
+ * @param error set to 1 if the copy stops before the end of the data,
+ *        otherwise 0.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copySplice(int clientSocket, int outFD, int pipeSize, int *unsupported, Writeback *wb, int *error) {
+  int pipeFDs[2];
+  ssize_t totalLen=0;
+  int result;
+
+  *unsupported = 0;
+  *error = 0;
+  result = pipe2(pipeFDs, O_CLOEXEC);
+  if (result < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create pipe for splice() (%s)", errstr);
+    *unsupported = 1;
+    return 0;
+  }
+
+  /* enlarge the pipe. A failure here only costs throughput. */
+  if (pipeSize > 0) {
+    result = fcntl(pipeFDs[1], F_SETPIPE_SZ, pipeSize);
+    if (result < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "Cannot set pipe size to %d (%s)", pipeSize, errstr);
+    }
+  }
+  result = fcntl(pipeFDs[1], F_GETPIPE_SZ);
+  size_t chunkSize = (result > 0) ? (size_t)result : 65536;
+
+  /* cleared at the end of the data, or when the caller falls back */
+  *error = 1;
+  while (!quitFlag) {
+    long long recvStart = metricsNow();
+    ssize_t inLen = splice(clientSocket, NULL, pipeFDs[1], NULL, chunkSize, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (inLen < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      } else if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(clientSocket, &readfds);
+	long long selectStart = metricsNow();
+	select(clientSocket+1, &readfds, NULL, NULL, NULL);
+	traceSpan("select", selectStart, metricsNow());
+	continue;
+      } else if (totalLen == 0 && (errsv == EINVAL || errsv == ENOSYS)) {
+	*unsupported = 1;
+	*error = 0;
+	break;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
+      metricsError(METRICS_ERROR_RECV);
+      break;
+    } else if (inLen == 0) {
+      syslog(LOG_DEBUG, "read from client socket ended");
+      *error = 0;
+      break;
+    }
+    long long writeStart = metricsNow();
+    metricsAddRecv(inLen, writeStart - recvStart);
+    traceSpan("recv", recvStart, writeStart);
+
+    /* move everything in the pipe to the device */
+    ssize_t chunkStart = totalLen;
+    while (inLen > 0) {
+      ssize_t outLen = splice(pipeFDs[0], NULL, outFD, NULL, inLen, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (outLen < 0) {
+	int errsv = errno;
+	if (errsv == EINTR) {
+	  continue;
+	} else if (totalLen == 0 && (errsv == EINVAL || errsv == ENOSYS)) {
+	  ssize_t drained = drainPipe(pipeFDs[0], outFD, inLen);
+	  totalLen += drained;
+	  if (drained < inLen) {
+	    /* data is lost, so the loop engine must not continue */
+	    metricsError(METRICS_ERROR_WRITE);
+	    break;
+	  }
+	  *unsupported = 1;
+	  *error = 0;
+	  inLen = 0;
+	  break;
+	}
+	char errbuf[1024];
+	char *errstr;
+	errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+	syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+	metricsError(METRICS_ERROR_WRITE);
+	break;
+      }
+      totalLen += outLen;
+      inLen -= outLen;
+    }
+    if (wb != NULL && writebackAdd(wb, totalLen - chunkStart) < 0) {
+      metricsError(METRICS_ERROR_WRITE);
+      break;
+    }
+    long long writeEnd = metricsNow();
+    metricsAddWrite(totalLen - chunkStart, writeEnd - writeStart);
+    traceSpan("write", writeStart, writeEnd);
+    hubThrottle(totalLen - chunkStart);
+    if (inLen > 0 || *unsupported) {
+      break;
+    }
+  }
+
+  close(pipeFDs[0]);
+  close(pipeFDs[1]);
+  return totalLen;
+}
@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_COPY_ENGINE_HEAD1_H
+#define _HEADER_UMS2NET_COPY_ENGINE_HEAD1_H
+
+#include <sys/types.h>
+
+#include "zeroBlock.h"
+#include "writeback.h"
+#include "ioSize.h"
+
+ssize_t recvn(int sockfd, void *buf, size_t len, int flags);
+ssize_t copyLoop(int clientSocket, int outFD, int bufSize, ZeroWriter *zero, Writeback *wb, IOSizer *sizer, int *error);
+ssize_t copySplice(int clientSocket, int outFD, int pipeSize, int *unsupported, Writeback *wb, int *error);
+ssize_t copyDirect(int clientSocket, int outFD, int bufSize, int nBuffers, ZeroWriter *zero, int *error);
+ssize_t copyUring(int clientSocket, int outFD, int bufSize, int queueDepth, int *unsupported, int *error);
+int getLogicalBlockSize(int fd);
+
+#endif /* _HEADER_UMS2NET_COPY_ENGINE_HEAD1_H */
@@ -0,0 +1,493 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "decompress.h"
+#include "include/config.h"
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define UMS2NET_WITH_GZIP 1
+#include <zlib.h>
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#define UMS2NET_WITH_XZ 1
+#include <lzma.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define UMS2NET_WITH_ZSTD 1
+#include <zstd.h>
+#endif
+
+#define DECOMPRESS_BUF_SIZE (256*1024)
+
+/**
+ * parse the value of the comp= operand.
+ *
+ * @param str the value: auto, none, gzip, xz or zstd.
+ * @param compression the Compression is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseCompression(const std::string &str, int *compression) {
+  static const struct {
+    const char *name;
+    int compression;
+  } names[] = {
+    { "auto", COMP_AUTO },
+    { "none", COMP_NONE },
+    { "gzip", COMP_GZIP },
+    { "xz", COMP_XZ },
+    { "zstd", COMP_ZSTD },
+  };
+  for (int i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++) {
+    if (str.compare(names[i].name) == 0) {
+      *compression = names[i].compression;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * detect the compression format by the magic number.
+ *
+ * @param buf the first bytes of the stream.
+ * @param len the number of bytes in buf.
+ *
+ * @return the Compression, COMP_NONE if no known magic number is found.
+ */
+int detectCompression(const unsigned char *buf, size_t len) {
+  static const unsigned char gzipMagic[] = { 0x1f, 0x8b };
+  static const unsigned char xzMagic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+  static const unsigned char zstdMagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+  if (len >= sizeof(gzipMagic) && memcmp(buf, gzipMagic, sizeof(gzipMagic)) == 0) {
+    return COMP_GZIP;
+  }
+  if (len >= sizeof(xzMagic) && memcmp(buf, xzMagic, sizeof(xzMagic)) == 0) {
+    return COMP_XZ;
+  }
+  if (len >= sizeof(zstdMagic) && memcmp(buf, zstdMagic, sizeof(zstdMagic)) == 0) {
+    return COMP_ZSTD;
+  }
+  return COMP_NONE;
+}
+
+/**
+ * detect the compression format of the client stream without consuming it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ *
+ * @return the Compression, COMP_NONE if no known magic number is found.
+ */
+int sniffCompression(int clientSocket) {
+  unsigned char magic[6];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 <= 0) {
+    return COMP_NONE;
+  }
+  return detectCompression(magic, (size_t)r1);
+}
+
+/**
+ * get the name of a compression format for logging.
+ *
+ * @param compression the Compression.
+ *
+ * @return the name.
+ */
+const char *getCompressionName(int compression) {
+  switch (compression) {
+  case COMP_GZIP:
+    return "gzip";
+  case COMP_XZ:
+    return "xz";
+  case COMP_ZSTD:
+    return "zstd";
+  case COMP_AUTO:
+    return "auto";
+  default:
+    return "none";
+  }
+}
+
+/**
+ * check if ums2net is built with a decoder for a compression format.
+ *
+ * @param compression the Compression.
+ *
+ * @return 1 if supported, otherwise 0.
+ */
+int isCompressionSupported(int compression) {
+  switch (compression) {
+#ifdef UMS2NET_WITH_GZIP
+  case COMP_GZIP:
+    return 1;
+#endif
+#ifdef UMS2NET_WITH_XZ
+  case COMP_XZ:
+    return 1;
+#endif
+#ifdef UMS2NET_WITH_ZSTD
+  case COMP_ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+ * receive some compressed data from the client.
+ *
+ * @param d the decompressor.
+ * @param buf the buffer.
+ * @param len the size of the buffer.
+ *
+ * @return the number of bytes, 0 if EOF, -1 if error.
+ */
+static ssize_t decompressRecv(Decompressor *d, void *buf, size_t len) {
+  while (1) {
+    ssize_t r1 = recv(d->inFD, buf, len, 0);
+    if (r1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
+      return -1;
+    }
+    d->inLen += r1;
+    return r1;
+  }
+}
+
+/**
+ * pass decompressed data to the copy engine.
+ *
+ * @param d the decompressor.
+ * @param buf the data.
+ * @param len the length of the data.
+ *
+ * @return 0 on success, -1 if the copy engine has stopped reading.
+ */
+static int decompressSend(Decompressor *d, const void *buf, size_t len) {
+  const char *bufC = (const char *)(buf);
+  while (len > 0) {
+    ssize_t w1 = send(d->outFD, bufC, len, MSG_NOSIGNAL);
+    if (w1 < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    d->outLen += w1;
+    bufC += w1;
+    len -= (size_t)w1;
+  }
+  return 0;
+}
+
+#ifdef UMS2NET_WITH_GZIP
+/**
+ * decompress gzip (or zlib) data. Concatenated gzip members are handled.
+ *
+ * @param d the decompressor.
+ * @param inBuf buffer for compressed data.
+ * @param outBuf buffer for decompressed data.
+ */
+static void decompressGzip(Decompressor *d, unsigned char *inBuf, unsigned char *outBuf) {
+  z_stream zs;
+  int streamEnd = 0;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    syslog(LOG_ERR, "Cannot initialize gzip decoder");
+    d->error = 1;
+    return;
+  }
+  while (!quitFlag) {
+    if (zs.avail_in == 0) {
+      ssize_t r1 = decompressRecv(d, inBuf, DECOMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	d->error = 1;
+	break;
+      } else if (r1 == 0) {
+	if (!streamEnd) {
+	  syslog(LOG_ERR, "gzip stream is truncated");
+	  d->error = 1;
+	}
+	break;
+      }
+      zs.next_in = inBuf;
+      zs.avail_in = (uInt)r1;
+    }
+    if (streamEnd) {
+      inflateReset(&zs);
+      streamEnd = 0;
+    }
+    zs.next_out = outBuf;
+    zs.avail_out = DECOMPRESS_BUF_SIZE;
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    size_t produced = DECOMPRESS_BUF_SIZE - zs.avail_out;
+    if (produced > 0 && decompressSend(d, outBuf, produced) < 0) {
+      break;
+    }
+    if (ret == Z_STREAM_END) {
+      streamEnd = 1;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      syslog(LOG_ERR, "gzip stream is corrupt (%s)", zs.msg ? zs.msg : "unknown error");
+      d->error = 1;
+      break;
+    }
+  }
+  inflateEnd(&zs);
+}
+#endif
+
+#ifdef UMS2NET_WITH_XZ
+/**
+ * decompress xz data. Blocks are decoded by d->threads threads when
+ * liblzma supports it.
+ *
+ * @param d the decompressor.
+ * @param inBuf buffer for compressed data.
+ * @param outBuf buffer for decompressed data.
+ */
+static void decompressXz(Decompressor *d, unsigned char *inBuf, unsigned char *outBuf) {
+  lzma_stream strm = LZMA_STREAM_INIT;
+  lzma_ret ret;
+#if LZMA_VERSION >= 50040002U
+  if (d->threads > 1) {
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = (uint32_t)d->threads;
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+    ret = lzma_stream_decoder_mt(&strm, &mt);
+  } else {
+    ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+  }
+#else
+  ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+  if (ret != LZMA_OK) {
+    syslog(LOG_ERR, "Cannot initialize xz decoder (%d)", (int)ret);
+    d->error = 1;
+    return;
+  }
+  lzma_action action = LZMA_RUN;
+  while (!quitFlag) {
+    if (strm.avail_in == 0 && action == LZMA_RUN) {
+      ssize_t r1 = decompressRecv(d, inBuf, DECOMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	d->error = 1;
+	break;
+      } else if (r1 == 0) {
+	action = LZMA_FINISH;
+      }
+      strm.next_in = inBuf;
+      strm.avail_in = (size_t)r1;
+    }
+    strm.next_out = outBuf;
+    strm.avail_out = DECOMPRESS_BUF_SIZE;
+    ret = lzma_code(&strm, action);
+    size_t produced = DECOMPRESS_BUF_SIZE - strm.avail_out;
+    if (produced > 0 && decompressSend(d, outBuf, produced) < 0) {
+      break;
+    }
+    if (ret == LZMA_STREAM_END) {
+      break;
+    } else if (ret != LZMA_OK) {
+      syslog(LOG_ERR, "xz stream is corrupt (%d)", (int)ret);
+      d->error = 1;
+      break;
+    }
+  }
+  lzma_end(&strm);
+}
+#endif
+
+#ifdef UMS2NET_WITH_ZSTD
+/**
+ * decompress zstd data. Concatenated frames are handled.
+ *
+ * @param d the decompressor.
+ * @param inBuf buffer for compressed data.
+ * @param outBuf buffer for decompressed data.
+ */
+static void decompressZstd(Decompressor *d, unsigned char *inBuf, unsigned char *outBuf) {
+  ZSTD_DStream *zds = ZSTD_createDStream();
+  size_t ret = 0;
+  if (zds == NULL || ZSTD_isError(ZSTD_initDStream(zds))) {
+    syslog(LOG_ERR, "Cannot initialize zstd decoder");
+    d->error = 1;
+    ZSTD_freeDStream(zds);
+    return;
+  }
+  ZSTD_inBuffer in = { inBuf, 0, 0 };
+  while (!quitFlag) {
+    if (in.pos == in.size) {
+      ssize_t r1 = decompressRecv(d, inBuf, DECOMPRESS_BUF_SIZE);
+      if (r1 < 0) {
+	d->error = 1;
+	break;
+      } else if (r1 == 0) {
+	if (ret != 0) {
+	  syslog(LOG_ERR, "zstd stream is truncated");
+	  d->error = 1;
+	}
+	break;
+      }
+      in.size = (size_t)r1;
+      in.pos = 0;
+    }
+    ZSTD_outBuffer out = { outBuf, DECOMPRESS_BUF_SIZE, 0 };
+    ret = ZSTD_decompressStream(zds, &out, &in);
+    if (ZSTD_isError(ret)) {
+      syslog(LOG_ERR, "zstd stream is corrupt (%s)", ZSTD_getErrorName(ret));
+      d->error = 1;
+      break;
+    }
+    if (out.pos > 0 && decompressSend(d, outBuf, out.pos) < 0) {
+      break;
+    }
+  }
+  ZSTD_freeDStream(zds);
+}
+#endif
+
+/**
+ * the decompressing thread.
+ *
+ * @param data the pointer of Decompressor
+ *
+ * @return NULL.
+ */
+static void* decompressThread(void *data) {
+  Decompressor *d = (Decompressor *)(data);
+  unsigned char *inBuf = (unsigned char *)malloc(DECOMPRESS_BUF_SIZE);
+  unsigned char *outBuf = (unsigned char *)malloc(DECOMPRESS_BUF_SIZE);
+  if (inBuf == NULL || outBuf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", DECOMPRESS_BUF_SIZE);
+    d->error = 1;
+  } else {
+    switch (d->compression) {
+#ifdef UMS2NET_WITH_GZIP
+    case COMP_GZIP:
+      decompressGzip(d, inBuf, outBuf);
+      break;
+#endif
+#ifdef UMS2NET_WITH_XZ
+    case COMP_XZ:
+      decompressXz(d, inBuf, outBuf);
+      break;
+#endif
+#ifdef UMS2NET_WITH_ZSTD
+    case COMP_ZSTD:
+      decompressZstd(d, inBuf, outBuf);
+      break;
+#endif
+    default:
+      d->error = 1;
+      break;
+    }
+  }
+  free(inBuf);
+  free(outBuf);
+
+  /* the copy engine sees EOF */
+  close(d->outFD);
+  d->outFD = -1;
+  return NULL;
+}
+
+/**
+ * start decompressing the client socket in a new thread.
+ *
+ * @param d the decompressor.
+ * @param clientSocket the socket which is connected to the client.
+ * @param compression the Compression of the stream.
+ * @param threads the number of decoder threads.
+ *
+ * @return the file descriptor the copy engine reads instead of the client
+ *   socket, -1 on error.
+ */
+int startDecompressor(Decompressor *d, int clientSocket, int compression, int threads) {
+  int fds[2];
+  d->compression = compression;
+  d->threads = threads;
+  d->inFD = clientSocket;
+  d->error = 0;
+  d->inLen = 0;
+  d->outLen = 0;
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create socketpair for decompression (%s)", errstr);
+    return -1;
+  }
+  d->readFD = fds[0];
+  d->outFD = fds[1];
+  shutdown(d->readFD, SHUT_WR);
+  shutdown(d->outFD, SHUT_RD);
+  int result = pthread_create(&(d->thread), NULL, decompressThread, d);
+  if (result != 0) {
+    syslog(LOG_ERR, "Cannot create decompression thread (%s)", strerror(result));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  return d->readFD;
+}
+
+/**
+ * stop the decompressing thread after the copy engine is done.
+ *
+ * @param d the decompressor.
+ *
+ * @return 0 if the whole stream was decompressed, -1 otherwise.
+ */
+int finishDecompressor(Decompressor *d) {
+  /* if the copy engine stopped early, this makes the thread stop too */
+  close(d->readFD);
+  d->readFD = -1;
+  pthread_join(d->thread, NULL);
+  syslog(LOG_INFO, "Decompressed %s: %lld bytes received, %lld bytes produced",
+	 getCompressionName(d->compression), d->inLen, d->outLen);
+  return d->error ? -1 : 0;
+}
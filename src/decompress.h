@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_DECOMPRESS_HEAD1_H
+#define _HEADER_UMS2NET_DECOMPRESS_HEAD1_H
+
+#include <string>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * The compression format of the incoming stream.
+ */
+enum Compression {
+  COMP_AUTO = -1, ///< detect by the magic number
+  COMP_NONE = 0, ///< raw data
+  COMP_GZIP, ///< gzip or zlib
+  COMP_XZ, ///< xz
+  COMP_ZSTD, ///< zstd
+};
+
+/**
+ * A thread which decompresses the client socket into one end of a
+ * socketpair. The copy engines read the other end as if it was the client.
+ */
+struct Decompressor {
+  pthread_t thread; ///< the decompressing thread
+  int compression; ///< the Compression
+  int threads; ///< decoder threads, for formats which support it
+  int inFD; ///< the client socket
+  int outFD; ///< written by the thread
+  int readFD; ///< read by the copy engine
+  int error; ///< set if the stream is corrupt
+  long long inLen; ///< compressed bytes received
+  long long outLen; ///< decompressed bytes produced
+};
+
+int parseCompression(const std::string &, int *);
+int detectCompression(const unsigned char *buf, size_t len);
+int sniffCompression(int clientSocket);
+const char *getCompressionName(int compression);
+int isCompressionSupported(int compression);
+int startDecompressor(Decompressor *d, int clientSocket, int compression, int threads);
+int finishDecompressor(Decompressor *d);
+
+#endif /* _HEADER_UMS2NET_DECOMPRESS_HEAD1_H */
@@ -0,0 +1,656 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/netlink.h>
+
+#include "main.h"
+#include "deviceManager.h"
+#include "ums2netconfrecord.h"
+
+/**
+ * A device which the manager watches.
+ */
+struct DeviceEntry {
+  int watched; ///< 0 once no port uses the device
+  int holdFD; ///< keeps the device open while it is present, -1 if absent
+  dev_t dev; ///< st_dev of the path when it was opened
+  ino_t ino; ///< st_ino of the path when it was opened
+  dev_t rdev; ///< st_rdev of the path when it was opened
+  DeviceInfo info; ///< read when it was opened
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t scanLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+static std::map<std::string, DeviceEntry> devices;
+static int running = 0;
+static int stopFDs[2] = { -1, -1 };
+static int eventFDs[2] = { -1, -1 };
+static pthread_t watcher;
+
+/**
+ * find where a block device is on the USB.
+ *
+ * @param rdev the device number.
+ * @param info the speed of its link, its hub and its root hub are stored
+ *        here; they are left empty if the device is not on USB.
+ */
+static void getUSBTopology(dev_t rdev, DeviceInfo *info) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(rdev), minor(rdev));
+  char *resolved = realpath(path, NULL);
+  if (resolved == NULL) {
+    return;
+  }
+  /* the USB device is an ancestor of the disk, and its hub is its parent */
+  std::string dir(resolved);
+  free(resolved);
+  while (dir.length() > strlen("/sys/devices/")) {
+    struct stat st;
+    std::string speedPath = dir + "/speed";
+    if (stat((dir + "/idVendor").c_str(), &st) == 0 && stat(speedPath.c_str(), &st) == 0) {
+      info->usbSpeed = (int)readSysfsNumber(speedPath.c_str());
+      std::string hub = dir.substr(0, dir.rfind('/'));
+      info->hubSpeed = (int)readSysfsNumber((hub + "/speed").c_str());
+      snprintf(info->usbHub, sizeof(info->usbHub), "%s", hub.substr(hub.rfind('/') + 1).c_str());
+      /* the root hub is named usbN after its bus */
+      std::size_t bus = dir.find("/usb");
+      while (bus != std::string::npos && (bus + 4 >= dir.length() || dir[bus + 4] < '0' || dir[bus + 4] > '9')) {
+	bus = dir.find("/usb", bus + 1);
+      }
+      if (bus != std::string::npos) {
+	std::string name = dir.substr(bus + 1);
+	snprintf(info->usbBus, sizeof(info->usbBus), "%s", name.substr(0, name.find('/')).c_str());
+      }
+      break;
+    }
+    dir = dir.substr(0, dir.rfind('/'));
+  }
+}
+
+/**
+ * get the NUMA node of the controller of a block device.
+ *
+ * @param rdev the device number.
+ *
+ * @return the node, -1 if unknown.
+ */
+static int getNumaNode(dev_t rdev) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(rdev), minor(rdev));
+  char *resolved = realpath(path, NULL);
+  if (resolved == NULL) {
+    return -1;
+  }
+  /* the PCI device of the host controller is an ancestor of the disk */
+  std::string dir(resolved);
+  free(resolved);
+  while (dir.length() > strlen("/sys/devices/")) {
+    std::string nodePath = dir + "/numa_node";
+    struct stat st;
+    if (stat(nodePath.c_str(), &st) == 0) {
+      char buf[32];
+      int fd = open(nodePath.c_str(), O_RDONLY | O_CLOEXEC);
+      ssize_t len = (fd >= 0) ? read(fd, buf, sizeof(buf) - 1) : -1;
+      if (fd >= 0) {
+	close(fd);
+      }
+      if (len <= 0) {
+	return -1;
+      }
+      buf[len] = '\0';
+      return atoi(buf);
+    }
+    dir = dir.substr(0, dir.rfind('/'));
+  }
+  return -1;
+}
+
+/**
+ * read what is known about an open device.
+ *
+ * @param fd the device.
+ * @param st the stat of the device.
+ * @param info the information is stored here.
+ */
+static void getDeviceInfo(int fd, const struct stat *st, DeviceInfo *info) {
+  memset(info, 0, sizeof(*info));
+  info->numaNode = -1;
+  info->size = (long long)st->st_size;
+  if (S_ISBLK(st->st_mode)) {
+    unsigned long long size = 0;
+    if (ioctl(fd, BLKGETSIZE64, &size) == 0) {
+      info->size = (long long)size;
+    }
+    getUSBTopology(st->st_rdev, info);
+    info->numaNode = getNumaNode(st->st_rdev);
+  }
+  getDeviceTopology(fd, &info->topology);
+}
+
+/**
+ * open a device which the manager does not watch.
+ *
+ * @param path the device path.
+ * @param flags the flags of open().
+ * @param info the information is stored here.
+ *
+ * @return the file descriptor, -1 on error.
+ */
+static int openUnwatched(const std::string &path, int flags, DeviceInfo *info) {
+  int fd = open(path.c_str(), flags);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    getDeviceInfo(fd, &st, info);
+  }
+  return fd;
+}
+
+/**
+ * check every watched path and open the devices which have appeared.
+ *
+ * Only one scan runs at a time, so the devices are opened without the
+ * lock held.
+ *
+ * @param refresh if 1, read the information of present devices again.
+ */
+static void rescanDevices(int refresh) {
+  pthread_mutex_lock(&scanLock);
+  pthread_mutex_lock(&lock);
+  std::vector<std::string> paths;
+  for (std::map<std::string, DeviceEntry>::iterator it=devices.begin(); it!=devices.end(); ++it) {
+    /* a pattern only has its directory watched */
+    if (it->second.watched && !isDevicePattern(it->first)) {
+      paths.push_back(it->first);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (int i=0; i<(int)paths.size(); i++) {
+    pthread_mutex_lock(&lock);
+    DeviceEntry old = devices[paths[i]];
+    pthread_mutex_unlock(&lock);
+
+    struct stat st;
+    if (stat(paths[i].c_str(), &st) < 0) {
+      if (old.holdFD >= 0) {
+	syslog(LOG_INFO, "Device %s removed", paths[i].c_str());
+	pthread_mutex_lock(&lock);
+	devices[paths[i]].holdFD = -1;
+	pthread_mutex_unlock(&lock);
+	close(old.holdFD);
+      }
+      continue;
+    }
+    int same = (old.holdFD >= 0 && old.dev == st.st_dev && old.ino == st.st_ino && old.rdev == st.st_rdev);
+    if (same && !refresh) {
+      continue;
+    }
+
+    DeviceEntry entry;
+    entry.watched = 1;
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.rdev = st.st_rdev;
+    if (same) {
+      entry.holdFD = old.holdFD;
+    } else {
+      /* the device may not take opens until it has settled, try again later */
+      entry.holdFD = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+      if (entry.holdFD < 0) {
+	continue;
+      }
+    }
+    getDeviceInfo(entry.holdFD, &st, &entry.info);
+    if (!same) {
+      syslog(LOG_INFO, "Device %s appeared: %lld bytes, logical %d, physical %d, USB %d Mbit/s",
+	     paths[i].c_str(), entry.info.size, entry.info.topology.logicalBlockSize,
+	     entry.info.topology.physicalBlockSize, entry.info.usbSpeed);
+    }
+
+    pthread_mutex_lock(&lock);
+    int watched = devices[paths[i]].watched;
+    if (watched) {
+      devices[paths[i]] = entry;
+      pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+    if (!watched && !same) {
+      /* no port uses it any more */
+      close(entry.holdFD);
+    } else if (old.holdFD >= 0 && !same) {
+      close(old.holdFD);
+    }
+  }
+  pthread_mutex_unlock(&scanLock);
+}
+
+/**
+ * open the uevent socket of the kernel and of udev.
+ *
+ * @return the socket, -1 if it cannot be opened.
+ */
+static int openUeventSocket() {
+  int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (s < 0) {
+    return -1;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  /* udev sends its events once the links in /dev are made */
+  addr.nl_groups = 1 | 2;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    addr.nl_groups = 1;
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(s);
+      return -1;
+    }
+  }
+  return s;
+}
+
+/**
+ * watch the directories of the devices which are not watched yet.
+ *
+ * @param inotifyFD the inotify instance.
+ * @param watched the directories being watched.
+ *
+ * @return the number of directories which are watched from now on.
+ */
+static int watchDirectories(int inotifyFD, std::set<std::string> &watched) {
+  pthread_mutex_lock(&lock);
+  std::vector<std::string> dirs;
+  for (std::map<std::string, DeviceEntry>::iterator it=devices.begin(); it!=devices.end(); ++it) {
+    if (!it->second.watched) {
+      continue;
+    }
+    std::vector<char> copy(it->first.begin(), it->first.end());
+    copy.push_back('\0');
+    dirs.push_back(std::string(dirname(&copy[0])));
+  }
+  pthread_mutex_unlock(&lock);
+  int added = 0;
+  for (int i=0; i<(int)dirs.size(); i++) {
+    if (watched.find(dirs[i]) != watched.end()) {
+      continue;
+    }
+    if (inotify_add_watch(inotifyFD, dirs[i].c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB) >= 0) {
+      watched.insert(dirs[i]);
+      added++;
+    }
+  }
+  return added;
+}
+
+/**
+ * drain a non-blocking descriptor.
+ *
+ * @param fd the descriptor.
+ * @param pattern if not NULL, the text to look for.
+ *
+ * @return 1 if the pattern was found or is NULL, 0 otherwise.
+ */
+static int drainEvents(int fd, const char *pattern) {
+  char buf[8192];
+  int found = (pattern == NULL);
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    if (!found && memmem(buf, (size_t)len, pattern, strlen(pattern)) != NULL) {
+      found = 1;
+    }
+  }
+  return found;
+}
+
+/**
+ * the thread which follows the devices as they come and go.
+ *
+ * Block uevents from the kernel and udev trigger a rescan; the
+ * directories of the device paths are watched with inotify as well, so
+ * the links of /dev/disk/by-id are seen when udev makes them, and where
+ * netlink is not allowed. Everything is checked again every second in
+ * case an event was missed. deviceManagerEventFD() is told about the
+ * events, so the patterns can be matched again.
+ *
+ * @param data not used.
+ *
+ * @return NULL.
+ */
+static void* deviceWatcher(void *data) {
+  (void)data;
+  int ueventFD = openUeventSocket();
+  if (ueventFD < 0) {
+    syslog(LOG_INFO, "Cannot listen to uevents, watch the device directories only");
+  }
+  int inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  std::set<std::string> watched;
+
+  while (running) {
+    int notify = 0;
+    if (inotifyFD >= 0) {
+      /* a new directory may have devices in it already */
+      notify = (watchDirectories(inotifyFD, watched) > 0);
+    }
+    struct pollfd pfds[3];
+    pfds[0].fd = stopFDs[0];
+    pfds[1].fd = ueventFD;
+    pfds[2].fd = inotifyFD;
+    for (int i=0; i<3; i++) {
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    int nReady = poll(pfds, 3, 1000);
+    if (nReady < 0 && errno != EINTR) {
+      break;
+    }
+    if ((pfds[0].revents & POLLIN) != 0) {
+      /* stopped, or the paths have changed */
+      drainEvents(stopFDs[0], NULL);
+      if (!running) {
+	break;
+      }
+    }
+    int refresh = 0;
+    if ((pfds[1].revents & POLLIN) != 0) {
+      refresh = drainEvents(ueventFD, "SUBSYSTEM=block");
+      notify |= refresh;
+    }
+    if ((pfds[2].revents & POLLIN) != 0) {
+      drainEvents(inotifyFD, NULL);
+      notify = 1;
+    }
+    rescanDevices(refresh);
+    if (notify) {
+      ssize_t w1 = write(eventFDs[1], "", 1);
+      (void)w1;
+    }
+  }
+
+  if (ueventFD >= 0) {
+    close(ueventFD);
+  }
+  if (inotifyFD >= 0) {
+    close(inotifyFD);
+  }
+  return NULL;
+}
+
+/**
+ * start the thread which follows the devices. deviceManagerWatch() tells
+ * it which ones.
+ *
+ * @return 0 on success, -1 if the devices are opened at each connection.
+ */
+int deviceManagerStart() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&changed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pipe2(stopFDs, O_CLOEXEC | O_NONBLOCK) < 0) {
+    stopFDs[0] = -1;
+    stopFDs[1] = -1;
+  }
+  if (pipe2(eventFDs, O_CLOEXEC | O_NONBLOCK) < 0) {
+    eventFDs[0] = -1;
+    eventFDs[1] = -1;
+  }
+  running = 1;
+  if (stopFDs[0] < 0 || eventFDs[0] < 0 || pthread_create(&watcher, NULL, deviceWatcher, NULL) != 0) {
+    syslog(LOG_WARNING, "Cannot watch the devices, clients cannot wait for them");
+    running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * set the devices to follow.
+ *
+ * The devices which are present are opened and kept open, so a client
+ * does not pay for the first open of the device, and their information is
+ * read once. The devices which are no longer in the list are closed.
+ * For a glob pattern, only its directory is watched.
+ *
+ * @param paths the device paths.
+ */
+void deviceManagerWatch(const std::vector<std::string> &paths) {
+  std::set<std::string> wanted(paths.begin(), paths.end());
+  std::vector<int> unused;
+  pthread_mutex_lock(&lock);
+  for (std::map<std::string, DeviceEntry>::iterator it=devices.begin(); it!=devices.end(); ++it) {
+    if (wanted.find(it->first) == wanted.end() && it->second.watched) {
+      it->second.watched = 0;
+      if (it->second.holdFD >= 0) {
+	unused.push_back(it->second.holdFD);
+	it->second.holdFD = -1;
+      }
+    }
+  }
+  for (std::set<std::string>::iterator it=wanted.begin(); it!=wanted.end(); ++it) {
+    if (devices.find(*it) == devices.end() || !devices[*it].watched) {
+      DeviceEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.watched = 1;
+      entry.holdFD = -1;
+      devices[*it] = entry;
+    }
+  }
+  /* the clients waiting for a device which is dropped open it directly */
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  for (int i=0; i<(int)unused.size(); i++) {
+    close(unused[i]);
+  }
+
+  rescanDevices(0);
+  /* the watcher watches the directories of the new devices */
+  if (stopFDs[1] >= 0) {
+    ssize_t w1 = write(stopFDs[1], "", 1);
+    (void)w1;
+  }
+}
+
+/**
+ * stop following the devices and close them. The clients waiting for a
+ * device give up.
+ */
+void deviceManagerStop() {
+  pthread_mutex_lock(&lock);
+  int wasRunning = running;
+  running = 0;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  if (wasRunning) {
+    ssize_t w1 = write(stopFDs[1], "", 1);
+    (void)w1;
+    pthread_join(watcher, NULL);
+  }
+  if (stopFDs[0] >= 0) {
+    close(stopFDs[0]);
+    close(stopFDs[1]);
+    stopFDs[0] = -1;
+    stopFDs[1] = -1;
+  }
+  if (eventFDs[0] >= 0) {
+    close(eventFDs[0]);
+    close(eventFDs[1]);
+    eventFDs[0] = -1;
+    eventFDs[1] = -1;
+  }
+  pthread_mutex_lock(&lock);
+  for (std::map<std::string, DeviceEntry>::iterator it=devices.begin(); it!=devices.end(); ++it) {
+    if (it->second.holdFD >= 0) {
+      close(it->second.holdFD);
+      it->second.holdFD = -1;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * get the descriptor which becomes readable when a device may have come
+ * or gone. The reader drains it.
+ *
+ * @return the descriptor, -1 if the devices are not followed.
+ */
+int deviceManagerEventFD() {
+  return running ? eventFDs[0] : -1;
+}
+
+/**
+ * get the NUMA node of a device which is present.
+ *
+ * @param path the device path.
+ *
+ * @return the node of its host controller, -1 if unknown or absent.
+ */
+int deviceManagerNumaNode(const std::string &path) {
+  int node = -1;
+  pthread_mutex_lock(&lock);
+  std::map<std::string, DeviceEntry>::iterator it = devices.find(path);
+  if (it != devices.end() && it->second.watched && it->second.holdFD >= 0) {
+    node = it->second.info.numaNode;
+  }
+  pthread_mutex_unlock(&lock);
+  return node;
+}
+
+/**
+ * get the information of a device without keeping it open.
+ *
+ * A watched device is answered from what was read when it appeared;
+ * other paths are opened read-only for a moment.
+ *
+ * @param path the device path.
+ * @param info the information is stored here.
+ *
+ * @return 0 on success, -1 if the device is absent or cannot be opened.
+ */
+int deviceManagerQuery(const std::string &path, DeviceInfo *info) {
+  pthread_mutex_lock(&lock);
+  std::map<std::string, DeviceEntry>::iterator it = devices.find(path);
+  if (it != devices.end() && it->second.watched && running) {
+    int present = (it->second.holdFD >= 0);
+    if (present) {
+      *info = it->second.info;
+    }
+    pthread_mutex_unlock(&lock);
+    return present ? 0 : -1;
+  }
+  pthread_mutex_unlock(&lock);
+  int fd = openUnwatched(path, O_RDONLY, info);
+  if (fd < 0) {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * open a device, waiting for it to appear.
+ *
+ * A watched device is opened again through the descriptor which keeps it
+ * open, so it is the device which was checked even if its link changes.
+ * Other paths are opened directly.
+ *
+ * @param path the device path.
+ * @param flags the flags of open().
+ * @param waitMsec how long to wait for a missing device, 0 for not at all.
+ * @param info the information of the device is stored here.
+ *
+ * @return the file descriptor, -1 with errno ENOENT if the device has not
+ *         appeared, or -1 with the errno of open().
+ */
+int deviceManagerOpen(const std::string &path, int flags, int waitMsec, DeviceInfo *info) {
+  pthread_mutex_lock(&lock);
+  std::map<std::string, DeviceEntry>::iterator it = devices.find(path);
+  if (it == devices.end() || !it->second.watched || !running) {
+    pthread_mutex_unlock(&lock);
+    return openUnwatched(path, flags, info);
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += waitMsec / 1000;
+  deadline.tv_nsec += (long)(waitMsec % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  if (it->second.holdFD < 0 && waitMsec > 0) {
+    syslog(LOG_INFO, "Wait up to %d ms for device %s", waitMsec, path.c_str());
+  }
+  while (it->second.holdFD < 0 && it->second.watched && waitMsec > 0 && running && !quitFlag) {
+    if (pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  if (!it->second.watched) {
+    pthread_mutex_unlock(&lock);
+    return openUnwatched(path, flags, info);
+  }
+  if (it->second.holdFD < 0) {
+    pthread_mutex_unlock(&lock);
+    errno = ENOENT;
+    return -1;
+  }
+  int holdFD = fcntl(it->second.holdFD, F_DUPFD_CLOEXEC, 0);
+  *info = it->second.info;
+  pthread_mutex_unlock(&lock);
+
+  if (holdFD < 0) {
+    return openUnwatched(path, flags, info);
+  }
+  char procPath[64];
+  snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", holdFD);
+  int fd = open(procPath, flags);
+  if (fd < 0 && errno == ENOENT) {
+    /* no /proc */
+    fd = open(path.c_str(), flags);
+  }
+  int errsv = errno;
+  close(holdFD);
+  errno = errsv;
+  return fd;
+}
@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_DEVICE_MANAGER_HEAD1_H
+#define _HEADER_UMS2NET_DEVICE_MANAGER_HEAD1_H
+
+#include <string>
+#include <vector>
+
+#include "ioSize.h"
+
+/**
+ * What is known about a device when it is opened.
+ */
+struct DeviceInfo {
+  long long size; ///< bytes
+  int usbSpeed; ///< Mbit/s of the USB link, 0 if not on USB
+  char usbHub[32]; ///< the hub the device is plugged into, e.g. "2-1" or "usb2"
+  int hubSpeed; ///< Mbit/s of the link of that hub, 0 if not on USB
+  char usbBus[16]; ///< the root hub of the controller, e.g. "usb2"
+  int numaNode; ///< NUMA node of the host controller, -1 if unknown
+  DeviceTopology topology; ///< the I/O limits
+};
+
+int deviceManagerStart();
+void deviceManagerWatch(const std::vector<std::string> &paths);
+void deviceManagerStop();
+int deviceManagerEventFD();
+int deviceManagerNumaNode(const std::string &path);
+int deviceManagerQuery(const std::string &path, DeviceInfo *info);
+int deviceManagerOpen(const std::string &path, int flags, int waitMsec, DeviceInfo *info);
+
+#endif /* _HEADER_UMS2NET_DEVICE_MANAGER_HEAD1_H */
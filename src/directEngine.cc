@@ -0,0 +1,317 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <deque>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "main.h"
+#include "copyEngine.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hubScheduler.h"
+
+/**
+ * The state shared by the receiving and the writing stage of copyDirect().
+ *
+ * Buffers are passed by index: the receiver takes one from freeBuffers,
+ * fills it and appends it to filledBuffers; the writer does the opposite.
+ */
+struct DirectPipeline {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::vector<char *> buffers; ///< the aligned buffers
+  std::vector<ssize_t> lengths; ///< number of valid bytes in each buffer
+  std::vector<long long> recvStarts; ///< when the receive of each buffer started
+  std::vector<long long> recvEnds; ///< when the receive of each buffer ended
+  std::deque<int> freeBuffers; ///< buffers ready to be filled
+  std::deque<int> filledBuffers; ///< buffers waiting to be written
+  int outFD; ///< the device
+  ZeroWriter *zero; ///< if not NULL, blocks are written through it
+  int alignment; ///< the logical block size of the device
+  int eof; ///< set by the receiver after the last buffer is queued
+  int error; ///< set by the writer if the device fails
+  ssize_t totalLen; ///< bytes written to the device
+  HubGroup *hub; ///< the USB hub whose rate the writes share, may be NULL
+  SessionMetrics *metrics; ///< the metrics of the session, may be NULL
+  TraceRing *trace; ///< the trace of the session, may be NULL
+};
+
+/**
+ * get the logical block size of a device.
+ *
+ * @param fd the file descriptor of the device.
+ *
+ * @return the logical block size for block devices, 4096 for other files.
+ */
+int getLogicalBlockSize(int fd) {
+  struct stat statbuf;
+  int blockSize = 0;
+  if (fstat(fd, &statbuf) == 0 && S_ISBLK(statbuf.st_mode)) {
+    if (ioctl(fd, BLKSSZGET, &blockSize) == 0 && blockSize > 0) {
+      return blockSize;
+    }
+  }
+  return 4096;
+}
+
+/**
+ * write one buffer to the device.
+ *
+ * O_DIRECT needs the length to be a multiple of the logical block size, so
+ * a short tail is written after turning O_DIRECT off.
+ *
+ * @param p the pipeline.
+ * @param buf the buffer.
+ * @param len the length of the data in the buffer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int directWrite(DirectPipeline *p, const char *buf, ssize_t len) {
+  if (len % p->alignment != 0) {
+    int flags = fcntl(p->outFD, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT)) {
+      fcntl(p->outFD, F_SETFL, flags & ~O_DIRECT);
+    }
+  }
+  if (p->zero != NULL) {
+    if (zeroWriterWrite(p->zero, buf, len) < 0) {
+      return -1;
+    }
+    p->totalLen += len;
+    return 0;
+  }
+  while (len > 0) {
+    ssize_t w1 = write(p->outFD, buf, len);
+    if (w1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+      return -1;
+    }
+    p->totalLen += w1;
+    buf += w1;
+    len -= w1;
+  }
+  return 0;
+}
+
+/**
+ * the writing stage of copyDirect().
+ *
+ * @param data the pointer of DirectPipeline
+ *
+ * @return NULL.
+ */
+static void* directWriterThread(void *data) {
+  DirectPipeline *p = (DirectPipeline *)(data);
+  /* the receiver only adds to the recv counters, so they do not race */
+  sessionMetrics = p->metrics;
+  /* a trace ring has a single writer, the receive spans are recorded here */
+  traceRing = p->trace;
+  while (1) {
+    int index;
+    pthread_mutex_lock(&p->mutex);
+    while (p->filledBuffers.empty() && !p->eof) {
+      pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    if (p->filledBuffers.empty()) {
+      pthread_mutex_unlock(&p->mutex);
+      break;
+    }
+    index = p->filledBuffers.front();
+    p->filledBuffers.pop_front();
+    pthread_mutex_unlock(&p->mutex);
+
+    traceSpan("recv", p->recvStarts[index], p->recvEnds[index]);
+    long long writeStart = metricsNow();
+    int result = directWrite(p, p->buffers[index], p->lengths[index]);
+    if (result == 0) {
+      long long writeEnd = metricsNow();
+      metricsAddWrite(p->lengths[index], writeEnd - writeStart);
+      traceSpan("write", writeStart, writeEnd);
+      hubThrottleGroup(p->hub, p->lengths[index]);
+    } else {
+      metricsError(METRICS_ERROR_WRITE);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->freeBuffers.push_back(index);
+    if (result < 0) {
+      p->error = 1;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    if (result < 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * copy data from socket to device with a two stage pipeline.
+ *
+ * The calling thread receives into aligned buffers while a second thread
+ * writes the previously received buffers to the device, so the network and
+ * the device are busy at the same time. The device should be opened with
+ * O_DIRECT; the block size is rounded up to its logical block size.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param outFD the file descriptor of the device.
+ * @param bufSize the size of each block.
+ * @param nBuffers the number of buffers in flight.
+ * @param zero if not NULL, blocks are written through it.
+ * @param error set to 1 if the copy stops before the end of the data,
+ *        otherwise 0.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copyDirect(int clientSocket, int outFD, int bufSize, int nBuffers, ZeroWriter *zero, int *error) {
+  DirectPipeline p;
+  pthread_t writer;
+  int result;
+  int eof = 0;
+
+  *error = 1;
+  p.outFD = outFD;
+  p.zero = zero;
+  /* the writer is not the session thread */
+  p.hub = hubGroup;
+  p.metrics = sessionMetrics;
+  p.trace = traceRing;
+  p.alignment = getLogicalBlockSize(outFD);
+  p.eof = 0;
+  p.error = 0;
+  p.totalLen = 0;
+  if (nBuffers < 2) {
+    nBuffers = 2;
+  }
+  bufSize = ((bufSize + p.alignment - 1) / p.alignment) * p.alignment;
+
+  /* allocate buffers */
+  for (int i=0; i<nBuffers; i++) {
+    void *buf = NULL;
+    result = posix_memalign(&buf, p.alignment, bufSize);
+    if (result != 0) {
+      syslog(LOG_ERR, "Malloc aligned buffer for %d bytes failed", bufSize);
+      break;
+    }
+    p.buffers.push_back((char *)buf);
+    p.lengths.push_back(0);
+    p.recvStarts.push_back(0);
+    p.recvEnds.push_back(0);
+    p.freeBuffers.push_back(i);
+  }
+  if ((int)p.buffers.size() < nBuffers) {
+    for (int i=0; i<(int)p.buffers.size(); i++) {
+      free(p.buffers[i]);
+    }
+    return 0;
+  }
+
+  pthread_mutex_init(&p.mutex, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  result = pthread_create(&writer, NULL, directWriterThread, &p);
+  if (result != 0) {
+    syslog(LOG_ERR, "Cannot create writer thread (%s)", strerror(result));
+  } else {
+    /* receiving stage */
+    while (!quitFlag) {
+      int index;
+      pthread_mutex_lock(&p.mutex);
+      while (p.freeBuffers.empty() && !p.error) {
+	pthread_cond_wait(&p.cond, &p.mutex);
+      }
+      if (p.error) {
+	pthread_mutex_unlock(&p.mutex);
+	break;
+      }
+      index = p.freeBuffers.front();
+      p.freeBuffers.pop_front();
+      pthread_mutex_unlock(&p.mutex);
+
+      long long recvStart = metricsNow();
+      ssize_t bufLen = recvn(clientSocket, p.buffers[index], bufSize, 0);
+      if (bufLen <= 0) {
+	if (bufLen < 0) {
+	  int errsv = errno;
+	  char errbuf[1024];
+	  char *errstr;
+	  errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+	  syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
+	  metricsError(METRICS_ERROR_RECV);
+	} else {
+	  syslog(LOG_DEBUG, "read from client socket ended");
+	  eof = 1;
+	}
+	pthread_mutex_lock(&p.mutex);
+	p.freeBuffers.push_back(index);
+	pthread_mutex_unlock(&p.mutex);
+	break;
+      }
+
+      long long recvEnd = metricsNow();
+      metricsAddRecv(bufLen, recvEnd - recvStart);
+      pthread_mutex_lock(&p.mutex);
+      p.lengths[index] = bufLen;
+      p.recvStarts[index] = recvStart;
+      p.recvEnds[index] = recvEnd;
+      p.filledBuffers.push_back(index);
+      pthread_cond_broadcast(&p.cond);
+      pthread_mutex_unlock(&p.mutex);
+      if (bufLen < bufSize) {
+	eof = 1;
+	break;
+      }
+    }
+
+    pthread_mutex_lock(&p.mutex);
+    p.eof = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.mutex);
+    pthread_join(writer, NULL);
+  }
+
+  pthread_cond_destroy(&p.cond);
+  pthread_mutex_destroy(&p.mutex);
+  for (int i=0; i<(int)p.buffers.size(); i++) {
+    free(p.buffers[i]);
+  }
+  /* stopped by a failure or by a signal before the end of the data */
+  if (eof && !p.error) {
+    *error = 0;
+  }
+  return p.totalLen;
+}
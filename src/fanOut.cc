@@ -0,0 +1,515 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "fanOut.h"
+#include "copyEngine.h"
+#include "ioSize.h"
+#include "metrics.h"
+#include "trace.h"
+#include "checksum.h"
+#include "decompress.h"
+#include "imageFormat.h"
+#include "servantThread.h"
+#include "deviceManager.h"
+
+/**
+ * parse the value of the lag= operand.
+ *
+ * @param str the value: wait or drop.
+ * @param policy the LagPolicy is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseLagPolicy(const std::string &str, int *policy) {
+  if (str.compare("wait") == 0) {
+    *policy = LAG_WAIT;
+    return 1;
+  }
+  if (str.compare("drop") == 0) {
+    *policy = LAG_DROP;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * give up a reference to a session, and free it with the last one.
+ *
+ * @param f the session, not locked.
+ */
+static void fanOutRelease(FanOut *f) {
+  pthread_mutex_lock(&f->mutex);
+  int last = (--f->refs == 0);
+  pthread_mutex_unlock(&f->mutex);
+  if (!last) {
+    return;
+  }
+  for (int i=0; i<(int)f->slots.size(); i++) {
+    free(f->slots[i]);
+  }
+  for (int i=0; i<(int)f->orphans.size(); i++) {
+    free(f->orphans[i]);
+  }
+  pthread_cond_destroy(&f->spaceCond);
+  pthread_cond_destroy(&f->dataCond);
+  pthread_mutex_destroy(&f->mutex);
+  delete f;
+}
+
+/**
+ * the writing thread of one device.
+ *
+ * A thread which is detached because its device was dropped closes the
+ * device and gives up its reference to the session when it ends.
+ *
+ * @param data the pointer of FanOutTarget
+ *
+ * @return NULL.
+ */
+static void* fanOutWriterThread(void *data) {
+  FanOutTarget *t = (FanOutTarget *)(data);
+  FanOut *f = t->fanOut;
+  int detached = 0;
+  while (1) {
+    pthread_mutex_lock(&f->mutex);
+    while (t->next == f->head && !f->eof && !t->dropped) {
+      pthread_cond_wait(&f->dataCond, &f->mutex);
+    }
+    if (t->dropped || t->next == f->head) {
+      t->done = 1;
+      detached = t->detached;
+      pthread_cond_broadcast(&f->spaceCond);
+      pthread_mutex_unlock(&f->mutex);
+      break;
+    }
+    int index = (int)(t->next % (long long)f->slots.size());
+    ssize_t len = f->lengths[index];
+    t->writing = f->slots[index];
+    pthread_mutex_unlock(&f->mutex);
+
+    ssize_t result = zeroWriterWrite(&t->zero, t->writing, len);
+    if (result >= 0) {
+      hubThrottleGroup(t->hub, len);
+    }
+
+    pthread_mutex_lock(&f->mutex);
+    t->writing = NULL;
+    if (result < 0) {
+      t->error = 1;
+      t->done = 1;
+    } else {
+      t->totalLen += len;
+    }
+    t->next++;
+    pthread_cond_broadcast(&f->spaceCond);
+    pthread_mutex_unlock(&f->mutex);
+    if (result < 0) {
+      syslog(LOG_ERR, "Cannot write to %s, stop writing it", t->devFilename.c_str());
+      break;
+    }
+  }
+  if (detached) {
+    if (t->zero.verify != NULL) {
+      verifierStop(t->zero.verify);
+    }
+    close(t->outFD);
+    syslog(LOG_INFO, "Dropped %s after %ld bytes", t->devFilename.c_str(), t->totalLen);
+    fanOutRelease(f);
+  }
+  return NULL;
+}
+
+/**
+ * give up a device which is too slow.
+ *
+ * If its thread is still writing a block, the buffer of that block is
+ * taken out of the ring and replaced, so the receiver does not overwrite
+ * it.
+ *
+ * @param f the session, locked.
+ * @param t the device.
+ *
+ * @return 0 on success, -1 if no buffer can be allocated.
+ */
+static int dropTarget(FanOut *f, FanOutTarget *t) {
+  if (t->writing != NULL) {
+    for (int i=0; i<(int)f->slots.size(); i++) {
+      if (f->slots[i] != t->writing) {
+	continue;
+      }
+      void *buf = NULL;
+      if (posix_memalign(&buf, 4096, f->bufSize) != 0) {
+	syslog(LOG_ERR, "Malloc aligned buffer for %d bytes failed", f->bufSize);
+	return -1;
+      }
+      f->orphans.push_back(f->slots[i]);
+      f->slots[i] = (char *)buf;
+    }
+  }
+  t->dropped = 1;
+  return 0;
+}
+
+/**
+ * wait until the slot of the next block is written by every device.
+ *
+ * With LAG_DROP, the devices which hold up the ring for lagTime seconds
+ * without writing a block are dropped.
+ *
+ * @param f the session, locked.
+ * @param lagPolicy the LagPolicy.
+ * @param lagTime seconds to wait for a slow device.
+ *
+ * @return the number of devices still written.
+ */
+static int waitForSpace(FanOut *f, int lagPolicy, int lagTime) {
+  long long nSlots = (long long)f->slots.size();
+  long long waitingFor = -1;
+  struct timespec deadline;
+  while (1) {
+    long long oldest = f->head;
+    int active = 0;
+    for (int i=0; i<(int)f->targets.size(); i++) {
+      FanOutTarget *t = f->targets[i];
+      if (!t->done && !t->dropped) {
+	active++;
+	if (t->next < oldest) {
+	  oldest = t->next;
+	}
+      }
+    }
+    if (active == 0 || f->head - oldest < nSlots || quitFlag) {
+      return active;
+    }
+    if (lagPolicy == LAG_WAIT) {
+      pthread_cond_wait(&f->spaceCond, &f->mutex);
+      continue;
+    }
+    if (oldest != waitingFor) {
+      /* the slowest device made progress, give it lagTime again */
+      waitingFor = oldest;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += lagTime;
+    }
+    if (pthread_cond_timedwait(&f->spaceCond, &f->mutex, &deadline) == ETIMEDOUT) {
+      for (int i=0; i<(int)f->targets.size(); i++) {
+	FanOutTarget *t = f->targets[i];
+	if (!t->done && !t->dropped && t->next == oldest && dropTarget(f, t) == 0) {
+	  syslog(LOG_WARNING, "%s is %lld blocks behind for %d seconds, drop it", t->devFilename.c_str(), f->head - t->next, lagTime);
+	}
+      }
+      pthread_cond_broadcast(&f->dataCond);
+    }
+  }
+}
+
+/**
+ * the function that serves one client for several devices.
+ *
+ * The data is received once into a ring of blocks. Every device has a
+ * thread which writes the blocks at its own pace; the receiver waits for
+ * the slowest device, or drops it by lag=. The result of every device is
+ * logged and sent back to the client, one line per device.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param devFilenames the devices.
+ * @param ddParameters the parameters for the devices.
+ */
+void fanOutServant(int clientSocket, const std::vector<std::string> &devFilenames, const std::map<std::string, std::string> &ddParameters) {
+  /* get blocksize, default: IO_SIZE_DEFAULT, which suits most devices */
+  int bufSize = (int)getNumberOperand(ddParameters, std::string("bs"), IO_SIZE_DEFAULT);
+  if (bufSize <= 0) {
+    bufSize = IO_SIZE_DEFAULT;
+  }
+  int nSlots = (int)getNumberOperand(ddParameters, std::string("nbuf"), 16);
+  if (nSlots < 2) {
+    nSlots = 2;
+  }
+
+  /* get lag policy, default: wait for the slowest device */
+  int lagPolicy = LAG_WAIT;
+  if (ddParameters.find(std::string("lag")) != ddParameters.end()) {
+    if (!parseLagPolicy(ddParameters.at(std::string("lag")), &lagPolicy)) {
+      syslog(LOG_WARNING, "Unknown lag=%s, wait for the slowest device", ddParameters.at(std::string("lag")).c_str());
+    }
+  }
+  int lagTime = (int)getNumberOperand(ddParameters, std::string("lagtime"), 10);
+
+  int zeroPolicy = ZERO_WRITE;
+  if (ddParameters.find(std::string("zero")) != ddParameters.end()) {
+    if (!parseZeroPolicy(ddParameters.at(std::string("zero")), &zeroPolicy)) {
+      syslog(LOG_WARNING, "Unknown zero=%s, write zero blocks", ddParameters.at(std::string("zero")).c_str());
+    }
+  }
+  int verifyMode = 0;
+  if (ddParameters.find(std::string("verify")) != ddParameters.end()) {
+    verifyMode = (ddParameters.at(std::string("verify")).compare("yes") == 0);
+  }
+  int checksumType = CHECKSUM_NONE;
+  if (ddParameters.find(std::string("checksum")) != ddParameters.end()) {
+    if (!parseChecksum(ddParameters.at(std::string("checksum")), &checksumType) || !isChecksumSupported(checksumType)) {
+      syslog(LOG_WARNING, "Unknown or unsupported checksum=%s, use crc32c", ddParameters.at(std::string("checksum")).c_str());
+      checksumType = CHECKSUM_CRC32C;
+    }
+  }
+  if (ddParameters.find(std::string("engine")) != ddParameters.end()
+      || ddParameters.find(std::string("compare")) != ddParameters.end()
+      || ddParameters.find(std::string("index")) != ddParameters.end()) {
+    syslog(LOG_INFO, "engine=, compare= and index= are not used for several of=");
+  }
+
+  /* open the devices, waiting wait= seconds in all for them to appear,
+     default: 0. The ones which cannot be opened are reported as failed. */
+  long long waitUntil = metricsNow() + getNumberOperand(ddParameters, std::string("wait"), 0) * 1000000000LL;
+  FanOut *f = new FanOut;
+  f->refs = 1;
+  f->bufSize = bufSize;
+  f->devices.resize(devFilenames.size());
+  f->head = 0;
+  f->eof = 0;
+  pthread_mutex_init(&f->mutex, NULL);
+  pthread_cond_init(&f->dataCond, NULL);
+  pthread_cond_init(&f->spaceCond, NULL);
+  for (int i=0; i<(int)f->devices.size(); i++) {
+    FanOutTarget *t = &f->devices[i];
+    t->fanOut = f;
+    t->devFilename = devFilenames[i];
+    t->next = 0;
+    t->done = 1;
+    t->error = 1;
+    t->dropped = 0;
+    t->detached = 0;
+    t->writing = NULL;
+    t->totalLen = 0;
+    t->outFD = -1;
+    t->hub = NULL;
+    long long waitNsec = waitUntil - metricsNow();
+    DeviceInfo deviceInfo;
+    t->outFD = deviceManagerOpen(t->devFilename, O_RDWR | O_CLOEXEC, (waitNsec > 0) ? (int)(waitNsec / 1000000) : 0, &deviceInfo);
+    if (t->outFD < 0 && errno == ENOENT) {
+      syslog(LOG_WARNING, "Device %s not appeared.", t->devFilename.c_str());
+      continue;
+    }
+    if (t->outFD < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_ERR, "Cannot open device %s. (%s)", t->devFilename.c_str(), errstr);
+      continue;
+    }
+    /* the devices of a session are written together, so they share the
+       rate of their hub but do not wait for its slots */
+    t->hub = hubSchedulerFind(t->devFilename, &deviceInfo, ddParameters);
+    zeroWriterInit(&t->zero, t->outFD, zeroPolicy);
+    if (verifyMode && verifierStart(&t->verifier, t->devFilename, t->zero.offset, 1024*1024) == 0) {
+      t->zero.verify = &t->verifier;
+    }
+    t->done = 0;
+    t->error = 0;
+    f->targets.push_back(t);
+  }
+
+  /* allocate the ring */
+  for (int i=0; i<nSlots; i++) {
+    void *buf = NULL;
+    if (posix_memalign(&buf, 4096, bufSize) != 0) {
+      syslog(LOG_ERR, "Malloc aligned buffer for %d bytes failed", bufSize);
+      break;
+    }
+    f->slots.push_back((char *)buf);
+    f->lengths.push_back(0);
+  }
+
+  Checksum checksum;
+  int hasChecksum = (checksumType != CHECKSUM_NONE && checksumInit(&checksum, checksumType) == 0);
+  int compression = COMP_NONE;
+  Decompressor decompressor;
+  int inFD = -1;
+  if ((int)f->slots.size() == nSlots && !f->targets.empty()) {
+    inFD = openClientInput(clientSocket, ddParameters, &decompressor, &compression);
+  }
+  int receiving = (inFD >= 0);
+  if (receiving) {
+    int format = FORMAT_AUTO;
+    if (ddParameters.find(std::string("format")) != ddParameters.end()) {
+      if (!parseImageFormat(ddParameters.at(std::string("format")), &format)) {
+	syslog(LOG_WARNING, "Unknown format=%s, detect by the magic number", ddParameters.at(std::string("format")).c_str());
+      }
+    }
+    if (format == FORMAT_AUTO) {
+      format = sniffImageFormat(inFD);
+    }
+    if (format != FORMAT_RAW) {
+      syslog(LOG_ERR, "%s images cannot be written to several of=", getImageFormatName(format));
+      receiving = 0;
+    }
+  }
+  if (!receiving) {
+    for (int i=0; i<(int)f->targets.size(); i++) {
+      f->targets[i]->error = 1;
+    }
+  }
+
+  /* start the writers */
+  std::vector<FanOutTarget *> started;
+  for (int i=0; receiving && i<(int)f->targets.size(); i++) {
+    FanOutTarget *t = f->targets[i];
+    int result = pthread_create(&t->thread, NULL, fanOutWriterThread, t);
+    if (result != 0) {
+      syslog(LOG_ERR, "Cannot create writer thread for %s (%s)", t->devFilename.c_str(), strerror(result));
+      t->done = 1;
+      t->error = 1;
+      continue;
+    }
+    started.push_back(t);
+  }
+
+  /* receive each block once */
+  while (receiving && !quitFlag) {
+    /* the devices hold the receiver back while the ring is full */
+    long long waitStart = metricsNow();
+    pthread_mutex_lock(&f->mutex);
+    int active = waitForSpace(f, lagPolicy, lagTime);
+    pthread_mutex_unlock(&f->mutex);
+    traceSpan("wait", waitStart, metricsNow());
+    if (active == 0 || quitFlag) {
+      break;
+    }
+    int index = (int)(f->head % nSlots);
+    long long recvStart = metricsNow();
+    ssize_t bufLen = recvn(inFD, f->slots[index], bufSize, 0);
+    if (bufLen <= 0) {
+      syslog(LOG_DEBUG, "read from client socket ended");
+      if (bufLen < 0) {
+	metricsError(METRICS_ERROR_RECV);
+      }
+      break;
+    }
+    long long recvEnd = metricsNow();
+    metricsAddRecv(bufLen, recvEnd - recvStart);
+    traceSpan("recv", recvStart, recvEnd);
+    if (hasChecksum) {
+      checksumUpdate(&checksum, f->slots[index], bufLen);
+    }
+    pthread_mutex_lock(&f->mutex);
+    f->lengths[index] = bufLen;
+    f->head++;
+    pthread_cond_broadcast(&f->dataCond);
+    pthread_mutex_unlock(&f->mutex);
+    if (bufLen < bufSize) {
+      break;
+    }
+  }
+  pthread_mutex_lock(&f->mutex);
+  f->eof = 1;
+  pthread_cond_broadcast(&f->dataCond);
+  pthread_mutex_unlock(&f->mutex);
+  /* a dropped device may be stuck in write(), its thread is left to
+     finish on its own */
+  for (int i=0; i<(int)started.size(); i++) {
+    FanOutTarget *t = started[i];
+    pthread_mutex_lock(&f->mutex);
+    if (t->dropped && !t->done) {
+      t->detached = 1;
+      f->refs++;
+    }
+    pthread_mutex_unlock(&f->mutex);
+    if (t->detached) {
+      pthread_detach(t->thread);
+    } else {
+      pthread_join(t->thread, NULL);
+    }
+  }
+
+  if (compression != COMP_NONE && inFD >= 0) {
+    if (finishDecompressor(&decompressor) < 0) {
+      syslog(LOG_ERR, "Cannot decompress all the data");
+    }
+  }
+
+  /* report every device */
+  std::ostringstream report;
+  if (hasChecksum) {
+    std::string digest = checksumFinish(&checksum);
+    syslog(LOG_INFO, "Checksum of %lld bytes received: %s", checksum.length, digest.c_str());
+    report << "ums2net: " << checksum.length << " bytes " << digest << "\n";
+  }
+  for (int i=0; i<(int)f->devices.size(); i++) {
+    FanOutTarget *t = &f->devices[i];
+    const char *result = "ok";
+    ssize_t totalLen = t->totalLen;
+    if (t->detached) {
+      /* its thread owns the device now, only the count is read */
+      pthread_mutex_lock(&f->mutex);
+      totalLen = t->totalLen;
+      pthread_mutex_unlock(&f->mutex);
+    } else if (t->outFD >= 0) {
+      if (zeroWriterFinish(&t->zero) < 0) {
+	t->error = 1;
+      }
+      if (t->zero.verify != NULL && verifierStop(t->zero.verify) < 0) {
+	syslog(LOG_ERR, "Verification of %s failed, %lld bytes differ from offset %lld",
+	       t->devFilename.c_str(), t->verifier.mismatched, (long long)t->verifier.firstMismatch);
+	metricsError(METRICS_ERROR_VERIFY);
+	t->error = 1;
+      }
+      close(t->outFD);
+      syslog(LOG_INFO, "Totally write %ld bytes to %s", t->totalLen, t->devFilename.c_str());
+    }
+    /* the device threads only count their own bytes */
+    metricsAddBytes(0, totalLen);
+    if (t->dropped) {
+      result = "dropped";
+    } else if (t->error || t->next < f->head) {
+      result = "failed";
+      metricsError((t->outFD >= 0) ? METRICS_ERROR_WRITE : METRICS_ERROR_OPEN);
+    }
+    report << "ums2net: " << t->devFilename << " " << totalLen << " bytes " << result;
+    if (t->outFD >= 0 && !t->detached && t->zero.verify != NULL) {
+      report << " verify=" << ((t->verifier.mismatched == 0) ? "ok" : "failed");
+      if (t->verifier.unverified > 0) {
+	report << " unverified=" << t->verifier.unverified;
+      }
+    }
+    report << "\n";
+  }
+  std::string lines = report.str();
+  if (send(clientSocket, lines.c_str(), lines.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the result to the client");
+  }
+
+  fanOutRelease(f);
+}
@@ -0,0 +1,88 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_FAN_OUT_HEAD1_H
+#define _HEADER_UMS2NET_FAN_OUT_HEAD1_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "zeroBlock.h"
+#include "hubScheduler.h"
+
+struct FanOut;
+
+/**
+ * What to do when a device falls a whole ring behind the network.
+ */
+enum LagPolicy {
+  LAG_WAIT = 0, ///< stop receiving until the slowest device catches up
+  LAG_DROP, ///< give up the devices which do not catch up in time
+};
+
+/**
+ * One device written by a fan-out session.
+ */
+struct FanOutTarget {
+  FanOut *fanOut; ///< the session
+  std::string devFilename; ///< the device path
+  int outFD; ///< the device
+  pthread_t thread; ///< the writing thread
+  long long next; ///< the sequence number of the next block to write
+  int done; ///< set when the thread does not write any more blocks
+  int error; ///< set if the device fails
+  int dropped; ///< set if the device is given up for being too slow
+  int detached; ///< set if the thread is left to finish on its own
+  char *writing; ///< the buffer being written, NULL between blocks
+  ZeroWriter zero; ///< writes the blocks to the device
+  Verifier verifier; ///< used if verify=yes
+  ssize_t totalLen; ///< bytes written to the device
+  HubGroup *hub; ///< the USB hub whose rate the writes share, may be NULL
+};
+
+/**
+ * A ring of blocks received once and written to every device.
+ *
+ * Block number n is in slot n % nSlots. The receiver may only reuse a
+ * slot once every device which is not done has written it. The buffer
+ * which a dropped device is still writing is taken out of the ring.
+ *
+ * The session is freed by the last of the servant and the detached
+ * threads of dropped devices.
+ */
+struct FanOut {
+  int refs; ///< the servant and the detached threads
+  pthread_mutex_t mutex;
+  pthread_cond_t dataCond; ///< signalled when a block is received
+  pthread_cond_t spaceCond; ///< signalled when a block is written
+  std::vector<char *> slots; ///< the aligned buffers
+  std::vector<ssize_t> lengths; ///< number of valid bytes in each slot
+  std::vector<char *> orphans; ///< buffers taken out of the ring
+  int bufSize; ///< the size of each buffer
+  long long head; ///< the sequence number of the next block to receive
+  int eof; ///< set after the last block is received
+  std::vector<FanOutTarget> devices; ///< every device of the port
+  std::vector<FanOutTarget *> targets; ///< the devices which were opened
+};
+
+int parseLagPolicy(const std::string &, int *);
+void fanOutServant(int clientSocket, const std::vector<std::string> &devFilenames, const std::map<std::string, std::string> &ddParameters);
+
+#endif /* _HEADER_UMS2NET_FAN_OUT_HEAD1_H */
@@ -0,0 +1,240 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <map>
+#include <cerrno>
+
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "main.h"
+#include "hubScheduler.h"
+#include "ums2netconfrecord.h"
+#include "metrics.h"
+#include "trace.h"
+
+__thread HubGroup *hubGroup = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotFreed = PTHREAD_COND_INITIALIZER;
+static std::map<std::string, HubGroup *> groups;
+
+/**
+ * get a limit from the operands. The numbers were checked when the config
+ * was read.
+ *
+ * @param ddParameters the operands.
+ * @param key the name of the operand.
+ *
+ * @return the limit, 0 if it is not given.
+ */
+static long long getLimit(const std::map<std::string, std::string> &ddParameters, const std::string &key) {
+  long long value = 0;
+  std::map<std::string, std::string>::const_iterator it = ddParameters.find(key);
+  if (it == ddParameters.end() || !parseDDNumber(it->second, &value)) {
+    return 0;
+  }
+  return value;
+}
+
+/**
+ * parse the hubgroup= operand.
+ *
+ * @param str the value of the operand.
+ * @param grouping the HubGrouping is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseHubGrouping(const std::string &str, int *grouping) {
+  if (str.compare("hub") == 0) {
+    *grouping = HUB_GROUP_HUB;
+    return 1;
+  }
+  if (str.compare("bus") == 0) {
+    *grouping = HUB_GROUP_BUS;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * find the group of a device, if its port schedules the writes.
+ *
+ * The limits of the group are taken from the port of the latest session,
+ * so a reload changes them for the next session.
+ *
+ * @param device the device path.
+ * @param info what is known about the device.
+ * @param ddParameters the operands: hubmax=, hubrate= and hubgroup=.
+ *
+ * @return the group, NULL if the device is not on USB or not scheduled.
+ */
+HubGroup* hubSchedulerFind(const std::string &device, const DeviceInfo *info, const std::map<std::string, std::string> &ddParameters) {
+  int maxSessions = (int)getLimit(ddParameters, std::string("hubmax"));
+  long long rate = getLimit(ddParameters, std::string("hubrate"));
+  if ((maxSessions <= 0 && rate <= 0) || info->usbHub[0] == '\0') {
+    return NULL;
+  }
+  int grouping = HUB_GROUP_HUB;
+  if (ddParameters.find(std::string("hubgroup")) != ddParameters.end()) {
+    if (!parseHubGrouping(ddParameters.at(std::string("hubgroup")), &grouping)) {
+      syslog(LOG_WARNING, "Unknown hubgroup=%s, group by hub", ddParameters.at(std::string("hubgroup")).c_str());
+    }
+  }
+  std::string name = std::string((grouping == HUB_GROUP_BUS) ? info->usbBus : info->usbHub);
+  if (name.empty()) {
+    name = std::string(info->usbHub);
+  }
+
+  pthread_mutex_lock(&lock);
+  HubGroup *group;
+  std::map<std::string, HubGroup *>::iterator it = groups.find(name);
+  if (it == groups.end()) {
+    group = new HubGroup;
+    group->name = name;
+    group->active = 0;
+    group->nextTicket = 0;
+    group->servingTicket = 0;
+    group->tokens = 0;
+    group->refilled = metricsNow();
+    groups[name] = group;
+    syslog(LOG_INFO, "USB %s %s, %d Mbit/s: at most %d sessions, %lld bytes/s", (grouping == HUB_GROUP_BUS) ? "bus" : "hub",
+	   name.c_str(), info->hubSpeed, maxSessions, rate);
+  } else {
+    group = it->second;
+  }
+  group->maxSessions = maxSessions;
+  group->rate = rate;
+  pthread_cond_broadcast(&slotFreed);
+  pthread_mutex_unlock(&lock);
+  syslog(LOG_DEBUG, "%s is behind USB hub %s of %s at %d Mbit/s", device.c_str(), info->usbHub, info->usbBus, info->usbSpeed);
+  return group;
+}
+
+/**
+ * start writing a device whose port schedules the writes.
+ *
+ * The session waits its turn while hubmax= sessions are writing the
+ * devices of the same group; the sessions start in the order they came.
+ * Its writes are then accounted by hubThrottle().
+ *
+ * @param device the device path.
+ * @param info what is known about the device.
+ * @param ddParameters the operands.
+ *
+ * @return the group, NULL if the writes are not scheduled.
+ */
+HubGroup* hubSchedulerJoin(const std::string &device, const DeviceInfo *info, const std::map<std::string, std::string> &ddParameters) {
+  HubGroup *group = hubSchedulerFind(device, info, ddParameters);
+  if (group == NULL) {
+    return NULL;
+  }
+  long long waitStart = metricsNow();
+  pthread_mutex_lock(&lock);
+  long long ticket = group->nextTicket++;
+  if (ticket != group->servingTicket || (group->maxSessions > 0 && group->active >= group->maxSessions)) {
+    syslog(LOG_INFO, "USB hub %s has %d sessions writing, %s waits its turn", group->name.c_str(), group->active, device.c_str());
+  }
+  while (!quitFlag && (ticket != group->servingTicket || (group->maxSessions > 0 && group->active >= group->maxSessions))) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait(&slotFreed, &lock, &deadline);
+  }
+  group->servingTicket++;
+  group->active++;
+  /* the next one may fit as well */
+  pthread_cond_broadcast(&slotFreed);
+  pthread_mutex_unlock(&lock);
+  traceSpan("hub", waitStart, metricsNow());
+  hubGroup = group;
+  return group;
+}
+
+/**
+ * stop writing a device, so the next session of the group may start.
+ *
+ * @param group the group returned by hubSchedulerJoin(), may be NULL.
+ */
+void hubSchedulerLeave(HubGroup *group) {
+  if (group == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  group->active--;
+  pthread_cond_broadcast(&slotFreed);
+  pthread_mutex_unlock(&lock);
+  if (hubGroup == group) {
+    hubGroup = NULL;
+  }
+}
+
+/**
+ * account a device write to the token bucket of a group.
+ *
+ * The bucket fills at hubrate= bytes per second and holds a quarter of a
+ * second of them. A write is done before it is paid for, so the writer
+ * sleeps off the debt afterwards; the writers of a group then share the
+ * rate by the bytes they write.
+ *
+ * @param group the group, may be NULL.
+ * @param bytes the number of bytes written.
+ */
+void hubThrottleGroup(HubGroup *group, long long bytes) {
+  if (group == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  long long rate = group->rate;
+  if (rate <= 0) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  long long now = metricsNow();
+  long long burst = rate / 4;
+  group->tokens += (long long)((double)(now - group->refilled) * (double)rate / 1e9);
+  if (group->tokens > burst) {
+    group->tokens = burst;
+  }
+  group->refilled = now;
+  group->tokens -= bytes;
+  long long debt = -group->tokens;
+  pthread_mutex_unlock(&lock);
+  if (debt <= 0) {
+    return;
+  }
+
+  long long sleepNsec = (long long)((double)debt * 1e9 / (double)rate);
+  long long wakeUp = now + sleepNsec;
+  while (!quitFlag) {
+    long long left = wakeUp - metricsNow();
+    if (left <= 0) {
+      break;
+    }
+    /* wake up now and then to see if the daemon stops */
+    if (left > 100000000LL) {
+      left = 100000000LL;
+    }
+    struct timespec ts;
+    ts.tv_sec = left / 1000000000LL;
+    ts.tv_nsec = left % 1000000000LL;
+    nanosleep(&ts, NULL);
+  }
+  traceSpan("throttle", now, metricsNow());
+}
@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_HUB_SCHEDULER_HEAD1_H
+#define _HEADER_UMS2NET_HUB_SCHEDULER_HEAD1_H
+
+#include <string>
+#include <map>
+
+#include "deviceManager.h"
+
+/**
+ * Which upstream link the devices share.
+ */
+enum HubGrouping {
+  HUB_GROUP_HUB = 0, ///< the hub the device is plugged into
+  HUB_GROUP_BUS, ///< the root hub, i.e. the host controller
+};
+
+/**
+ * The devices behind one USB hub or bus, and the sessions writing them.
+ */
+struct HubGroup {
+  std::string name; ///< the hub, e.g. "2-1", or the bus, e.g. "usb2"
+  int active; ///< sessions which are writing
+  int maxSessions; ///< sessions which may write at once, 0 for no limit
+  long long nextTicket; ///< the ticket of the next session to wait
+  long long servingTicket; ///< the ticket of the next session to start
+  long long rate; ///< bytes per second shared by the writes, 0 for no limit
+  long long tokens; ///< bytes which may be written without waiting
+  long long refilled; ///< monotonic time the tokens were last added
+};
+
+extern __thread HubGroup *hubGroup;
+
+void hubThrottleGroup(HubGroup *group, long long bytes);
+
+/**
+ * account a device write of the session of this thread. It is a single
+ * test when the session is not scheduled.
+ *
+ * @param bytes the number of bytes written.
+ */
+static inline void hubThrottle(long long bytes) {
+  HubGroup *group = hubGroup;
+  if (group == NULL) {
+    return;
+  }
+  hubThrottleGroup(group, bytes);
+}
+
+int parseHubGrouping(const std::string &, int *);
+HubGroup* hubSchedulerFind(const std::string &device, const DeviceInfo *info, const std::map<std::string, std::string> &ddParameters);
+HubGroup* hubSchedulerJoin(const std::string &device, const DeviceInfo *info, const std::map<std::string, std::string> &ddParameters);
+void hubSchedulerLeave(HubGroup *group);
+
+#endif /* _HEADER_UMS2NET_HUB_SCHEDULER_HEAD1_H */
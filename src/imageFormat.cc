@@ -0,0 +1,632 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "copyEngine.h"
+#include "imageFormat.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hubScheduler.h"
+
+#define BMAP_MAX_SIZE (16*1024*1024)
+/* enough for the XML declaration and the comment bmaptool writes */
+#define BMAP_SNIFF_SIZE 4096
+
+/**
+ * parse the value of the format= operand.
+ *
+ * @param str the value: auto, raw, sparse or bmap.
+ * @param format the ImageFormat is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseImageFormat(const std::string &str, int *format) {
+  static const struct {
+    const char *name;
+    int format;
+  } names[] = {
+    { "auto", FORMAT_AUTO },
+    { "raw", FORMAT_RAW },
+    { "sparse", FORMAT_SPARSE },
+    { "bmap", FORMAT_BMAP },
+  };
+  for (int i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++) {
+    if (str.compare(names[i].name) == 0) {
+      *format = names[i].format;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * check that a stream starts with a bmap document.
+ *
+ * The XML declaration, comments and whitespace before the root element
+ * are skipped; the root element must be "<bmap version=".
+ *
+ * @param buf the first bytes of the stream.
+ * @param len the number of bytes in buf.
+ *
+ * @return 1 if the stream starts with a bmap document, otherwise 0.
+ */
+static int isBmapHeader(const unsigned char *buf, size_t len) {
+  std::string head((const char *)buf, len);
+  size_t pos = head.find_first_not_of(" \t\r\n");
+  if (pos != std::string::npos && head.compare(pos, 5, "<?xml") == 0) {
+    pos = head.find("?>", pos);
+    if (pos != std::string::npos) {
+      pos = head.find_first_not_of(" \t\r\n", pos + 2);
+    }
+  }
+  while (pos != std::string::npos && head.compare(pos, 4, "<!--") == 0) {
+    pos = head.find("-->", pos + 4);
+    if (pos != std::string::npos) {
+      pos = head.find_first_not_of(" \t\r\n", pos + 3);
+    }
+  }
+  if (pos == std::string::npos || head.compare(pos, 5, "<bmap") != 0) {
+    return 0;
+  }
+  /* "<bmapx" is another element */
+  pos += 5;
+  if (pos >= head.length() || std::string(" \t\r\n").find(head[pos]) == std::string::npos) {
+    return 0;
+  }
+  pos = head.find_first_not_of(" \t\r\n", pos);
+  return (pos != std::string::npos && head.compare(pos, 8, "version=") == 0);
+}
+
+/**
+ * detect the image format by the magic number.
+ *
+ * A bmap has no magic number, so the whole start of the document up to
+ * "<bmap version=" must be in buf; any other XML is a raw image.
+ *
+ * @param buf the first bytes of the stream.
+ * @param len the number of bytes in buf.
+ *
+ * @return the ImageFormat, FORMAT_RAW if no known magic number is found.
+ */
+int detectImageFormat(const unsigned char *buf, size_t len) {
+  static const unsigned char sparseMagic[] = { 0x3a, 0xff, 0x26, 0xed };
+  if (len >= sizeof(sparseMagic) && memcmp(buf, sparseMagic, sizeof(sparseMagic)) == 0) {
+    return FORMAT_SPARSE;
+  }
+  if (isBmapHeader(buf, len)) {
+    return FORMAT_BMAP;
+  }
+  return FORMAT_RAW;
+}
+
+/**
+ * detect the image format of the stream without consuming it.
+ *
+ * Only a stream which starts like XML is peeked further, to find the
+ * root element of a bmap.
+ *
+ * @param inFD the socket the copy engine reads.
+ *
+ * @return the ImageFormat, FORMAT_RAW if no known magic number is found.
+ */
+int sniffImageFormat(int inFD) {
+  unsigned char magic[5];
+  ssize_t r1;
+  do {
+    r1 = recv(inFD, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 <= 0) {
+    return FORMAT_RAW;
+  }
+  if (r1 < (ssize_t)sizeof(magic) || (memcmp(magic, "<?xml", 5) != 0 && memcmp(magic, "<bmap", 5) != 0)) {
+    return detectImageFormat(magic, (size_t)r1);
+  }
+  std::vector<unsigned char> head(BMAP_SNIFF_SIZE);
+  do {
+    r1 = recv(inFD, head.data(), head.size(), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 <= 0) {
+    return FORMAT_RAW;
+  }
+  return detectImageFormat(head.data(), (size_t)r1);
+}
+
+/**
+ * get the name of an image format for logging.
+ *
+ * @param format the ImageFormat.
+ *
+ * @return the name.
+ */
+const char *getImageFormatName(int format) {
+  switch (format) {
+  case FORMAT_SPARSE:
+    return "sparse";
+  case FORMAT_BMAP:
+    return "bmap";
+  case FORMAT_AUTO:
+    return "auto";
+  default:
+    return "raw";
+  }
+}
+
+static uint16_t getLE16(const unsigned char *buf) {
+  return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+static uint32_t getLE32(const unsigned char *buf) {
+  return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * parse and check the file header of an Android sparse image.
+ *
+ * @param buf SPARSE_HEADER_SIZE bytes of the header.
+ * @param header the parsed header.
+ *
+ * @return 1 if the header is valid, otherwise 0.
+ */
+int parseSparseHeader(const unsigned char *buf, SparseHeader *header) {
+  header->magic = getLE32(buf);
+  header->majorVersion = getLE16(buf + 4);
+  header->minorVersion = getLE16(buf + 6);
+  header->fileHeaderSize = getLE16(buf + 8);
+  header->chunkHeaderSize = getLE16(buf + 10);
+  header->blockSize = getLE32(buf + 12);
+  header->totalBlocks = getLE32(buf + 16);
+  header->totalChunks = getLE32(buf + 20);
+  header->imageChecksum = getLE32(buf + 24);
+  if (header->magic != SPARSE_HEADER_MAGIC || header->majorVersion != 1) {
+    return 0;
+  }
+  if (header->fileHeaderSize < SPARSE_HEADER_SIZE || header->chunkHeaderSize < SPARSE_CHUNK_HEADER_SIZE) {
+    return 0;
+  }
+  if (header->blockSize == 0 || header->blockSize % 4 != 0) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * parse the header of one chunk of an Android sparse image.
+ *
+ * @param buf SPARSE_CHUNK_HEADER_SIZE bytes of the chunk header.
+ * @param chunk the parsed chunk header.
+ */
+void parseSparseChunkHeader(const unsigned char *buf, SparseChunkHeader *chunk) {
+  chunk->chunkType = getLE16(buf);
+  chunk->reserved = getLE16(buf + 2);
+  chunk->chunkSize = getLE32(buf + 4);
+  chunk->totalSize = getLE32(buf + 8);
+}
+
+/**
+ * get the number inside the first <tag>...</tag> of a document.
+ *
+ * @param xml the document.
+ * @param tag the name of the tag.
+ * @param value the number is stored here on success.
+ *
+ * @return 1 if success, otherwise 0.
+ */
+static int getTagNumber(const std::string &xml, const std::string &tag, long long *value) {
+  std::size_t found = xml.find(std::string("<") + tag + std::string(">"));
+  if (found == std::string::npos) {
+    return 0;
+  }
+  const char *start = xml.c_str() + found + tag.length() + 2;
+  char *end = NULL;
+  long long v = strtoll(start, &end, 10);
+  if (end == start || v < 0) {
+    return 0;
+  }
+  *value = v;
+  return 1;
+}
+
+/**
+ * parse a bmaptool .bmap document.
+ *
+ * Only BlockSize, ImageSize and the Range elements of BlockMap are used.
+ * A range is either "first-last" or a single block number.
+ *
+ * @param xml the document.
+ * @param info the parsed block map.
+ *
+ * @return 1 if success, 0 if the document is not a valid bmap.
+ */
+int parseBmap(const std::string &xml, BmapInfo *info) {
+  info->blockSize = 0;
+  info->imageSize = 0;
+  info->ranges.clear();
+  if (!getTagNumber(xml, std::string("BlockSize"), &(info->blockSize)) || info->blockSize <= 0) {
+    return 0;
+  }
+  getTagNumber(xml, std::string("ImageSize"), &(info->imageSize));
+
+  std::size_t pos = xml.find("<BlockMap>");
+  if (pos == std::string::npos) {
+    return 0;
+  }
+  while ((pos = xml.find("<Range", pos)) != std::string::npos) {
+    std::size_t contentStart = xml.find(">", pos);
+    std::size_t contentEnd = xml.find("</Range>", pos);
+    if (contentStart == std::string::npos || contentEnd == std::string::npos || contentEnd < contentStart) {
+      return 0;
+    }
+    std::string content = xml.substr(contentStart + 1, contentEnd - contentStart - 1);
+    const char *s = content.c_str();
+    char *end = NULL;
+    long long first = strtoll(s, &end, 10);
+    if (end == s || first < 0) {
+      return 0;
+    }
+    long long last = first;
+    while (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r') {
+      end++;
+    }
+    if (*end == '-') {
+      s = end + 1;
+      last = strtoll(s, &end, 10);
+      if (end == s || last < first) {
+	return 0;
+      }
+    }
+    info->ranges.push_back(std::make_pair(first, last));
+    pos = contentEnd + 8;
+  }
+  return 1;
+}
+
+/**
+ * receive and throw away some bytes of the stream.
+ *
+ * @param inFD the socket the copy engine reads.
+ * @param len the number of bytes.
+ *
+ * @return 0 on success, -1 on error or EOF.
+ */
+static int skipInput(int inFD, size_t len) {
+  char buf[4096];
+  while (len > 0) {
+    size_t l1 = (len < sizeof(buf)) ? len : sizeof(buf);
+    if (recvn(inFD, buf, l1, 0) != (ssize_t)l1) {
+      return -1;
+    }
+    len -= l1;
+  }
+  return 0;
+}
+
+/**
+ * write a buffer to a position of the device completely.
+ *
+ * @param outFD the device.
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ * @param offset the position on the device.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int pwriteAll(int outFD, const char *buf, size_t len, off_t offset) {
+  size_t totalLen = len;
+  long long writeStart = metricsNow();
+  while (len > 0) {
+    ssize_t w1 = pwrite(outFD, buf, len, offset);
+    if (w1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+      return -1;
+    }
+    buf += w1;
+    len -= (size_t)w1;
+    offset += w1;
+  }
+  long long writeEnd = metricsNow();
+  metricsAddWrite((long long)totalLen, writeEnd - writeStart);
+  traceSpan("write", writeStart, writeEnd);
+  hubThrottle(totalLen);
+  return 0;
+}
+
+/**
+ * receive len bytes and write them to a position of the device.
+ *
+ * @param inFD the socket the copy engine reads.
+ * @param outFD the device.
+ * @param buf a buffer of bufSize bytes.
+ * @param bufSize the size of buf.
+ * @param len the number of bytes.
+ * @param offset the position on the device.
+ *
+ * @return 0 on success, -1 on error or EOF.
+ */
+static int copyRange(int inFD, int outFD, char *buf, int bufSize, long long len, off_t offset) {
+  while (len > 0 && !quitFlag) {
+    size_t l1 = (len < bufSize) ? (size_t)len : (size_t)bufSize;
+    long long recvStart = metricsNow();
+    ssize_t r1 = recvn(inFD, buf, l1, 0);
+    if (r1 != (ssize_t)l1) {
+      syslog(LOG_ERR, "Image ends in the middle of a block");
+      return -1;
+    }
+    long long recvEnd = metricsNow();
+    metricsAddRecv(r1, recvEnd - recvStart);
+    traceSpan("recv", recvStart, recvEnd);
+    if (pwriteAll(outFD, buf, l1, offset) < 0) {
+      return -1;
+    }
+    offset += (off_t)l1;
+    len -= (long long)l1;
+  }
+  return (len > 0) ? -1 : 0;
+}
+
+/**
+ * extend a regular file to the size of the image.
+ *
+ * Block devices keep their size; only the position is restored.
+ *
+ * @param outFD the device.
+ * @param size the size of the image.
+ */
+static void finishImage(int outFD, off_t size) {
+  struct stat statbuf;
+  if (fstat(outFD, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size < size) {
+    if (ftruncate(outFD, size) < 0) {
+      syslog(LOG_WARNING, "Cannot extend the file to %lld bytes", (long long)size);
+    }
+  }
+  lseek(outFD, size, SEEK_SET);
+}
+
+/**
+ * write an Android sparse image to the device.
+ *
+ * RAW chunks are written at their offset, FILL chunks are expanded from
+ * their pattern and DONT_CARE chunks are skipped. CRC32 chunks are read
+ * but not checked.
+ *
+ * @param inFD the socket the copy engine reads.
+ * @param outFD the device.
+ * @param bufSize the size of each write.
+ * @param error set to 1 if the image is corrupt or a write fails.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copySparse(int inFD, int outFD, int bufSize, int *error) {
+  unsigned char hdrBuf[SPARSE_HEADER_SIZE];
+  SparseHeader header;
+  ssize_t totalLen = 0;
+  long long skippedLen = 0;
+  off_t offset = 0;
+
+  *error = 1;
+  if (recvn(inFD, hdrBuf, sizeof(hdrBuf), 0) != (ssize_t)sizeof(hdrBuf) || !parseSparseHeader(hdrBuf, &header)) {
+    syslog(LOG_ERR, "Invalid sparse image header");
+    return 0;
+  }
+  if (skipInput(inFD, header.fileHeaderSize - SPARSE_HEADER_SIZE) < 0) {
+    return 0;
+  }
+
+  bufSize = (bufSize < 4096) ? 4096 : (bufSize & ~3);
+  char *buf = (char *)malloc(sizeof(char)*bufSize);
+  if (buf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", bufSize);
+    return 0;
+  }
+
+  uint32_t i;
+  for (i=0; i<header.totalChunks && !quitFlag; i++) {
+    unsigned char chunkBuf[SPARSE_CHUNK_HEADER_SIZE];
+    SparseChunkHeader chunk;
+    if (recvn(inFD, chunkBuf, sizeof(chunkBuf), 0) != (ssize_t)sizeof(chunkBuf)) {
+      syslog(LOG_ERR, "Sparse image ends at chunk %u of %u", i, header.totalChunks);
+      break;
+    }
+    parseSparseChunkHeader(chunkBuf, &chunk);
+    if (skipInput(inFD, header.chunkHeaderSize - SPARSE_CHUNK_HEADER_SIZE) < 0) {
+      break;
+    }
+    long long len = (long long)chunk.chunkSize * header.blockSize;
+    long long dataLen = (long long)chunk.totalSize - header.chunkHeaderSize;
+
+    if (chunk.chunkType == SPARSE_CHUNK_RAW) {
+      if (dataLen != len) {
+	syslog(LOG_ERR, "Sparse RAW chunk %u has %lld bytes of data for %lld bytes", i, dataLen, len);
+	break;
+      }
+      if (copyRange(inFD, outFD, buf, bufSize, len, offset) < 0) {
+	break;
+      }
+      totalLen += len;
+    } else if (chunk.chunkType == SPARSE_CHUNK_FILL) {
+      unsigned char pattern[4];
+      if (dataLen != 4 || recvn(inFD, pattern, sizeof(pattern), 0) != (ssize_t)sizeof(pattern)) {
+	syslog(LOG_ERR, "Invalid sparse FILL chunk %u", i);
+	break;
+      }
+      for (int j=0; j<bufSize; j+=4) {
+	memcpy(&(buf[j]), pattern, 4);
+      }
+      long long left = len;
+      off_t o1 = offset;
+      while (left > 0) {
+	size_t l1 = (left < bufSize) ? (size_t)left : (size_t)bufSize;
+	if (pwriteAll(outFD, buf, l1, o1) < 0) {
+	  break;
+	}
+	o1 += (off_t)l1;
+	left -= (long long)l1;
+      }
+      if (left > 0) {
+	break;
+      }
+      totalLen += len;
+    } else if (chunk.chunkType == SPARSE_CHUNK_DONT_CARE) {
+      if (dataLen != 0) {
+	syslog(LOG_ERR, "Invalid sparse DONT_CARE chunk %u", i);
+	break;
+      }
+      skippedLen += len;
+    } else if (chunk.chunkType == SPARSE_CHUNK_CRC32) {
+      if (dataLen != 4 || skipInput(inFD, 4) < 0) {
+	syslog(LOG_ERR, "Invalid sparse CRC32 chunk %u", i);
+	break;
+      }
+      len = 0;
+    } else {
+      syslog(LOG_ERR, "Unknown sparse chunk type 0x%04x", chunk.chunkType);
+      break;
+    }
+    offset += (off_t)len;
+  }
+  free(buf);
+
+  if (i == header.totalChunks) {
+    *error = 0;
+    finishImage(outFD, (off_t)header.totalBlocks * header.blockSize);
+  }
+  syslog(LOG_INFO, "Sparse image: %u of %u chunks, %lld bytes skipped", i, header.totalChunks, skippedLen);
+  return totalLen;
+}
+
+/**
+ * receive the .bmap document at the start of the stream.
+ *
+ * Exactly the document, up to "</bmap>" and one following newline, is
+ * taken from the stream.
+ *
+ * @param inFD the socket the copy engine reads.
+ * @param xml the document.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int recvBmap(int inFD, std::string *xml) {
+  static const std::string endTag("</bmap>");
+  char buf[65536];
+  xml->clear();
+  while (xml->length() < BMAP_MAX_SIZE) {
+    ssize_t r1 = recv(inFD, buf, sizeof(buf), MSG_PEEK);
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    } else if (r1 <= 0) {
+      return -1;
+    }
+    std::size_t searchFrom = (xml->length() > endTag.length()) ? xml->length() - endTag.length() : 0;
+    std::string combined = *xml + std::string(buf, r1);
+    std::size_t found = combined.find(endTag, searchFrom);
+    std::size_t take = (found == std::string::npos) ? (size_t)r1 : found + endTag.length() - xml->length();
+    if (recvn(inFD, buf, take, 0) != (ssize_t)take) {
+      return -1;
+    }
+    xml->append(buf, take);
+    if (found != std::string::npos) {
+      /* the document ends with a newline */
+      char newline[2];
+      do {
+	r1 = recv(inFD, newline, sizeof(newline), MSG_PEEK | MSG_WAITALL);
+      } while (r1 < 0 && errno == EINTR);
+      if (r1 == 2 && newline[0] == '\r' && newline[1] == '\n') {
+	recvn(inFD, newline, 2, 0);
+      } else if (r1 >= 1 && newline[0] == '\n') {
+	recvn(inFD, newline, 1, 0);
+      }
+      return 0;
+    }
+  }
+  syslog(LOG_ERR, "bmap is larger than %d bytes", BMAP_MAX_SIZE);
+  return -1;
+}
+
+/**
+ * write an image described by a bmaptool .bmap to the device.
+ *
+ * The stream is the .bmap document followed by the data of each mapped
+ * range, in the order of the ranges. Unmapped blocks are not touched.
+ *
+ * @param inFD the socket the copy engine reads.
+ * @param outFD the device.
+ * @param bufSize the size of each write.
+ * @param error set to 1 if the stream is invalid or a write fails.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copyBmap(int inFD, int outFD, int bufSize, int *error) {
+  std::string xml;
+  BmapInfo info;
+  ssize_t totalLen = 0;
+
+  *error = 1;
+  if (recvBmap(inFD, &xml) < 0 || !parseBmap(xml, &info)) {
+    syslog(LOG_ERR, "Invalid bmap");
+    return 0;
+  }
+
+  bufSize = (bufSize < 4096) ? 4096 : bufSize;
+  char *buf = (char *)malloc(sizeof(char)*bufSize);
+  if (buf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", bufSize);
+    return 0;
+  }
+
+  int i;
+  for (i=0; i<(int)info.ranges.size() && !quitFlag; i++) {
+    long long start = info.ranges[i].first * info.blockSize;
+    long long len = (info.ranges[i].second - info.ranges[i].first + 1) * info.blockSize;
+    /* the last block of the image may be partial */
+    if (info.imageSize > 0 && start + len > info.imageSize) {
+      len = info.imageSize - start;
+    }
+    if (len > 0 && copyRange(inFD, outFD, buf, bufSize, len, (off_t)start) < 0) {
+      break;
+    }
+    totalLen += (len > 0) ? len : 0;
+  }
+  free(buf);
+
+  if (i == (int)info.ranges.size()) {
+    *error = 0;
+    if (info.imageSize > 0) {
+      finishImage(outFD, (off_t)info.imageSize);
+    }
+  }
+  syslog(LOG_INFO, "bmap: %d of %d ranges written", i, (int)info.ranges.size());
+  return totalLen;
+}
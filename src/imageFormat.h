@@ -0,0 +1,89 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_IMAGE_FORMAT_HEAD1_H
+#define _HEADER_UMS2NET_IMAGE_FORMAT_HEAD1_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The format of the (decompressed) incoming stream.
+ */
+enum ImageFormat {
+  FORMAT_AUTO = -1, ///< detect by the magic number
+  FORMAT_RAW = 0, ///< written sequentially as it is
+  FORMAT_SPARSE, ///< Android sparse image
+  FORMAT_BMAP, ///< bmaptool .bmap followed by the mapped blocks
+};
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3aU
+#define SPARSE_HEADER_SIZE 28
+#define SPARSE_CHUNK_HEADER_SIZE 12
+#define SPARSE_CHUNK_RAW 0xcac1
+#define SPARSE_CHUNK_FILL 0xcac2
+#define SPARSE_CHUNK_DONT_CARE 0xcac3
+#define SPARSE_CHUNK_CRC32 0xcac4
+
+/**
+ * The file header of an Android sparse image.
+ */
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t majorVersion;
+  uint16_t minorVersion;
+  uint16_t fileHeaderSize;
+  uint16_t chunkHeaderSize;
+  uint32_t blockSize;
+  uint32_t totalBlocks;
+  uint32_t totalChunks;
+  uint32_t imageChecksum;
+};
+
+/**
+ * The header of one chunk of an Android sparse image.
+ */
+struct SparseChunkHeader {
+  uint16_t chunkType;
+  uint16_t reserved;
+  uint32_t chunkSize; ///< in blocks
+  uint32_t totalSize; ///< in bytes, including the header
+};
+
+/**
+ * What is needed from a bmaptool .bmap file.
+ */
+struct BmapInfo {
+  long long blockSize;
+  long long imageSize;
+  std::vector<std::pair<long long, long long> > ranges; ///< first and last block
+};
+
+int parseImageFormat(const std::string &, int *);
+int detectImageFormat(const unsigned char *buf, size_t len);
+int sniffImageFormat(int inFD);
+const char *getImageFormatName(int format);
+int parseSparseHeader(const unsigned char *buf, SparseHeader *header);
+void parseSparseChunkHeader(const unsigned char *buf, SparseChunkHeader *chunk);
+int parseBmap(const std::string &xml, BmapInfo *info);
+ssize_t copySparse(int inFD, int outFD, int bufSize, int *error);
+ssize_t copyBmap(int inFD, int outFD, int bufSize, int *error);
+
+#endif /* _HEADER_UMS2NET_IMAGE_FORMAT_HEAD1_H */
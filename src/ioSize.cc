@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#include "ioSize.h"
+
+/**
+ * read a number from a file in sysfs.
+ *
+ * @param path the file.
+ *
+ * @return the number, 0 if it cannot be read.
+ */
+long long readSysfsNumber(const char *path) {
+  char buf[64];
+  long long value = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len > 0) {
+    buf[len] = '\0';
+    value = atoll(buf);
+  }
+  return (value > 0) ? value : 0;
+}
+
+/**
+ * read a queue limit of a block device from sysfs.
+ *
+ * A partition has no queue of its own, so the queue of the disk is used.
+ *
+ * @param dev the device number.
+ * @param name the name of the limit in the queue directory.
+ *
+ * @return the limit, 0 if it cannot be read.
+ */
+static long long readQueueLimit(dev_t dev, const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(dev), minor(dev), name);
+  long long value = readSysfsNumber(path);
+  if (value == 0) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(dev), minor(dev), name);
+    value = readSysfsNumber(path);
+  }
+  return value;
+}
+
+/**
+ * probe the I/O limits of a device.
+ *
+ * For a regular file the preferred I/O size of the file system is used as
+ * the physical block size.
+ *
+ * @param fd the device.
+ * @param t the limits are stored here.
+ */
+void getDeviceTopology(int fd, DeviceTopology *t) {
+  struct stat statbuf;
+  memset(t, 0, sizeof(*t));
+  if (fstat(fd, &statbuf) != 0) {
+    return;
+  }
+  if (!S_ISBLK(statbuf.st_mode)) {
+    t->logicalBlockSize = 512;
+    t->physicalBlockSize = (int)statbuf.st_blksize;
+    return;
+  }
+  unsigned int opt = 0;
+  if (ioctl(fd, BLKSSZGET, &t->logicalBlockSize) != 0) {
+    t->logicalBlockSize = 0;
+  }
+  if (ioctl(fd, BLKPBSZGET, &opt) == 0) {
+    t->physicalBlockSize = (int)opt;
+  }
+  opt = 0;
+  if (ioctl(fd, BLKIOOPT, &opt) == 0 && opt > 0) {
+    t->optimalIOSize = (int)opt;
+  } else {
+    t->optimalIOSize = (int)readQueueLimit(statbuf.st_rdev, "optimal_io_size");
+  }
+  long long maxKB = readQueueLimit(statbuf.st_rdev, "max_sectors_kb");
+  if (maxKB > 0 && maxKB * 1024 <= IO_SIZE_MAX) {
+    t->maxIOSize = (int)(maxKB * 1024);
+  }
+}
+
+/**
+ * choose the size of each write for a device.
+ *
+ * The size is the optimal I/O size of the device, but at least
+ * IO_SIZE_DEFAULT. It is a multiple of the largest request of the device,
+ * so that the block layer splits it into full requests, and of the
+ * physical block size.
+ *
+ * @param t the limits of the device.
+ *
+ * @return the size.
+ */
+int chooseIOSize(const DeviceTopology *t) {
+  int size = IO_SIZE_DEFAULT;
+  if (t->optimalIOSize > size && t->optimalIOSize <= IO_SIZE_MAX) {
+    size = t->optimalIOSize;
+  }
+  if (t->maxIOSize > 0 && t->maxIOSize < size) {
+    size = (size / t->maxIOSize) * t->maxIOSize;
+  }
+  int align = (t->physicalBlockSize > t->logicalBlockSize) ? t->physicalBlockSize : t->logicalBlockSize;
+  if (align > 0) {
+    size = ((size + align - 1) / align) * align;
+  }
+  return size;
+}
+
+/**
+ * initialize an IOSizer.
+ *
+ * @param s the sizer.
+ * @param size the size to start with.
+ * @param maxSize the largest size to try.
+ */
+void ioSizerInit(IOSizer *s, int size, int maxSize) {
+  s->size = size;
+  s->maxSize = maxSize;
+  s->settled = (size * 2 > maxSize);
+  s->bytes = 0;
+  s->nsec = 0;
+  s->writes = 0;
+  s->bestRate = 0;
+  s->bestSize = size;
+}
+
+/**
+ * account for one write and choose the size of the next one.
+ *
+ * Each size is measured over 64 writes and at least 64 MiB, so that the
+ * page cache and the writeback have settled.
+ *
+ * @param s the sizer.
+ * @param len the length of the write.
+ * @param nsec how long the write took.
+ *
+ * @return the size of the next write.
+ */
+int ioSizerUpdate(IOSizer *s, size_t len, long long nsec) {
+  if (s->settled) {
+    return s->size;
+  }
+  s->bytes += (long long)len;
+  s->nsec += nsec;
+  s->writes++;
+  if (s->writes < 64 || s->bytes < 64LL*1024*1024) {
+    return s->size;
+  }
+  double rate = (s->nsec > 0) ? (double)s->bytes * 1e9 / (double)s->nsec : 0;
+  if (rate > s->bestRate * 1.05) {
+    s->bestRate = rate;
+    s->bestSize = s->size;
+    if (s->size * 2 <= s->maxSize) {
+      s->size *= 2;
+    } else {
+      s->settled = 1;
+    }
+  } else {
+    s->size = s->bestSize;
+    s->settled = 1;
+  }
+  if (s->settled) {
+    syslog(LOG_DEBUG, "Write size settled at %d bytes (%.1f MB/s)", s->size, s->bestRate / 1e6);
+  }
+  s->bytes = 0;
+  s->nsec = 0;
+  s->writes = 0;
+  return s->size;
+}
@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_IO_SIZE_HEAD1_H
+#define _HEADER_UMS2NET_IO_SIZE_HEAD1_H
+
+#include <sys/types.h>
+
+#define IO_SIZE_DEFAULT (1024*1024)
+#define IO_SIZE_MAX (16*1024*1024)
+
+/**
+ * The limits a device puts on its I/O, 0 if unknown.
+ */
+struct DeviceTopology {
+  int logicalBlockSize; ///< BLKSSZGET, the alignment of O_DIRECT
+  int physicalBlockSize; ///< BLKPBSZGET, smaller writes are read-modify-write
+  int optimalIOSize; ///< BLKIOOPT or queue/optimal_io_size
+  int maxIOSize; ///< queue/max_sectors_kb, larger writes are split
+};
+
+/**
+ * Adapts the size of each write to the throughput measured at runtime.
+ *
+ * The size starts at the size chosen from the topology and is doubled as
+ * long as each doubling raises the throughput by at least 5%. After that
+ * it stays at the best size found.
+ */
+struct IOSizer {
+  int size; ///< the size of the next write
+  int maxSize; ///< the size is never larger than this
+  int settled; ///< 1 once the size no longer changes
+  long long bytes; ///< bytes written at the current size
+  long long nsec; ///< time spent writing them
+  int writes; ///< writes at the current size
+  double bestRate; ///< bytes per second of the best size so far
+  int bestSize; ///< the best size so far
+};
+
+long long readSysfsNumber(const char *path);
+void getDeviceTopology(int fd, DeviceTopology *t);
+int chooseIOSize(const DeviceTopology *t);
+void ioSizerInit(IOSizer *s, int size, int maxSize);
+int ioSizerUpdate(IOSizer *s, size_t len, long long nsec);
+
+#endif /* _HEADER_UMS2NET_IO_SIZE_HEAD1_H */
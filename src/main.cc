@@ -26,13 +26,14 @@
 
 #include <unistd.h>
 #include <getopt.h>
-#include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
 
 #include "main.h"
 #include "configReader.h"
-#include "servantThread.h"
+#include "reactor.h"
+#include "workerPool.h"
+#include "trace.h"
 #include "include/config.h"
 
 static int debug=0;
@@ -47,7 +48,7 @@ volatile int quitFlag=0;
  * @return always 0
  */
 int usage(const char *prog) {
-  std::cerr << "Usage: " << prog << " -c <configFile> [-d] [-P <pidFile>]" << std::endl;
+  std::cerr << "Usage: " << prog << " -c <configFile> [-d] [-P <pidFile>] [-m <metricsPort>] [-t <traceDir>] [-w <workers>]" << std::endl;
   return 0;
 }
 
@@ -66,53 +67,15 @@ void makePIDFile(const std::string &pidfile) {
   fout.close();
 }
 
-std::vector<pthread_t> threads;
-
-/**
- * start threads for each TCP port.
- *
- * @param records the config records
- */
-void startServantThreads(const std::vector<UMS2NETConfRecord> &records) {
-  for (int i=0; i<(int)(records.size()); i++) {
-    pthread_t thread1;
-    pthread_create(&thread1, NULL, servantThread, (void *)(&(records[i])));
-    threads.push_back(thread1);
-  }
-}
-
-/**
- * join threads.
- *
- * @param records the config records
- */
-void joinServantThreads() {
-  for (int i=((int)(threads.size()))-1; i>=0; i--) {
-    void *result1 = NULL;
-    int result;
-    pthread_t thread1 = threads[i];
-    result = pthread_join(thread1, &result1);
-    if (result < 0) {
-      int errsv = errno;
-      char errbuf[1024];
-      char *errstr;
-      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-      syslog(LOG_DEBUG, "fail to join thread (%s)", errstr);
-    }
-    threads.pop_back();
-  }
-}
-
-void sigINTHandler(void) {
-  quitFlag=1;
-}
-
 int main(int argc, char **argv) {
   std::string configFilename;
   int opt;
   std::string pidFilename;
+  int metricsPort = 0;
+  std::string traceDir;
+  int workers = 0;
 
-  while ((opt = getopt(argc, argv, "dc:P:")) != -1) {
+  while ((opt = getopt(argc, argv, "dc:P:m:t:w:")) != -1) {
     switch(opt) {
     case 'c':
       configFilename = std::string(optarg);
@@ -124,6 +87,15 @@ int main(int argc, char **argv) {
     case 'P':
       pidFilename = std::string(optarg);
       break;
+    case 'm':
+      metricsPort = atoi(optarg);
+      break;
+    case 't':
+      traceDir = std::string(optarg);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
     default:
       usage(argv[0]);
       exit(1);
@@ -133,6 +105,22 @@ int main(int argc, char **argv) {
     usage(argv[0]);
     exit(1);
   }
+  /* the config is read again on SIGHUP, after the daemon changes to / */
+  char *resolvedConfig = realpath(configFilename.c_str(), NULL);
+  if (resolvedConfig != NULL) {
+    configFilename = std::string(resolvedConfig);
+    free(resolvedConfig);
+  }
+  if (traceDir.length() > 0) {
+    /* the daemon changes to / */
+    char *resolved = realpath(traceDir.c_str(), NULL);
+    if (resolved == NULL) {
+      std::cerr << "Cannot find trace directory " << traceDir << std::endl;
+      exit(1);
+    }
+    traceEnable(std::string(resolved));
+    free(resolved);
+  }
   if (debug && !detach) {
     openlog(PROJECT_NAME, LOG_PID | LOG_CONS | LOG_PERROR, LOG_DAEMON);
   } else if (detach) {
@@ -182,7 +170,17 @@ int main(int argc, char **argv) {
     makePIDFile(pidFilename);
   }
 
-  startServantThreads(confRecords);
-  joinServantThreads();
+  /* SIGINT, SIGTERM and SIGUSR1 are read by the event loop */
+  if (blockReactorSignals() < 0) {
+    syslog(LOG_WARNING, "Cannot block signals, they terminate ums2net immediately");
+  }
+  /* the workers inherit the blocked signals */
+  if (workers > 0 && workerPoolStart(workers) < 0) {
+    syslog(LOG_WARNING, "Cannot start the workers, each client has its own thread");
+  }
+  if (runReactor(configFilename, confRecords, metricsPort) < 0) {
+    exit(1);
+  }
+  workerPoolStop();
   return 0;
 }
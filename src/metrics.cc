@@ -0,0 +1,431 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+__thread SessionMetrics *sessionMetrics = NULL;
+
+/** the upper bounds of the write latency buckets, in nanoseconds */
+static const long long latencyBounds[METRICS_LATENCY_BUCKETS - 1] = {
+  100000LL, 250000LL, 500000LL, 1000000LL, 2500000LL, 5000000LL, 10000000LL,
+  25000000LL, 50000000LL, 100000000LL, 250000000LL, 500000000LL,
+  1000000000LL, 2500000000LL, 5000000000LL,
+};
+
+/** the upper bounds of the session duration buckets, in seconds */
+static const double durationBounds[METRICS_DURATION_BUCKETS - 1] = {
+  1, 5, 10, 30, 60, 120, 300, 600, 1800, 3600,
+};
+
+static const char *errorNames[METRICS_ERROR_TYPES] = {
+  "open", "recv", "write", "verify", "reject",
+};
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<PortMetrics *> registry;
+
+/**
+ * get the monotonic time.
+ *
+ * @return the time in nanoseconds.
+ */
+long long metricsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * count data received by the session of this thread.
+ *
+ * @param bytes the number of bytes.
+ * @param nsec the time spent waiting for them.
+ */
+void metricsAddRecv(long long bytes, long long nsec) {
+  SessionMetrics *sm = sessionMetrics;
+  if (sm == NULL) {
+    return;
+  }
+  metricsAdd(&sm->bytesReceived, bytes);
+  metricsAdd(&sm->recvNsec, nsec);
+}
+
+/**
+ * count one device write of the session of this thread.
+ *
+ * @param bytes the number of bytes.
+ * @param nsec how long the write took.
+ */
+void metricsAddWrite(long long bytes, long long nsec) {
+  SessionMetrics *sm = sessionMetrics;
+  if (sm == NULL) {
+    return;
+  }
+  int bucket = 0;
+  while (bucket < METRICS_LATENCY_BUCKETS - 1 && nsec > latencyBounds[bucket]) {
+    bucket++;
+  }
+  metricsAdd(&sm->bytesWritten, bytes);
+  metricsAdd(&sm->writeNsec, nsec);
+  metricsAdd(&sm->writes, 1);
+  metricsAdd(&sm->latency[bucket], 1);
+}
+
+/**
+ * count data moved by an engine which does not time its writes.
+ *
+ * @param received bytes received from the client.
+ * @param written bytes written to the device, or sent from it.
+ */
+void metricsAddBytes(long long received, long long written) {
+  SessionMetrics *sm = sessionMetrics;
+  if (sm == NULL) {
+    return;
+  }
+  metricsAdd(&sm->bytesReceived, received);
+  metricsAdd(&sm->bytesWritten, written);
+}
+
+/**
+ * count an error of the session of this thread.
+ *
+ * @param type the MetricsError.
+ */
+void metricsError(int type) {
+  SessionMetrics *sm = sessionMetrics;
+  if (sm == NULL) {
+    return;
+  }
+  metricsAdd(&sm->errors[type], 1);
+}
+
+/**
+ * create the metrics of a port. They are kept until ums2net exits, so a
+ * scrape never sees them go away.
+ *
+ * @param port the TCP port.
+ * @param device the device of the port.
+ *
+ * @return the metrics.
+ */
+PortMetrics *metricsRegisterPort(int port, const std::string &device) {
+  PortMetrics *pm = new PortMetrics;
+  pm->port = port;
+  pm->device = device;
+  pthread_mutex_init(&pm->lock, NULL);
+  memset(&pm->done, 0, sizeof(pm->done));
+  memset(pm->duration, 0, sizeof(pm->duration));
+  pm->durationSum = 0;
+  pm->sessions = 0;
+  pm->active = 0;
+  pm->queued = 0;
+  pthread_mutex_lock(&registryLock);
+  registry.push_back(pm);
+  pthread_mutex_unlock(&registryLock);
+  return pm;
+}
+
+/**
+ * publish the number of sessions and waiting clients of a port.
+ *
+ * @param pm the metrics of the port.
+ * @param active the number of sessions being served.
+ * @param queued the number of clients waiting.
+ */
+void metricsSetPortState(PortMetrics *pm, int active, int queued) {
+  __atomic_store_n(&pm->active, active, __ATOMIC_RELAXED);
+  __atomic_store_n(&pm->queued, queued, __ATOMIC_RELAXED);
+}
+
+/**
+ * count an error which happens outside a session.
+ *
+ * @param pm the metrics of the port.
+ * @param type the MetricsError.
+ */
+void metricsPortError(PortMetrics *pm, int type) {
+  pthread_mutex_lock(&pm->lock);
+  pm->done.errors[type]++;
+  pthread_mutex_unlock(&pm->lock);
+}
+
+/**
+ * start counting a session in this thread.
+ *
+ * @param pm the metrics of the port.
+ * @param sm the counters of the session.
+ */
+void metricsSessionStart(PortMetrics *pm, SessionMetrics *sm) {
+  memset(sm, 0, sizeof(*sm));
+  pthread_mutex_lock(&pm->lock);
+  pm->live.insert(sm);
+  pthread_mutex_unlock(&pm->lock);
+  sessionMetrics = sm;
+}
+
+/**
+ * add up two sets of counters.
+ *
+ * @param sum the sum.
+ * @param sm the counters to add.
+ */
+static void metricsMerge(SessionMetrics *sum, SessionMetrics *sm) {
+  sum->bytesReceived += __atomic_load_n(&sm->bytesReceived, __ATOMIC_RELAXED);
+  sum->bytesWritten += __atomic_load_n(&sm->bytesWritten, __ATOMIC_RELAXED);
+  sum->recvNsec += __atomic_load_n(&sm->recvNsec, __ATOMIC_RELAXED);
+  sum->writeNsec += __atomic_load_n(&sm->writeNsec, __ATOMIC_RELAXED);
+  sum->writes += __atomic_load_n(&sm->writes, __ATOMIC_RELAXED);
+  for (int i=0; i<METRICS_LATENCY_BUCKETS; i++) {
+    sum->latency[i] += __atomic_load_n(&sm->latency[i], __ATOMIC_RELAXED);
+  }
+  for (int i=0; i<METRICS_ERROR_TYPES; i++) {
+    sum->errors[i] += __atomic_load_n(&sm->errors[i], __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * stop counting a session and merge it into its port.
+ *
+ * @param pm the metrics of the port.
+ * @param sm the counters of the session.
+ * @param nsec the duration of the session.
+ */
+void metricsSessionEnd(PortMetrics *pm, SessionMetrics *sm, long long nsec) {
+  double seconds = (double)nsec / 1e9;
+  int bucket = 0;
+  while (bucket < METRICS_DURATION_BUCKETS - 1 && seconds > durationBounds[bucket]) {
+    bucket++;
+  }
+  sessionMetrics = NULL;
+  pthread_mutex_lock(&pm->lock);
+  pm->live.erase(sm);
+  metricsMerge(&pm->done, sm);
+  pm->duration[bucket]++;
+  pm->durationSum += seconds;
+  pm->sessions++;
+  pthread_mutex_unlock(&pm->lock);
+}
+
+/**
+ * quote a label value.
+ *
+ * @param value the value.
+ *
+ * @return the value with '\\', '"' and newlines escaped.
+ */
+static std::string metricsEscape(const std::string &value) {
+  std::string ret;
+  for (std::size_t i=0; i<value.length(); i++) {
+    if (value[i] == '\\' || value[i] == '"') {
+      ret += '\\';
+      ret += value[i];
+    } else if (value[i] == '\n') {
+      ret += "\\n";
+    } else {
+      ret += value[i];
+    }
+  }
+  return ret;
+}
+
+/**
+ * A copy of the metrics of one port, taken under its lock.
+ */
+struct PortSnapshot {
+  std::string labels;
+  SessionMetrics sum;
+  long long duration[METRICS_DURATION_BUCKETS];
+  double durationSum;
+  long long sessions;
+  int active;
+  int queued;
+};
+
+/**
+ * format the metrics of every port in the Prometheus text format.
+ *
+ * @return the text.
+ */
+std::string metricsFormat() {
+  std::vector<PortSnapshot> snapshots;
+  pthread_mutex_lock(&registryLock);
+  std::vector<PortMetrics *> ports = registry;
+  pthread_mutex_unlock(&registryLock);
+  for (int i=0; i<(int)ports.size(); i++) {
+    PortMetrics *pm = ports[i];
+    PortSnapshot s;
+    std::ostringstream labels;
+    labels << "port=\"" << pm->port << "\",device=\"" << metricsEscape(pm->device) << "\"";
+    s.labels = labels.str();
+    pthread_mutex_lock(&pm->lock);
+    s.sum = pm->done;
+    for (std::set<SessionMetrics *>::iterator it=pm->live.begin(); it!=pm->live.end(); ++it) {
+      metricsMerge(&s.sum, *it);
+    }
+    memcpy(s.duration, pm->duration, sizeof(s.duration));
+    s.durationSum = pm->durationSum;
+    s.sessions = pm->sessions;
+    pthread_mutex_unlock(&pm->lock);
+    s.active = __atomic_load_n(&pm->active, __ATOMIC_RELAXED);
+    s.queued = __atomic_load_n(&pm->queued, __ATOMIC_RELAXED);
+    snapshots.push_back(s);
+  }
+
+  std::ostringstream out;
+  out << "# HELP ums2net_received_bytes_total Bytes received from clients.\n"
+      << "# TYPE ums2net_received_bytes_total counter\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_received_bytes_total{" << snapshots[i].labels << "} " << snapshots[i].sum.bytesReceived << "\n";
+  }
+  out << "# HELP ums2net_written_bytes_total Bytes written to the device, or sent from it by if= ports.\n"
+      << "# TYPE ums2net_written_bytes_total counter\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_written_bytes_total{" << snapshots[i].labels << "} " << snapshots[i].sum.bytesWritten << "\n";
+  }
+  out << "# HELP ums2net_recv_seconds_total Time blocked receiving from clients.\n"
+      << "# TYPE ums2net_recv_seconds_total counter\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_recv_seconds_total{" << snapshots[i].labels << "} " << (double)snapshots[i].sum.recvNsec / 1e9 << "\n";
+  }
+  out << "# HELP ums2net_write_seconds_total Time blocked writing to the device.\n"
+      << "# TYPE ums2net_write_seconds_total counter\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_write_seconds_total{" << snapshots[i].labels << "} " << (double)snapshots[i].sum.writeNsec / 1e9 << "\n";
+  }
+  out << "# HELP ums2net_write_latency_seconds Latency of each device write.\n"
+      << "# TYPE ums2net_write_latency_seconds histogram\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    long long cumulative = 0;
+    for (int b=0; b<METRICS_LATENCY_BUCKETS; b++) {
+      cumulative += snapshots[i].sum.latency[b];
+      out << "ums2net_write_latency_seconds_bucket{" << snapshots[i].labels << ",le=\"";
+      if (b < METRICS_LATENCY_BUCKETS - 1) {
+	out << (double)latencyBounds[b] / 1e9;
+      } else {
+	out << "+Inf";
+      }
+      out << "\"} " << cumulative << "\n";
+    }
+    out << "ums2net_write_latency_seconds_sum{" << snapshots[i].labels << "} " << (double)snapshots[i].sum.writeNsec / 1e9 << "\n";
+    out << "ums2net_write_latency_seconds_count{" << snapshots[i].labels << "} " << snapshots[i].sum.writes << "\n";
+  }
+  out << "# HELP ums2net_errors_total Errors by type.\n"
+      << "# TYPE ums2net_errors_total counter\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    for (int e=0; e<METRICS_ERROR_TYPES; e++) {
+      out << "ums2net_errors_total{" << snapshots[i].labels << ",type=\"" << errorNames[e] << "\"} " << snapshots[i].sum.errors[e] << "\n";
+    }
+  }
+  out << "# HELP ums2net_sessions_active Clients being served.\n"
+      << "# TYPE ums2net_sessions_active gauge\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_sessions_active{" << snapshots[i].labels << "} " << snapshots[i].active << "\n";
+  }
+  out << "# HELP ums2net_clients_queued Clients waiting for a busy port.\n"
+      << "# TYPE ums2net_clients_queued gauge\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    out << "ums2net_clients_queued{" << snapshots[i].labels << "} " << snapshots[i].queued << "\n";
+  }
+  out << "# HELP ums2net_session_duration_seconds Duration of the finished sessions.\n"
+      << "# TYPE ums2net_session_duration_seconds histogram\n";
+  for (int i=0; i<(int)snapshots.size(); i++) {
+    long long cumulative = 0;
+    for (int b=0; b<METRICS_DURATION_BUCKETS; b++) {
+      cumulative += snapshots[i].duration[b];
+      out << "ums2net_session_duration_seconds_bucket{" << snapshots[i].labels << ",le=\"";
+      if (b < METRICS_DURATION_BUCKETS - 1) {
+	out << durationBounds[b];
+      } else {
+	out << "+Inf";
+      }
+      out << "\"} " << cumulative << "\n";
+    }
+    out << "ums2net_session_duration_seconds_sum{" << snapshots[i].labels << "} " << snapshots[i].durationSum << "\n";
+    out << "ums2net_session_duration_seconds_count{" << snapshots[i].labels << "} " << snapshots[i].sessions << "\n";
+  }
+  return out.str();
+}
+
+/**
+ * answer one HTTP request for the metrics.
+ *
+ * GET /metrics (or /) returns the metrics; anything else gets 404. The
+ * connection is closed after the response.
+ *
+ * @param clientSocket the socket which is connected to the scraper.
+ */
+void metricsServeClient(int clientSocket) {
+  struct timeval timeout;
+  timeout.tv_sec = 2;
+  timeout.tv_usec = 0;
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* read the request line and headers */
+  std::string request;
+  char buf[1024];
+  while (request.length() < 8192 && request.find("\r\n\r\n") == std::string::npos
+	 && request.find("\n\n") == std::string::npos) {
+    ssize_t r1 = recv(clientSocket, buf, sizeof(buf), 0);
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    } else if (r1 <= 0) {
+      break;
+    }
+    request.append(buf, (size_t)r1);
+  }
+
+  std::string status("404 Not Found");
+  std::string body("Not Found\n");
+  if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+    status = std::string("200 OK");
+    body = metricsFormat();
+  }
+  std::ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+	   << "Content-Type: text/plain; version=0.0.4\r\n"
+	   << "Content-Length: " << body.length() << "\r\n"
+	   << "Connection: close\r\n\r\n"
+	   << body;
+  std::string text = response.str();
+  std::size_t sent = 0;
+  while (sent < text.length()) {
+    ssize_t w1 = send(clientSocket, text.c_str() + sent, text.length() - sent, MSG_NOSIGNAL);
+    if (w1 < 0 && errno == EINTR) {
+      continue;
+    } else if (w1 <= 0) {
+      syslog(LOG_DEBUG, "Cannot send the metrics");
+      break;
+    }
+    sent += (size_t)w1;
+  }
+}
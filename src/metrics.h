@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_METRICS_HEAD1_H
+#define _HEADER_UMS2NET_METRICS_HEAD1_H
+
+#include <set>
+#include <string>
+#include <pthread.h>
+
+#define METRICS_LATENCY_BUCKETS 16
+#define METRICS_DURATION_BUCKETS 11
+
+/**
+ * The kinds of errors which are counted.
+ */
+enum MetricsError {
+  METRICS_ERROR_OPEN = 0, ///< the device is missing or cannot be opened
+  METRICS_ERROR_RECV, ///< the client connection failed
+  METRICS_ERROR_WRITE, ///< a device write failed
+  METRICS_ERROR_VERIFY, ///< the read-back differs from the data
+  METRICS_ERROR_REJECT, ///< a client was turned away by busy=reject
+  METRICS_ERROR_TYPES,
+};
+
+/**
+ * The counters of one session. Each counter has a single writer, the
+ * session thread or the writer thread of the direct engine, which uses
+ * plain relaxed stores, so the hot path takes no lock and no locked
+ * instruction; a scrape reads them with relaxed loads.
+ */
+struct SessionMetrics {
+  long long bytesReceived; ///< bytes received from the client
+  long long bytesWritten; ///< bytes written to the device, or sent from it
+  long long recvNsec; ///< time blocked receiving from the client
+  long long writeNsec; ///< time blocked writing to the device
+  long long writes; ///< number of timed writes
+  long long latency[METRICS_LATENCY_BUCKETS]; ///< writes by latency bucket
+  long long errors[METRICS_ERROR_TYPES]; ///< errors by MetricsError
+};
+
+/**
+ * The metrics of one port. Finished sessions are merged into done; the
+ * sessions being served are summed in at each scrape.
+ */
+struct PortMetrics {
+  int port; ///< TCP port
+  std::string device; ///< the first of= or if= operand
+  pthread_mutex_t lock; ///< protects done, live and duration
+  SessionMetrics done; ///< the sum of the finished sessions
+  std::set<SessionMetrics *> live; ///< the sessions being served
+  long long duration[METRICS_DURATION_BUCKETS]; ///< sessions by duration bucket
+  double durationSum; ///< seconds of all the finished sessions
+  long long sessions; ///< finished sessions
+  int active; ///< sessions being served, set by the reactor
+  int queued; ///< clients waiting for the port, set by the reactor
+};
+
+extern __thread SessionMetrics *sessionMetrics;
+
+/**
+ * add to a counter of the session of this thread.
+ *
+ * @param counter the counter.
+ * @param value the value to add.
+ */
+static inline void metricsAdd(long long *counter, long long value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+long long metricsNow();
+void metricsAddRecv(long long bytes, long long nsec);
+void metricsAddWrite(long long bytes, long long nsec);
+void metricsAddBytes(long long received, long long written);
+void metricsError(int type);
+PortMetrics *metricsRegisterPort(int port, const std::string &device);
+void metricsSetPortState(PortMetrics *pm, int active, int queued);
+void metricsPortError(PortMetrics *pm, int type);
+void metricsSessionStart(PortMetrics *pm, SessionMetrics *sm);
+void metricsSessionEnd(PortMetrics *pm, SessionMetrics *sm, long long nsec);
+std::string metricsFormat();
+void metricsServeClient(int clientSocket);
+
+#endif /* _HEADER_UMS2NET_METRICS_HEAD1_H */
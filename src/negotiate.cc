@@ -0,0 +1,333 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "negotiate.h"
+#include "decompress.h"
+#include "checksum.h"
+#include "deviceManager.h"
+#include "ums2netconfrecord.h"
+
+/**
+ * read a little-endian uint64_t.
+ *
+ * @param p the first byte.
+ *
+ * @return the value.
+ */
+static uint64_t getLE64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i=7; i>=0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/**
+ * append a little-endian uint64_t.
+ *
+ * @param str the bytes so far.
+ * @param value the value.
+ */
+static void putLE64(std::string *str, uint64_t value) {
+  for (int i=0; i<8; i++) {
+    str->push_back((char)(value & 0xff));
+    value >>= 8;
+  }
+}
+
+/**
+ * check if a connection starts with a magic number, without consuming it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param magic the 8-byte magic number.
+ *
+ * @return 1 if it does, otherwise 0.
+ */
+static int sniffMagic(int clientSocket, const char *magic) {
+  unsigned char buf[8];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, buf, sizeof(buf), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  return (r1 == (ssize_t)sizeof(buf) && memcmp(buf, magic, sizeof(buf)) == 0);
+}
+
+/**
+ * check if a connection is a capability query, without consuming it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ *
+ * @return 1 if it is, otherwise 0.
+ */
+int sniffCapsQuery(int clientSocket) {
+  return sniffMagic(clientSocket, CAPS_QUERY_MAGIC);
+}
+
+/**
+ * describe what a port accepts, as one line.
+ *
+ * The line is "ums2net: caps" followed by key=value pairs: the protocol
+ * version, the number of devices, the size of the smallest block device
+ * (0 if unknown), the size of each write and the USB speed of the first
+ * device, the compressions ("none" for raw data) and image formats,
+ * whether ranged and resumable uploads are served, the checksums a client
+ * may ask for, and whether the data is read back.
+ *
+ * @param ddParameters the dd operands of the port.
+ * @param devFilenames the devices of the port.
+ *
+ * @return the line, with its newline.
+ */
+std::string formatCapabilities(const std::map<std::string, std::string> &ddParameters, const std::vector<std::string> &devFilenames) {
+  int single = (devFilenames.size() == 1);
+  long long size = 0;
+  int ioSize = 0;
+  int usbSpeed = 0;
+  for (int i=0; i<(int)devFilenames.size(); i++) {
+    DeviceInfo info;
+    struct stat st;
+    if (deviceManagerQuery(devFilenames[i], &info) < 0) {
+      continue;
+    }
+    /* a regular file grows to the size of the image */
+    if (stat(devFilenames[i].c_str(), &st) == 0 && S_ISBLK(st.st_mode) && (size == 0 || info.size < size)) {
+      size = info.size;
+    }
+    if (ioSize == 0) {
+      ioSize = chooseIOSize(&info.topology);
+      usbSpeed = info.usbSpeed;
+    }
+  }
+  long long bs = 0;
+  if (ddParameters.find(std::string("bs")) != ddParameters.end()
+      && parseDDNumber(ddParameters.at(std::string("bs")), &bs) && bs > 0) {
+    ioSize = (int)bs;
+  }
+
+  /* comp= fixes the compression, otherwise raw data and every supported
+     compression are detected */
+  std::string comp;
+  int compression = COMP_AUTO;
+  if (ddParameters.find(std::string("comp")) != ddParameters.end()) {
+    parseCompression(ddParameters.at(std::string("comp")), &compression);
+  }
+  if (compression == COMP_AUTO) {
+    static const int all[] = { COMP_GZIP, COMP_XZ, COMP_ZSTD };
+    comp = "none";
+    for (int i=0; i<(int)(sizeof(all)/sizeof(all[0])); i++) {
+      if (isCompressionSupported(all[i])) {
+	comp += std::string(",") + getCompressionName(all[i]);
+      }
+    }
+  } else if (compression != COMP_NONE && isCompressionSupported(compression)) {
+    comp = getCompressionName(compression);
+  } else {
+    comp = "none";
+  }
+
+  /* several devices only take raw images */
+  std::string format("raw,sparse,bmap");
+  if (!single) {
+    format = "raw";
+  } else if (ddParameters.find(std::string("format")) != ddParameters.end()
+	     && ddParameters.at(std::string("format")).compare("auto") != 0) {
+    format = ddParameters.at(std::string("format"));
+  }
+
+  /* a single device computes what the client asks for, several devices
+     only what checksum= says */
+  std::string checksum;
+  if (single) {
+    checksum = isChecksumSupported(CHECKSUM_SHA256) ? "crc32c,sha256" : "crc32c";
+  } else if (ddParameters.find(std::string("checksum")) != ddParameters.end()) {
+    checksum = ddParameters.at(std::string("checksum"));
+  }
+
+  int range = single && ddParameters.find(std::string("busy")) != ddParameters.end()
+    && ddParameters.at(std::string("busy")).compare("concurrent") == 0;
+  int resume = single && ddParameters.find(std::string("checkpoint")) != ddParameters.end();
+  int verify = ddParameters.find(std::string("verify")) != ddParameters.end()
+    && ddParameters.at(std::string("verify")).compare("yes") == 0;
+
+  std::ostringstream line;
+  line << "ums2net: caps proto=" << CAPS_PROTOCOL_VERSION << " devices=" << devFilenames.size()
+       << " size=" << size << " iosize=" << ioSize << " usb=" << usbSpeed
+       << " comp=" << comp << " format=" << format
+       << " range=" << range << " resume=" << resume
+       << " checksum=" << (checksum.length() > 0 ? checksum : std::string("none")) << " verify=" << verify << "\n";
+  return line.str();
+}
+
+/**
+ * parse the line which answers a capability query.
+ *
+ * @param line the line, with or without its newline.
+ * @param caps the key=value pairs are stored here.
+ *
+ * @return 1 if success, 0 if the line is not a capability line.
+ */
+int parseCapabilities(const std::string &line, std::map<std::string, std::string> *caps) {
+  static const std::string prefix("ums2net: caps ");
+  caps->clear();
+  if (line.compare(0, prefix.length(), prefix) != 0) {
+    return 0;
+  }
+  std::istringstream words(line.substr(prefix.length()));
+  std::string word;
+  while (words >> word) {
+    std::size_t eq = word.find('=');
+    if (eq == std::string::npos || eq == 0) {
+      continue;
+    }
+    (*caps)[word.substr(0, eq)] = word.substr(eq + 1);
+  }
+  return (caps->find(std::string("proto")) != caps->end());
+}
+
+/**
+ * answer a capability query and end the connection.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param ddParameters the dd operands of the port.
+ * @param devFilenames the devices of the port.
+ */
+void capsServant(int clientSocket, const std::map<std::string, std::string> &ddParameters, const std::vector<std::string> &devFilenames) {
+  char magic[8];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, magic, sizeof(magic), MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  std::string line = formatCapabilities(ddParameters, devFilenames);
+  syslog(LOG_DEBUG, "Answer a capability query: %s", line.substr(0, line.length() - 1).c_str());
+  if (send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the capabilities to the client");
+  }
+}
+
+/**
+ * build the header of a push connection.
+ *
+ * @param header the flags and the size.
+ *
+ * @return the PUSH_HEADER_SIZE bytes.
+ */
+std::string formatPushHeader(const PushHeader &header) {
+  std::string buf(PUSH_HEADER_MAGIC);
+  putLE64(&buf, header.flags);
+  putLE64(&buf, header.dataSize);
+  return buf;
+}
+
+/**
+ * parse the header of a push connection.
+ *
+ * @param buf the received bytes.
+ * @param len the number of bytes.
+ * @param header the parsed header.
+ *
+ * @return 1 if success, 0 if it is not a push header.
+ */
+int parsePushHeader(const unsigned char *buf, size_t len, PushHeader *header) {
+  if (len < PUSH_HEADER_SIZE || memcmp(buf, PUSH_HEADER_MAGIC, 8) != 0) {
+    return 0;
+  }
+  header->flags = getLE64(buf + 8);
+  header->dataSize = getLE64(buf + 16);
+  return 1;
+}
+
+/**
+ * take the push header from the start of a connection, if there is one.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param header the parsed header.
+ *
+ * @return 1 if it was there, 0 if not, -1 if it was cut short.
+ */
+int recvPushHeader(int clientSocket, PushHeader *header) {
+  if (!sniffMagic(clientSocket, PUSH_HEADER_MAGIC)) {
+    return 0;
+  }
+  unsigned char buf[PUSH_HEADER_SIZE];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, buf, sizeof(buf), MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 != (ssize_t)sizeof(buf) || !parsePushHeader(buf, sizeof(buf), header)) {
+    syslog(LOG_ERR, "Invalid push header");
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * send the final status of a push connection as one line, e.g.
+ * "ums2net: push 5874929 of 5874929 bytes ok", without "of" if the size
+ * is unknown.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param header the header of the connection, dataSize 0 is not checked.
+ * @param totalLen the number of bytes written to the device.
+ * @param error set if anything failed.
+ */
+void reportPush(int clientSocket, const PushHeader &header, ssize_t totalLen, int error) {
+  if (!(header.flags & PUSH_STATUS)) {
+    return;
+  }
+  std::ostringstream report;
+  int ok = !error && (header.dataSize == 0 || (uint64_t)totalLen == header.dataSize);
+  report << "ums2net: push " << totalLen;
+  if (header.dataSize > 0) {
+    report << " of " << header.dataSize;
+  }
+  report << " bytes " << (ok ? "ok" : "failed") << "\n";
+  std::string line = report.str();
+  if (send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the status to the client");
+  }
+}
+
+/**
+ * build the header of one connection of a ranged upload.
+ *
+ * @param header the range.
+ *
+ * @return the RANGE_HEADER_SIZE bytes.
+ */
+std::string formatRangeHeader(const RangeHeader &header) {
+  std::string buf(RANGE_HEADER_MAGIC);
+  putLE64(&buf, header.uploadId);
+  putLE64(&buf, header.offset);
+  putLE64(&buf, header.length);
+  putLE64(&buf, header.imageSize);
+  return buf;
+}
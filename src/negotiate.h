@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_NEGOTIATE_HEAD1_H
+#define _HEADER_UMS2NET_NEGOTIATE_HEAD1_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rangeUpload.h"
+
+#define CAPS_QUERY_MAGIC "UMS2CAP1"
+#define CAPS_PROTOCOL_VERSION 1
+#define PUSH_HEADER_MAGIC "UMS2PSH1"
+#define PUSH_HEADER_SIZE 24
+
+/**
+ * The flags of a PushHeader.
+ */
+enum PushFlags {
+  PUSH_STATUS = 1, ///< send a final status line
+  PUSH_CRC32C = 2, ///< compute the CRC32C of the data, if the port does not
+  PUSH_SHA256 = 4, ///< compute the CRC32C and SHA-256 of the data
+};
+
+/**
+ * The header which a push client sends before the image, so that the
+ * connection always ends with a status line. The numbers are
+ * little-endian uint64_t after the 8-byte magic.
+ */
+struct PushHeader {
+  uint64_t flags; ///< the PushFlags
+  uint64_t dataSize; ///< bytes the device is expected to receive, 0 if unknown
+};
+
+int sniffCapsQuery(int clientSocket);
+std::string formatCapabilities(const std::map<std::string, std::string> &ddParameters, const std::vector<std::string> &devFilenames);
+int parseCapabilities(const std::string &line, std::map<std::string, std::string> *caps);
+void capsServant(int clientSocket, const std::map<std::string, std::string> &ddParameters, const std::vector<std::string> &devFilenames);
+std::string formatPushHeader(const PushHeader &header);
+int parsePushHeader(const unsigned char *buf, size_t len, PushHeader *header);
+int recvPushHeader(int clientSocket, PushHeader *header);
+void reportPush(int clientSocket, const PushHeader &header, ssize_t totalLen, int error);
+std::string formatRangeHeader(const RangeHeader &header);
+
+#endif /* _HEADER_UMS2NET_NEGOTIATE_HEAD1_H */
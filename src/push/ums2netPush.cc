@@ -0,0 +1,945 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "../main.h"
+#include "../compress.h"
+#include "../decompress.h"
+#include "../checksum.h"
+#include "../zeroBlock.h"
+#include "../negotiate.h"
+
+volatile int quitFlag = 0;
+
+/** the image bytes in one compressed chunk */
+#define PUSH_CHUNK_SIZE (4*1024*1024)
+/** the block size of the map of a sparse image */
+#define PUSH_BLOCK_SIZE 4096
+/** images smaller than this are sent over one connection */
+#define PUSH_RANGE_MIN (256LL*1024*1024)
+/** the most connections of a ranged upload chosen without -n */
+#define PUSH_RANGE_MAX 4
+
+/**
+ * A piece of the data of a connection, read and compressed by a worker.
+ */
+struct PushChunk {
+  off_t offset; ///< the image offset, -1 if raw already holds the data
+  size_t length; ///< bytes of the image
+  std::string raw; ///< the data before compression
+  std::string data; ///< the bytes to send
+  int ready; ///< set by the worker
+  int error; ///< set if the data cannot be read or compressed
+};
+
+struct PushClient;
+
+/**
+ * One connection to the server, sending its chunks in order.
+ */
+struct PushConnection {
+  PushClient *client; ///< the shared state
+  int socket; ///< connected to the server
+  std::string header; ///< sent before the data, never compressed
+  std::vector<PushChunk> chunks; ///< the data
+  size_t submitted; ///< chunks handed to the workers
+  Checksum *checksum; ///< if not NULL, the checksum of the data sent
+  pthread_t thread; ///< the sending thread
+  int started; ///< set if the thread was created
+  int error; ///< set if the data could not be sent
+  std::string reply; ///< the lines the server answered
+};
+
+/**
+ * The image and the workers which read and compress it.
+ */
+struct PushClient {
+  int fd; ///< the image
+  int compression; ///< the Compression of every chunk
+  int keepRaw; ///< keep the data before compression for the checksum
+  int window; ///< chunks each connection keeps in the workers ahead
+  pthread_mutex_t mutex; ///< protects everything below
+  pthread_cond_t jobCond; ///< signalled when a job is queued or stop is set
+  pthread_cond_t readyCond; ///< signalled when a chunk is ready
+  std::deque<PushChunk *> jobs; ///< chunks to read and compress
+  int stop; ///< set when the workers should exit
+  int finished; ///< connections which are done
+  long long sent; ///< bytes of the image sent
+  long long wire; ///< bytes sent over the network
+};
+
+/**
+ * get the time in seconds.
+ *
+ * @return the monotonic time.
+ */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * send a whole buffer.
+ *
+ * @param fd the socket.
+ * @param buf the data.
+ * @param len the size of the data.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sendAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t s1 = send(fd, buf, len, MSG_NOSIGNAL);
+    if (s1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (s1 <= 0) {
+      return -1;
+    }
+    buf += s1;
+    len -= (size_t)s1;
+  }
+  return 0;
+}
+
+/**
+ * read a socket until the server closes it.
+ *
+ * @param fd the socket.
+ *
+ * @return what was read.
+ */
+static std::string recvAll(int fd) {
+  std::string ret;
+  char buf[4096];
+  ssize_t r1;
+  while ((r1 = recv(fd, buf, sizeof(buf), 0)) != 0) {
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r1 < 0) {
+      break;
+    }
+    ret.append(buf, (size_t)r1);
+  }
+  return ret;
+}
+
+/**
+ * connect to the server.
+ *
+ * @param host the name or address of the server.
+ * @param port the TCP port.
+ *
+ * @return the socket, -1 on error.
+ */
+static int connectServer(const std::string &host, const std::string &port) {
+  struct addrinfo hints;
+  struct addrinfo *result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (ret != 0) {
+    std::cerr << "Cannot resolve " << host << " (" << gai_strerror(ret) << ")" << std::endl;
+    return -1;
+  }
+  int s = -1;
+  int errsv = 0;
+  for (struct addrinfo *ai=result; ai!=NULL; ai=ai->ai_next) {
+    s = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    errsv = errno;
+    if (s >= 0) {
+      close(s);
+      s = -1;
+    }
+  }
+  freeaddrinfo(result);
+  if (s < 0) {
+    char errbuf[1024];
+    char *errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    std::cerr << "Cannot connect to " << host << ":" << port << " (" << errstr << ")" << std::endl;
+  }
+  return s;
+}
+
+/**
+ * ask the server what the port accepts.
+ *
+ * The server answers when the session starts, so with busy=queue the
+ * answer waits for the clients before.
+ *
+ * @param host the server.
+ * @param port the TCP port.
+ * @param caps the capabilities are stored here.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int queryCapabilities(const std::string &host, const std::string &port, std::map<std::string, std::string> *caps) {
+  int s = connectServer(host, port);
+  if (s < 0) {
+    return -1;
+  }
+  std::string answer;
+  if (sendAll(s, CAPS_QUERY_MAGIC, 8) == 0) {
+    answer = recvAll(s);
+  }
+  close(s);
+  std::string line = answer.substr(0, answer.find('\n'));
+  if (!parseCapabilities(line, caps)) {
+    if (line.length() > 0) {
+      std::cerr << line << std::endl;
+    } else {
+      std::cerr << "The server does not answer the capability query" << std::endl;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * check if a comma separated list has an item.
+ *
+ * @param list the list.
+ * @param item the item.
+ *
+ * @return 1 if it has, otherwise 0.
+ */
+static int listHas(const std::string &list, const std::string &item) {
+  std::stringstream in(list);
+  std::string s;
+  while (std::getline(in, s, ',')) {
+    if (s.compare(item) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * read a whole range of the image.
+ *
+ * @param fd the image.
+ * @param buf the buffer.
+ * @param len the number of bytes.
+ * @param offset the image offset.
+ *
+ * @return 0 on success, -1 on error or EOF.
+ */
+static int preadAll(int fd, char *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t r1 = pread(fd, buf, len, offset);
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r1 <= 0) {
+      return -1;
+    }
+    buf += r1;
+    len -= (size_t)r1;
+    offset += r1;
+  }
+  return 0;
+}
+
+/**
+ * find the ranges of the image which hold data.
+ *
+ * Holes are found with SEEK_DATA and SEEK_HOLE. If scanZeros is set, the
+ * data is also read and blocks of zeros are treated as holes. The ranges
+ * are aligned to PUSH_BLOCK_SIZE, except at the end of the image.
+ *
+ * @param fd the image.
+ * @param size the size of the image.
+ * @param scanZeros if 1, read the data for blocks of zeros.
+ * @param extents the (offset, length) of each range are stored here.
+ *
+ * @return the bytes in the ranges, -1 on error.
+ */
+static long long mapImage(int fd, off_t size, int scanZeros, std::vector<std::pair<off_t, off_t> > *extents) {
+  std::vector<std::pair<off_t, off_t> > found;
+  off_t pos = 0;
+  while (pos < size) {
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      break;
+    } else if (data < 0) {
+      /* holes are not reported, so all of it is data */
+      found.clear();
+      found.push_back(std::make_pair((off_t)0, size));
+      break;
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > size) {
+      hole = size;
+    }
+    off_t start = data - data % PUSH_BLOCK_SIZE;
+    off_t end = std::min(size, (hole + PUSH_BLOCK_SIZE - 1) / PUSH_BLOCK_SIZE * PUSH_BLOCK_SIZE);
+    if (!found.empty() && start <= found.back().second) {
+      found.back().second = std::max(found.back().second, end);
+    } else {
+      found.push_back(std::make_pair(start, end));
+    }
+    pos = hole;
+  }
+
+  extents->clear();
+  long long mapped = 0;
+  std::vector<char> buf(scanZeros ? PUSH_CHUNK_SIZE : 0);
+  for (int i=0; i<(int)found.size(); i++) {
+    off_t start = found[i].first;
+    off_t end = found[i].second;
+    if (!scanZeros) {
+      extents->push_back(std::make_pair(start, end - start));
+      mapped += end - start;
+      continue;
+    }
+    for (off_t off=start; off<end; off+=PUSH_CHUNK_SIZE) {
+      size_t len = (size_t)std::min((off_t)PUSH_CHUNK_SIZE, end - off);
+      if (preadAll(fd, &buf[0], len, off) < 0) {
+	return -1;
+      }
+      for (size_t b=0; b<len; b+=PUSH_BLOCK_SIZE) {
+	size_t blockLen = std::min((size_t)PUSH_BLOCK_SIZE, len - b);
+	if (isZeroBlock(&buf[b], blockLen)) {
+	  continue;
+	}
+	off_t blockStart = off + (off_t)b;
+	if (!extents->empty() && extents->back().first + extents->back().second == blockStart) {
+	  extents->back().second += (off_t)blockLen;
+	} else {
+	  extents->push_back(std::make_pair(blockStart, (off_t)blockLen));
+	}
+	mapped += (long long)blockLen;
+      }
+    }
+  }
+  return mapped;
+}
+
+/**
+ * describe the ranges of the image as a bmaptool .bmap document.
+ *
+ * @param size the size of the image.
+ * @param mapped the bytes in the ranges.
+ * @param extents the ranges.
+ *
+ * @return the document, with a newline after "</bmap>".
+ */
+static std::string formatBmap(off_t size, long long mapped, const std::vector<std::pair<off_t, off_t> > &extents) {
+  std::ostringstream xml;
+  xml << "<?xml version=\"1.0\" ?>\n<bmap version=\"2.0\">\n"
+      << "    <ImageSize> " << size << " </ImageSize>\n"
+      << "    <BlockSize> " << PUSH_BLOCK_SIZE << " </BlockSize>\n"
+      << "    <BlocksCount> " << (size + PUSH_BLOCK_SIZE - 1) / PUSH_BLOCK_SIZE << " </BlocksCount>\n"
+      << "    <MappedBlocksCount> " << (mapped + PUSH_BLOCK_SIZE - 1) / PUSH_BLOCK_SIZE << " </MappedBlocksCount>\n"
+      << "    <BlockMap>\n";
+  for (int i=0; i<(int)extents.size(); i++) {
+    off_t first = extents[i].first / PUSH_BLOCK_SIZE;
+    off_t last = (extents[i].first + extents[i].second - 1) / PUSH_BLOCK_SIZE;
+    if (first == last) {
+      xml << "        <Range> " << first << " </Range>\n";
+    } else {
+      xml << "        <Range> " << first << "-" << last << " </Range>\n";
+    }
+  }
+  xml << "    </BlockMap>\n</bmap>\n";
+  return xml.str();
+}
+
+/**
+ * add the chunks of a range of the image to a connection.
+ *
+ * @param conn the connection.
+ * @param offset the image offset.
+ * @param length the bytes of the range.
+ */
+static void addChunks(PushConnection *conn, off_t offset, off_t length) {
+  for (off_t done=0; done<length; done+=PUSH_CHUNK_SIZE) {
+    PushChunk chunk;
+    chunk.offset = offset + done;
+    chunk.length = (size_t)std::min((off_t)PUSH_CHUNK_SIZE, length - done);
+    chunk.ready = 0;
+    chunk.error = 0;
+    conn->chunks.push_back(chunk);
+  }
+}
+
+/**
+ * a worker: read and compress the chunks of all the connections.
+ *
+ * @param data the pointer of PushClient
+ *
+ * @return NULL.
+ */
+static void* pushWorker(void *data) {
+  PushClient *c = (PushClient *)(data);
+  while (1) {
+    pthread_mutex_lock(&c->mutex);
+    while (c->jobs.empty() && !c->stop) {
+      pthread_cond_wait(&c->jobCond, &c->mutex);
+    }
+    if (c->jobs.empty()) {
+      pthread_mutex_unlock(&c->mutex);
+      break;
+    }
+    PushChunk *chunk = c->jobs.front();
+    c->jobs.pop_front();
+    pthread_mutex_unlock(&c->mutex);
+
+    int error = 0;
+    if (chunk->offset >= 0) {
+      chunk->raw.resize(chunk->length);
+      error = (preadAll(c->fd, &chunk->raw[0], chunk->length, chunk->offset) < 0);
+    }
+    if (!error && c->compression != COMP_NONE) {
+      error = (compressChunk(c->compression, chunk->raw.c_str(), chunk->raw.length(), &chunk->data) < 0);
+      if (!c->keepRaw) {
+	std::string().swap(chunk->raw);
+      }
+    } else {
+      chunk->data.swap(chunk->raw);
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    chunk->error = error;
+    chunk->ready = 1;
+    pthread_cond_broadcast(&c->readyCond);
+    pthread_mutex_unlock(&c->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * the sending thread of a connection: keep window chunks in the workers,
+ * send the chunks in order, then collect the answer of the server.
+ *
+ * @param data the pointer of PushConnection
+ *
+ * @return NULL.
+ */
+static void* pushSender(void *data) {
+  PushConnection *conn = (PushConnection *)(data);
+  PushClient *c = conn->client;
+  if (sendAll(conn->socket, conn->header.c_str(), conn->header.length()) < 0) {
+    conn->error = 1;
+  }
+  for (size_t i=0; i<conn->chunks.size() && !conn->error && !quitFlag; i++) {
+    PushChunk *chunk = &conn->chunks[i];
+    pthread_mutex_lock(&c->mutex);
+    while (conn->submitted < conn->chunks.size() && conn->submitted < i + c->window) {
+      c->jobs.push_back(&conn->chunks[conn->submitted++]);
+      pthread_cond_signal(&c->jobCond);
+    }
+    while (!chunk->ready) {
+      pthread_cond_wait(&c->readyCond, &c->mutex);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    if (chunk->error) {
+      std::cerr << "Cannot read the image at offset " << chunk->offset << std::endl;
+      conn->error = 1;
+      break;
+    }
+    if (conn->checksum != NULL) {
+      const std::string &plain = chunk->raw.empty() ? chunk->data : chunk->raw;
+      checksumUpdate(conn->checksum, plain.c_str(), plain.length());
+    }
+    if (sendAll(conn->socket, chunk->data.c_str(), chunk->data.length()) < 0) {
+      conn->error = 1;
+    }
+    __sync_fetch_and_add(&c->sent, (long long)chunk->length);
+    __sync_fetch_and_add(&c->wire, (long long)chunk->data.length());
+    std::string().swap(chunk->raw);
+    std::string().swap(chunk->data);
+  }
+
+  /* whatever happened, the server may have said why */
+  shutdown(conn->socket, SHUT_WR);
+  conn->reply = recvAll(conn->socket);
+  close(conn->socket);
+
+  /* chunks still in the workers are left to them */
+  pthread_mutex_lock(&c->mutex);
+  while (1) {
+    size_t pending = 0;
+    for (size_t i=0; i<conn->submitted; i++) {
+      pending += !conn->chunks[i].ready;
+    }
+    if (pending == 0) {
+      break;
+    }
+    pthread_cond_wait(&c->readyCond, &c->mutex);
+  }
+  c->finished++;
+  pthread_mutex_unlock(&c->mutex);
+  return NULL;
+}
+
+/**
+ * print the progress on one line of the terminal.
+ *
+ * @param done the bytes sent.
+ * @param total the bytes to send.
+ * @param seconds the time since the start.
+ */
+static void printProgress(long long done, long long total, double seconds) {
+  double rate = (seconds > 0) ? done / seconds : 0;
+  char eta[32] = "--:--";
+  if (rate > 0 && total >= done) {
+    long long left = (long long)((total - done) / rate);
+    snprintf(eta, sizeof(eta), "%lld:%02lld", left / 60, left % 60);
+  }
+  fprintf(stderr, "\r%8.1f of %.1f MiB %3d%% %8.1f MiB/s ETA %s ",
+	  done / 1048576.0, total / 1048576.0, (total > 0) ? (int)(done * 100 / total) : 100,
+	  rate / 1048576.0, eta);
+}
+
+/**
+ * check the answers of the server.
+ *
+ * A single connection ends with the push status and maybe the checksum, a
+ * ranged upload has one line per range, and several devices have one
+ * line each.
+ *
+ * @param conns the connections.
+ * @param devices the number of devices of the port.
+ * @param ranged set if the connections are the ranges of one upload.
+ * @param digest the local checksum, empty if none.
+ *
+ * @return 0 if everything was written, 1 on failure, 2 if the checksum
+ *         does not match.
+ */
+static int checkReplies(const std::vector<PushConnection *> &conns, int devices, int ranged, const std::string &digest) {
+  int status = 0;
+  int complete = 0;
+  int pushed = 0;
+  int devicesOk = 0;
+  int digestSeen = 0;
+  for (int i=0; i<(int)conns.size(); i++) {
+    if (conns[i]->error) {
+      status = 1;
+    }
+    std::istringstream lines(conns[i]->reply);
+    std::string line;
+    while (std::getline(lines, line)) {
+      std::cout << line << std::endl;
+      if (line.find("verify=failed") != std::string::npos) {
+	status = 1;
+      }
+      if (line.find("crc32c=") != std::string::npos) {
+	digestSeen = 1;
+	if (digest.length() > 0 && line.find(digest) == std::string::npos) {
+	  std::cerr << "The checksum of the server does not match " << digest << std::endl;
+	  status = (status == 0) ? 2 : status;
+	}
+      }
+      if (ranged) {
+	if (line.find(" ok, ") == std::string::npos) {
+	  status = 1;
+	}
+	complete |= (line.find("image complete") != std::string::npos);
+      } else if (devices > 1) {
+	if (line.find(" bytes ok") != std::string::npos) {
+	  devicesOk++;
+	} else if (line.find(" failed") != std::string::npos || line.find(" dropped") != std::string::npos) {
+	  status = 1;
+	}
+      } else if (line.compare(0, 14, "ums2net: push ") == 0) {
+	pushed = 1;
+	if (line.find(" ok") == std::string::npos) {
+	  status = 1;
+	}
+      }
+    }
+  }
+  if (ranged && !complete) {
+    std::cerr << "The server did not complete the image" << std::endl;
+    status = (status == 0) ? 1 : status;
+  } else if (!ranged && devices > 1 && devicesOk < devices) {
+    status = (status == 0) ? 1 : status;
+  } else if (!ranged && devices == 1 && !pushed) {
+    std::cerr << "The server did not report the result" << std::endl;
+    status = (status == 0) ? 1 : status;
+  }
+  if (digest.length() > 0 && !digestSeen) {
+    std::cerr << "The server did not report a checksum" << std::endl;
+  }
+  return status;
+}
+
+/**
+ * print usage
+ *
+ * @param prog the program name.
+ */
+static void usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [-c <comp>] [-j <threads>] [-n <connections>] [-C <checksum>] [-r] [-z] [-q] <host>:<port> <image>" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string compName("auto");
+  int threads = 0;
+  int nConns = 0;
+  int checksumType = CHECKSUM_NONE;
+  int forceRaw = 0;
+  int scanZeros = 0;
+  int quiet = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:j:n:C:rzq")) != -1) {
+    switch(opt) {
+    case 'c':
+      compName = std::string(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'n':
+      nConns = atoi(optarg);
+      break;
+    case 'C':
+      if (!parseChecksum(std::string(optarg), &checksumType) || checksumType == CHECKSUM_NONE) {
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'r':
+      forceRaw = 1;
+      break;
+    case 'z':
+      scanZeros = 1;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  int compression = COMP_AUTO;
+  if (optind + 2 != argc || !parseCompression(compName, &compression) || threads < 0 || nConns < 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+  std::string address(argv[optind]);
+  std::size_t colon = address.rfind(':');
+  if (colon == std::string::npos || colon == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+  if (host.length() > 2 && host[0] == '[' && host[host.length() - 1] == ']') {
+    host = host.substr(1, host.length() - 2);
+  }
+  openlog("ums2net-push", LOG_PID, LOG_USER);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* the image */
+  const char *imagePath = argv[optind + 1];
+  int fd = open(imagePath, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    std::cerr << "Cannot open " << imagePath << " (" << errstr << ")" << std::endl;
+    exit(1);
+  }
+  off_t size = st.st_size;
+  if (S_ISBLK(st.st_mode)) {
+    unsigned long long blkSize = 0;
+    if (ioctl(fd, BLKGETSIZE64, &blkSize) == 0) {
+      size = (off_t)blkSize;
+    }
+  }
+  unsigned char magic[16];
+  memset(magic, 0, sizeof(magic));
+  ssize_t magicLen = pread(fd, magic, sizeof(magic), 0);
+  int imageCompression = (magicLen > 0) ? detectCompression(magic, (size_t)magicLen) : COMP_NONE;
+  int precompressed = (imageCompression != COMP_NONE);
+
+  /* what the port accepts */
+  std::map<std::string, std::string> caps;
+  if (queryCapabilities(host, port, &caps) < 0) {
+    exit(1);
+  }
+  int devices = atoi(caps[std::string("devices")].c_str());
+  long long deviceSize = atoll(caps[std::string("size")].c_str());
+  std::string serverComp = caps[std::string("comp")];
+  if (devices < 1) {
+    std::cerr << "The port has no device" << std::endl;
+    exit(1);
+  }
+  if (!precompressed && deviceSize > 0 && (long long)size > deviceSize) {
+    std::cerr << imagePath << " has " << size << " bytes, more than the " << deviceSize << " bytes of the device" << std::endl;
+    exit(1);
+  }
+
+  /* compress with the fastest format both sides have, unless the image is
+     compressed already */
+  if (precompressed) {
+    if (!listHas(serverComp, std::string(getCompressionName(imageCompression)))) {
+      std::cerr << "The port does not take " << getCompressionName(imageCompression) << " data" << std::endl;
+      exit(1);
+    }
+    compression = COMP_NONE;
+  } else if (compression == COMP_AUTO) {
+    static const int preferred[] = { COMP_ZSTD, COMP_GZIP };
+    compression = COMP_NONE;
+    for (int i=0; i<(int)(sizeof(preferred)/sizeof(preferred[0])); i++) {
+      if (isCompressionSupported(preferred[i]) && listHas(serverComp, std::string(getCompressionName(preferred[i])))) {
+	compression = preferred[i];
+	break;
+      }
+    }
+  } else if (compression != COMP_NONE && (!isCompressionSupported(compression) || !listHas(serverComp, std::string(getCompressionName(compression))))) {
+    std::cerr << "The client and the server do not both support " << compName << std::endl;
+    exit(1);
+  }
+  if (compression == COMP_NONE && !precompressed && !listHas(serverComp, std::string("none"))) {
+    std::cerr << "The port only takes " << serverComp << " data" << std::endl;
+    exit(1);
+  }
+
+  /* the server computes the checksum of what it writes */
+  if (checksumType != CHECKSUM_NONE) {
+    std::string name = (checksumType == CHECKSUM_SHA256) ? "sha256" : "crc32c";
+    if (precompressed) {
+      std::cerr << "The checksum of a compressed image is not checked" << std::endl;
+      checksumType = CHECKSUM_NONE;
+    } else if (!listHas(caps[std::string("checksum")], name) || !isChecksumSupported(checksumType)) {
+      std::cerr << "The port does not compute " << name << std::endl;
+      exit(1);
+    }
+  }
+
+  /* a sparse image is sent as a bmap, so its holes are not sent at all */
+  std::vector<std::pair<off_t, off_t> > extents;
+  long long mapped = size;
+  int useBmap = 0;
+  if (!precompressed && !forceRaw && checksumType == CHECKSUM_NONE && devices == 1
+      && listHas(caps[std::string("format")], std::string("bmap"))) {
+    mapped = mapImage(fd, size, scanZeros, &extents);
+    if (mapped < 0) {
+      std::cerr << "Cannot read " << imagePath << std::endl;
+      exit(1);
+    }
+    useBmap = (mapped < (long long)size);
+  }
+
+  /* a large dense image is split into ranges, one per connection */
+  int rangeOk = (caps[std::string("range")].compare("1") == 0) && !precompressed && !useBmap && checksumType == CHECKSUM_NONE;
+  if (nConns == 0) {
+    nConns = 1;
+    if (rangeOk && size >= PUSH_RANGE_MIN) {
+      nConns = (int)std::min((long long)PUSH_RANGE_MAX, (long long)(size / (PUSH_RANGE_MIN / 2)));
+    }
+  } else if (nConns > 1 && !rangeOk) {
+    std::cerr << "The image is sent over one connection, the port or the image does not allow ranges" << std::endl;
+    nConns = 1;
+  }
+  /* every range has at least one chunk */
+  nConns = (int)std::max(1LL, std::min((long long)nConns, (long long)((size + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE)));
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cpus > 0) ? (int)cpus : 1;
+  }
+
+  PushClient client;
+  client.fd = fd;
+  client.compression = compression;
+  client.keepRaw = (checksumType != CHECKSUM_NONE);
+  client.window = std::max(2, threads / nConns + 1);
+  pthread_mutex_init(&client.mutex, NULL);
+  pthread_cond_init(&client.jobCond, NULL);
+  pthread_cond_init(&client.readyCond, NULL);
+  client.stop = 0;
+  client.finished = 0;
+  client.sent = 0;
+  client.wire = 0;
+
+  /* build the connections */
+  Checksum checksum;
+  std::vector<PushConnection *> conns;
+  uint64_t uploadId = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)st.st_ino;
+  off_t rangeLen = (size + nConns - 1) / nConns;
+  rangeLen = (rangeLen + PUSH_CHUNK_SIZE - 1) / PUSH_CHUNK_SIZE * PUSH_CHUNK_SIZE;
+  for (int i=0; i<nConns; i++) {
+    PushConnection *conn = new PushConnection;
+    conn->client = &client;
+    conn->socket = -1;
+    conn->submitted = 0;
+    conn->checksum = NULL;
+    conn->started = 0;
+    conn->error = 0;
+    if (nConns > 1) {
+      RangeHeader header;
+      header.uploadId = uploadId;
+      header.offset = (uint64_t)std::min(size, (off_t)i * rangeLen);
+      header.length = (uint64_t)std::min(size - (off_t)header.offset, rangeLen);
+      header.imageSize = (uint64_t)size;
+      conn->header = formatRangeHeader(header);
+      addChunks(conn, (off_t)header.offset, (off_t)header.length);
+    } else {
+      if (devices == 1) {
+	PushHeader header;
+	header.flags = PUSH_STATUS;
+	header.flags |= (checksumType == CHECKSUM_SHA256) ? PUSH_SHA256 : (checksumType == CHECKSUM_CRC32C) ? PUSH_CRC32C : 0;
+	header.dataSize = precompressed ? 0 : (uint64_t)mapped;
+	conn->header = formatPushHeader(header);
+      }
+      if (useBmap) {
+	PushChunk chunk;
+	chunk.offset = -1;
+	chunk.length = 0;
+	chunk.raw = formatBmap(size, mapped, extents);
+	chunk.ready = 0;
+	chunk.error = 0;
+	conn->chunks.push_back(chunk);
+	for (int e=0; e<(int)extents.size(); e++) {
+	  addChunks(conn, extents[e].first, extents[e].second);
+	}
+      } else {
+	addChunks(conn, 0, size);
+      }
+      if (checksumType != CHECKSUM_NONE && checksumInit(&checksum, checksumType) == 0) {
+	conn->checksum = &checksum;
+      }
+    }
+    conns.push_back(conn);
+  }
+
+  if (!quiet) {
+    std::cerr << "Push " << imagePath << " to " << address << ": " << mapped << " of " << size << " bytes"
+	      << (useBmap ? " as bmap" : "") << ", " << (precompressed ? "compressed already" : getCompressionName(compression))
+	      << ", " << nConns << " connection" << (nConns > 1 ? "s" : "") << ", " << threads << " thread" << (threads > 1 ? "s" : "") << std::endl;
+  }
+
+  /* connect all of them before sending, so a busy port fails early */
+  for (int i=0; i<nConns; i++) {
+    conns[i]->socket = connectServer(host, port);
+    if (conns[i]->socket < 0) {
+      exit(1);
+    }
+  }
+  std::vector<pthread_t> workers;
+  for (int i=0; i<threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pushWorker, &client) == 0) {
+      workers.push_back(thread);
+    }
+  }
+  if (workers.empty()) {
+    std::cerr << "Cannot create the workers" << std::endl;
+    exit(1);
+  }
+  double start = now();
+  for (int i=0; i<nConns; i++) {
+    if (pthread_create(&conns[i]->thread, NULL, pushSender, conns[i]) != 0) {
+      std::cerr << "Cannot create the sender of connection " << i << std::endl;
+      conns[i]->error = 1;
+      close(conns[i]->socket);
+      pthread_mutex_lock(&client.mutex);
+      client.finished++;
+      pthread_mutex_unlock(&client.mutex);
+      continue;
+    }
+    conns[i]->started = 1;
+  }
+
+  /* show the progress until every connection is done */
+  int tty = isatty(2);
+  double lastPrint = 0;
+  while (1) {
+    pthread_mutex_lock(&client.mutex);
+    int finished = client.finished;
+    pthread_mutex_unlock(&client.mutex);
+    if (finished >= nConns) {
+      break;
+    }
+    double t = now();
+    if (tty && !quiet && t - lastPrint >= 0.5) {
+      printProgress(__sync_fetch_and_add(&client.sent, 0), mapped, t - start);
+      lastPrint = t;
+    }
+    usleep(100000);
+  }
+  for (int i=0; i<nConns; i++) {
+    if (conns[i]->started) {
+      pthread_join(conns[i]->thread, NULL);
+    }
+  }
+  pthread_mutex_lock(&client.mutex);
+  client.stop = 1;
+  pthread_cond_broadcast(&client.jobCond);
+  pthread_mutex_unlock(&client.mutex);
+  for (int i=0; i<(int)workers.size(); i++) {
+    pthread_join(workers[i], NULL);
+  }
+  double seconds = now() - start;
+  if (!quiet) {
+    if (tty) {
+      printProgress(client.sent, mapped, seconds);
+      fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "Sent %.1f MiB in %.1f s, %.1f MiB/s, %.1f MiB over the network\n",
+	    client.sent / 1048576.0, seconds, (seconds > 0) ? client.sent / seconds / 1048576.0 : 0.0,
+	    client.wire / 1048576.0);
+  }
+
+  std::string digest;
+  if (checksumType != CHECKSUM_NONE && conns[0]->checksum != NULL) {
+    digest = checksumFinish(conns[0]->checksum);
+  }
+  int status = checkReplies(conns, devices, nConns > 1, digest);
+  for (int i=0; i<nConns; i++) {
+    delete conns[i];
+  }
+  close(fd);
+  return status;
+}
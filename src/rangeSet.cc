@@ -0,0 +1,74 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <stdint.h>
+
+#include "rangeSet.h"
+
+/**
+ * initialize an empty RangeSet.
+ *
+ * @param set the set.
+ */
+void rangeSetInit(RangeSet *set) {
+  set->ranges.clear();
+  set->covered = 0;
+}
+
+/**
+ * add a range to a RangeSet.
+ *
+ * @param set the set.
+ * @param offset the start of the range.
+ * @param length the length of the range.
+ *
+ * @return the total length covered by the set.
+ */
+uint64_t rangeSetAdd(RangeSet *set, uint64_t offset, uint64_t length) {
+  uint64_t start = offset;
+  uint64_t end = offset + length;
+  if (length == 0) {
+    return set->covered;
+  }
+  /* merge with the range before it, if they touch */
+  std::map<uint64_t, uint64_t>::iterator it = set->ranges.upper_bound(start);
+  if (it != set->ranges.begin()) {
+    std::map<uint64_t, uint64_t>::iterator prev = it;
+    --prev;
+    if (prev->second >= start) {
+      start = prev->first;
+      if (prev->second > end) {
+	end = prev->second;
+      }
+      set->covered -= prev->second - prev->first;
+      set->ranges.erase(prev);
+    }
+  }
+  /* and with all the ranges which start inside it */
+  it = set->ranges.lower_bound(start);
+  while (it != set->ranges.end() && it->first <= end) {
+    if (it->second > end) {
+      end = it->second;
+    }
+    set->covered -= it->second - it->first;
+    set->ranges.erase(it++);
+  }
+  set->ranges[start] = end;
+  set->covered += end - start;
+  return set->covered;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_RANGE_SET_HEAD1_H
+#define _HEADER_UMS2NET_RANGE_SET_HEAD1_H
+
+#include <map>
+#include <stdint.h>
+
+/**
+ * A set of byte ranges, merged where they touch or overlap.
+ */
+struct RangeSet {
+  std::map<uint64_t, uint64_t> ranges; ///< start -> end (exclusive)
+  uint64_t covered; ///< the total length of the ranges
+};
+
+void rangeSetInit(RangeSet *set);
+uint64_t rangeSetAdd(RangeSet *set, uint64_t offset, uint64_t length);
+
+#endif /* _HEADER_UMS2NET_RANGE_SET_HEAD1_H */
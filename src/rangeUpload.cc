@@ -0,0 +1,328 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "rangeUpload.h"
+#include "copyEngine.h"
+#include "decompress.h"
+#include "servantThread.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hubScheduler.h"
+
+/**
+ * the uploads in progress, by device.
+ */
+static pthread_mutex_t rangeUploadsMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, RangeUpload *> rangeUploads;
+
+/**
+ * read a little-endian uint64_t.
+ *
+ * @param p the first byte.
+ *
+ * @return the value.
+ */
+static uint64_t getLE64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i=7; i>=0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/**
+ * parse the header of a ranged upload.
+ *
+ * @param buf the first bytes of the connection.
+ * @param len the number of bytes in buf.
+ * @param header the header is stored here on success.
+ *
+ * @return 1 if success, 0 if buf is not a valid header.
+ */
+int parseRangeHeader(const unsigned char *buf, size_t len, RangeHeader *header) {
+  if (len < RANGE_HEADER_SIZE || memcmp(buf, RANGE_HEADER_MAGIC, 8) != 0) {
+    return 0;
+  }
+  header->uploadId = getLE64(buf + 8);
+  header->offset = getLE64(buf + 16);
+  header->length = getLE64(buf + 24);
+  header->imageSize = getLE64(buf + 32);
+  if (header->offset > header->imageSize || header->length > header->imageSize - header->offset) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * check if a connection starts with a range header, without consuming it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ *
+ * @return 1 if it does, otherwise 0.
+ */
+int sniffRangeHeader(int clientSocket) {
+  unsigned char magic[8];
+  ssize_t r1;
+  do {
+    r1 = recv(clientSocket, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+  } while (r1 < 0 && errno == EINTR);
+  return (r1 == (ssize_t)sizeof(magic) && memcmp(magic, RANGE_HEADER_MAGIC, sizeof(magic)) == 0);
+}
+
+/**
+ * join the upload of a device, or start it.
+ *
+ * An upload which nobody is using is replaced by one with another id or
+ * size; one which is in use is not.
+ *
+ * @param devFilename the device.
+ * @param header the header of the connection.
+ *
+ * @return the upload, NULL if another upload is in progress.
+ */
+static RangeUpload *rangeUploadAcquire(const std::string &devFilename, const RangeHeader &header) {
+  RangeUpload *u = NULL;
+  pthread_mutex_lock(&rangeUploadsMutex);
+  std::map<std::string, RangeUpload *>::iterator it = rangeUploads.find(devFilename);
+  if (it != rangeUploads.end()) {
+    u = it->second;
+    if (u->uploadId != header.uploadId || u->imageSize != header.imageSize) {
+      if (u->users > 0) {
+	pthread_mutex_unlock(&rangeUploadsMutex);
+	return NULL;
+      }
+      syslog(LOG_INFO, "Upload %llx to %s replaces the unfinished upload %llx",
+	     (unsigned long long)header.uploadId, devFilename.c_str(), (unsigned long long)u->uploadId);
+      rangeUploads.erase(it);
+      delete u;
+      u = NULL;
+    }
+  }
+  if (u == NULL) {
+    u = new RangeUpload;
+    u->devFilename = devFilename;
+    u->uploadId = header.uploadId;
+    u->imageSize = header.imageSize;
+    rangeSetInit(&u->done);
+    u->users = 0;
+    u->complete = 0;
+    u->failed = 0;
+    rangeUploads[devFilename] = u;
+  }
+  u->users++;
+  pthread_mutex_unlock(&rangeUploadsMutex);
+  return u;
+}
+
+/**
+ * record a written range and leave the upload.
+ *
+ * A range which is not written drops the upload, so that the next
+ * connection starts a new one instead of adding to an image with a hole.
+ *
+ * @param u the upload.
+ * @param header the header of the connection.
+ * @param written 1 if the whole range is written.
+ * @param complete set to 1 if this range completes the image.
+ *
+ * @return the number of bytes of the image which are written.
+ */
+static uint64_t rangeUploadRelease(RangeUpload *u, const RangeHeader &header, int written, int *complete) {
+  pthread_mutex_lock(&rangeUploadsMutex);
+  uint64_t covered = u->done.covered;
+  *complete = 0;
+  if (!written && !u->complete && !u->failed) {
+    syslog(LOG_WARNING, "Drop upload %llx to %s after a failed range",
+	   (unsigned long long)u->uploadId, u->devFilename.c_str());
+    u->failed = 1;
+    rangeUploads.erase(u->devFilename);
+  } else if (written && !u->complete && !u->failed) {
+    covered = rangeSetAdd(&u->done, header.offset, header.length);
+    if (covered == u->imageSize) {
+      u->complete = 1;
+      *complete = 1;
+      rangeUploads.erase(u->devFilename);
+    }
+  }
+  u->users--;
+  if (u->users == 0 && (u->complete || u->failed)) {
+    delete u;
+  }
+  pthread_mutex_unlock(&rangeUploadsMutex);
+  return covered;
+}
+
+/**
+ * write one range of a ranged upload to the device.
+ *
+ * Each connection writes its range with pwrite(), so connections to the
+ * same device run in parallel. The image is reported as written once the
+ * ranges of all the connections cover it.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param outFD the device.
+ * @param devFilename the device path.
+ * @param deviceSize the size of the device, 0 if it can grow.
+ * @param bufSize the size of each block.
+ * @param ddParameters the dd operands, for comp= and threads=.
+ */
+void rangeServant(int clientSocket, int outFD, const std::string &devFilename, long long deviceSize, int bufSize, const std::map<std::string, std::string> &ddParameters) {
+  unsigned char headerBuf[RANGE_HEADER_SIZE];
+  RangeHeader header;
+  std::ostringstream report;
+
+  if (recvn(clientSocket, headerBuf, sizeof(headerBuf), 0) != (ssize_t)sizeof(headerBuf)
+      || !parseRangeHeader(headerBuf, sizeof(headerBuf), &header)) {
+    syslog(LOG_ERR, "Invalid range header for %s", devFilename.c_str());
+    report << "ums2net: invalid range header\n";
+    std::string line = report.str();
+    send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL);
+    return;
+  }
+  report << "ums2net: range " << header.offset << "+" << header.length;
+
+  /* a block device does not grow, so the image must fit it */
+  if (deviceSize > 0 && (header.imageSize > (uint64_t)deviceSize
+			 || header.offset + header.length > (uint64_t)deviceSize)) {
+    syslog(LOG_ERR, "Image of %llu bytes does not fit %s of %lld bytes, reject range %llu+%llu",
+	   (unsigned long long)header.imageSize, devFilename.c_str(), deviceSize,
+	   (unsigned long long)header.offset, (unsigned long long)header.length);
+    report << " rejected, the image does not fit the device\n";
+    std::string line = report.str();
+    send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL);
+    return;
+  }
+
+  RangeUpload *u = rangeUploadAcquire(devFilename, header);
+  if (u == NULL) {
+    syslog(LOG_WARNING, "Another upload to %s is in progress, reject range %llu+%llu",
+	   devFilename.c_str(), (unsigned long long)header.offset, (unsigned long long)header.length);
+    report << " rejected, another upload is in progress\n";
+    std::string line = report.str();
+    send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL);
+    return;
+  }
+
+  /* offsets are not aligned, so O_DIRECT is not used */
+  int flags = fcntl(outFD, F_GETFL);
+  if (flags >= 0 && (flags & O_DIRECT)) {
+    fcntl(outFD, F_SETFL, flags & ~O_DIRECT);
+  }
+
+  int compression = COMP_NONE;
+  Decompressor decompressor;
+  int inFD = openClientInput(clientSocket, ddParameters, &decompressor, &compression);
+  uint64_t done = 0;
+  int error = (inFD < 0);
+  char *buf = (char *)malloc(bufSize);
+  if (buf == NULL) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", bufSize);
+    error = 1;
+  }
+  while (!error && !quitFlag && done < header.length) {
+    size_t len = bufSize;
+    if (header.length - done < (uint64_t)len) {
+      len = (size_t)(header.length - done);
+    }
+    long long recvStart = metricsNow();
+    ssize_t bufLen = recvn(inFD, buf, len, 0);
+    if (bufLen <= 0) {
+      break;
+    }
+    long long writeStart = metricsNow();
+    metricsAddRecv(bufLen, writeStart - recvStart);
+    traceSpan("recv", recvStart, writeStart);
+    ssize_t written = 0;
+    while (written < bufLen) {
+      ssize_t w1 = pwrite(outFD, buf + written, bufLen - written, (off_t)(header.offset + done) + written);
+      if (w1 < 0 && errno == EINTR) {
+	continue;
+      }
+      if (w1 < 0) {
+	int errsv = errno;
+	char errbuf[1024];
+	char *errstr;
+	errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+	syslog(LOG_ERR, "Cannot write to %s at offset %llu (%s)", devFilename.c_str(),
+	       (unsigned long long)(header.offset + done + written), errstr);
+	metricsError(METRICS_ERROR_WRITE);
+	error = 1;
+	break;
+      }
+      written += w1;
+    }
+    long long writeEnd = metricsNow();
+    metricsAddWrite(written, writeEnd - writeStart);
+    traceSpan("write", writeStart, writeEnd);
+    hubThrottle(written);
+    done += (uint64_t)written;
+    if ((size_t)bufLen < len) {
+      break;
+    }
+  }
+  free(buf);
+  if (compression != COMP_NONE && inFD >= 0) {
+    if (finishDecompressor(&decompressor) < 0) {
+      error = 1;
+    }
+  }
+
+  int complete = 0;
+  uint64_t covered = rangeUploadRelease(u, header, !error && done == header.length, &complete);
+  if (complete) {
+    long long syncStart = metricsNow();
+    int synced = fdatasync(outFD);
+    traceSpan("fsync", syncStart, metricsNow());
+    if (synced < 0) {
+      syslog(LOG_ERR, "Cannot sync %s", devFilename.c_str());
+      complete = 0;
+    }
+  }
+  syslog(LOG_INFO, "Write range %llu+%llu of upload %llx to %s: %llu bytes, %llu of %llu bytes of the image",
+	 (unsigned long long)header.offset, (unsigned long long)header.length, (unsigned long long)header.uploadId,
+	 devFilename.c_str(), (unsigned long long)done, (unsigned long long)covered, (unsigned long long)header.imageSize);
+  if (!error && done == header.length) {
+    report << " ok, " << covered << " of " << header.imageSize << " bytes";
+  } else {
+    report << " failed after " << done << " bytes";
+  }
+  if (complete) {
+    syslog(LOG_INFO, "Totally write %llu bytes to %s", (unsigned long long)header.imageSize, devFilename.c_str());
+    report << ", image complete";
+  }
+  report << "\n";
+  std::string line = report.str();
+  if (send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the result to the client");
+  }
+}
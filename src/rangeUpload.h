@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_RANGE_UPLOAD_HEAD1_H
+#define _HEADER_UMS2NET_RANGE_UPLOAD_HEAD1_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rangeSet.h"
+
+#define RANGE_HEADER_MAGIC "UMS2RNG1"
+#define RANGE_HEADER_SIZE 40
+
+/**
+ * The header which starts each connection of a ranged upload. All the
+ * numbers are little-endian uint64_t after the 8-byte magic.
+ */
+struct RangeHeader {
+  uint64_t uploadId; ///< chosen by the client, the same for all connections
+  uint64_t offset; ///< the device offset of this range
+  uint64_t length; ///< the length of this range
+  uint64_t imageSize; ///< the size of the whole image
+};
+
+/**
+ * An image uploaded to one device by several connections.
+ */
+struct RangeUpload {
+  std::string devFilename; ///< the device
+  uint64_t uploadId; ///< from the header
+  uint64_t imageSize; ///< from the header
+  RangeSet done; ///< the ranges which are completely written
+  int users; ///< connections using this upload
+  int complete; ///< set when done covers the whole image
+  int failed; ///< set when a range fails, the upload is dropped
+};
+
+int parseRangeHeader(const unsigned char *buf, size_t len, RangeHeader *header);
+int sniffRangeHeader(int clientSocket);
+void rangeServant(int clientSocket, int outFD, const std::string &devFilename, long long deviceSize, int bufSize, const std::map<std::string, std::string> &ddParameters);
+
+#endif /* _HEADER_UMS2NET_RANGE_UPLOAD_HEAD1_H */
@@ -0,0 +1,680 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "main.h"
+#include "reactor.h"
+#include "servantThread.h"
+#include "configReader.h"
+#include "fanOut.h"
+#include "readDevice.h"
+#include "metrics.h"
+#include "trace.h"
+#include "deviceManager.h"
+#include "workerPool.h"
+#include "negotiate.h"
+
+/**
+ * A client handed from the reactor to a worker thread.
+ */
+struct Session {
+  PortListener *listener; ///< the port of the client
+  int clientSocket; ///< the socket which is connected to the client
+  int doneFD; ///< the worker writes the session here when it finishes
+  std::map<std::string, std::string> ddParameters; ///< the dd operands when it started
+  std::vector<std::string> devFilenames; ///< every of= operand when it started
+  PortMetrics *metrics; ///< the metrics of the port when it started
+};
+
+/**
+ * parse the value of the busy= operand.
+ *
+ * @param str the value: queue, reject or concurrent.
+ * @param policy the BusyPolicy is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseBusyPolicy(const std::string &str, int *policy) {
+  static const struct {
+    const char *name;
+    int policy;
+  } policies[] = {
+    { "queue", BUSY_QUEUE },
+    { "reject", BUSY_REJECT },
+    { "concurrent", BUSY_CONCURRENT },
+  };
+  for (int i=0; i<(int)(sizeof(policies)/sizeof(policies[0])); i++) {
+    if (str.compare(policies[i].name) == 0) {
+      *policy = policies[i].policy;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * block the signals which the reactor handles.
+ *
+ * Must be called before any thread is created, so that every thread
+ * inherits the mask and the signals are only seen by the signalfd.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blockReactorSignals() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    return -1;
+  }
+  /* clients that disappear must not kill the daemon */
+  signal(SIGPIPE, SIG_IGN);
+  return 0;
+}
+
+/**
+ * the worker thread which serves one client.
+ *
+ * @param data the pointer of Session
+ *
+ * @return NULL.
+ */
+static void* sessionThread(void *data) {
+  Session *session = (Session *)(data);
+
+  SessionMetrics metrics;
+  TraceRing ring;
+  long long start = metricsNow();
+  metricsSessionStart(session->metrics, &metrics);
+  traceSessionStart(&ring, session->listener->port);
+
+  /* send the device to the client, or answer what a writing port accepts,
+     or write the data to the device or to every device. The settings were
+     copied when the session started, so a reload does not change them. */
+  if (session->ddParameters.find(std::string("if")) != session->ddParameters.end()) {
+    readServant(session->clientSocket, session->ddParameters);
+  } else if (sniffCapsQuery(session->clientSocket)) {
+    capsServant(session->clientSocket, session->ddParameters, session->devFilenames);
+  } else if (session->devFilenames.size() > 1) {
+    fanOutServant(session->clientSocket, session->devFilenames, session->ddParameters);
+  } else {
+    clientServant(session->clientSocket, session->ddParameters);
+  }
+  metricsSessionEnd(session->metrics, &metrics, metricsNow() - start);
+  traceSessionEnd(&ring);
+
+  /* the reactor closes the client socket, a pointer is written atomically */
+  ssize_t w1;
+  do {
+    w1 = write(session->doneFD, &session, sizeof(session));
+  } while (w1 < 0 && errno == EINTR);
+  return NULL;
+}
+
+/**
+ * hand a client to a worker of the pool, on the NUMA node of its device
+ * or else of its network card, or to a new thread if there is no pool.
+ *
+ * @param sessions the sessions being served.
+ * @param listener the port of the client.
+ * @param clientSocket the socket which is connected to the client.
+ * @param doneFD the pipe which the worker writes when it finishes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int startSession(std::set<Session *> &sessions, PortListener *listener, int clientSocket, int doneFD) {
+  Session *session = new Session;
+  session->listener = listener;
+  session->clientSocket = clientSocket;
+  session->doneFD = doneFD;
+  session->ddParameters = listener->ddParameters;
+  session->devFilenames = listener->devFilenames;
+  session->metrics = listener->metrics;
+  if (workerPoolRunning()) {
+    std::string device = session->devFilenames.empty() ? std::string("") : session->devFilenames[0];
+    if (session->ddParameters.find(std::string("if")) != session->ddParameters.end()) {
+      device = session->ddParameters.at(std::string("if"));
+    }
+    int node = deviceManagerNumaNode(device);
+    if (node < 0) {
+      node = workerPoolSocketNode(clientSocket);
+    }
+    workerPoolSubmit(sessionThread, session, node);
+  } else {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&thread, &attr, sessionThread, session);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+      syslog(LOG_ERR, "Cannot create session thread for TCP port %d (%s)", listener->port, strerror(result));
+      close(clientSocket);
+      delete session;
+      return -1;
+    }
+  }
+  listener->active++;
+  metricsSetPortState(listener->metrics, listener->active, (int)listener->pending.size());
+  sessions.insert(session);
+  return 0;
+}
+
+/**
+ * apply the busy= policy of a port to a client which has just connected.
+ *
+ * A client of an idle port, or of a port with busy=concurrent, is to be
+ * served now. Otherwise it is told that the port is busy and closed, or
+ * queued behind the clients already waiting.
+ *
+ * @param listener the port.
+ * @param clientSocket the socket which is connected to the client.
+ *
+ * @return 1 if the client should be served now, 0 if it was rejected or
+ * queued.
+ */
+int admitClient(PortListener *listener, int clientSocket) {
+  if (listener->active == 0 || listener->policy == BUSY_CONCURRENT) {
+    return 1;
+  }
+  if (listener->policy == BUSY_REJECT) {
+    char message[128];
+    int len = snprintf(message, sizeof(message), "ums2net: TCP port %d is busy\n", listener->port);
+    syslog(LOG_INFO, "TCP port %d is busy, reject a client", listener->port);
+    metricsPortError(listener->metrics, METRICS_ERROR_REJECT);
+    if (send(clientSocket, message, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+      syslog(LOG_DEBUG, "Cannot send the busy message to the client");
+    }
+    close(clientSocket);
+  } else {
+    syslog(LOG_INFO, "TCP port %d is busy, queue a client behind %d others", listener->port, (int)listener->pending.size());
+    listener->pending.push_back(clientSocket);
+    metricsSetPortState(listener->metrics, listener->active, (int)listener->pending.size());
+  }
+  return 0;
+}
+
+/**
+ * take the next queued client of a port which has become idle.
+ *
+ * @param listener the port.
+ *
+ * @return the socket of the client, -1 if the port is busy or no client
+ * is waiting.
+ */
+int nextPendingClient(PortListener *listener) {
+  if (listener->active > 0 || listener->pending.empty()) {
+    return -1;
+  }
+  int clientSocket = listener->pending.front();
+  listener->pending.pop_front();
+  return clientSocket;
+}
+
+/**
+ * accept all the clients waiting on a port.
+ *
+ * @param sessions the sessions being served.
+ * @param listener the port.
+ * @param doneFD the pipe which the workers write when they finish.
+ */
+static void acceptClients(std::set<Session *> &sessions, PortListener *listener, int doneFD) {
+  while (1) {
+    int clientSocket = accept4(listener->serverSocket, NULL, NULL, SOCK_CLOEXEC);
+    if (clientSocket < 0) {
+      int errsv = errno;
+      if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+	return;
+      }
+      if (errsv == EINTR || errsv == ECONNABORTED) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_WARNING, "Cannot accept client socket at port %d (%s)", listener->port, errstr);
+      return;
+    }
+
+    if (admitClient(listener, clientSocket)) {
+      startSession(sessions, listener, clientSocket, doneFD);
+    }
+  }
+}
+
+/**
+ * clean up after a worker has finished. A port which was removed by a
+ * reload is freed with its last session.
+ *
+ * @param sessions the sessions being served.
+ * @param session the finished session.
+ */
+static void endSession(std::set<Session *> &sessions, Session *session) {
+  PortListener *listener = session->listener;
+  listener->active--;
+  metricsSetPortState(listener->metrics, listener->active, (int)listener->pending.size());
+  sessions.erase(session);
+  close(session->clientSocket);
+  delete session;
+  if (listener->retired && listener->active == 0) {
+    delete listener;
+  }
+}
+
+/**
+ * take the settings of a port from its config record.
+ *
+ * @param listener the port.
+ * @param record the config record.
+ */
+static void configureListener(PortListener *listener, const UMS2NETConfRecord &record) {
+  listener->ddParameters = record.getDDParameterMap();
+  listener->devFilenames = record.getDDParameterValues(std::string("of"));
+  std::string device = listener->devFilenames.empty() ? std::string("") : listener->devFilenames[0];
+  if (listener->ddParameters.find(std::string("if")) != listener->ddParameters.end()) {
+    device = listener->ddParameters.at(std::string("if"));
+  }
+  if (listener->metrics == NULL || listener->metrics->device.compare(device) != 0) {
+    if (listener->metrics != NULL) {
+      metricsSetPortState(listener->metrics, 0, 0);
+    }
+    listener->metrics = metricsRegisterPort(listener->port, device);
+  }
+  listener->policy = BUSY_QUEUE;
+  if (listener->ddParameters.find(std::string("busy")) != listener->ddParameters.end()) {
+    if (!parseBusyPolicy(listener->ddParameters.at(std::string("busy")), &listener->policy)) {
+      syslog(LOG_WARNING, "Unknown busy=%s for TCP port %d, queue the clients", listener->ddParameters.at(std::string("busy")).c_str(), listener->port);
+    }
+  }
+  metricsSetPortState(listener->metrics, listener->active, (int)listener->pending.size());
+}
+
+/**
+ * start listening to a port.
+ *
+ * @param record the config record of the port.
+ * @param epollFD the event loop.
+ *
+ * @return the port, NULL if it cannot be listened to.
+ */
+static PortListener* openListener(const UMS2NETConfRecord &record, int epollFD) {
+  PortListener *listener = new PortListener;
+  listener->port = record.getPort();
+  listener->active = 0;
+  listener->retired = 0;
+  listener->metrics = NULL;
+  listener->serverSocket = openServerSocket(listener->port);
+  if (listener->serverSocket < 0) {
+    delete listener;
+    return NULL;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = listener;
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listener->serverSocket, &event) < 0) {
+    close(listener->serverSocket);
+    delete listener;
+    return NULL;
+  }
+  configureListener(listener, record);
+  return listener;
+}
+
+/**
+ * stop listening to a port and drop its queued clients. The sessions
+ * being served finish first if there are any.
+ *
+ * @param listener the port.
+ */
+static void closeListener(PortListener *listener) {
+  close(listener->serverSocket);
+  listener->serverSocket = -1;
+  while (!listener->pending.empty()) {
+    close(listener->pending.front());
+    listener->pending.pop_front();
+  }
+  metricsSetPortState(listener->metrics, listener->active, 0);
+  listener->retired = 1;
+  if (listener->active == 0) {
+    delete listener;
+  }
+}
+
+/**
+ * make the ports follow the config records.
+ *
+ * New ports are opened, ports which are gone are closed, and ports whose
+ * operands have changed keep their socket and queue and take the new
+ * operands for the next session. Unchanged ports are not touched. The
+ * port ranges are bound to the devices which have appeared so far.
+ *
+ * @param listeners the open ports by TCP port.
+ * @param config the config records.
+ * @param bindings the devices bound to the ports of the ranges.
+ * @param epollFD the event loop.
+ * @param loaded 1 if the config has just been read, 0 if only the devices
+ *        have changed.
+ */
+static void applyConfig(std::map<int, PortListener *> &listeners, const std::vector<UMS2NETConfRecord> &config, std::map<std::string, int> &bindings, int epollFD, int loaded) {
+  std::vector<UMS2NETConfRecord> records = expandConfig(config, bindings);
+  std::map<int, const UMS2NETConfRecord *> wanted;
+  for (int i=0; i<(int)records.size(); i++) {
+    if (wanted.find(records[i].getPort()) != wanted.end()) {
+      if (loaded) {
+	syslog(LOG_WARNING, "TCP port %d is configured twice, use the first line", records[i].getPort());
+      }
+      continue;
+    }
+    wanted[records[i].getPort()] = &records[i];
+  }
+
+  int started = 0;
+  int stopped = 0;
+  int changed = 0;
+  for (std::map<int, PortListener *>::iterator it=listeners.begin(); it!=listeners.end(); ) {
+    PortListener *listener = it->second;
+    std::map<int, const UMS2NETConfRecord *>::iterator found = wanted.find(it->first);
+    if (found == wanted.end()) {
+      syslog(LOG_INFO, "TCP port %d is removed, %d sessions finish first", listener->port, listener->active);
+      closeListener(listener);
+      listeners.erase(it++);
+      stopped++;
+      continue;
+    }
+    const UMS2NETConfRecord *record = found->second;
+    if (listener->ddParameters != record->getDDParameterMap() ||
+	listener->devFilenames != record->getDDParameterValues(std::string("of"))) {
+      syslog(LOG_INFO, "TCP port %d is changed to %s", listener->port, record->getDDParameter().c_str());
+      configureListener(listener, *record);
+      changed++;
+    }
+    wanted.erase(found);
+    ++it;
+  }
+  for (std::map<int, const UMS2NETConfRecord *>::iterator it=wanted.begin(); it!=wanted.end(); ++it) {
+    PortListener *listener = openListener(*(it->second), epollFD);
+    if (listener != NULL) {
+      listeners[it->first] = listener;
+      started++;
+    }
+  }
+  if (!loaded && started == 0 && stopped == 0 && changed == 0) {
+    return;
+  }
+  syslog(LOG_INFO, "%d TCP ports: %d started, %d stopped, %d changed", (int)listeners.size(), started, stopped, changed);
+
+  /* the devices are kept open and clients may wait for them */
+  std::vector<std::string> devicePaths;
+  for (int i=0; i<(int)config.size(); i++) {
+    if (!config[i].getDevicePattern().empty()) {
+      devicePaths.push_back(config[i].getDevicePattern());
+    }
+  }
+  for (std::map<int, PortListener *>::iterator it=listeners.begin(); it!=listeners.end(); ++it) {
+    PortListener *listener = it->second;
+    if (listener->ddParameters.find(std::string("if")) != listener->ddParameters.end()) {
+      devicePaths.push_back(listener->ddParameters.at(std::string("if")));
+    }
+    devicePaths.insert(devicePaths.end(), listener->devFilenames.begin(), listener->devFilenames.end());
+  }
+  deviceManagerWatch(devicePaths);
+}
+
+/**
+ * the thread which answers one scrape of the metrics.
+ *
+ * @param data the socket, cast to a pointer.
+ *
+ * @return NULL.
+ */
+static void* metricsThread(void *data) {
+  int clientSocket = (int)(intptr_t)data;
+  metricsServeClient(clientSocket);
+  close(clientSocket);
+  return NULL;
+}
+
+/**
+ * accept all the scrapers waiting on the metrics port. Each one is
+ * answered by its own thread, so a slow scraper never stalls the loop.
+ *
+ * @param metricsSocket the listening socket of the metrics.
+ */
+static void acceptScrapers(int metricsSocket) {
+  while (1) {
+    int clientSocket = accept4(metricsSocket, NULL, NULL, SOCK_CLOEXEC);
+    if (clientSocket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+      return;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, metricsThread, (void *)(intptr_t)clientSocket) != 0) {
+      close(clientSocket);
+    }
+    pthread_attr_destroy(&attr);
+  }
+}
+
+/**
+ * serve all the ports from one epoll loop until SIGINT or SIGTERM.
+ *
+ * The loop owns every listening socket and accepts the clients. Each
+ * client is served by its own worker thread, which reports back through a
+ * pipe when it is done, so the next queued client of the port can start.
+ * On a signal the clients being served are shut down, so their workers
+ * stop even if the clients are idle. SIGUSR1 writes the traces of the
+ * sessions being served. SIGHUP reads the config file again and applies
+ * the changes to the ports; the sessions being served keep their
+ * settings. The port ranges are bound again as the devices come and go.
+ * blockReactorSignals() must be called first.
+ *
+ * @param configFilename the config file, read again on SIGHUP.
+ * @param records the config records.
+ * @param metricsPort the TCP port of the metrics, 0 for none.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int runReactor(const std::string &configFilename, const std::vector<UMS2NETConfRecord> &records, int metricsPort) {
+  std::map<int, PortListener *> listeners;
+  std::vector<UMS2NETConfRecord> config = records;
+  std::map<std::string, int> bindings;
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  int doneFDs[2] = { -1, -1 };
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGHUP);
+  int signalFD = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (epollFD < 0 || signalFD < 0 || pipe2(doneFDs, O_CLOEXEC) < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot create the event loop (%s)", errstr);
+    return -1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(epollFD, EPOLL_CTL_ADD, signalFD, &event);
+  event.data.ptr = &doneFDs[0];
+  epoll_ctl(epollFD, EPOLL_CTL_ADD, doneFDs[0], &event);
+
+  deviceManagerStart();
+  int deviceEventFD = deviceManagerEventFD();
+  if (deviceEventFD >= 0) {
+    event.data.ptr = &deviceEventFD;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, deviceEventFD, &event);
+  }
+  applyConfig(listeners, config, bindings, epollFD, 1);
+  /* the ports of a range are opened when their devices appear */
+  int templates = 0;
+  for (int i=0; i<(int)config.size(); i++) {
+    templates += config[i].isTemplate();
+  }
+  if (listeners.empty() && templates == 0) {
+    syslog(LOG_ERR, "No TCP port can be listened to");
+  }
+
+  /* the metrics are served over HTTP on their own port */
+  int metricsSocket = -1;
+  if (metricsPort > 0) {
+    metricsSocket = openServerSocket(metricsPort);
+    if (metricsSocket >= 0) {
+      event.data.ptr = &metricsSocket;
+      if (epoll_ctl(epollFD, EPOLL_CTL_ADD, metricsSocket, &event) < 0) {
+	close(metricsSocket);
+	metricsSocket = -1;
+      }
+    }
+  }
+
+  /* wait for clients, finished workers and signals */
+  std::set<Session *> sessions;
+  int running = !listeners.empty() || templates > 0;
+  while (!quitFlag && running) {
+    struct epoll_event events[64];
+    int nReady = epoll_wait(epollFD, events, 64, -1);
+    if (nReady < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_WARNING, "epoll_wait() returns bad value %d, event loop exits. (%s)", nReady, errstr);
+      break;
+    }
+    int reload = 0;
+    int rebind = 0;
+    for (int i=0; i<nReady; i++) {
+      if (events[i].data.ptr == NULL) {
+	struct signalfd_siginfo info;
+	if (read(signalFD, &info, sizeof(info)) != (ssize_t)sizeof(info)) {
+	  continue;
+	}
+	if (info.ssi_signo == SIGUSR1) {
+	  /* a snapshot of the sessions being served */
+	  traceDumpAll();
+	} else if (info.ssi_signo == SIGHUP) {
+	  /* after this batch, which may still refer to the ports */
+	  reload = 1;
+	} else {
+	  syslog(LOG_NOTICE, "Signal %d received, stop serving", (int)info.ssi_signo);
+	  quitFlag = 1;
+	}
+      } else if (events[i].data.ptr == &doneFDs[0]) {
+	Session *session;
+	if (read(doneFDs[0], &session, sizeof(session)) != (ssize_t)sizeof(session)) {
+	  continue;
+	}
+	PortListener *listener = session->listener;
+	int retired = listener->retired;
+	endSession(sessions, session);
+	int clientSocket = retired ? -1 : nextPendingClient(listener);
+	if (clientSocket >= 0) {
+	  startSession(sessions, listener, clientSocket, doneFDs[1]);
+	}
+      } else if (events[i].data.ptr == &metricsSocket) {
+	acceptScrapers(metricsSocket);
+      } else if (events[i].data.ptr == &deviceEventFD) {
+	char buf[64];
+	while (read(deviceEventFD, buf, sizeof(buf)) > 0) {
+	}
+	rebind = 1;
+      } else {
+	acceptClients(sessions, (PortListener *)(events[i].data.ptr), doneFDs[1]);
+      }
+    }
+    if (reload && !quitFlag) {
+      std::vector<UMS2NETConfRecord> newRecords = getConfig(configFilename);
+      if (newRecords.empty()) {
+	syslog(LOG_WARNING, "No config in %s, keep the current ports", configFilename.c_str());
+      } else {
+	syslog(LOG_NOTICE, "Reload %s", configFilename.c_str());
+	config = newRecords;
+	applyConfig(listeners, config, bindings, epollFD, 1);
+      }
+    } else if (rebind && !quitFlag) {
+      applyConfig(listeners, config, bindings, epollFD, 0);
+    }
+  }
+
+  /* stop accepting, drop the queued clients and wait for the workers */
+  for (std::map<int, PortListener *>::iterator it=listeners.begin(); it!=listeners.end(); ++it) {
+    closeListener(it->second);
+  }
+  listeners.clear();
+  for (std::set<Session *>::iterator it=sessions.begin(); it!=sessions.end(); ++it) {
+    shutdown((*it)->clientSocket, SHUT_RDWR);
+  }
+  /* the clients waiting for a device give up */
+  deviceManagerStop();
+  while (!sessions.empty()) {
+    Session *session;
+    ssize_t r1 = read(doneFDs[0], &session, sizeof(session));
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r1 != (ssize_t)sizeof(session)) {
+      break;
+    }
+    endSession(sessions, session);
+  }
+  if (metricsSocket >= 0) {
+    close(metricsSocket);
+  }
+  close(signalFD);
+  close(epollFD);
+  close(doneFDs[0]);
+  close(doneFDs[1]);
+  return 0;
+}
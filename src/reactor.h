@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_REACTOR_HEAD1_H
+#define _HEADER_UMS2NET_REACTOR_HEAD1_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ums2netconfrecord.h"
+#include "metrics.h"
+
+/**
+ * What to do with a client which connects while the port is serving
+ * another one.
+ */
+enum BusyPolicy {
+  BUSY_QUEUE = 0, ///< accept it and serve it after the current client
+  BUSY_REJECT, ///< tell it the port is busy and close it
+  BUSY_CONCURRENT, ///< serve it at the same time
+};
+
+/**
+ * A listening socket owned by the reactor.
+ */
+struct PortListener {
+  int port; ///< TCP port
+  std::map<std::string, std::string> ddParameters; ///< the dd operands
+  std::vector<std::string> devFilenames; ///< every of= operand
+  int serverSocket; ///< the listening socket
+  int policy; ///< the BusyPolicy
+  int active; ///< number of clients being served
+  std::deque<int> pending; ///< accepted clients waiting for the port
+  PortMetrics *metrics; ///< the metrics of the port
+  int retired; ///< 1 once a reload has removed the port
+};
+
+int parseBusyPolicy(const std::string &, int *);
+int admitClient(PortListener *listener, int clientSocket);
+int nextPendingClient(PortListener *listener);
+int blockReactorSignals();
+int runReactor(const std::string &configFilename, const std::vector<UMS2NETConfRecord> &records, int metricsPort);
+
+#endif /* _HEADER_UMS2NET_REACTOR_HEAD1_H */
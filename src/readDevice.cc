@@ -0,0 +1,263 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "main.h"
+#include "readDevice.h"
+#include "servantThread.h"
+#include "compress.h"
+#include "ioSize.h"
+#include "metrics.h"
+#include "deviceManager.h"
+#include "trace.h"
+
+/**
+ * wait until a socket can take more data.
+ *
+ * @param fd the socket.
+ */
+static void waitWritable(int fd) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  long long pollStart = metricsNow();
+  poll(&pfd, 1, -1);
+  traceSpan("poll", pollStart, metricsNow());
+}
+
+/**
+ * send a range of the device with pread() and send().
+ *
+ * Used when the kernel cannot sendfile() from the device.
+ *
+ * @param outFD the socket.
+ * @param devFD the device.
+ * @param buf the buffer.
+ * @param offset the device offset.
+ * @param len the number of bytes to send.
+ *
+ * @return the number of bytes sent, 0 at the end of the device, -1 on
+ *   error.
+ */
+static ssize_t sendDeviceCopy(int outFD, int devFD, char *buf, off_t offset, size_t len) {
+  ssize_t r1;
+  do {
+    r1 = pread(devFD, buf, len, offset);
+  } while (r1 < 0 && errno == EINTR);
+  if (r1 <= 0) {
+    return r1;
+  }
+  ssize_t sent = 0;
+  while (sent < r1) {
+    ssize_t w1 = send(outFD, buf + sent, (size_t)(r1 - sent), MSG_NOSIGNAL);
+    if (w1 < 0) {
+      if (errno == EINTR) {
+	continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	waitWritable(outFD);
+	continue;
+      }
+      return -1;
+    }
+    sent += w1;
+  }
+  return sent;
+}
+
+/**
+ * send a range of the device to a socket.
+ *
+ * The data goes from the page cache to the socket with sendfile() without
+ * being copied to userspace, and is dropped from the page cache once sent.
+ * If the kernel cannot sendfile() from the device, pread() and send() are
+ * used instead.
+ *
+ * @param outFD the socket.
+ * @param devFD the device.
+ * @param offset the device offset to start from.
+ * @param length the number of bytes to send, -1 for up to the end.
+ * @param chunkSize the number of bytes sent by each call.
+ * @param error set to 1 if the range cannot be sent completely.
+ *
+ * @return the number of bytes sent.
+ */
+ssize_t sendDevice(int outFD, int devFD, off_t offset, off_t length, int chunkSize, int *error) {
+  ssize_t totalLen = 0;
+  char *buf = NULL;
+  *error = 0;
+  while (!quitFlag) {
+    size_t len = (size_t)chunkSize;
+    if (length >= 0 && length - totalLen < (off_t)len) {
+      len = (size_t)(length - totalLen);
+    }
+    if (len == 0) {
+      break;
+    }
+    off_t start = offset;
+    long long sendStart = metricsNow();
+    ssize_t s1;
+    if (buf == NULL) {
+      s1 = sendfile(outFD, devFD, &offset, len);
+    } else {
+      s1 = sendDeviceCopy(outFD, devFD, buf, offset, len);
+      if (s1 > 0) {
+	offset += s1;
+      }
+    }
+    if (s1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      } else if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+	waitWritable(outFD);
+	continue;
+      } else if (buf == NULL && totalLen == 0 && (errsv == EINVAL || errsv == ENOSYS)) {
+	syslog(LOG_INFO, "sendfile() is not supported for the device, copy through userspace");
+	buf = (char *)malloc(chunkSize);
+	if (buf == NULL) {
+	  syslog(LOG_ERR, "Malloc buffer for %d bytes failed", chunkSize);
+	  *error = 1;
+	  break;
+	}
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to client socket ended (%s)", errstr);
+      metricsError(METRICS_ERROR_RECV);
+      *error = 1;
+      break;
+    } else if (s1 == 0) {
+      /* the end of the device */
+      break;
+    }
+    posix_fadvise(devFD, start, s1, POSIX_FADV_DONTNEED);
+    long long sendEnd = metricsNow();
+    metricsAddWrite(s1, sendEnd - sendStart);
+    traceSpan("send", sendStart, sendEnd);
+    totalLen += s1;
+  }
+  if (quitFlag) {
+    *error = 1;
+  }
+  free(buf);
+  return totalLen;
+}
+
+/**
+ * the function that sends a device to one client.
+ *
+ * skip= and count= are in blocks of bs=, or of 512 bytes as in dd if bs=
+ * is not given. comp= compresses the data on the way.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param ddParameters the parameters for the device.
+ */
+void readServant(int clientSocket, const std::map<std::string, std::string> &ddParameters) {
+  /* get device path */
+  std::string devFilename;
+  if (ddParameters.find(std::string("if")) != ddParameters.end()) {
+    devFilename = ddParameters.at(std::string("if"));
+  }
+  if (devFilename.length() <= 0) {
+    syslog(LOG_ERR, "No device path. Please assign if=");
+    return;
+  }
+
+  /* get blocksize, default: chosen from the device once it is open */
+  int bufSize = (int)getNumberOperand(ddParameters, std::string("bs"), 0);
+  int autoSize = (bufSize <= 0);
+  off_t unit = autoSize ? 512 : bufSize;
+  off_t skip = (off_t)getNumberOperand(ddParameters, std::string("skip"), 0) * unit;
+  off_t count = (off_t)getNumberOperand(ddParameters, std::string("count"), -1);
+  off_t length = (count >= 0) ? count * unit : -1;
+
+  /* get compression, default: none */
+  int compression = COMP_NONE;
+  if (ddParameters.find(std::string("comp")) != ddParameters.end()) {
+    if (!parseCompression(ddParameters.at(std::string("comp")), &compression) || compression == COMP_AUTO) {
+      syslog(LOG_WARNING, "Unknown comp=%s, send uncompressed data", ddParameters.at(std::string("comp")).c_str());
+      compression = COMP_NONE;
+    }
+  }
+  if (compression != COMP_NONE && !isCompressionSupported(compression)) {
+    syslog(LOG_WARNING, "comp=%s is not supported by this build, send uncompressed data", getCompressionName(compression));
+    compression = COMP_NONE;
+  }
+
+  /* open the device, waiting wait= seconds for it to appear, default: 0 */
+  int waitMsec = (int)getNumberOperand(ddParameters, std::string("wait"), 0) * 1000;
+  DeviceInfo deviceInfo;
+  int devFD = deviceManagerOpen(devFilename, O_RDONLY | O_CLOEXEC, waitMsec, &deviceInfo);
+  if (devFD < 0 && errno == ENOENT) {
+    syslog(LOG_WARNING, "Device %s not appeared. Close the connection.", devFilename.c_str());
+    metricsError(METRICS_ERROR_OPEN);
+    return;
+  }
+  if (devFD < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot open device %s. (%s)", devFilename.c_str(), errstr);
+    metricsError(METRICS_ERROR_OPEN);
+    return;
+  }
+  if (autoSize) {
+    bufSize = chooseIOSize(&deviceInfo.topology);
+  }
+  posix_fadvise(devFD, skip, (length >= 0) ? length : 0, POSIX_FADV_SEQUENTIAL);
+
+  /* the device data goes through the compressor instead of to the socket */
+  Compressor compressor;
+  int outFD = clientSocket;
+  if (compression != COMP_NONE) {
+    outFD = startCompressor(&compressor, clientSocket, compression);
+    if (outFD < 0) {
+      close(devFD);
+      return;
+    }
+  }
+
+  int error = 0;
+  ssize_t totalLen = sendDevice(outFD, devFD, skip, length, bufSize, &error);
+  if (compression != COMP_NONE && finishCompressor(&compressor) < 0) {
+    error = 1;
+  }
+  if (error) {
+    syslog(LOG_ERR, "%s is not completely sent to the client", devFilename.c_str());
+  }
+
+  close(devFD);
+
+  syslog(LOG_INFO, "Totally read %ld bytes from %s", totalLen, devFilename.c_str());
+}
@@ -0,0 +1,28 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_READ_DEVICE_HEAD1_H
+#define _HEADER_UMS2NET_READ_DEVICE_HEAD1_H
+
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+ssize_t sendDevice(int outFD, int devFD, off_t offset, off_t length, int chunkSize, int *error);
+void readServant(int clientSocket, const std::map<std::string, std::string> &ddParameters);
+
+#endif /* _HEADER_UMS2NET_READ_DEVICE_HEAD1_H */
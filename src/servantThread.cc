@@ -26,82 +26,154 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <sys/types.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "main.h"
 #include "servantThread.h"
+#include "copyEngine.h"
+#include "zeroBlock.h"
+#include "checksum.h"
+#include "decompress.h"
+#include "imageFormat.h"
+#include "rangeUpload.h"
+#include "checkpoint.h"
+#include "writeback.h"
+#include "ioSize.h"
+#include "metrics.h"
+#include "deviceManager.h"
+#include "hubScheduler.h"
+#include "negotiate.h"
 #include "ums2netconfrecord.h"
 
 /**
- * recv len bytes exactly
+ * get a numeric dd operand.
  *
- * @param sockfd socket file descriptor
- * @param buf the buffer
- * @param len the length of the buffer
- * @param flags the flags
+ * @param ddParameters the dd operands.
+ * @param key the name of the operand.
+ * @param defaultValue the value used if the operand is absent or invalid.
  *
- * @return -1 if error. 0 or less than len is EOF
+ * @return the value of the operand.
  */
-ssize_t recvn(int sockfd, void *buf, size_t len, int flags) {
-  ssize_t ret = 0;
-  char *bufC = (char *)(buf);
-  while (ret < len) {
-    ssize_t r1 = recv(sockfd, &(bufC[ret]), len-((size_t)ret), flags);
-    if (r1 < 0) {
-      /* some error */
-      int errsv = errno;
-      if (errsv == EINTR) {
-	continue;
-      } else if (errsv == EAGAIN) {
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(sockfd, &readfds);
-	select(sockfd+1, &readfds, NULL, NULL, NULL);
-	continue;
-      } else if (errsv == EWOULDBLOCK) {
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(sockfd, &readfds);
-	select(sockfd+1, &readfds, NULL, NULL, NULL);
-	continue;
-      }
-      if (ret == 0) {
-	ret = r1;
-	return ret;
-      }
-      char errbuf[1024];
-      char *errstr;
-      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-      syslog(LOG_ERR, "recvn() error (%s)", errstr);
-      break;
-    } else if (r1 == 0) {
-      /* EOF */
-      break;
+long long getNumberOperand(const std::map<std::string, std::string> &ddParameters, const std::string &key, long long defaultValue) {
+  long long value = defaultValue;
+  if (ddParameters.find(key) == ddParameters.end()) {
+    return defaultValue;
+  }
+  if (!parseDDNumber(ddParameters.at(key), &value)) {
+    syslog(LOG_WARNING, "Invalid value %s=%s, use %lld", key.c_str(), ddParameters.at(key).c_str(), defaultValue);
+    return defaultValue;
+  }
+  return value;
+}
+
+/**
+ * get the stream which the copy engine reads.
+ *
+ * The compression is taken from comp= or detected by the magic number. If
+ * the data is compressed, a Decompressor is started and the engine reads
+ * its output instead of the socket.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param ddParameters the dd operands.
+ * @param decompressor started if the data is compressed.
+ * @param compression the Compression of the data is stored here.
+ *
+ * @return the file descriptor to read the data from, -1 on error.
+ */
+int openClientInput(int clientSocket, const std::map<std::string, std::string> &ddParameters, Decompressor *decompressor, int *compression) {
+  /* get compression, default: detect by the magic number */
+  *compression = COMP_AUTO;
+  if (ddParameters.find(std::string("comp")) != ddParameters.end()) {
+    if (!parseCompression(ddParameters.at(std::string("comp")), compression)) {
+      syslog(LOG_WARNING, "Unknown comp=%s, detect by the magic number", ddParameters.at(std::string("comp")).c_str());
+    }
+  }
+  if (*compression == COMP_AUTO) {
+    *compression = sniffCompression(clientSocket);
+    if (*compression != COMP_NONE && !isCompressionSupported(*compression)) {
+      syslog(LOG_WARNING, "Data looks like %s, which is not supported by this build. Write it as is.", getCompressionName(*compression));
+      *compression = COMP_NONE;
     }
-    ret += (ssize_t)(r1);
+  } else if (*compression != COMP_NONE && !isCompressionSupported(*compression)) {
+    syslog(LOG_ERR, "comp=%s is not supported by this build", getCompressionName(*compression));
+    return -1;
+  }
+
+  if (*compression == COMP_NONE) {
+    return clientSocket;
   }
-  return ret;
+  int threads = (int)getNumberOperand(ddParameters, std::string("threads"), sysconf(_SC_NPROCESSORS_ONLN));
+  return startDecompressor(decompressor, clientSocket, *compression, threads);
 }
 
 /**
- * Check if file exists
+ * log the checksum and the result of the verification, and send them back
+ * to the client as one line.
  *
- * @param filename the name of the file that needs to be checked
+ * Stops the checksum and the verifier of the writer.
  *
- * @return 0: non-exist, 1: exist
+ * @param clientSocket the socket which is connected to the client.
+ * @param zero the writer, after zeroWriterFinish().
+ * @param devFilename the device path.
+ * @param totalLen the number of bytes received.
  */
-int checkFileExists(const std::string &filename) {
-  int result;
-  struct stat statbuf;
-  memset(&statbuf, 0, sizeof(statbuf));
-  result = stat(filename.c_str(), &statbuf);
-  if (result < 0) {
-    return 0;
+static void reportChecksum(int clientSocket, ZeroWriter *zero, const std::string &devFilename, ssize_t totalLen) {
+  std::ostringstream report;
+  report << "ums2net: " << totalLen << " bytes";
+  if (zero->checksum != NULL) {
+    std::string digest = checksumFinish(zero->checksum);
+    syslog(LOG_INFO, "Checksum of %lld bytes written to %s: %s", zero->checksum->length, devFilename.c_str(), digest.c_str());
+    report << " " << digest;
+  }
+  if (zero->verify != NULL) {
+    if (verifierStop(zero->verify) == 0) {
+      syslog(LOG_INFO, "Verified %lld bytes of %s, %lld bytes not verified",
+	     zero->verify->verified, devFilename.c_str(), zero->verify->unverified);
+      report << " verify=ok";
+      if (zero->verify->unverified > 0) {
+	report << " unverified=" << zero->verify->unverified;
+      }
+    } else {
+      syslog(LOG_ERR, "Verification of %s failed, %lld bytes differ from offset %lld",
+	     devFilename.c_str(), zero->verify->mismatched, (long long)zero->verify->firstMismatch);
+      report << " verify=failed offset=" << zero->verify->firstMismatch;
+      metricsError(METRICS_ERROR_VERIFY);
+    }
+  }
+  report << "\n";
+  std::string line = report.str();
+  /* the client may have closed the socket already */
+  if (send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the checksum to the client");
+  }
+}
+
+/**
+ * save the final checkpoint of a resumable upload, and send the durable
+ * offset back to the client as one line.
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param zero the writer, after zeroWriterFinish().
+ * @param devFilename the device path.
+ */
+static void reportCheckpoint(int clientSocket, ZeroWriter *zero, const std::string &devFilename) {
+  Checkpoint *c = zero->checkpoint;
+  checkpointSave(c, zero->offset);
+  if ((uint64_t)c->durable >= c->imageSize) {
+    syslog(LOG_INFO, "Upload %llx to %s is complete", (unsigned long long)c->uploadId, devFilename.c_str());
+  } else {
+    syslog(LOG_INFO, "Upload %llx to %s is durable up to %lld of %llu bytes", (unsigned long long)c->uploadId,
+	   devFilename.c_str(), (long long)c->durable, (unsigned long long)c->imageSize);
+  }
+  std::ostringstream report;
+  report << "ums2net: " << c->durable << " of " << c->imageSize << " bytes durable\n";
+  std::string line = report.str();
+  if (send(clientSocket, line.c_str(), line.length(), MSG_NOSIGNAL) < 0) {
+    syslog(LOG_DEBUG, "Cannot send the checkpoint to the client");
   }
-  return 1;
 }
 
 /**
@@ -114,9 +186,7 @@ int checkFileExists(const std::string &filename) {
  * @param ddParameters the parameters for the device.
  */
 void clientServant(int clientSocket, const std::map<std::string, std::string> &ddParameters) {
-  char *buf=NULL;
-  int bufSize = 512;
-  ssize_t bufLen;
+  int bufSize;
   ssize_t totalLen=0;
 
   /* get device path */
@@ -129,110 +199,362 @@ void clientServant(int clientSocket, const std::map<std::string, std::string> &d
     return;
   }
 
-  /* get blocksize, default: 512 */
-  bufSize=512;
-  if (ddParameters.find(std::string("bs")) != ddParameters.end()) {
-    std::string o1 = ddParameters.at(std::string("bs"));
-      std::istringstream ifs1 (o1);
-      ifs1 >> bufSize;
-      if (ifs1.fail()) {
-	bufSize = 512;
-      }
+  /* get blocksize, default: chosen from the device once it is open */
+  bufSize = (int)getNumberOperand(ddParameters, std::string("bs"), 0);
+  int autoSize = (bufSize <= 0);
+
+  /* get copy engine, default: loop */
+  std::string engine("loop");
+  if (ddParameters.find(std::string("engine")) != ddParameters.end()) {
+    engine = ddParameters.at(std::string("engine"));
   }
 
-  /* check if device is appeared. */
-  if (!checkFileExists(devFilename)) {
-    syslog(LOG_WARNING, "Device %s not appeared. Close immediately.", devFilename.c_str());
+  /* get zero block policy, default: write */
+  int zeroPolicy = ZERO_WRITE;
+  if (ddParameters.find(std::string("zero")) != ddParameters.end()) {
+    if (!parseZeroPolicy(ddParameters.at(std::string("zero")), &zeroPolicy)) {
+      syslog(LOG_WARNING, "Unknown zero=%s, write zero blocks", ddParameters.at(std::string("zero")).c_str());
+    }
+  }
+
+  /* get compare mode, default: no */
+  int compareMode = 0;
+  if (ddParameters.find(std::string("compare")) != ddParameters.end()) {
+    compareMode = (ddParameters.at(std::string("compare")).compare("yes") == 0);
+  }
+
+  /* get index directory, default: no index */
+  std::string indexDir;
+  if (ddParameters.find(std::string("index")) != ddParameters.end()) {
+    indexDir = ddParameters.at(std::string("index"));
+  }
+
+  /* get checksum, default: none, crc32c if verify=yes */
+  int verifyMode = 0;
+  if (ddParameters.find(std::string("verify")) != ddParameters.end()) {
+    verifyMode = (ddParameters.at(std::string("verify")).compare("yes") == 0);
+  }
+  int checksumType = verifyMode ? CHECKSUM_CRC32C : CHECKSUM_NONE;
+  if (ddParameters.find(std::string("checksum")) != ddParameters.end()) {
+    if (!parseChecksum(ddParameters.at(std::string("checksum")), &checksumType)) {
+      syslog(LOG_WARNING, "Unknown checksum=%s, use crc32c", ddParameters.at(std::string("checksum")).c_str());
+      checksumType = CHECKSUM_CRC32C;
+    }
+  }
+  if (!isChecksumSupported(checksumType)) {
+    syslog(LOG_WARNING, "checksum=sha256 is not supported by this build, use crc32c");
+    checksumType = CHECKSUM_CRC32C;
+  }
+
+  /* get checkpoint directory, default: checkpoints are not kept */
+  std::string checkpointDir;
+  if (ddParameters.find(std::string("checkpoint")) != ddParameters.end()) {
+    checkpointDir = ddParameters.at(std::string("checkpoint"));
+  }
+
+  /* a push client asks for a final status line, and may ask for a
+     checksum which the port does not compute */
+  PushHeader push;
+  int pushMode = recvPushHeader(clientSocket, &push);
+  if (pushMode < 0) {
     return;
   }
+  if (pushMode && (push.flags & PUSH_SHA256) && isChecksumSupported(CHECKSUM_SHA256)) {
+    checksumType = CHECKSUM_SHA256;
+  } else if (pushMode && (push.flags & (PUSH_CRC32C | PUSH_SHA256)) && checksumType == CHECKSUM_NONE) {
+    checksumType = CHECKSUM_CRC32C;
+  }
+
+  /* a resumable upload starts with a resume header */
+  int resumeMode = sniffResumeHeader(clientSocket);
+
+  int needWriter = (zeroPolicy != ZERO_WRITE || compareMode || indexDir.length() > 0 || checksumType != CHECKSUM_NONE || verifyMode || resumeMode);
+  if (needWriter && engine.compare("direct") != 0 && engine.compare("loop") != 0) {
+    syslog(LOG_WARNING, "zero=, compare=, index=, checksum=, verify= and resumable uploads need the data in userspace, use loop engine instead of %s", engine.c_str());
+    engine = std::string("loop");
+  }
 
-  /* open the device */
-  int outFD = open(devFilename.c_str(), O_RDWR);
+  /* open the device, waiting wait= seconds for it to appear, default: 0.
+     engine=direct bypasses the page cache if possible. */
+  int waitMsec = (int)getNumberOperand(ddParameters, std::string("wait"), 0) * 1000;
+  DeviceInfo deviceInfo;
+  int outFD = -1;
+  int openErrno = 0;
+  if (engine.compare("direct") == 0) {
+    outFD = deviceManagerOpen(devFilename, O_RDWR | O_DIRECT, waitMsec, &deviceInfo);
+    openErrno = (outFD < 0) ? errno : 0;
+    if (openErrno == EINVAL) {
+      syslog(LOG_INFO, "O_DIRECT is not supported for %s, use buffered I/O", devFilename.c_str());
+    }
+  }
+  if (outFD < 0 && openErrno != ENOENT) {
+    outFD = deviceManagerOpen(devFilename, O_RDWR, waitMsec, &deviceInfo);
+    openErrno = (outFD < 0) ? errno : 0;
+  }
+  if (openErrno == ENOENT) {
+    syslog(LOG_WARNING, "Device %s not appeared. Close the connection.", devFilename.c_str());
+    metricsError(METRICS_ERROR_OPEN);
+    if (pushMode) {
+      reportPush(clientSocket, push, 0, 1);
+    }
+    return;
+  }
   if (outFD < 0) {
-    int errsv = errno;
+    int errsv = openErrno;
     char errbuf[1024];
     char *errstr;
     errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
     syslog(LOG_ERR, "Cannot open device %s. (%s)", devFilename.c_str(), errstr);
+    metricsError(METRICS_ERROR_OPEN);
+    if (pushMode) {
+      reportPush(clientSocket, push, 0, 1);
+    }
     return;
   }
 
-  /* allocate buffer */
-  if (buf == NULL) {
-    buf = (char *)malloc(sizeof(char)*bufSize);
+  /* without bs=, the size of each write follows the limits of the device */
+  if (autoSize) {
+    DeviceTopology *topology = &deviceInfo.topology;
+    bufSize = chooseIOSize(topology);
+    syslog(LOG_DEBUG, "%s: logical %d, physical %d, optimal %d, max %d bytes, USB %d Mbit/s, write %d bytes",
+	   devFilename.c_str(), topology->logicalBlockSize, topology->physicalBlockSize,
+	   topology->optimalIOSize, topology->maxIOSize, deviceInfo.usbSpeed, bufSize);
+  }
+
+  /* tell the client where to resume, and continue from there */
+  Checkpoint checkpoint;
+  if (resumeMode) {
+    if (resumeHandshake(clientSocket, &checkpoint, checkpointDir, devFilename, outFD) < 0) {
+      close(outFD);
+      if (pushMode) {
+	reportPush(clientSocket, push, 0, 1);
+      }
+      return;
+    }
+    checkpoint.interval = (off_t)getNumberOperand(ddParameters, std::string("ckptint"), 64*1024*1024);
   }
-  if (buf == NULL) {
-    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", bufSize);
+
+  /* a connection of a ranged upload carries one range of the image; the
+     connections of an upload share the rate of the hub but do not wait
+     for each other's slot */
+  if (sniffRangeHeader(clientSocket)) {
+    hubGroup = hubSchedulerFind(devFilename, &deviceInfo, ddParameters);
+    struct stat statbuf;
+    long long deviceSize = 0;
+    if (fstat(outFD, &statbuf) == 0 && S_ISBLK(statbuf.st_mode)) {
+      deviceSize = deviceInfo.size;
+    }
+    rangeServant(clientSocket, outFD, devFilename, deviceSize, bufSize, ddParameters);
+    hubGroup = NULL;
+    close(outFD);
     return;
   }
 
+  /* wait for a slot on the USB hub of the device, if hubmax= is given */
+  HubGroup *hub = hubSchedulerJoin(devFilename, &deviceInfo, ddParameters);
+
+  /* the copy engine reads the decompressed data instead of the socket */
+  int compression = COMP_NONE;
+  Decompressor decompressor;
+  int inFD = openClientInput(clientSocket, ddParameters, &decompressor, &compression);
+  if (inFD < 0) {
+    hubSchedulerLeave(hub);
+    close(outFD);
+    return;
+  }
+
+  /* get image format, default: detect by the magic number */
+  int format = FORMAT_AUTO;
+  if (ddParameters.find(std::string("format")) != ddParameters.end()) {
+    if (!parseImageFormat(ddParameters.at(std::string("format")), &format)) {
+      syslog(LOG_WARNING, "Unknown format=%s, detect by the magic number", ddParameters.at(std::string("format")).c_str());
+    }
+  }
+  if (resumeMode) {
+    /* the rest of an image can only be written at its offset */
+    format = FORMAT_RAW;
+  } else if (format == FORMAT_AUTO) {
+    format = sniffImageFormat(inFD);
+  }
+  if (format != FORMAT_RAW) {
+    syslog(LOG_INFO, "Write %s image to %s", getImageFormatName(format), devFilename.c_str());
+  }
+
+  ZeroWriter zeroWriter;
+  ZeroWriter *zero = NULL;
+  CompareReader compareReader;
+  BlockIndex blockIndex;
+  Checksum checksum;
+  Verifier verifier;
+  if (needWriter && format == FORMAT_RAW) {
+    zeroWriterInit(&zeroWriter, outFD, zeroPolicy);
+    zero = &zeroWriter;
+    if (compareMode) {
+      int nChunks = (int)getNumberOperand(ddParameters, std::string("nbuf"), 4);
+      if (compareReaderStart(&compareReader, outFD, zero->offset, 1024*1024, nChunks) == 0) {
+	zero->compare = &compareReader;
+      }
+    }
+    if (indexDir.length() > 0) {
+      /* the index has one hash per block as the engine writes them */
+      int indexBlockSize = bufSize;
+      if (engine.compare("direct") == 0) {
+	int alignment = getLogicalBlockSize(outFD);
+	indexBlockSize = ((bufSize + alignment - 1) / alignment) * alignment;
+      }
+      if (blockIndexOpen(&blockIndex, indexDir, devFilename, outFD, indexBlockSize) == 0) {
+	zero->index = &blockIndex;
+      }
+    }
+    if (checksumType != CHECKSUM_NONE && checksumInit(&checksum, checksumType) == 0) {
+      zero->checksum = &checksum;
+    }
+    if (verifyMode && verifierStart(&verifier, devFilename, zero->offset, 1024*1024) == 0) {
+      zero->verify = &verifier;
+    }
+    if (resumeMode) {
+      zero->checkpoint = &checkpoint;
+    }
+  } else if ((checksumType != CHECKSUM_NONE || verifyMode) && format != FORMAT_RAW) {
+    syslog(LOG_WARNING, "checksum= and verify= are not supported for %s images", getImageFormatName(format));
+  }
+
+  /* keep at most dirty= bytes in the page cache, default: 64M */
+  Writeback writeback;
+  Writeback *wb = NULL;
+  off_t dirtyLimit = (off_t)getNumberOperand(ddParameters, std::string("dirty"), 64*1024*1024);
+  if (format == FORMAT_RAW && writebackInit(&writeback, outFD, dirtyLimit) == 0) {
+    wb = &writeback;
+  }
+
+  /* the plain loop engine may grow the writes while it measures them */
+  IOSizer ioSizer;
+  IOSizer *sizer = NULL;
+  if (autoSize && zero == NULL) {
+    ioSizerInit(&ioSizer, bufSize, IO_SIZE_MAX);
+    sizer = &ioSizer;
+  }
+
   /* copy data from socket to device */
-  while (!quitFlag) {
-    ssize_t writeBufLen = 0;
-    bufLen = recvn(clientSocket, buf, bufSize, 0);
-    if (bufLen == 0) {
-      syslog(LOG_DEBUG, "read from client socket ended");
-      break;
-    } else if (bufLen < 0) {
-      int errsv = errno;
-      char errbuf[1024];
-      char *errstr;
-      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-      syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
-      break;
+  int error = 0;
+  if (format == FORMAT_SPARSE || format == FORMAT_BMAP) {
+    if (format == FORMAT_SPARSE) {
+      totalLen = copySparse(inFD, outFD, bufSize, &error);
+    } else {
+      totalLen = copyBmap(inFD, outFD, bufSize, &error);
     }
-    writeBufLen = write(outFD,buf,bufLen);
-    if (writeBufLen < 0) {
-      int errsv = errno;
-      char errbuf[1024];
-      char *errstr;
-      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-      syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
-      break;
+    if (error) {
+      syslog(LOG_ERR, "The %s image is not completely written to %s", getImageFormatName(format), devFilename.c_str());
+      metricsError(METRICS_ERROR_WRITE);
     }
-    totalLen += writeBufLen;
-    if (bufLen < bufSize) {
-      break;
+  } else {
+    if (engine.compare("splice") == 0) {
+      int unsupported = 0;
+      int pipeSize = (int)getNumberOperand(ddParameters, std::string("pipesz"), 1024*1024);
+      totalLen = copySplice(inFD, outFD, pipeSize, &unsupported, wb, &error);
+      if (unsupported) {
+	syslog(LOG_INFO, "splice() is not supported for %s, fall back to loop engine", devFilename.c_str());
+	totalLen += copyLoop(inFD, outFD, bufSize, zero, wb, sizer, &error);
+      }
+    } else if (engine.compare("direct") == 0) {
+      int nBuffers = (int)getNumberOperand(ddParameters, std::string("nbuf"), 4);
+      totalLen = copyDirect(inFD, outFD, bufSize, nBuffers, zero, &error);
+    } else if (engine.compare("uring") == 0) {
+      int unsupported = 0;
+      int queueDepth = (int)getNumberOperand(ddParameters, std::string("qd"), 8);
+      totalLen = copyUring(inFD, outFD, bufSize, queueDepth, &unsupported, &error);
+      if (unsupported) {
+	syslog(LOG_INFO, "io_uring is not supported for %s, fall back to loop engine", devFilename.c_str());
+	totalLen += copyLoop(inFD, outFD, bufSize, zero, wb, sizer, &error);
+      }
+    } else {
+      if (engine.compare("loop") != 0) {
+	syslog(LOG_WARNING, "Unknown engine=%s, use loop engine", engine.c_str());
+      }
+      totalLen = copyLoop(inFD, outFD, bufSize, zero, wb, sizer, &error);
+    }
+    if (error) {
+      syslog(LOG_ERR, "The data is not completely written to %s", devFilename.c_str());
     }
   }
 
-  /* free the buf */
-  if (buf != NULL) {
-    free(buf);
-    buf=NULL;
+  if (compression != COMP_NONE) {
+    if (finishDecompressor(&decompressor) < 0) {
+      syslog(LOG_ERR, "Cannot decompress all the data for %s", devFilename.c_str());
+      error = 1;
+    }
   }
 
+  if (zero != NULL) {
+    if (zero->compare != NULL) {
+      compareReaderStop(zero->compare);
+    }
+    if (zero->compare != NULL || zero->index != NULL) {
+      syslog(LOG_INFO, "%lld bytes are already on %s and not written", zero->sameTotal, devFilename.c_str());
+    }
+    if (zeroWriterFinish(zero) < 0) {
+      syslog(LOG_ERR, "Cannot finish zero blocks on %s", devFilename.c_str());
+      error = 1;
+    }
+    if (zero->index != NULL) {
+      syslog(LOG_INFO, "%lld bytes are unchanged by the index of %s", zero->index->matched, devFilename.c_str());
+      blockIndexCommit(zero->index, outFD);
+    }
+    if (zeroPolicy != ZERO_WRITE) {
+      syslog(LOG_INFO, "%lld bytes of zero blocks are not written to %s", zero->zeroTotal, devFilename.c_str());
+    }
+    if (zero->checksum != NULL || zero->verify != NULL) {
+      reportChecksum(clientSocket, zero, devFilename, totalLen);
+    }
+    if (zero->checkpoint != NULL) {
+      reportCheckpoint(clientSocket, zero, devFilename);
+    }
+  }
+
+  if (wb != NULL && writebackFinish(wb) < 0) {
+    syslog(LOG_ERR, "Cannot write all the data to %s", devFilename.c_str());
+    error = 1;
+  }
+  hubSchedulerLeave(hub);
+
   /* close output file */
   close(outFD);
 
+  if (pushMode) {
+    if (push.dataSize > 0 && (uint64_t)totalLen != push.dataSize) {
+      syslog(LOG_ERR, "%ld of %llu bytes are written to %s", totalLen, (unsigned long long)push.dataSize, devFilename.c_str());
+      error = 1;
+    }
+    reportPush(clientSocket, push, totalLen, error);
+  }
+
   syslog(LOG_INFO, "Totally write %ld bytes to %s", totalLen, devFilename.c_str());
 }
 
 /**
- * the thread for a TCP port
+ * open a listening socket for a TCP port.
  *
- * This function will bind and listen to the TCP port. If client connects,
- * it passes the client socket to clientServant() function.
+ * The socket is non-blocking, so the reactor can accept from it without
+ * ever blocking on a port whose client has gone away.
  *
- * @param data the pointer of UMS2NETConfRecord instance
+ * @param port the TCP port.
  *
- * @return NULL.
+ * @return the socket, -1 on error.
  */
-void* servantThread(void * data) {
-  UMS2NETConfRecord *record = (UMS2NETConfRecord *)(data);
+int openServerSocket(int port) {
   int serverSocket = -1;
   int enable=1;
   int result;
 
   /* create socket */
-  serverSocket = socket(AF_INET6, SOCK_STREAM, 0);
+  serverSocket = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (serverSocket < 0) {
     int errsv = errno;
     char errbuf[1024];
     char *errstr;
     errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
     syslog(LOG_ERR, "Cannot create server socket (%s)", errstr);
-    return NULL;
+    return -1;
   }
 
   /* set SO_REUSEADDR to the socket */
@@ -244,7 +566,8 @@ void* servantThread(void * data) {
     char *errstr;
     errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
     syslog(LOG_ERR, "Cannot setsockopt() server socket (%s)", errstr);
-    return NULL;
+    close(serverSocket);
+    return -1;
   }
 
   /* bind the socket to the TCP port */
@@ -252,7 +575,7 @@ void* servantThread(void * data) {
   memset(&serverAddr, 0, sizeof(serverAddr));
   serverAddr.sin6_family = AF_INET6;
   serverAddr.sin6_addr = in6addr_any;
-  serverAddr.sin6_port = htons(record->getPort());
+  serverAddr.sin6_port = htons(port);
 
   result = bind(serverSocket, (struct sockaddr *)(&serverAddr), sizeof(serverAddr));
   if (result < 0) {
@@ -260,8 +583,9 @@ void* servantThread(void * data) {
     char errbuf[1024];
     char *errstr;
     errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-    syslog(LOG_ERR, "Cannot bind server socket to TCP port %d (%s)", record->getPort(), errstr);
-    return NULL;
+    syslog(LOG_ERR, "Cannot bind server socket to TCP port %d (%s)", port, errstr);
+    close(serverSocket);
+    return -1;
   }
 
   /* start listen to the socket */
@@ -271,44 +595,9 @@ void* servantThread(void * data) {
     char errbuf[1024];
     char *errstr;
     errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-    syslog(LOG_ERR, "Cannot listen to server socket to TCP port %d (%s)", record->getPort(), errstr);
-    return NULL;
-  }
-
-  /* wait for client */
-  while (!quitFlag) {
-    fd_set rset;
-    int nReady;
-    FD_ZERO(&rset);
-    FD_SET(serverSocket, &rset);
-    nReady = select(serverSocket+1, &rset, NULL, NULL, NULL);
-    if (nReady == 1 && FD_ISSET(serverSocket, &rset)) {
-      struct sockaddr_in6 clientAddr;
-      socklen_t clientAddrSize = sizeof(clientAddr);
-      int clientSocket = accept(serverSocket, (struct sockaddr *) (&clientAddr), &clientAddrSize);
-      if (clientSocket < 0) {
-	int errsv = errno;
-	char errbuf[1024];
-	char *errstr;
-	errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-	syslog(LOG_WARNING, "Cannot accept client socket at port %d (%s)", record->getPort(), errstr);
-	continue;
-      }
-
-      /* call clientServant() to move the data from the socket to device */
-      clientServant(clientSocket, record->getDDParameterMap());
-
-      /* close client socket */
-      close(clientSocket);
-    } else {
-      int errsv = errno;
-      char errbuf[1024];
-      char *errstr;
-      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
-      syslog(LOG_WARNING, "select() on serverSocket (TCP port %d) returns bad value %d, thread loop exits. (%s)", record->getPort(), nReady, errstr);
-      break;
-    }
+    syslog(LOG_ERR, "Cannot listen to server socket to TCP port %d (%s)", port, errstr);
+    close(serverSocket);
+    return -1;
   }
-  
-  return NULL;
+  return serverSocket;
 }
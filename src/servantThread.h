@@ -18,6 +18,14 @@
 #ifndef _HEADER_UMS2NET_SERVANT_THREAD_HEAD1_H
 #define _HEADER_UMS2NET_SERVANT_THREAD_HEAD1_H
 
-void* servantThread(void *);
+#include <map>
+#include <string>
+
+#include "decompress.h"
+
+long long getNumberOperand(const std::map<std::string, std::string> &ddParameters, const std::string &key, long long defaultValue);
+int openClientInput(int clientSocket, const std::map<std::string, std::string> &ddParameters, Decompressor *decompressor, int *compression);
+void clientServant(int clientSocket, const std::map<std::string, std::string> &ddParameters);
+int openServerSocket(int port);
 
 #endif /* _HEADER_UMS2NET_SERVANT_THREAD_HEAD1_H */
@@ -0,0 +1,186 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../blockIndex.h"
+
+class UMS2NETBlockIndexTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETBlockIndexTest);
+  CPPUNIT_TEST(testBlockHash);
+  CPPUNIT_TEST(testGetBlockIndexPath);
+  CPPUNIT_TEST(testBlockIndex);
+  CPPUNIT_TEST(testConcurrentSessions);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *dirname;
+  char *devname;
+  int devFD;
+
+public:
+  void setUp() {
+    char buf[4096*4];
+    dirname = strdup("ums2net-testUMS2NET-BlockIndex-XXXXXX");
+    mkdtemp(dirname);
+    devname = strdup("ums2net-testUMS2NET-BlockIndex-dev-XXXXXX");
+    devFD = mkstemp(devname);
+    memset(buf, 0, sizeof(buf));
+    if (write(devFD, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+      fprintf(stderr, "Error write to file (%s)", strerror(errno));
+    }
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    unlink(getBlockIndexPath(std::string(dirname), std::string(devname)).c_str());
+    rmdir(dirname);
+    free(devname);
+    free(dirname);
+  }
+
+protected:
+  /**
+   * test for blockHash() function
+   */
+  void testBlockHash() {
+    char buf1[4096];
+    char buf2[4096];
+    memset(buf1, 0x5a, sizeof(buf1));
+    memset(buf2, 0x5a, sizeof(buf2));
+    CPPUNIT_ASSERT(blockHash(buf1, sizeof(buf1)) == blockHash(buf2, sizeof(buf2)));
+    CPPUNIT_ASSERT(blockHash(buf1, sizeof(buf1)) != 0);
+    buf2[4095] = 0;
+    CPPUNIT_ASSERT(blockHash(buf1, sizeof(buf1)) != blockHash(buf2, sizeof(buf2)));
+    /* the length is part of the hash */
+    CPPUNIT_ASSERT(blockHash(buf1, 100) != blockHash(buf1, 101));
+  }
+
+  /**
+   * test for getBlockIndexPath() function
+   */
+  void testGetBlockIndexPath() {
+    std::string path = getBlockIndexPath(std::string("/var/lib/ums2net"), std::string("/dev/disk/by-id/usb-Linux_UMS_disk_0_WaRP7-0x2c98b953000003b5-0:0"));
+    CPPUNIT_ASSERT(path.compare(std::string("/var/lib/ums2net/%2Fdev%2Fdisk%2Fby-id%2Fusb-Linux_UMS_disk_0_WaRP7-0x2c98b953000003b5-0%3A0.idx"))==0);
+  }
+
+  /**
+   * test for blockIndexOpen(), blockIndexMatch(), blockIndexUpdate() and
+   * blockIndexCommit() functions
+   */
+  void testBlockIndex() {
+    BlockIndex index;
+    std::string dir(dirname);
+    std::string dev(devname);
+
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 0, 4096, 123), 0);
+    blockIndexUpdate(&index, 0, 4096, 123);
+    blockIndexUpdate(&index, 4096, 4096, 456);
+    /* not a whole block, so unknown */
+    blockIndexUpdate(&index, 8192, 100, 789);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index, devFD), 0);
+
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 0, 4096, 123), 1);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 4096, 4096, 123), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 4096, 4096, 456), 1);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 8192, 100, 789), 0);
+    CPPUNIT_ASSERT_EQUAL(index.matched, 8192LL);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index, devFD), 0);
+
+    /* another block size drops the index */
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index, dir, dev, devFD, 8192), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 0, 8192, 123), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index, devFD), 0);
+
+    /* a file which was written by someone else drops the index */
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index, dir, dev, devFD, 4096), 0);
+    blockIndexUpdate(&index, 0, 4096, 123);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index, devFD), 0);
+    CPPUNIT_ASSERT(write(devFD, "x", 1) == 1);
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index, 0, 4096, 123), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index, devFD), 0);
+  }
+
+  /**
+   * test that two sessions of the same device do not share a copy
+   */
+  void testConcurrentSessions() {
+    BlockIndex index1;
+    BlockIndex index2;
+    std::string dir(dirname);
+    std::string dev(devname);
+
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index1, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index2, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT(index1.tmpPath.compare(index2.tmpPath) != 0);
+    blockIndexUpdate(&index1, 0, 4096, 123);
+    blockIndexUpdate(&index2, 4096, 4096, 456);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index2, devFD), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index1, devFD), 0);
+
+    /* the last session wins, with an index of its own */
+    CPPUNIT_ASSERT_EQUAL(blockIndexOpen(&index1, dir, dev, devFD, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index1, 0, 4096, 123), 1);
+    CPPUNIT_ASSERT_EQUAL(blockIndexMatch(&index1, 4096, 4096, 456), 0);
+    CPPUNIT_ASSERT_EQUAL(blockIndexCommit(&index1, devFD), 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETBlockIndexTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
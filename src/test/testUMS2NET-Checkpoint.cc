@@ -0,0 +1,151 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../checkpoint.h"
+
+class UMS2NETCheckpointTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETCheckpointTest);
+  CPPUNIT_TEST(testParseResumeHeader);
+  CPPUNIT_TEST(testGetCheckpointPath);
+  CPPUNIT_TEST(testCheckpoint);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *dirname;
+  char *devname;
+  int devFD;
+
+public:
+  void setUp() {
+    char buf[4096];
+    dirname = strdup("ums2net-testUMS2NET-Checkpoint-XXXXXX");
+    mkdtemp(dirname);
+    devname = strdup("ums2net-testUMS2NET-Checkpoint-dev-XXXXXX");
+    devFD = mkstemp(devname);
+    memset(buf, 0, sizeof(buf));
+    if (write(devFD, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+      fprintf(stderr, "Error write to file (%s)", strerror(errno));
+    }
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    unlink(getCheckpointPath(std::string(dirname), std::string(devname)).c_str());
+    rmdir(dirname);
+    free(devname);
+    free(dirname);
+  }
+
+protected:
+  /**
+   * test for parseResumeHeader() function
+   */
+  void testParseResumeHeader() {
+    unsigned char buf[RESUME_HEADER_SIZE];
+    uint64_t uploadId = 0;
+    uint64_t imageSize = 0;
+    memcpy(buf, RESUME_HEADER_MAGIC, 8);
+    for (int i=0; i<8; i++) {
+      buf[8 + i] = (unsigned char)(0x10 + i);
+      buf[16 + i] = (unsigned char)(i == 1 ? 0x02 : 0);
+    }
+    CPPUNIT_ASSERT_EQUAL(parseResumeHeader(buf, sizeof(buf), &uploadId, &imageSize), 1);
+    CPPUNIT_ASSERT_EQUAL(uploadId, (uint64_t)0x1716151413121110ULL);
+    CPPUNIT_ASSERT_EQUAL(imageSize, (uint64_t)512);
+    CPPUNIT_ASSERT_EQUAL(parseResumeHeader(buf, sizeof(buf) - 1, &uploadId, &imageSize), 0);
+    buf[0] = 'X';
+    CPPUNIT_ASSERT_EQUAL(parseResumeHeader(buf, sizeof(buf), &uploadId, &imageSize), 0);
+  }
+
+  /**
+   * test for getCheckpointPath() function
+   */
+  void testGetCheckpointPath() {
+    std::string path = getCheckpointPath(std::string("/var/lib/ums2net"), std::string("/dev/sdb"));
+    CPPUNIT_ASSERT(path.compare(std::string("/var/lib/ums2net/%2Fdev%2Fsdb.ckpt"))==0);
+  }
+
+  /**
+   * test for checkpointOpen() and checkpointSave() functions
+   */
+  void testCheckpoint() {
+    Checkpoint c;
+    std::string dir(dirname);
+    std::string dev(devname);
+
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, dir, dev, devFD, 0x1234, 8192), (off_t)0);
+    CPPUNIT_ASSERT_EQUAL(checkpointSave(&c, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(c.durable, (off_t)4096);
+
+    /* the same image resumes, another one does not */
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, dir, dev, devFD, 0x1234, 8192), (off_t)4096);
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, dir, dev, devFD, 0x1235, 8192), (off_t)0);
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, dir, dev, devFD, 0x1234, 8193), (off_t)0);
+
+    /* a file which was written by someone else does not resume */
+    CPPUNIT_ASSERT(write(devFD, "x", 1) == 1);
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, dir, dev, devFD, 0x1234, 8192), (off_t)0);
+
+    /* no directory, no checkpoint */
+    CPPUNIT_ASSERT_EQUAL(checkpointOpen(&c, std::string(), dev, devFD, 0x1234, 8192), (off_t)0);
+    CPPUNIT_ASSERT_EQUAL(checkpointSave(&c, 4096), 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETCheckpointTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
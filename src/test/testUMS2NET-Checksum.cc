@@ -0,0 +1,181 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../checksum.h"
+#include "../verifier.h"
+
+class UMS2NETChecksumTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETChecksumTest);
+  CPPUNIT_TEST(testCrc32c);
+  CPPUNIT_TEST(testParseChecksum);
+  CPPUNIT_TEST(testChecksum);
+  CPPUNIT_TEST(testVerifier);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  int devFD;
+  char buf[3*4096+100];
+
+public:
+  void setUp() {
+    for (int i=0; i<(int)sizeof(buf); i++) {
+      buf[i] = (char)(i * 7 + i / 256);
+    }
+    devname = strdup("ums2net-testUMS2NET-Checksum-XXXXXX");
+    devFD = mkstemp(devname);
+    if (write(devFD, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+      fprintf(stderr, "Error write to file (%s)", strerror(errno));
+    }
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for crc32c() function
+   */
+  void testCrc32c() {
+    CPPUNIT_ASSERT_EQUAL(crc32c(0, "123456789", 9), (uint32_t)0xe3069283);
+    CPPUNIT_ASSERT_EQUAL(crc32c(0, "", 0), (uint32_t)0);
+
+    /* the same CRC in pieces, at any alignment */
+    uint32_t whole = crc32c(0, buf, 1000);
+    for (int split=0; split<=40; split+=3) {
+      uint32_t crc = crc32c(0, buf, split);
+      crc = crc32c(crc, buf + split, 1000 - split);
+      CPPUNIT_ASSERT_EQUAL(crc, whole);
+    }
+    buf[999] ^= 1;
+    CPPUNIT_ASSERT(crc32c(0, buf, 1000) != whole);
+  }
+
+  /**
+   * test for parseChecksum() function
+   */
+  void testParseChecksum() {
+    int type = -1;
+    CPPUNIT_ASSERT_EQUAL(parseChecksum(std::string("none"), &type), 1);
+    CPPUNIT_ASSERT_EQUAL(type, (int)CHECKSUM_NONE);
+    CPPUNIT_ASSERT_EQUAL(parseChecksum(std::string("crc32c"), &type), 1);
+    CPPUNIT_ASSERT_EQUAL(type, (int)CHECKSUM_CRC32C);
+    CPPUNIT_ASSERT_EQUAL(parseChecksum(std::string("sha256"), &type), 1);
+    CPPUNIT_ASSERT_EQUAL(type, (int)CHECKSUM_SHA256);
+    CPPUNIT_ASSERT_EQUAL(parseChecksum(std::string("md5"), &type), 0);
+    CPPUNIT_ASSERT_EQUAL(type, (int)CHECKSUM_SHA256);
+  }
+
+  /**
+   * test for checksumInit(), checksumUpdate() and checksumFinish() functions
+   */
+  void testChecksum() {
+    Checksum c;
+    CPPUNIT_ASSERT_EQUAL(checksumInit(&c, CHECKSUM_CRC32C), 0);
+    checksumUpdate(&c, "1234", 4);
+    checksumUpdate(&c, "56789", 5);
+    CPPUNIT_ASSERT_EQUAL(c.length, 9LL);
+    CPPUNIT_ASSERT(checksumFinish(&c).compare(std::string("crc32c=e3069283"))==0);
+
+    if (isChecksumSupported(CHECKSUM_SHA256)) {
+      CPPUNIT_ASSERT_EQUAL(checksumInit(&c, CHECKSUM_SHA256), 0);
+      checksumUpdate(&c, "a", 1);
+      checksumUpdate(&c, "bc", 2);
+      CPPUNIT_ASSERT(checksumFinish(&c).compare(std::string("crc32c=364b3fb7 sha256=ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"))==0);
+    }
+  }
+
+  /**
+   * test for verifierStart(), verifierAdd(), verifierWritten() and
+   * verifierStop() functions
+   */
+  void testVerifier() {
+    Verifier v;
+    std::string dev(devname);
+
+    /* the file holds the data */
+    CPPUNIT_ASSERT_EQUAL(verifierStart(&v, dev, 0, 4096), 0);
+    verifierAdd(&v, buf, 5000);
+    verifierWritten(&v, 5000);
+    verifierAdd(&v, buf + 5000, sizeof(buf) - 5000);
+    verifierWritten(&v, sizeof(buf));
+    CPPUNIT_ASSERT_EQUAL(verifierStop(&v), 0);
+    CPPUNIT_ASSERT_EQUAL(v.verified, (long long)sizeof(buf));
+
+    /* the second chunk differs */
+    CPPUNIT_ASSERT_EQUAL(verifierStart(&v, dev, 0, 4096), 0);
+    buf[5000] ^= 1;
+    verifierAdd(&v, buf, sizeof(buf));
+    CPPUNIT_ASSERT_EQUAL(verifierStop(&v), -1);
+    CPPUNIT_ASSERT_EQUAL(v.mismatched, 4096LL);
+    CPPUNIT_ASSERT_EQUAL(v.firstMismatch, (off_t)4096);
+
+    /* the data is longer than the file */
+    CPPUNIT_ASSERT_EQUAL(verifierStart(&v, dev, 4096, 4096), 0);
+    buf[5000] ^= 1;
+    verifierAdd(&v, buf + 4096, sizeof(buf) - 4096);
+    verifierAdd(&v, buf, 4096);
+    CPPUNIT_ASSERT_EQUAL(verifierStop(&v), -1);
+    CPPUNIT_ASSERT_EQUAL(v.firstMismatch, (off_t)(3*4096));
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETChecksumTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
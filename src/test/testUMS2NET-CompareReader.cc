@@ -0,0 +1,182 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../zeroBlock.h"
+#include "../compareReader.h"
+
+#define BLOCK_SIZE 4096
+#define N_BLOCKS 8
+
+class UMS2NETCompareReaderTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETCompareReaderTest);
+  CPPUNIT_TEST(testUnchangedBlocks);
+  CPPUNIT_TEST(testChangedBlocks);
+  CPPUNIT_TEST(testShortDevice);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  int devFD;
+  char data[BLOCK_SIZE*N_BLOCKS];
+
+  /**
+   * fill the device with the first len bytes of data.
+   */
+  void fillDevice(size_t len) {
+    CPPUNIT_ASSERT_EQUAL(ftruncate(devFD, 0), 0);
+    CPPUNIT_ASSERT_EQUAL(pwrite(devFD, data, len, 0), (ssize_t)len);
+  }
+
+  /**
+   * write data to the device with compare=yes, as the servant does.
+   *
+   * @param chunkSize the size of each read-ahead.
+   *
+   * @return the number of bytes which were not written.
+   */
+  long long writeCompared(size_t chunkSize) {
+    ZeroWriter zero;
+    CompareReader compareReader;
+    CPPUNIT_ASSERT_EQUAL(lseek(devFD, 0, SEEK_SET), (off_t)0);
+    zeroWriterInit(&zero, devFD, ZERO_WRITE);
+    CPPUNIT_ASSERT_EQUAL(compareReaderStart(&compareReader, devFD, zero.offset, chunkSize, 2), 0);
+    zero.compare = &compareReader;
+    for (int i=0; i<N_BLOCKS; i++) {
+      CPPUNIT_ASSERT_EQUAL(zeroWriterWrite(&zero, &(data[i*BLOCK_SIZE]), BLOCK_SIZE), (ssize_t)BLOCK_SIZE);
+    }
+    CPPUNIT_ASSERT_EQUAL(zeroWriterFinish(&zero), 0);
+    compareReaderStop(&compareReader);
+    return zero.sameTotal;
+  }
+
+  /**
+   * check that the device holds exactly data.
+   */
+  void checkDevice() {
+    char buf[sizeof(data)+1];
+    struct stat statbuf;
+    CPPUNIT_ASSERT_EQUAL(fstat(devFD, &statbuf), 0);
+    CPPUNIT_ASSERT_EQUAL(statbuf.st_size, (off_t)sizeof(data));
+    CPPUNIT_ASSERT_EQUAL(pread(devFD, buf, sizeof(buf), 0), (ssize_t)sizeof(data));
+    CPPUNIT_ASSERT(memcmp(buf, data, sizeof(data)) == 0);
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-CompareReader-XXXXXX");
+    devFD = mkstemp(devname);
+    for (int i=0; i<(int)sizeof(data); i++) {
+      data[i] = (char)(i*7 + i/BLOCK_SIZE);
+    }
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test that blocks already on the device are not written again
+   */
+  void testUnchangedBlocks() {
+    fillDevice(sizeof(data));
+    /* read-ahead chunks smaller, equal and larger than the blocks */
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE/2), (long long)sizeof(data));
+    checkDevice();
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE), (long long)sizeof(data));
+    checkDevice();
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE*3), (long long)sizeof(data));
+    checkDevice();
+  }
+
+  /**
+   * test that changed blocks are written and only those
+   */
+  void testChangedBlocks() {
+    fillDevice(sizeof(data));
+    /* change the first byte of block 1 and the last byte of block 6 */
+    char c = (char)(data[BLOCK_SIZE] + 1);
+    CPPUNIT_ASSERT_EQUAL(pwrite(devFD, &c, 1, BLOCK_SIZE), (ssize_t)1);
+    c = (char)(data[BLOCK_SIZE*7-1] + 1);
+    CPPUNIT_ASSERT_EQUAL(pwrite(devFD, &c, 1, BLOCK_SIZE*7-1), (ssize_t)1);
+
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE*3), (long long)(BLOCK_SIZE*(N_BLOCKS-2)));
+    checkDevice();
+
+    /* everything is the same now */
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE*3), (long long)sizeof(data));
+  }
+
+  /**
+   * test a device which is shorter than the data
+   */
+  void testShortDevice() {
+    /* ends in the middle of block 3 */
+    fillDevice(BLOCK_SIZE*3 + 100);
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE), (long long)(BLOCK_SIZE*3));
+    checkDevice();
+
+    fillDevice(0);
+    CPPUNIT_ASSERT_EQUAL(writeCompared(BLOCK_SIZE*2), 0LL);
+    checkDevice();
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETCompareReaderTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
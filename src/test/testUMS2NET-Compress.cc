@@ -0,0 +1,201 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../compress.h"
+
+volatile int quitFlag = 0;
+
+class UMS2NETCompressTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETCompressTest);
+  CPPUNIT_TEST(testCompressGzip);
+  CPPUNIT_TEST(testCompressXz);
+  CPPUNIT_TEST(testCompressZstd);
+  CPPUNIT_TEST(testCompressChunk);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  std::string data;
+
+  /**
+   * read a socket until EOF.
+   */
+  std::string readAll(int fd) {
+    std::string ret;
+    char buf[65536];
+    ssize_t r1;
+    while ((r1 = read(fd, buf, sizeof(buf))) > 0) {
+      ret.append(buf, (size_t)r1);
+    }
+    return ret;
+  }
+
+  /**
+   * compress data and decompress it again.
+   */
+  std::string roundTrip(int compression) {
+    int client[2];
+    int comp[2];
+    Compressor c;
+    Decompressor d;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, client);
+    int writeFD = startCompressor(&c, client[0], compression);
+    CPPUNIT_ASSERT(writeFD >= 0);
+    CPPUNIT_ASSERT_EQUAL(write(writeFD, data.c_str(), data.length()), (ssize_t)data.length());
+    CPPUNIT_ASSERT_EQUAL(finishCompressor(&c), 0);
+    CPPUNIT_ASSERT_EQUAL(c.inLen, (long long)data.length());
+    close(client[0]);
+    std::string compressed = readAll(client[1]);
+    close(client[1]);
+    CPPUNIT_ASSERT_EQUAL((long long)compressed.length(), c.outLen);
+    CPPUNIT_ASSERT(compressed.length() < data.length());
+    CPPUNIT_ASSERT_EQUAL(detectCompression((const unsigned char *)compressed.c_str(), compressed.length()), compression);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, comp);
+    CPPUNIT_ASSERT_EQUAL(write(comp[1], compressed.c_str(), compressed.length()), (ssize_t)compressed.length());
+    close(comp[1]);
+    int readFD = startDecompressor(&d, comp[0], compression, 1);
+    CPPUNIT_ASSERT(readFD >= 0);
+    std::string ret = readAll(readFD);
+    CPPUNIT_ASSERT_EQUAL(finishDecompressor(&d), 0);
+    close(comp[0]);
+    return ret;
+  }
+
+  /**
+   * decompress a stream.
+   */
+  std::string decompress(const std::string &compressed, int compression) {
+    int comp[2];
+    Decompressor d;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, comp);
+    CPPUNIT_ASSERT_EQUAL(write(comp[1], compressed.c_str(), compressed.length()), (ssize_t)compressed.length());
+    close(comp[1]);
+    int readFD = startDecompressor(&d, comp[0], compression, 1);
+    CPPUNIT_ASSERT(readFD >= 0);
+    std::string ret = readAll(readFD);
+    CPPUNIT_ASSERT_EQUAL(finishDecompressor(&d), 0);
+    close(comp[0]);
+    return ret;
+  }
+
+public:
+  void setUp() {
+    data.clear();
+    for (int i=0; i<10000; i++) {
+      data += std::to_string(i * 7919) + std::string(" ");
+    }
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for gzip Compressor
+   */
+  void testCompressGzip() {
+    if (isCompressionSupported(COMP_GZIP)) {
+      CPPUNIT_ASSERT(roundTrip(COMP_GZIP) == data);
+    }
+  }
+
+  /**
+   * test for xz Compressor
+   */
+  void testCompressXz() {
+    if (isCompressionSupported(COMP_XZ)) {
+      CPPUNIT_ASSERT(roundTrip(COMP_XZ) == data);
+    }
+  }
+
+  /**
+   * test for zstd Compressor
+   */
+  void testCompressZstd() {
+    if (isCompressionSupported(COMP_ZSTD)) {
+      CPPUNIT_ASSERT(roundTrip(COMP_ZSTD) == data);
+    }
+  }
+
+  /**
+   * test that chunks compressed on their own are one stream when they
+   * are concatenated
+   */
+  void testCompressChunk() {
+    static const int all[] = { COMP_GZIP, COMP_XZ, COMP_ZSTD };
+    std::string out;
+    for (int i=0; i<3; i++) {
+      if (!isCompressionSupported(all[i])) {
+	CPPUNIT_ASSERT_EQUAL(compressChunk(all[i], data.c_str(), data.length(), &out), -1);
+	continue;
+      }
+      std::string compressed;
+      size_t chunkSize = data.length() / 3 + 1;
+      for (size_t pos=0; pos<data.length(); pos+=chunkSize) {
+	size_t len = (data.length() - pos < chunkSize) ? data.length() - pos : chunkSize;
+	CPPUNIT_ASSERT_EQUAL(compressChunk(all[i], data.c_str() + pos, len, &out), 0);
+	CPPUNIT_ASSERT(out.length() < len);
+	compressed += out;
+      }
+      CPPUNIT_ASSERT_EQUAL(detectCompression((const unsigned char *)compressed.c_str(), compressed.length()), all[i]);
+      CPPUNIT_ASSERT(decompress(compressed, all[i]) == data);
+    }
+    CPPUNIT_ASSERT_EQUAL(compressChunk(COMP_NONE, data.c_str(), data.length(), &out), -1);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETCompressTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
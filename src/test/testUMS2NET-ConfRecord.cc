@@ -34,6 +34,10 @@ class UMS2NETConfRecordTest : public CppUnit::TestFixture {
   CPPUNIT_TEST(testGetDDParameter);
   CPPUNIT_TEST(testGetDDParameterVector);
   CPPUNIT_TEST(testGetDDParameterMap);
+  CPPUNIT_TEST(testGetDDParameterValues);
+  CPPUNIT_TEST(testParseDDNumber);
+  CPPUNIT_TEST(testTemplate);
+  CPPUNIT_TEST(testValidate);
   CPPUNIT_TEST_SUITE_END();
   
 private:
@@ -126,6 +130,95 @@ protected:
     CPPUNIT_ASSERT(map3.at(std::string("seek")).compare(std::string("1"))==0);
   }
 
+  /**
+   * test for getDDParameterValues() member function
+   */
+  void testGetDDParameterValues() {
+    std::string dd4("of=/tmp/fa bs=4096 of=/tmp/fb of=/tmp/fc");
+    UMS2NETConfRecord record4(port1, dd4);
+    std::vector<std::string> values = record4.getDDParameterValues(std::string("of"));
+
+    CPPUNIT_ASSERT_EQUAL((int)values.size(), 3);
+    CPPUNIT_ASSERT(values[0].compare(std::string("/tmp/fa"))==0);
+    CPPUNIT_ASSERT(values[1].compare(std::string("/tmp/fb"))==0);
+    CPPUNIT_ASSERT(values[2].compare(std::string("/tmp/fc"))==0);
+    CPPUNIT_ASSERT(record4.getDDParameterMap().at(std::string("of")).compare(std::string("/tmp/fc"))==0);
+    CPPUNIT_ASSERT_EQUAL((int)record3->getDDParameterValues(std::string("of")).size(), 1);
+    CPPUNIT_ASSERT_EQUAL((int)record3->getDDParameterValues(std::string("if")).size(), 0);
+  }
+
+  /**
+   * test for parseDDNumber() function
+   */
+  void testParseDDNumber() {
+    long long value = 0;
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("4096"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 4096LL);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("2b"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 1024LL);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("4K"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 4096LL);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("1kB"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 1000LL);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("1M"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 1048576LL);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("2G"), &value), 1);
+    CPPUNIT_ASSERT_EQUAL(value, 2147483648LL);
+
+    value = 7;
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string(""), &value), 0);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("M"), &value), 0);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("12X"), &value), 0);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("-1"), &value), 0);
+    CPPUNIT_ASSERT_EQUAL(parseDDNumber(std::string("99999999999G"), &value), 0);
+    CPPUNIT_ASSERT_EQUAL(value, 7LL);
+  }
+
+  /**
+   * test for isTemplate() and bindDevice() member functions
+   */
+  void testTemplate() {
+    std::string dd4("of=/dev/disk/by-id/usb-Linux_UMS_disk_0_*-0:0 bs=1M");
+    UMS2NETConfRecord record4(30000, 30099, dd4);
+
+    CPPUNIT_ASSERT_EQUAL(record1->isTemplate(), 0);
+    CPPUNIT_ASSERT_EQUAL(record1->getLastPort(), port1);
+    CPPUNIT_ASSERT_EQUAL(record4.isTemplate(), 1);
+    CPPUNIT_ASSERT(record4.getDevicePattern().compare(std::string("/dev/disk/by-id/usb-Linux_UMS_disk_0_*-0:0"))==0);
+
+    UMS2NETConfRecord bound = record4.bindDevice(30002, std::string("/dev/disk/by-id/usb-Linux_UMS_disk_0_42-0:0"));
+    CPPUNIT_ASSERT_EQUAL(bound.getPort(), 30002);
+    CPPUNIT_ASSERT_EQUAL(bound.getLastPort(), 30002);
+    CPPUNIT_ASSERT_EQUAL(bound.isTemplate(), 0);
+    CPPUNIT_ASSERT(bound.getDDParameter().compare(std::string("of=/dev/disk/by-id/usb-Linux_UMS_disk_0_42-0:0 bs=1M"))==0);
+    CPPUNIT_ASSERT(bound.getDDParameterMap().at(std::string("bs")).compare(std::string("1M"))==0);
+  }
+
+  /**
+   * test for validate() member function
+   */
+  void testValidate() {
+    std::string error;
+    std::vector<std::string> warnings;
+    CPPUNIT_ASSERT_EQUAL(record2->validate(error, warnings), 1);
+    CPPUNIT_ASSERT_EQUAL((int)warnings.size(), 0);
+    /* seek= is not an operand of ums2net */
+    CPPUNIT_ASSERT_EQUAL(record3->validate(error, warnings), 1);
+    CPPUNIT_ASSERT_EQUAL((int)warnings.size(), 1);
+
+    std::string bad1("of=/tmp/fa bs=4X");
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, bad1).validate(error, warnings), 0);
+    std::string bad2("of=/tmp/fa");
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, port1 + 9, bad2).validate(error, warnings), 0);
+    std::string bad3("of=/tmp/*/disk");
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, bad3).validate(error, warnings), 0);
+    std::string bad4("of=/tmp/a* of=/tmp/b*");
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, bad4).validate(error, warnings), 0);
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, port1 - 1, bad2).validate(error, warnings), 0);
+    std::string good("of=/tmp/disk[0-9] wait=30");
+    CPPUNIT_ASSERT_EQUAL(UMS2NETConfRecord(port1, port1 + 9, good).validate(error, warnings), 1);
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETConfRecordTest);
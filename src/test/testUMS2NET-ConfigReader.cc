@@ -20,6 +20,7 @@
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
+#include <fcntl.h>
 #include <cppunit/TestCase.h>
 #include <cppunit/TestFixture.h>
 #include <cppunit/ui/text/TestRunner.h>
@@ -35,6 +36,8 @@
 class UMS2NETConfigReaderTest : public CppUnit::TestFixture {
   CPPUNIT_TEST_SUITE(UMS2NETConfigReaderTest);
   CPPUNIT_TEST(testConfigReader);
+  CPPUNIT_TEST(testPortRange);
+  CPPUNIT_TEST(testExpandConfig);
   CPPUNIT_TEST_SUITE_END();
   
 private:
@@ -86,6 +89,95 @@ protected:
     CPPUNIT_ASSERT(results[2].getDDParameter().compare(std::string("of=/tmp/f11111 bs=4096 seek=2"))==0);
       
   }
+
+  /**
+   * test for port ranges and invalid lines in getConfig()
+   */
+  void testPortRange() {
+    char rangeFilename[] = "ums2net-testUMS2NET-ConfigReader-range-XXXXXX";
+    int rangeFD = mkstemp(rangeFilename);
+    CPPUNIT_ASSERT(rangeFD >= 0);
+    const char *data =
+      "30000-30099 of=/dev/disk/by-id/usb-Linux_UMS_disk_0_*-0:0\n"
+      "30100 of=/tmp/f30100 bs=4Q\n"
+      "30200-30201 of=/tmp/f30200\n"
+      "30300-x of=/tmp/f3030*\n"
+      "30400 of=/tmp/f30400\n";
+    CPPUNIT_ASSERT_EQUAL(write(rangeFD, data, strlen(data)), (ssize_t)strlen(data));
+    close(rangeFD);
+
+    std::vector<UMS2NETConfRecord> results = getConfig(rangeFilename);
+    unlink(rangeFilename);
+    CPPUNIT_ASSERT_EQUAL((int)results.size(), 2);
+    CPPUNIT_ASSERT_EQUAL(results[0].getPort(), 30000);
+    CPPUNIT_ASSERT_EQUAL(results[0].getLastPort(), 30099);
+    CPPUNIT_ASSERT_EQUAL(results[0].isTemplate(), 1);
+    CPPUNIT_ASSERT_EQUAL(results[1].getPort(), 30400);
+    CPPUNIT_ASSERT_EQUAL(results[1].isTemplate(), 0);
+  }
+
+  /**
+   * test for expandConfig() function
+   */
+  void testExpandConfig() {
+    char dir[] = "/tmp/ums2net-testUMS2NET-ConfigReader-XXXXXX";
+    CPPUNIT_ASSERT(mkdtemp(dir) != NULL);
+    std::string base(dir);
+    std::string pattern = base + "/disk_*";
+    std::string dd1 = std::string("of=") + pattern + " bs=1M";
+    std::string dd2 = std::string("of=/tmp/f30001");
+    std::vector<UMS2NETConfRecord> config;
+    config.push_back(UMS2NETConfRecord(30000, 30003, dd1));
+    config.push_back(UMS2NETConfRecord(30001, dd2));
+    std::map<std::string, int> bindings;
+
+    /* no device yet, only the plain port */
+    std::vector<UMS2NETConfRecord> records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 1);
+    CPPUNIT_ASSERT_EQUAL(records[0].getPort(), 30001);
+
+    /* the devices take the free ports in sorted order */
+    close(open((base + "/disk_b").c_str(), O_CREAT | O_WRONLY, 0644));
+    close(open((base + "/disk_a").c_str(), O_CREAT | O_WRONLY, 0644));
+    records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 3);
+    CPPUNIT_ASSERT_EQUAL(bindings[base + "/disk_a"], 30000);
+    CPPUNIT_ASSERT_EQUAL(bindings[base + "/disk_b"], 30002);
+    CPPUNIT_ASSERT(records[1].getDDParameter().compare(std::string("of=") + base + "/disk_a bs=1M")==0);
+
+    /* a device which is gone keeps its port, a new one takes the next */
+    unlink((base + "/disk_a").c_str());
+    close(open((base + "/disk_0").c_str(), O_CREAT | O_WRONLY, 0644));
+    records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 4);
+    CPPUNIT_ASSERT_EQUAL(bindings[base + "/disk_a"], 30000);
+    CPPUNIT_ASSERT_EQUAL(bindings[base + "/disk_0"], 30003);
+
+    /* the range is full, the device which is gone gives up its port */
+    close(open((base + "/disk_c").c_str(), O_CREAT | O_WRONLY, 0644));
+    records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 4);
+    CPPUNIT_ASSERT(bindings.find(base + "/disk_a") == bindings.end());
+    CPPUNIT_ASSERT_EQUAL(bindings[base + "/disk_c"], 30000);
+
+    /* the range is full and every device is there */
+    close(open((base + "/disk_d").c_str(), O_CREAT | O_WRONLY, 0644));
+    records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 4);
+    CPPUNIT_ASSERT(bindings.find(base + "/disk_d") == bindings.end());
+
+    /* the bindings of a pattern which is removed are dropped */
+    config.erase(config.begin());
+    records = expandConfig(config, bindings);
+    CPPUNIT_ASSERT_EQUAL((int)records.size(), 1);
+    CPPUNIT_ASSERT(bindings.empty());
+
+    unlink((base + "/disk_0").c_str());
+    unlink((base + "/disk_b").c_str());
+    unlink((base + "/disk_c").c_str());
+    unlink((base + "/disk_d").c_str());
+    rmdir(dir);
+  }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETConfigReaderTest);
@@ -0,0 +1,117 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../decompress.h"
+
+volatile int quitFlag = 0;
+
+class UMS2NETDecompressTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETDecompressTest);
+  CPPUNIT_TEST(testParseCompression);
+  CPPUNIT_TEST(testDetectCompression);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for parseCompression() function
+   */
+  void testParseCompression() {
+    int compression = COMP_NONE;
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("auto"), &compression), 1);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_AUTO);
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("none"), &compression), 1);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_NONE);
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("gzip"), &compression), 1);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_GZIP);
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("xz"), &compression), 1);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_XZ);
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("zstd"), &compression), 1);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_ZSTD);
+
+    compression = COMP_GZIP;
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string(""), &compression), 0);
+    CPPUNIT_ASSERT_EQUAL(parseCompression(std::string("bzip2"), &compression), 0);
+    CPPUNIT_ASSERT_EQUAL(compression, (int)COMP_GZIP);
+  }
+
+  /**
+   * test for detectCompression() function
+   */
+  void testDetectCompression() {
+    const unsigned char gzip[] = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00 };
+    const unsigned char xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+    const unsigned char zstd[] = { 0x28, 0xb5, 0x2f, 0xfd, 0x04, 0x00 };
+    const unsigned char raw[] = { 0xeb, 0x3c, 0x90, 'm', 'k', 'f' };
+
+    CPPUNIT_ASSERT_EQUAL(detectCompression(gzip, sizeof(gzip)), (int)COMP_GZIP);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(xz, sizeof(xz)), (int)COMP_XZ);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(zstd, sizeof(zstd)), (int)COMP_ZSTD);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(raw, sizeof(raw)), (int)COMP_NONE);
+
+    /* too short to hold the whole magic number */
+    CPPUNIT_ASSERT_EQUAL(detectCompression(gzip, 1), (int)COMP_NONE);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(xz, 5), (int)COMP_NONE);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(zstd, 3), (int)COMP_NONE);
+    CPPUNIT_ASSERT_EQUAL(detectCompression(raw, 0), (int)COMP_NONE);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETDecompressTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../deviceManager.h"
+#include "../metrics.h"
+
+volatile int quitFlag = 0;
+
+/**
+ * create a file after a delay. It is renamed into place, as udev makes
+ * its links.
+ */
+static void* createLater(void *data) {
+  std::string path((const char *)(data));
+  std::string tmpPath = path + ".tmp";
+  usleep(200000);
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    ssize_t w1 = write(fd, "0123456789", 10);
+    (void)w1;
+    close(fd);
+    rename(tmpPath.c_str(), path.c_str());
+  }
+  return NULL;
+}
+
+class UMS2NETDeviceManagerTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETDeviceManagerTest);
+  CPPUNIT_TEST(testWaitForDevice);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char dirTemplate[64];
+  std::string present;
+  std::string late;
+  std::string missing;
+
+public:
+  void setUp() {
+    strcpy(dirTemplate, "/tmp/ums2net-devices-XXXXXX");
+    CPPUNIT_ASSERT(mkdtemp(dirTemplate) != NULL);
+    present = std::string(dirTemplate) + "/present";
+    late = std::string(dirTemplate) + "/late";
+    missing = std::string(dirTemplate) + "/missing";
+    int fd = open(present.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(write(fd, "01234", 5), (ssize_t)5);
+    close(fd);
+  }
+
+  void tearDown() {
+    unlink(present.c_str());
+    unlink(late.c_str());
+    rmdir(dirTemplate);
+  }
+
+protected:
+  /**
+   * test for deviceManagerOpen() function
+   */
+  void testWaitForDevice() {
+    std::vector<std::string> paths;
+    paths.push_back(present);
+    paths.push_back(late);
+    paths.push_back(missing);
+    CPPUNIT_ASSERT_EQUAL(deviceManagerStart(), 0);
+    deviceManagerWatch(paths);
+
+    /* a present device is opened at once, with its information */
+    DeviceInfo info;
+    int fd = deviceManagerOpen(present, O_RDWR, 0, &info);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(info.size, 5LL);
+    CPPUNIT_ASSERT_EQUAL(info.usbSpeed, 0);
+    /* each open has its own file position */
+    int fd2 = deviceManagerOpen(present, O_RDONLY, 0, &info);
+    CPPUNIT_ASSERT(fd2 >= 0);
+    CPPUNIT_ASSERT_EQUAL(lseek(fd, 3, SEEK_SET), (off_t)3);
+    CPPUNIT_ASSERT_EQUAL(lseek(fd2, 0, SEEK_CUR), (off_t)0);
+    close(fd);
+    close(fd2);
+
+    /* a missing device is not waited for without a timeout */
+    CPPUNIT_ASSERT_EQUAL(deviceManagerOpen(missing, O_RDWR, 0, &info), -1);
+    CPPUNIT_ASSERT_EQUAL(errno, ENOENT);
+
+    /* a device which appears while the client waits */
+    pthread_t thread;
+    pthread_create(&thread, NULL, createLater, (void *)late.c_str());
+    long long start = metricsNow();
+    fd = deviceManagerOpen(late, O_RDWR, 5000, &info);
+    long long waited = metricsNow() - start;
+    pthread_join(thread, NULL);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(info.size, 10LL);
+    CPPUNIT_ASSERT(waited >= 150000000LL);
+    CPPUNIT_ASSERT(waited < 1500000000LL);
+    close(fd);
+
+    /* the wait ends at the timeout */
+    start = metricsNow();
+    CPPUNIT_ASSERT_EQUAL(deviceManagerOpen(missing, O_RDWR, 300, &info), -1);
+    CPPUNIT_ASSERT_EQUAL(errno, ENOENT);
+    CPPUNIT_ASSERT(metricsNow() - start >= 290000000LL);
+
+    /* a removed device is gone */
+    unlink(present.c_str());
+    usleep(200000);
+    CPPUNIT_ASSERT_EQUAL(deviceManagerOpen(present, O_RDWR, 0, &info), -1);
+
+    /* a device which is no longer watched is not waited for */
+    paths.pop_back();
+    deviceManagerWatch(paths);
+    start = metricsNow();
+    CPPUNIT_ASSERT_EQUAL(deviceManagerOpen(missing, O_RDWR, 300, &info), -1);
+    CPPUNIT_ASSERT(metricsNow() - start < 200000000LL);
+    deviceManagerStop();
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETDeviceManagerTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../copyEngine.h"
+#include "../metrics.h"
+
+volatile int quitFlag = 0;
+
+#define BLOCK_SIZE 65536
+/* not a multiple of any logical block size */
+#define DATA_SIZE (BLOCK_SIZE*3 + 1234)
+
+/**
+ * The client side of a copy.
+ */
+struct Sender {
+  int fd; ///< the client end of the socket pair
+  const char *buf; ///< the data to send
+  size_t len; ///< the length of the data
+};
+
+/**
+ * send the data and close the socket, as a client does.
+ *
+ * @param data the pointer of Sender
+ *
+ * @return NULL.
+ */
+static void* senderThread(void *data) {
+  Sender *s = (Sender *)(data);
+  size_t done = 0;
+  while (done < s->len) {
+    ssize_t w1 = write(s->fd, s->buf + done, s->len - done);
+    if (w1 <= 0) {
+      break;
+    }
+    done += (size_t)w1;
+  }
+  close(s->fd);
+  return NULL;
+}
+
+class UMS2NETDirectEngineTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETDirectEngineTest);
+  CPPUNIT_TEST(testGetLogicalBlockSize);
+  CPPUNIT_TEST(testDirect);
+  CPPUNIT_TEST(testBuffered);
+  CPPUNIT_TEST(testShortImage);
+  CPPUNIT_TEST(testMetrics);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  char data[DATA_SIZE];
+
+  /**
+   * copy the first len bytes of data to the device with copyDirect().
+   *
+   * @param flags the flags the device is opened with.
+   * @param len the length of the image.
+   * @param outFD set to the device, which is left open.
+   *
+   * @return what copyDirect() returns.
+   */
+  ssize_t copy(int flags, size_t len, int *outFD) {
+    int fds[2];
+    pthread_t sender;
+    Sender s;
+    *outFD = open(devname, O_RDWR | O_TRUNC | flags);
+    CPPUNIT_ASSERT(*outFD >= 0);
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    s.fd = fds[1];
+    s.buf = data;
+    s.len = len;
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&sender, NULL, senderThread, &s), 0);
+    int error = -1;
+    ssize_t totalLen = copyDirect(fds[0], *outFD, BLOCK_SIZE, 2, NULL, &error);
+    pthread_join(sender, NULL);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    close(fds[0]);
+    return totalLen;
+  }
+
+  /**
+   * check that the device holds exactly the first len bytes of data.
+   */
+  void checkDevice(size_t len) {
+    char buf[DATA_SIZE+1];
+    struct stat statbuf;
+    CPPUNIT_ASSERT_EQUAL(stat(devname, &statbuf), 0);
+    CPPUNIT_ASSERT_EQUAL(statbuf.st_size, (off_t)len);
+    int fd = open(devname, O_RDONLY);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(read(fd, buf, sizeof(buf)), (ssize_t)len);
+    close(fd);
+    CPPUNIT_ASSERT(memcmp(buf, data, len) == 0);
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-DirectEngine-XXXXXX");
+    close(mkstemp(devname));
+    for (int i=0; i<DATA_SIZE; i++) {
+      data[i] = (char)(i*13 + i/4096);
+    }
+  }
+
+  void tearDown() {
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for getLogicalBlockSize() function
+   */
+  void testGetLogicalBlockSize() {
+    int fd = open(devname, O_RDONLY);
+    /* regular files are written in pages */
+    CPPUNIT_ASSERT_EQUAL(getLogicalBlockSize(fd), 4096);
+    close(fd);
+  }
+
+  /**
+   * test copyDirect() with O_DIRECT and a tail which is not aligned
+   */
+  void testDirect() {
+    int outFD;
+    int fd = open(devname, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+      /* the file system has no O_DIRECT, covered by testBuffered() */
+      return;
+    }
+    close(fd);
+    CPPUNIT_ASSERT_EQUAL(copy(O_DIRECT, DATA_SIZE, &outFD), (ssize_t)DATA_SIZE);
+    /* O_DIRECT is turned off for the tail only */
+    CPPUNIT_ASSERT_EQUAL(fcntl(outFD, F_GETFL) & O_DIRECT, 0);
+    close(outFD);
+    checkDevice(DATA_SIZE);
+  }
+
+  /**
+   * test copyDirect() on a device opened without O_DIRECT
+   */
+  void testBuffered() {
+    int outFD;
+    CPPUNIT_ASSERT_EQUAL(copy(0, DATA_SIZE, &outFD), (ssize_t)DATA_SIZE);
+    close(outFD);
+    checkDevice(DATA_SIZE);
+  }
+
+  /**
+   * test images which fit in one buffer or end on a block boundary
+   */
+  void testShortImage() {
+    int outFD;
+    int flags = O_DIRECT;
+    int fd = open(devname, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+      flags = 0;
+    } else {
+      close(fd);
+    }
+    CPPUNIT_ASSERT_EQUAL(copy(flags, 100, &outFD), (ssize_t)100);
+    close(outFD);
+    checkDevice(100);
+
+    CPPUNIT_ASSERT_EQUAL(copy(flags, BLOCK_SIZE*2, &outFD), (ssize_t)(BLOCK_SIZE*2));
+    /* no tail, so O_DIRECT is kept */
+    CPPUNIT_ASSERT_EQUAL(fcntl(outFD, F_GETFL) & O_DIRECT, flags);
+    close(outFD);
+    checkDevice(BLOCK_SIZE*2);
+
+    CPPUNIT_ASSERT_EQUAL(copy(flags, 0, &outFD), (ssize_t)0);
+    close(outFD);
+    checkDevice(0);
+  }
+
+  /**
+   * test that the writer thread counts into the metrics of the session
+   */
+  void testMetrics() {
+    int outFD;
+    SessionMetrics sm;
+    memset(&sm, 0, sizeof(sm));
+    sessionMetrics = &sm;
+    CPPUNIT_ASSERT_EQUAL(copy(0, DATA_SIZE, &outFD), (ssize_t)DATA_SIZE);
+    sessionMetrics = NULL;
+    close(outFD);
+    CPPUNIT_ASSERT_EQUAL(sm.bytesReceived, (long long)DATA_SIZE);
+    CPPUNIT_ASSERT_EQUAL(sm.bytesWritten, (long long)DATA_SIZE);
+    /* three full buffers and the tail */
+    CPPUNIT_ASSERT_EQUAL(sm.writes, 4LL);
+    long long bucketed = 0;
+    for (int i=0; i<METRICS_LATENCY_BUCKETS; i++) {
+      bucketed += sm.latency[i];
+    }
+    CPPUNIT_ASSERT_EQUAL(bucketed, 4LL);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETDirectEngineTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,273 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../fanOut.h"
+
+volatile int quitFlag = 0;
+
+#define DATA_SIZE (1024*1024 + 1234)
+
+/**
+ * The client side of a fan-out session.
+ */
+struct FanOutClient {
+  int fd; ///< the client end of the socket pair
+  const char *buf; ///< the data to send
+  size_t len; ///< the length of the data
+  std::string reply; ///< what the server answers
+};
+
+/**
+ * send the data, close the sending side and read the reply.
+ *
+ * @param data the pointer of FanOutClient
+ *
+ * @return NULL.
+ */
+static void* fanOutClientThread(void *data) {
+  FanOutClient *c = (FanOutClient *)(data);
+  size_t done = 0;
+  while (done < c->len) {
+    ssize_t w1 = write(c->fd, c->buf + done, c->len - done);
+    if (w1 <= 0) {
+      break;
+    }
+    done += (size_t)w1;
+  }
+  shutdown(c->fd, SHUT_WR);
+  char buf[256];
+  ssize_t r1;
+  while ((r1 = read(c->fd, buf, sizeof(buf))) > 0) {
+    c->reply.append(buf, (size_t)r1);
+  }
+  close(c->fd);
+  return NULL;
+}
+
+class UMS2NETFanOutTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETFanOutTest);
+  CPPUNIT_TEST(testParseLagPolicy);
+  CPPUNIT_TEST(testTwoFiles);
+  CPPUNIT_TEST(testMissingDevice);
+  CPPUNIT_TEST(testDropSlowDevice);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname1;
+  char *devname2;
+  char data[DATA_SIZE];
+  std::map<std::string, std::string> ddParameters;
+
+  /**
+   * send the data through fanOutServant().
+   *
+   * @param devFilenames the devices.
+   *
+   * @return the reply of the server.
+   */
+  std::string fanOut(const std::vector<std::string> &devFilenames) {
+    int fds[2];
+    pthread_t thread;
+    FanOutClient c;
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    c.fd = fds[1];
+    c.buf = data;
+    c.len = DATA_SIZE;
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&thread, NULL, fanOutClientThread, &c), 0);
+    fanOutServant(fds[0], devFilenames, ddParameters);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return c.reply;
+  }
+
+  /**
+   * check that a file holds exactly the data.
+   */
+  void checkDevice(const char *devname) {
+    std::string content;
+    char buf[65536];
+    ssize_t r1;
+    int fd = open(devname, O_RDONLY);
+    CPPUNIT_ASSERT(fd >= 0);
+    while ((r1 = read(fd, buf, sizeof(buf))) > 0) {
+      content.append(buf, (size_t)r1);
+    }
+    close(fd);
+    CPPUNIT_ASSERT_EQUAL(content.length(), (size_t)DATA_SIZE);
+    CPPUNIT_ASSERT(memcmp(content.data(), data, DATA_SIZE) == 0);
+  }
+
+  /**
+   * the report line of a device which got all the data.
+   */
+  std::string okLine(const char *devname) {
+    return std::string("ums2net: ") + devname + " " + std::to_string(DATA_SIZE) + " bytes ok\n";
+  }
+
+public:
+  void setUp() {
+    devname1 = strdup("ums2net-testUMS2NET-FanOut-XXXXXX");
+    close(mkstemp(devname1));
+    devname2 = strdup("ums2net-testUMS2NET-FanOut-XXXXXX");
+    close(mkstemp(devname2));
+    for (int i=0; i<DATA_SIZE; i++) {
+      data[i] = (char)(i*7 + i/4096);
+    }
+    ddParameters.clear();
+    ddParameters[std::string("bs")] = std::string("4096");
+    ddParameters[std::string("nbuf")] = std::string("4");
+    ddParameters[std::string("comp")] = std::string("none");
+    ddParameters[std::string("format")] = std::string("raw");
+  }
+
+  void tearDown() {
+    unlink(devname1);
+    free(devname1);
+    unlink(devname2);
+    free(devname2);
+  }
+
+protected:
+  /**
+   * test for parseLagPolicy() function
+   */
+  void testParseLagPolicy() {
+    int policy = -1;
+    CPPUNIT_ASSERT_EQUAL(parseLagPolicy(std::string("wait"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)LAG_WAIT);
+    CPPUNIT_ASSERT_EQUAL(parseLagPolicy(std::string("drop"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)LAG_DROP);
+    CPPUNIT_ASSERT_EQUAL(parseLagPolicy(std::string("fast"), &policy), 0);
+  }
+
+  /**
+   * test two files written from one stream
+   */
+  void testTwoFiles() {
+    std::vector<std::string> devFilenames;
+    devFilenames.push_back(std::string(devname1));
+    devFilenames.push_back(std::string(devname2));
+    std::string reply = fanOut(devFilenames);
+    CPPUNIT_ASSERT(reply.compare(okLine(devname1) + okLine(devname2)) == 0);
+    checkDevice(devname1);
+    checkDevice(devname2);
+  }
+
+  /**
+   * test a device which cannot be opened, the other one is still written
+   */
+  void testMissingDevice() {
+    std::vector<std::string> devFilenames;
+    devFilenames.push_back(std::string(devname1));
+    devFilenames.push_back(std::string("ums2net-testUMS2NET-FanOut-missing"));
+    std::string reply = fanOut(devFilenames);
+    CPPUNIT_ASSERT(reply.compare(okLine(devname1) + "ums2net: ums2net-testUMS2NET-FanOut-missing 0 bytes failed\n") == 0);
+    checkDevice(devname1);
+  }
+
+  /**
+   * test lag=drop with a device which stops taking data. Its thread is
+   * stuck in write(), so it is detached and ends on its own after the
+   * session is reported.
+   */
+  void testDropSlowDevice() {
+    /* a FIFO nobody reads blocks its writer once the pipe is full */
+    unlink(devname2);
+    CPPUNIT_ASSERT_EQUAL(mkfifo(devname2, 0600), 0);
+    ddParameters[std::string("lag")] = std::string("drop");
+    ddParameters[std::string("lagtime")] = std::string("1");
+    std::vector<std::string> devFilenames;
+    devFilenames.push_back(std::string(devname1));
+    devFilenames.push_back(std::string(devname2));
+    std::string reply = fanOut(devFilenames);
+
+    std::string line1 = okLine(devname1);
+    CPPUNIT_ASSERT(reply.compare(0, line1.length(), line1) == 0);
+    std::string line2 = reply.substr(line1.length());
+    std::string prefix2 = std::string("ums2net: ") + devname2 + " ";
+    std::string suffix2(" bytes dropped\n");
+    CPPUNIT_ASSERT(line2.compare(0, prefix2.length(), prefix2) == 0);
+    CPPUNIT_ASSERT(line2.length() > prefix2.length() + suffix2.length());
+    CPPUNIT_ASSERT(line2.compare(line2.length() - suffix2.length(), suffix2.length(), suffix2) == 0);
+    long long reported = atoll(line2.c_str() + prefix2.length());
+    CPPUNIT_ASSERT(reported < DATA_SIZE);
+    checkDevice(devname1);
+
+    /* unblock the detached thread; the pipe ends when it closes the device */
+    std::string drained;
+    char buf[65536];
+    ssize_t r1;
+    int fd = open(devname2, O_RDONLY);
+    CPPUNIT_ASSERT(fd >= 0);
+    while ((r1 = read(fd, buf, sizeof(buf))) > 0) {
+      drained.append(buf, (size_t)r1);
+    }
+    close(fd);
+    CPPUNIT_ASSERT((long long)drained.length() >= reported);
+    CPPUNIT_ASSERT(drained.length() < (size_t)DATA_SIZE);
+    /* the block being written was kept out of the ring, so it is intact */
+    CPPUNIT_ASSERT(memcmp(drained.data(), data, drained.length()) == 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETFanOutTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
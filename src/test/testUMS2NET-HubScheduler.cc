@@ -0,0 +1,196 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <map>
+#include <cstring>
+#include <unistd.h>
+#include <pthread.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../hubScheduler.h"
+#include "../metrics.h"
+
+volatile int quitFlag = 0;
+
+/**
+ * the arguments of a session which writes a device behind a hub.
+ */
+struct FakeSession {
+  DeviceInfo *info;
+  std::map<std::string, std::string> *ddParameters;
+  long long started;
+};
+
+/**
+ * a session which holds its slot on the hub for a while.
+ */
+static void* fakeSession(void *data) {
+  FakeSession *s = (FakeSession *)data;
+  HubGroup *group = hubSchedulerJoin(std::string("/dev/fake"), s->info, *s->ddParameters);
+  s->started = metricsNow();
+  usleep(200000);
+  hubSchedulerLeave(group);
+  return NULL;
+}
+
+class UMS2NETHubSchedulerTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETHubSchedulerTest);
+  CPPUNIT_TEST(testParseHubGrouping);
+  CPPUNIT_TEST(testNotScheduled);
+  CPPUNIT_TEST(testGroups);
+  CPPUNIT_TEST(testMaxSessions);
+  CPPUNIT_TEST(testRate);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  DeviceInfo info;
+
+public:
+  void setUp() {
+    memset(&info, 0, sizeof(info));
+    info.usbSpeed = 480;
+    info.hubSpeed = 480;
+    strcpy(info.usbHub, "2-1");
+    strcpy(info.usbBus, "usb2");
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for parseHubGrouping() function
+   */
+  void testParseHubGrouping() {
+    int grouping = -1;
+    CPPUNIT_ASSERT_EQUAL(parseHubGrouping(std::string("hub"), &grouping), 1);
+    CPPUNIT_ASSERT_EQUAL(grouping, (int)HUB_GROUP_HUB);
+    CPPUNIT_ASSERT_EQUAL(parseHubGrouping(std::string("bus"), &grouping), 1);
+    CPPUNIT_ASSERT_EQUAL(grouping, (int)HUB_GROUP_BUS);
+    CPPUNIT_ASSERT_EQUAL(parseHubGrouping(std::string("port"), &grouping), 0);
+  }
+
+  /**
+   * test that the writes are not scheduled without hubmax= or hubrate=
+   */
+  void testNotScheduled() {
+    std::map<std::string, std::string> ddParameters;
+    CPPUNIT_ASSERT(hubSchedulerJoin(std::string("/dev/fake"), &info, ddParameters) == NULL);
+    CPPUNIT_ASSERT(hubGroup == NULL);
+    ddParameters[std::string("hubmax")] = std::string("1");
+    DeviceInfo notUSB;
+    memset(&notUSB, 0, sizeof(notUSB));
+    CPPUNIT_ASSERT(hubSchedulerFind(std::string("/dev/fake"), &notUSB, ddParameters) == NULL);
+  }
+
+  /**
+   * test that the devices are grouped by hub or by bus
+   */
+  void testGroups() {
+    std::map<std::string, std::string> ddParameters;
+    ddParameters[std::string("hubrate")] = std::string("1G");
+    HubGroup *byHub = hubSchedulerFind(std::string("/dev/fake"), &info, ddParameters);
+    CPPUNIT_ASSERT(byHub != NULL);
+    CPPUNIT_ASSERT(byHub->name.compare(std::string("2-1")) == 0);
+    ddParameters[std::string("hubgroup")] = std::string("bus");
+    HubGroup *byBus = hubSchedulerFind(std::string("/dev/fake"), &info, ddParameters);
+    CPPUNIT_ASSERT(byBus != NULL);
+    CPPUNIT_ASSERT(byBus->name.compare(std::string("usb2")) == 0);
+    CPPUNIT_ASSERT_EQUAL(byBus->rate, 1024LL*1024LL*1024LL);
+  }
+
+  /**
+   * test that at most hubmax= sessions write at once, in order
+   */
+  void testMaxSessions() {
+    std::map<std::string, std::string> ddParameters;
+    ddParameters[std::string("hubmax")] = std::string("1");
+    strcpy(info.usbHub, "3-1");
+    FakeSession sessions[3];
+    pthread_t threads[3];
+    for (int i=0; i<3; i++) {
+      sessions[i].info = &info;
+      sessions[i].ddParameters = &ddParameters;
+      sessions[i].started = 0;
+      CPPUNIT_ASSERT_EQUAL(pthread_create(&threads[i], NULL, fakeSession, &sessions[i]), 0);
+      usleep(20000);
+    }
+    for (int i=0; i<3; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    CPPUNIT_ASSERT(sessions[1].started - sessions[0].started >= 190000000LL);
+    CPPUNIT_ASSERT(sessions[2].started - sessions[1].started >= 190000000LL);
+  }
+
+  /**
+   * test that the writes of a group share hubrate=
+   */
+  void testRate() {
+    std::map<std::string, std::string> ddParameters;
+    ddParameters[std::string("hubrate")] = std::string("4M");
+    strcpy(info.usbHub, "4-1");
+    HubGroup *group = hubSchedulerJoin(std::string("/dev/fake"), &info, ddParameters);
+    CPPUNIT_ASSERT(group != NULL);
+    CPPUNIT_ASSERT(hubGroup == group);
+    long long start = metricsNow();
+    for (int i=0; i<8; i++) {
+      hubThrottle(256*1024);
+    }
+    long long elapsed = metricsNow() - start;
+    /* 2M at 4M/s, less the quarter second burst the bucket is not full */
+    CPPUNIT_ASSERT(elapsed >= 400000000LL);
+    CPPUNIT_ASSERT(elapsed < 1000000000LL);
+    hubSchedulerLeave(group);
+    CPPUNIT_ASSERT(hubGroup == NULL);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETHubSchedulerTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../ioSize.h"
+
+class UMS2NETIOSizeTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETIOSizeTest);
+  CPPUNIT_TEST(testChooseIOSize);
+  CPPUNIT_TEST(testIOSizerGrow);
+  CPPUNIT_TEST(testIOSizerSettle);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for chooseIOSize() function
+   */
+  void testChooseIOSize() {
+    DeviceTopology t;
+    memset(&t, 0, sizeof(t));
+    /* nothing known */
+    CPPUNIT_ASSERT_EQUAL(chooseIOSize(&t), IO_SIZE_DEFAULT);
+    /* a USB stick with 240 KiB requests */
+    t.logicalBlockSize = 512;
+    t.physicalBlockSize = 512;
+    t.maxIOSize = 240*1024;
+    CPPUNIT_ASSERT_EQUAL(chooseIOSize(&t), 4*240*1024);
+    /* a RAID with a large stripe */
+    t.maxIOSize = 1024*1024;
+    t.optimalIOSize = 4*1024*1024;
+    CPPUNIT_ASSERT_EQUAL(chooseIOSize(&t), 4*1024*1024);
+    /* an odd physical block size */
+    memset(&t, 0, sizeof(t));
+    t.physicalBlockSize = 3000;
+    CPPUNIT_ASSERT_EQUAL(chooseIOSize(&t) % 3000, 0);
+    CPPUNIT_ASSERT(chooseIOSize(&t) >= IO_SIZE_DEFAULT);
+  }
+
+  /**
+   * test for ioSizerUpdate() function with a device which is faster with
+   * larger writes
+   */
+  void testIOSizerGrow() {
+    IOSizer s;
+    ioSizerInit(&s, 1024*1024, 4*1024*1024);
+    CPPUNIT_ASSERT_EQUAL(s.settled, 0);
+    for (int i=0; i<64; i++) {
+      ioSizerUpdate(&s, 1024*1024, 10000000);
+    }
+    CPPUNIT_ASSERT_EQUAL(s.size, 2*1024*1024);
+    for (int i=0; i<64; i++) {
+      ioSizerUpdate(&s, 2*1024*1024, 10000000);
+    }
+    CPPUNIT_ASSERT_EQUAL(s.size, 4*1024*1024);
+    for (int i=0; i<64; i++) {
+      ioSizerUpdate(&s, 4*1024*1024, 10000000);
+    }
+    /* cannot grow any further */
+    CPPUNIT_ASSERT_EQUAL(s.settled, 1);
+    CPPUNIT_ASSERT_EQUAL(s.size, 4*1024*1024);
+  }
+
+  /**
+   * test for ioSizerUpdate() function with a device which does not gain
+   * from larger writes
+   */
+  void testIOSizerSettle() {
+    IOSizer s;
+    ioSizerInit(&s, 1024*1024, 16*1024*1024);
+    for (int i=0; i<64; i++) {
+      ioSizerUpdate(&s, 1024*1024, 10000000);
+    }
+    CPPUNIT_ASSERT_EQUAL(s.size, 2*1024*1024);
+    for (int i=0; i<64; i++) {
+      ioSizerUpdate(&s, 2*1024*1024, 20000000);
+    }
+    CPPUNIT_ASSERT_EQUAL(s.settled, 1);
+    CPPUNIT_ASSERT_EQUAL(s.size, 1024*1024);
+    CPPUNIT_ASSERT_EQUAL(ioSizerUpdate(&s, 1024*1024, 1), 1024*1024);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETIOSizeTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../imageFormat.h"
+
+volatile int quitFlag = 0;
+
+class UMS2NETImageFormatTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETImageFormatTest);
+  CPPUNIT_TEST(testParseImageFormat);
+  CPPUNIT_TEST(testDetectImageFormat);
+  CPPUNIT_TEST(testParseSparseHeader);
+  CPPUNIT_TEST(testParseBmap);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for parseImageFormat() function
+   */
+  void testParseImageFormat() {
+    int format = FORMAT_RAW;
+    CPPUNIT_ASSERT_EQUAL(parseImageFormat(std::string("auto"), &format), 1);
+    CPPUNIT_ASSERT_EQUAL(format, (int)FORMAT_AUTO);
+    CPPUNIT_ASSERT_EQUAL(parseImageFormat(std::string("raw"), &format), 1);
+    CPPUNIT_ASSERT_EQUAL(format, (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(parseImageFormat(std::string("sparse"), &format), 1);
+    CPPUNIT_ASSERT_EQUAL(format, (int)FORMAT_SPARSE);
+    CPPUNIT_ASSERT_EQUAL(parseImageFormat(std::string("bmap"), &format), 1);
+    CPPUNIT_ASSERT_EQUAL(format, (int)FORMAT_BMAP);
+    CPPUNIT_ASSERT_EQUAL(parseImageFormat(std::string("simg"), &format), 0);
+    CPPUNIT_ASSERT_EQUAL(format, (int)FORMAT_BMAP);
+  }
+
+  /**
+   * test for detectImageFormat() function
+   */
+  void testDetectImageFormat() {
+    const unsigned char sparse[] = { 0x3a, 0xff, 0x26, 0xed, 0x01 };
+    const unsigned char raw[] = { 0xeb, 0x3c, 0x90, 'm', 'k' };
+    CPPUNIT_ASSERT_EQUAL(detectImageFormat(sparse, sizeof(sparse)), (int)FORMAT_SPARSE);
+    CPPUNIT_ASSERT_EQUAL(detectImageFormat(raw, sizeof(raw)), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectImageFormat(sparse, 3), (int)FORMAT_RAW);
+
+    /* as bmaptool writes it */
+    std::string bmap("<?xml version=\"1.0\" ?>\n"
+		     "<!-- This file contains the block map for an image file -->\n"
+		     "<!-- and a second comment -->\n"
+		     "<bmap version=\"2.0\">\n"
+		     "  <ImageSize> 821752 </ImageSize>\n");
+    CPPUNIT_ASSERT_EQUAL(detectBmap(bmap), (int)FORMAT_BMAP);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<bmap version=\"1.4\">")), (int)FORMAT_BMAP);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("\n<bmap\n  version=\"1.4\">")), (int)FORMAT_BMAP);
+
+    /* other XML, or the start of a bmap which is cut short, is raw */
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<?xml")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<?xml version=\"1.0\"?><svg version=\"1.1\">")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<?xml version=\"1.0\"?><!-- <bmap version=\"2.0\"> --><x/>")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<?xml version=\"1.0\"?><!-- comment")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<bmap>")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<bmapx version=\"2.0\">")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(std::string("<bmap ")), (int)FORMAT_RAW);
+    CPPUNIT_ASSERT_EQUAL(detectBmap(bmap.substr(0, 100)), (int)FORMAT_RAW);
+  }
+
+  /**
+   * call detectImageFormat() with the bytes of a string.
+   */
+  int detectBmap(const std::string &head) {
+    return detectImageFormat((const unsigned char *)head.data(), head.length());
+  }
+
+  /**
+   * test for parseSparseHeader() and parseSparseChunkHeader() functions
+   */
+  void testParseSparseHeader() {
+    unsigned char buf[SPARSE_HEADER_SIZE] = {
+      0x3a, 0xff, 0x26, 0xed, 0x01, 0x00, 0x00, 0x00,
+      0x1c, 0x00, 0x0c, 0x00, 0x00, 0x10, 0x00, 0x00,
+      0x00, 0x01, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00,
+    };
+    SparseHeader header;
+    CPPUNIT_ASSERT_EQUAL(parseSparseHeader(buf, &header), 1);
+    CPPUNIT_ASSERT_EQUAL(header.blockSize, (uint32_t)4096);
+    CPPUNIT_ASSERT_EQUAL(header.totalBlocks, (uint32_t)256);
+    CPPUNIT_ASSERT_EQUAL(header.totalChunks, (uint32_t)3);
+
+    /* major version 2 is unknown */
+    buf[4] = 0x02;
+    CPPUNIT_ASSERT_EQUAL(parseSparseHeader(buf, &header), 0);
+    buf[4] = 0x01;
+    /* block size must be a multiple of 4 */
+    buf[12] = 0x02;
+    CPPUNIT_ASSERT_EQUAL(parseSparseHeader(buf, &header), 0);
+
+    const unsigned char chunkBuf[SPARSE_CHUNK_HEADER_SIZE] = {
+      0xc2, 0xca, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+    };
+    SparseChunkHeader chunk;
+    parseSparseChunkHeader(chunkBuf, &chunk);
+    CPPUNIT_ASSERT_EQUAL(chunk.chunkType, (uint16_t)SPARSE_CHUNK_FILL);
+    CPPUNIT_ASSERT_EQUAL(chunk.chunkSize, (uint32_t)5);
+    CPPUNIT_ASSERT_EQUAL(chunk.totalSize, (uint32_t)16);
+  }
+
+  /**
+   * test for parseBmap() function
+   */
+  void testParseBmap() {
+    BmapInfo info;
+    std::string xml("<?xml version=\"1.0\" ?>\n"
+		    "<bmap version=\"2.0\">\n"
+		    "  <ImageSize> 821752 </ImageSize>\n"
+		    "  <BlockSize> 4096 </BlockSize>\n"
+		    "  <BlocksCount> 201 </BlocksCount>\n"
+		    "  <BlockMap>\n"
+		    "    <Range chksum=\"abc\"> 0-1 </Range>\n"
+		    "    <Range chksum=\"def\"> 7 </Range>\n"
+		    "    <Range chksum=\"012\"> 100-200 </Range>\n"
+		    "  </BlockMap>\n"
+		    "</bmap>\n");
+    CPPUNIT_ASSERT_EQUAL(parseBmap(xml, &info), 1);
+    CPPUNIT_ASSERT_EQUAL(info.blockSize, 4096LL);
+    CPPUNIT_ASSERT_EQUAL(info.imageSize, 821752LL);
+    CPPUNIT_ASSERT_EQUAL((int)info.ranges.size(), 3);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[0].first, 0LL);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[0].second, 1LL);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[1].first, 7LL);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[1].second, 7LL);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[2].first, 100LL);
+    CPPUNIT_ASSERT_EQUAL(info.ranges[2].second, 200LL);
+
+    /* no block size */
+    CPPUNIT_ASSERT_EQUAL(parseBmap(std::string("<bmap><BlockMap></BlockMap></bmap>"), &info), 0);
+    /* range goes backwards */
+    CPPUNIT_ASSERT_EQUAL(parseBmap(std::string("<bmap><BlockSize>512</BlockSize><BlockMap><Range>5-4</Range></BlockMap></bmap>"), &info), 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETImageFormatTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../metrics.h"
+
+class UMS2NETMetricsTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETMetricsTest);
+  CPPUNIT_TEST(testSessionMetrics);
+  CPPUNIT_TEST(testMetricsFormat);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  /**
+   * get the value of one line of the metrics.
+   */
+  std::string getValue(const std::string &text, const std::string &name) {
+    std::size_t found = text.find(name + std::string(" "));
+    if (found == std::string::npos) {
+      return std::string("missing");
+    }
+    std::size_t start = found + name.length() + 1;
+    return text.substr(start, text.find('\n', start) - start);
+  }
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for metricsSessionStart() and metricsSessionEnd() functions
+   */
+  void testSessionMetrics() {
+    PortMetrics *pm = metricsRegisterPort(29543, std::string("/dev/sdb"));
+    SessionMetrics sm;
+
+    /* nothing is counted outside a session */
+    metricsAddWrite(100, 1000);
+    metricsSessionStart(pm, &sm);
+    CPPUNIT_ASSERT(sessionMetrics == &sm);
+    metricsAddRecv(4096, 2000);
+    metricsAddWrite(4096, 50000);
+    metricsAddWrite(4096, 2000000);
+    metricsAddBytes(10, 20);
+    metricsError(METRICS_ERROR_WRITE);
+    CPPUNIT_ASSERT_EQUAL(sm.bytesWritten, 8212LL);
+    CPPUNIT_ASSERT_EQUAL(sm.latency[0], 1LL);
+    CPPUNIT_ASSERT_EQUAL(sm.latency[4], 1LL);
+    CPPUNIT_ASSERT_EQUAL((int)pm->live.size(), 1);
+
+    metricsSessionEnd(pm, &sm, 3000000000LL);
+    CPPUNIT_ASSERT(sessionMetrics == NULL);
+    CPPUNIT_ASSERT_EQUAL((int)pm->live.size(), 0);
+    CPPUNIT_ASSERT_EQUAL(pm->done.bytesReceived, 4106LL);
+    CPPUNIT_ASSERT_EQUAL(pm->done.writes, 2LL);
+    CPPUNIT_ASSERT_EQUAL(pm->done.errors[METRICS_ERROR_WRITE], 1LL);
+    CPPUNIT_ASSERT_EQUAL(pm->duration[1], 1LL);
+    CPPUNIT_ASSERT_EQUAL(pm->sessions, 1LL);
+  }
+
+  /**
+   * test for metricsFormat() function
+   */
+  void testMetricsFormat() {
+    PortMetrics *pm = metricsRegisterPort(29544, std::string("/dev/\"odd\""));
+    SessionMetrics sm;
+    metricsSessionStart(pm, &sm);
+    metricsAddWrite(1024, 300000);
+    metricsSetPortState(pm, 1, 2);
+    metricsPortError(pm, METRICS_ERROR_REJECT);
+
+    /* a live session is included */
+    std::string text = metricsFormat();
+    std::string labels("port=\"29544\",device=\"/dev/\\\"odd\\\"\"");
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_written_bytes_total{" + labels + "}"), std::string("1024"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_sessions_active{" + labels + "}"), std::string("1"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_clients_queued{" + labels + "}"), std::string("2"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_errors_total{" + labels + ",type=\"reject\"}"), std::string("1"));
+    /* the buckets are cumulative */
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_write_latency_seconds_bucket{" + labels + ",le=\"0.00025\"}"), std::string("0"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_write_latency_seconds_bucket{" + labels + ",le=\"0.0005\"}"), std::string("1"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_write_latency_seconds_bucket{" + labels + ",le=\"+Inf\"}"), std::string("1"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_write_latency_seconds_count{" + labels + "}"), std::string("1"));
+    metricsSessionEnd(pm, &sm, 1000);
+    text = metricsFormat();
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_written_bytes_total{" + labels + "}"), std::string("1024"));
+    CPPUNIT_ASSERT_EQUAL(getValue(text, "ums2net_session_duration_seconds_count{" + labels + "}"), std::string("1"));
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETMetricsTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
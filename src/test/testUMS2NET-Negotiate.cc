@@ -0,0 +1,250 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../negotiate.h"
+#include "../decompress.h"
+
+volatile int quitFlag = 0;
+
+class UMS2NETNegotiateTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETNegotiateTest);
+  CPPUNIT_TEST(testPushHeader);
+  CPPUNIT_TEST(testRecvPushHeader);
+  CPPUNIT_TEST(testRangeHeader);
+  CPPUNIT_TEST(testCapabilities);
+  CPPUNIT_TEST(testParseCapabilities);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  int devFD;
+
+  /**
+   * get the capabilities of a port as key=value pairs.
+   */
+  std::map<std::string, std::string> getCaps(const std::string &operands, const std::vector<std::string> &devices) {
+    std::map<std::string, std::string> ddParameters;
+    std::map<std::string, std::string> caps;
+    ddParameters[std::string("of")] = devices[0];
+    std::size_t start = 0;
+    while (start < operands.length()) {
+      std::size_t end = operands.find(' ', start);
+      if (end == std::string::npos) {
+	end = operands.length();
+      }
+      std::string word = operands.substr(start, end - start);
+      std::size_t eq = word.find('=');
+      ddParameters[word.substr(0, eq)] = word.substr(eq + 1);
+      start = end + 1;
+    }
+    std::string line = formatCapabilities(ddParameters, devices);
+    CPPUNIT_ASSERT(line.length() > 0 && line[line.length() - 1] == '\n');
+    CPPUNIT_ASSERT_EQUAL(parseCapabilities(line, &caps), 1);
+    return caps;
+  }
+
+public:
+  void setUp() {
+    char buf[4096];
+    memset(buf, 0x5a, sizeof(buf));
+    devname = strdup("ums2net-testUMS2NET-Negotiate-XXXXXX");
+    devFD = mkstemp(devname);
+    for (int i=0; i<16; i++) {
+      if (write(devFD, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+	fprintf(stderr, "Error write to file (%s)", strerror(errno));
+      }
+    }
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for formatPushHeader() and parsePushHeader()
+   */
+  void testPushHeader() {
+    PushHeader header;
+    header.flags = PUSH_STATUS | PUSH_SHA256;
+    header.dataSize = 0x0102030405060708ULL;
+    std::string buf = formatPushHeader(header);
+    CPPUNIT_ASSERT_EQUAL(buf.length(), (size_t)PUSH_HEADER_SIZE);
+    CPPUNIT_ASSERT(buf.compare(0, 8, PUSH_HEADER_MAGIC) == 0);
+    CPPUNIT_ASSERT_EQUAL((int)buf[16], 8);
+
+    PushHeader parsed;
+    CPPUNIT_ASSERT_EQUAL(parsePushHeader((const unsigned char *)buf.c_str(), buf.length(), &parsed), 1);
+    CPPUNIT_ASSERT_EQUAL(parsed.flags, header.flags);
+    CPPUNIT_ASSERT_EQUAL(parsed.dataSize, header.dataSize);
+
+    CPPUNIT_ASSERT_EQUAL(parsePushHeader((const unsigned char *)buf.c_str(), buf.length() - 1, &parsed), 0);
+    buf[0] = 'X';
+    CPPUNIT_ASSERT_EQUAL(parsePushHeader((const unsigned char *)buf.c_str(), buf.length(), &parsed), 0);
+  }
+
+  /**
+   * test that recvPushHeader() takes the header and nothing else
+   */
+  void testRecvPushHeader() {
+    int sv[2];
+    char buf[16];
+    PushHeader header;
+    header.flags = PUSH_STATUS;
+    header.dataSize = 4;
+    std::string stream = formatPushHeader(header) + std::string("data");
+
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    CPPUNIT_ASSERT_EQUAL(write(sv[1], stream.c_str(), stream.length()), (ssize_t)stream.length());
+    close(sv[1]);
+    PushHeader parsed;
+    CPPUNIT_ASSERT_EQUAL(recvPushHeader(sv[0], &parsed), 1);
+    CPPUNIT_ASSERT_EQUAL(parsed.dataSize, (uint64_t)4);
+    CPPUNIT_ASSERT_EQUAL(read(sv[0], buf, sizeof(buf)), (ssize_t)4);
+    CPPUNIT_ASSERT(memcmp(buf, "data", 4) == 0);
+    close(sv[0]);
+
+    /* a plain image is left alone */
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    CPPUNIT_ASSERT_EQUAL(write(sv[1], "0123456789", 10), (ssize_t)10);
+    close(sv[1]);
+    CPPUNIT_ASSERT_EQUAL(recvPushHeader(sv[0], &parsed), 0);
+    CPPUNIT_ASSERT_EQUAL(read(sv[0], buf, sizeof(buf)), (ssize_t)10);
+    close(sv[0]);
+
+    /* a header which is cut short */
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    CPPUNIT_ASSERT_EQUAL(write(sv[1], stream.c_str(), 12), (ssize_t)12);
+    close(sv[1]);
+    CPPUNIT_ASSERT_EQUAL(recvPushHeader(sv[0], &parsed), -1);
+    close(sv[0]);
+  }
+
+  /**
+   * test for formatRangeHeader()
+   */
+  void testRangeHeader() {
+    RangeHeader header;
+    header.uploadId = 0x1122334455667788ULL;
+    header.offset = 4096;
+    header.length = 65536;
+    header.imageSize = 1 << 20;
+    std::string buf = formatRangeHeader(header);
+    CPPUNIT_ASSERT_EQUAL(buf.length(), (size_t)RANGE_HEADER_SIZE);
+    CPPUNIT_ASSERT(buf.compare(0, 8, RANGE_HEADER_MAGIC) == 0);
+    CPPUNIT_ASSERT_EQUAL((unsigned char)buf[8], (unsigned char)0x88);
+    CPPUNIT_ASSERT_EQUAL((unsigned char)buf[17], (unsigned char)0x10);
+    CPPUNIT_ASSERT_EQUAL((unsigned char)buf[26], (unsigned char)0x01);
+    CPPUNIT_ASSERT_EQUAL((unsigned char)buf[34], (unsigned char)0x10);
+  }
+
+  /**
+   * test for formatCapabilities()
+   */
+  void testCapabilities() {
+    std::vector<std::string> devices;
+    devices.push_back(std::string(devname));
+    std::map<std::string, std::string> caps = getCaps(std::string(""), devices);
+    CPPUNIT_ASSERT(caps[std::string("proto")] == std::to_string(CAPS_PROTOCOL_VERSION));
+    CPPUNIT_ASSERT(caps[std::string("devices")] == std::string("1"));
+    CPPUNIT_ASSERT(caps[std::string("size")] == std::string("0"));
+    CPPUNIT_ASSERT(caps[std::string("format")] == std::string("raw,sparse,bmap"));
+    CPPUNIT_ASSERT(caps[std::string("range")] == std::string("0"));
+    CPPUNIT_ASSERT(caps[std::string("resume")] == std::string("0"));
+    CPPUNIT_ASSERT(caps[std::string("checksum")].compare(0, 6, "crc32c") == 0);
+    CPPUNIT_ASSERT(caps[std::string("verify")] == std::string("0"));
+    CPPUNIT_ASSERT(caps[std::string("comp")].compare(0, 4, "none") == 0);
+    if (isCompressionSupported(COMP_GZIP)) {
+      CPPUNIT_ASSERT(caps[std::string("comp")].find("gzip") != std::string::npos);
+    }
+
+    caps = getCaps(std::string("busy=concurrent bs=1M comp=none checkpoint=/tmp verify=yes"), devices);
+    CPPUNIT_ASSERT(caps[std::string("range")] == std::string("1"));
+    CPPUNIT_ASSERT(caps[std::string("iosize")] == std::string("1048576"));
+    CPPUNIT_ASSERT(caps[std::string("comp")] == std::string("none"));
+    CPPUNIT_ASSERT(caps[std::string("resume")] == std::string("1"));
+    CPPUNIT_ASSERT(caps[std::string("verify")] == std::string("1"));
+
+    /* several devices take raw images, and only the configured checksum */
+    devices.push_back(std::string("/nonexistent/ums2net-device"));
+    caps = getCaps(std::string("busy=concurrent"), devices);
+    CPPUNIT_ASSERT(caps[std::string("devices")] == std::string("2"));
+    CPPUNIT_ASSERT(caps[std::string("format")] == std::string("raw"));
+    CPPUNIT_ASSERT(caps[std::string("range")] == std::string("0"));
+    CPPUNIT_ASSERT(caps[std::string("checksum")] == std::string("none"));
+  }
+
+  /**
+   * test for parseCapabilities()
+   */
+  void testParseCapabilities() {
+    std::map<std::string, std::string> caps;
+    CPPUNIT_ASSERT_EQUAL(parseCapabilities(std::string("ums2net: caps proto=1 comp=gzip,xz junk =x\n"), &caps), 1);
+    CPPUNIT_ASSERT_EQUAL(caps.size(), (size_t)2);
+    CPPUNIT_ASSERT(caps[std::string("comp")] == std::string("gzip,xz"));
+    CPPUNIT_ASSERT_EQUAL(parseCapabilities(std::string("ums2net: TCP port 2000 is busy\n"), &caps), 0);
+    CPPUNIT_ASSERT_EQUAL(parseCapabilities(std::string("ums2net: caps devices=1\n"), &caps), 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETNegotiateTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../rangeSet.h"
+
+class UMS2NETRangeSetTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETRangeSetTest);
+  CPPUNIT_TEST(testRangeSetAdd);
+  CPPUNIT_TEST(testRangeSetOverlap);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  RangeSet set;
+
+public:
+  void setUp() {
+    rangeSetInit(&set);
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for rangeSetAdd() function with separate and touching ranges
+   */
+  void testRangeSetAdd() {
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 100, 0), (uint64_t)0);
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 100, 50), (uint64_t)50);
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 0, 50), (uint64_t)100);
+    CPPUNIT_ASSERT_EQUAL((int)set.ranges.size(), 2);
+
+    /* fills the hole and merges all three */
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 50, 50), (uint64_t)150);
+    CPPUNIT_ASSERT_EQUAL((int)set.ranges.size(), 1);
+    CPPUNIT_ASSERT_EQUAL(set.ranges[0], (uint64_t)150);
+
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 150, 10), (uint64_t)160);
+    CPPUNIT_ASSERT_EQUAL((int)set.ranges.size(), 1);
+  }
+
+  /**
+   * test for rangeSetAdd() function with overlapping ranges
+   */
+  void testRangeSetOverlap() {
+    rangeSetAdd(&set, 10, 10);
+    rangeSetAdd(&set, 30, 10);
+    rangeSetAdd(&set, 50, 10);
+    CPPUNIT_ASSERT_EQUAL(set.covered, (uint64_t)30);
+
+    /* the same range again */
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 30, 10), (uint64_t)30);
+    /* inside a range */
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 12, 5), (uint64_t)30);
+    /* over the end of one and the start of the next */
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 15, 20), (uint64_t)40);
+    CPPUNIT_ASSERT_EQUAL((int)set.ranges.size(), 2);
+    /* over everything */
+    CPPUNIT_ASSERT_EQUAL(rangeSetAdd(&set, 0, 100), (uint64_t)100);
+    CPPUNIT_ASSERT_EQUAL((int)set.ranges.size(), 1);
+    CPPUNIT_ASSERT_EQUAL(set.ranges[0], (uint64_t)100);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETRangeSetTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../rangeUpload.h"
+
+volatile int quitFlag = 0;
+
+#define IMAGE_SIZE 100000
+
+/**
+ * The client side of one range.
+ */
+struct RangeClient {
+  int fd; ///< the client end of the socket pair
+  std::string request; ///< the header and the data to send
+  std::string reply; ///< what the server answers
+};
+
+/**
+ * send the request, close the sending side and read the reply.
+ *
+ * @param data the pointer of RangeClient
+ *
+ * @return NULL.
+ */
+static void* rangeClientThread(void *data) {
+  RangeClient *c = (RangeClient *)(data);
+  size_t done = 0;
+  while (done < c->request.length()) {
+    ssize_t w1 = write(c->fd, c->request.data() + done, c->request.length() - done);
+    if (w1 <= 0) {
+      break;
+    }
+    done += (size_t)w1;
+  }
+  shutdown(c->fd, SHUT_WR);
+  char buf[256];
+  ssize_t r1;
+  while ((r1 = read(c->fd, buf, sizeof(buf))) > 0) {
+    c->reply.append(buf, (size_t)r1);
+  }
+  close(c->fd);
+  return NULL;
+}
+
+/**
+ * append a little-endian uint64_t.
+ */
+static void putLE64(std::string *s, uint64_t value) {
+  for (int i=0; i<8; i++) {
+    s->push_back((char)(value >> (i*8)));
+  }
+}
+
+class UMS2NETRangeUploadTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETRangeUploadTest);
+  CPPUNIT_TEST(testParseRangeHeader);
+  CPPUNIT_TEST(testRanges);
+  CPPUNIT_TEST(testDeviceTooSmall);
+  CPPUNIT_TEST(testFailedRange);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  int devFD;
+  char image[IMAGE_SIZE];
+  std::map<std::string, std::string> ddParameters;
+
+  /**
+   * make the header of a range.
+   */
+  std::string rangeHeader(uint64_t uploadId, uint64_t offset, uint64_t length, uint64_t imageSize) {
+    std::string header(RANGE_HEADER_MAGIC);
+    putLE64(&header, uploadId);
+    putLE64(&header, offset);
+    putLE64(&header, length);
+    putLE64(&header, imageSize);
+    return header;
+  }
+
+  /**
+   * send one range through rangeServant().
+   *
+   * @param uploadId the id of the upload.
+   * @param offset the offset of the range.
+   * @param length the length in the header.
+   * @param sent the number of bytes of the range which are sent.
+   * @param deviceSize the size of the device, 0 if it can grow.
+   *
+   * @return the reply of the server.
+   */
+  std::string sendRange(uint64_t uploadId, uint64_t offset, uint64_t length, uint64_t sent, long long deviceSize) {
+    int fds[2];
+    pthread_t thread;
+    RangeClient c;
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    c.fd = fds[1];
+    c.request = rangeHeader(uploadId, offset, length, IMAGE_SIZE) + std::string(image + offset, (size_t)sent);
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&thread, NULL, rangeClientThread, &c), 0);
+    rangeServant(fds[0], devFD, std::string(devname), deviceSize, 4096, ddParameters);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return c.reply;
+  }
+
+  /**
+   * check that the device holds the image from offset for len bytes.
+   */
+  void checkDevice(off_t offset, size_t len) {
+    char buf[IMAGE_SIZE];
+    CPPUNIT_ASSERT_EQUAL(pread(devFD, buf, len, offset), (ssize_t)len);
+    CPPUNIT_ASSERT(memcmp(buf, image + offset, len) == 0);
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-RangeUpload-XXXXXX");
+    devFD = mkstemp(devname);
+    for (int i=0; i<IMAGE_SIZE; i++) {
+      image[i] = (char)(i*31 + i/1000);
+    }
+    ddParameters[std::string("comp")] = std::string("none");
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for parseRangeHeader() function
+   */
+  void testParseRangeHeader() {
+    RangeHeader header;
+    std::string buf = rangeHeader(0x1234, 100, 200, 1000);
+    CPPUNIT_ASSERT_EQUAL(parseRangeHeader((const unsigned char *)buf.data(), buf.length(), &header), 1);
+    CPPUNIT_ASSERT(header.uploadId == 0x1234);
+    CPPUNIT_ASSERT(header.offset == 100);
+    CPPUNIT_ASSERT(header.length == 200);
+    CPPUNIT_ASSERT(header.imageSize == 1000);
+    CPPUNIT_ASSERT_EQUAL(parseRangeHeader((const unsigned char *)buf.data(), buf.length() - 1, &header), 0);
+
+    /* the range must be inside the image */
+    buf = rangeHeader(0x1234, 900, 200, 1000);
+    CPPUNIT_ASSERT_EQUAL(parseRangeHeader((const unsigned char *)buf.data(), buf.length(), &header), 0);
+    buf = rangeHeader(0x1234, 2000, 0, 1000);
+    CPPUNIT_ASSERT_EQUAL(parseRangeHeader((const unsigned char *)buf.data(), buf.length(), &header), 0);
+  }
+
+  /**
+   * test an image written by ranges in any order
+   */
+  void testRanges() {
+    CPPUNIT_ASSERT(sendRange(1, 60000, 40000, 40000, IMAGE_SIZE)
+		   .compare("ums2net: range 60000+40000 ok, 40000 of 100000 bytes\n") == 0);
+    CPPUNIT_ASSERT(sendRange(1, 0, 60000, 60000, IMAGE_SIZE)
+		   .compare("ums2net: range 0+60000 ok, 100000 of 100000 bytes, image complete\n") == 0);
+    checkDevice(0, IMAGE_SIZE);
+  }
+
+  /**
+   * test an image which is larger than the device
+   */
+  void testDeviceTooSmall() {
+    CPPUNIT_ASSERT(sendRange(2, 0, 1000, 1000, IMAGE_SIZE - 1)
+		   .compare("ums2net: range 0+1000 rejected, the image does not fit the device\n") == 0);
+    struct stat statbuf;
+    CPPUNIT_ASSERT_EQUAL(fstat(devFD, &statbuf), 0);
+    CPPUNIT_ASSERT_EQUAL(statbuf.st_size, (off_t)0);
+
+    /* a device which can grow takes it */
+    CPPUNIT_ASSERT(sendRange(2, 0, 1000, 1000, 0)
+		   .compare("ums2net: range 0+1000 ok, 1000 of 100000 bytes\n") == 0);
+  }
+
+  /**
+   * test that a failed range drops the upload
+   */
+  void testFailedRange() {
+    CPPUNIT_ASSERT(sendRange(3, 0, 50000, 50000, IMAGE_SIZE)
+		   .compare("ums2net: range 0+50000 ok, 50000 of 100000 bytes\n") == 0);
+    CPPUNIT_ASSERT(sendRange(3, 50000, 50000, 20000, IMAGE_SIZE)
+		   .compare("ums2net: range 50000+50000 failed after 20000 bytes\n") == 0);
+
+    /* the first range is forgotten with the upload */
+    CPPUNIT_ASSERT(sendRange(3, 50000, 50000, 50000, IMAGE_SIZE)
+		   .compare("ums2net: range 50000+50000 ok, 50000 of 100000 bytes\n") == 0);
+    CPPUNIT_ASSERT(sendRange(3, 0, 50000, 50000, IMAGE_SIZE)
+		   .compare("ums2net: range 0+50000 ok, 100000 of 100000 bytes, image complete\n") == 0);
+    checkDevice(0, IMAGE_SIZE);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETRangeUploadTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
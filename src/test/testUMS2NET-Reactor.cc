@@ -0,0 +1,211 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../reactor.h"
+
+volatile int quitFlag = 0;
+
+class UMS2NETReactorTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETReactorTest);
+  CPPUNIT_TEST(testParseBusyPolicy);
+  CPPUNIT_TEST(testAdmitIdle);
+  CPPUNIT_TEST(testReject);
+  CPPUNIT_TEST(testQueue);
+  CPPUNIT_TEST(testConcurrent);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  PortListener listener;
+
+  /**
+   * connect a client and return the server end of it.
+   *
+   * @param client set to the client end.
+   */
+  int connectClient(int *client) {
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    *client = fds[1];
+    return fds[0];
+  }
+
+public:
+  void setUp() {
+    listener.port = 29600;
+    listener.serverSocket = -1;
+    listener.policy = BUSY_QUEUE;
+    listener.active = 0;
+    listener.metrics = metricsRegisterPort(listener.port, std::string("/dev/sdb"));
+    listener.retired = 0;
+  }
+
+  void tearDown() {
+    while (!listener.pending.empty()) {
+      close(listener.pending.front());
+      listener.pending.pop_front();
+    }
+  }
+
+protected:
+  /**
+   * test for parseBusyPolicy() function
+   */
+  void testParseBusyPolicy() {
+    int policy = -1;
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string("queue"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)BUSY_QUEUE);
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string("reject"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)BUSY_REJECT);
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string("concurrent"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)BUSY_CONCURRENT);
+
+    policy = -1;
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string(""), &policy), 0);
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string("Queue"), &policy), 0);
+    CPPUNIT_ASSERT_EQUAL(parseBusyPolicy(std::string("wait"), &policy), 0);
+    CPPUNIT_ASSERT_EQUAL(policy, -1);
+  }
+
+  /**
+   * test that an idle port serves a client with every policy
+   */
+  void testAdmitIdle() {
+    int client;
+    int server = connectClient(&client);
+    listener.policy = BUSY_QUEUE;
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server), 1);
+    listener.policy = BUSY_REJECT;
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server), 1);
+    CPPUNIT_ASSERT(listener.pending.empty());
+    close(server);
+    close(client);
+  }
+
+  /**
+   * test the busy=reject path
+   */
+  void testReject() {
+    int client;
+    char buf[128];
+    listener.policy = BUSY_REJECT;
+    listener.active = 1;
+    long long rejected = listener.metrics->done.errors[METRICS_ERROR_REJECT];
+    int server = connectClient(&client);
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server), 0);
+    CPPUNIT_ASSERT(listener.pending.empty());
+    CPPUNIT_ASSERT_EQUAL(listener.metrics->done.errors[METRICS_ERROR_REJECT], rejected + 1);
+
+    /* the client is told and the socket is closed */
+    std::string message;
+    ssize_t r1;
+    while ((r1 = read(client, buf, sizeof(buf))) > 0) {
+      message.append(buf, (size_t)r1);
+    }
+    CPPUNIT_ASSERT_EQUAL(r1, (ssize_t)0);
+    CPPUNIT_ASSERT(message.compare(std::string("ums2net: TCP port 29600 is busy\n")) == 0);
+    close(client);
+  }
+
+  /**
+   * test the busy=queue path and the order the clients are served in
+   */
+  void testQueue() {
+    int client1;
+    int client2;
+    listener.policy = BUSY_QUEUE;
+    listener.active = 1;
+    int server1 = connectClient(&client1);
+    int server2 = connectClient(&client2);
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server1), 0);
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server2), 0);
+    CPPUNIT_ASSERT_EQUAL((int)listener.pending.size(), 2);
+    CPPUNIT_ASSERT_EQUAL(listener.metrics->queued, 2);
+
+    /* nothing is taken while the port is busy */
+    CPPUNIT_ASSERT_EQUAL(nextPendingClient(&listener), -1);
+    listener.active = 0;
+    CPPUNIT_ASSERT_EQUAL(nextPendingClient(&listener), server1);
+    listener.active = 1;
+    CPPUNIT_ASSERT_EQUAL(nextPendingClient(&listener), -1);
+    listener.active = 0;
+    CPPUNIT_ASSERT_EQUAL(nextPendingClient(&listener), server2);
+    CPPUNIT_ASSERT_EQUAL(nextPendingClient(&listener), -1);
+
+    /* a queued client is not told anything */
+    char c;
+    CPPUNIT_ASSERT_EQUAL(recv(client1, &c, 1, MSG_DONTWAIT), (ssize_t)-1);
+    close(server1);
+    close(server2);
+    close(client1);
+    close(client2);
+  }
+
+  /**
+   * test the busy=concurrent path
+   */
+  void testConcurrent() {
+    int client;
+    listener.policy = BUSY_CONCURRENT;
+    listener.active = 3;
+    int server = connectClient(&client);
+    CPPUNIT_ASSERT_EQUAL(admitClient(&listener, server), 1);
+    CPPUNIT_ASSERT(listener.pending.empty());
+    close(server);
+    close(client);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETReactorTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,266 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../readDevice.h"
+
+volatile int quitFlag = 0;
+
+#define DATA_SIZE (4096*8 + 1234)
+/* sendfile() from it fails with EINVAL, pread() works */
+#define NO_SENDFILE_PATH "/proc/self/cmdline"
+
+/**
+ * The client side of a read.
+ */
+struct Receiver {
+  int fd; ///< the client end of the socket pair
+  std::string data; ///< what the server sends
+};
+
+/**
+ * receive until the server closes the connection.
+ *
+ * @param data the pointer of Receiver
+ *
+ * @return NULL.
+ */
+static void* receiverThread(void *data) {
+  Receiver *r = (Receiver *)(data);
+  char buf[65536];
+  ssize_t r1;
+  while ((r1 = read(r->fd, buf, sizeof(buf))) > 0) {
+    r->data.append(buf, (size_t)r1);
+  }
+  close(r->fd);
+  return NULL;
+}
+
+/**
+ * read a whole file with read().
+ */
+static std::string readFile(const char *path) {
+  std::string content;
+  char buf[65536];
+  ssize_t r1;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return content;
+  }
+  while ((r1 = read(fd, buf, sizeof(buf))) > 0) {
+    content.append(buf, (size_t)r1);
+  }
+  close(fd);
+  return content;
+}
+
+class UMS2NETReadDeviceTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETReadDeviceTest);
+  CPPUNIT_TEST(testSendDevice);
+  CPPUNIT_TEST(testSendDeviceCopy);
+  CPPUNIT_TEST(testReadServant);
+  CPPUNIT_TEST(testSkipCount);
+  CPPUNIT_TEST(testNoSendfile);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  char data[DATA_SIZE];
+  std::map<std::string, std::string> ddParameters;
+
+  /**
+   * receive what readServant() sends for ddParameters.
+   */
+  std::string readDevice() {
+    int fds[2];
+    pthread_t thread;
+    Receiver r;
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    r.fd = fds[1];
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&thread, NULL, receiverThread, &r), 0);
+    readServant(fds[0], ddParameters);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return r.data;
+  }
+
+  /**
+   * receive what sendDevice() sends of a file.
+   */
+  std::string sendFile(const char *path, off_t offset, off_t length, int chunkSize, ssize_t *totalLen, int *error) {
+    int fds[2];
+    pthread_t thread;
+    Receiver r;
+    int devFD = open(path, O_RDONLY);
+    CPPUNIT_ASSERT(devFD >= 0);
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    r.fd = fds[1];
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&thread, NULL, receiverThread, &r), 0);
+    *totalLen = sendDevice(fds[0], devFD, offset, length, chunkSize, error);
+    close(fds[0]);
+    close(devFD);
+    pthread_join(thread, NULL);
+    return r.data;
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-ReadDevice-XXXXXX");
+    int fd = mkstemp(devname);
+    for (int i=0; i<DATA_SIZE; i++) {
+      data[i] = (char)(i*23 + i/4096);
+    }
+    CPPUNIT_ASSERT_EQUAL(write(fd, data, DATA_SIZE), (ssize_t)DATA_SIZE);
+    close(fd);
+    ddParameters.clear();
+    ddParameters[std::string("if")] = std::string(devname);
+  }
+
+  void tearDown() {
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for sendDevice() function with sendfile()
+   */
+  void testSendDevice() {
+    ssize_t totalLen;
+    int error = -1;
+    std::string received = sendFile(devname, 0, -1, 4096, &totalLen, &error);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)DATA_SIZE);
+    CPPUNIT_ASSERT(received.compare(std::string(data, DATA_SIZE)) == 0);
+
+    received = sendFile(devname, 1000, 5000, 4096, &totalLen, &error);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)5000);
+    CPPUNIT_ASSERT(received.compare(std::string(data + 1000, 5000)) == 0);
+  }
+
+  /**
+   * test for sendDevice() function with pread() when sendfile() fails
+   */
+  void testSendDeviceCopy() {
+    std::string expected = readFile(NO_SENDFILE_PATH);
+    CPPUNIT_ASSERT(expected.length() > 2);
+    ssize_t totalLen;
+    int error = -1;
+    std::string received = sendFile(NO_SENDFILE_PATH, 0, -1, 7, &totalLen, &error);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)expected.length());
+    CPPUNIT_ASSERT(received.compare(expected) == 0);
+
+    received = sendFile(NO_SENDFILE_PATH, 1, 2, 7, &totalLen, &error);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    CPPUNIT_ASSERT(received.compare(expected.substr(1, 2)) == 0);
+  }
+
+  /**
+   * test readServant() sending the whole device
+   */
+  void testReadServant() {
+    CPPUNIT_ASSERT(readDevice().compare(std::string(data, DATA_SIZE)) == 0);
+
+    ddParameters[std::string("if")] = std::string("ums2net-testUMS2NET-ReadDevice-missing");
+    CPPUNIT_ASSERT(readDevice().empty());
+  }
+
+  /**
+   * test skip= and count=, in blocks of bs= or of 512 bytes
+   */
+  void testSkipCount() {
+    ddParameters[std::string("bs")] = std::string("4096");
+    ddParameters[std::string("skip")] = std::string("2");
+    ddParameters[std::string("count")] = std::string("3");
+    CPPUNIT_ASSERT(readDevice().compare(std::string(data + 4096*2, 4096*3)) == 0);
+
+    /* up to the end of the device, the last block is partial */
+    ddParameters.erase(std::string("count"));
+    ddParameters[std::string("skip")] = std::string("7");
+    CPPUNIT_ASSERT(readDevice().compare(std::string(data + 4096*7, DATA_SIZE - 4096*7)) == 0);
+
+    /* a count past the end stops at the end */
+    ddParameters[std::string("count")] = std::string("100");
+    CPPUNIT_ASSERT(readDevice().compare(std::string(data + 4096*7, DATA_SIZE - 4096*7)) == 0);
+
+    ddParameters.erase(std::string("bs"));
+    ddParameters[std::string("skip")] = std::string("3");
+    ddParameters[std::string("count")] = std::string("5");
+    CPPUNIT_ASSERT(readDevice().compare(std::string(data + 512*3, 512*5)) == 0);
+  }
+
+  /**
+   * test readServant() on a file which cannot be sent with sendfile()
+   */
+  void testNoSendfile() {
+    std::string expected = readFile(NO_SENDFILE_PATH);
+    ddParameters[std::string("if")] = std::string(NO_SENDFILE_PATH);
+    ddParameters[std::string("bs")] = std::string("1");
+    CPPUNIT_ASSERT(readDevice().compare(expected) == 0);
+
+    ddParameters[std::string("skip")] = std::string("1");
+    ddParameters[std::string("count")] = std::string("2");
+    CPPUNIT_ASSERT(readDevice().compare(expected.substr(1, 2)) == 0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETReadDeviceTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../copyEngine.h"
+
+volatile int quitFlag = 0;
+
+#define BLOCK_SIZE 65536
+/* not a multiple of the block size */
+#define DATA_SIZE (BLOCK_SIZE*5 + 1234)
+
+/**
+ * The client side of a copy.
+ */
+struct Sender {
+  int fd; ///< the client end of the socket pair
+  const char *buf; ///< the data to send
+  size_t len; ///< the length of the data
+  size_t piece; ///< the data is sent in pieces of this size
+  useconds_t pause; ///< the pause after each piece
+};
+
+/**
+ * send the data and close the socket, as a client does.
+ *
+ * @param data the pointer of Sender
+ *
+ * @return NULL.
+ */
+static void* senderThread(void *data) {
+  Sender *s = (Sender *)(data);
+  size_t done = 0;
+  while (done < s->len) {
+    size_t len = s->len - done;
+    if (len > s->piece) {
+      len = s->piece;
+    }
+    ssize_t w1 = write(s->fd, s->buf + done, len);
+    if (w1 <= 0) {
+      break;
+    }
+    done += (size_t)w1;
+    if (s->pause > 0) {
+      usleep(s->pause);
+    }
+  }
+  close(s->fd);
+  return NULL;
+}
+
+class UMS2NETSpliceEngineTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETSpliceEngineTest);
+  CPPUNIT_TEST(testSplice);
+  CPPUNIT_TEST(testFallback);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  char data[DATA_SIZE];
+
+  /**
+   * copy the data to the device with copySplice(), and with copyLoop()
+   * if splice() is not supported, as clientServant() does.
+   *
+   * @param flags the flags the device is opened with.
+   * @param unsupported set to 1 if copySplice() fell back.
+   * @param splicedLen set to what copySplice() returns.
+   *
+   * @return the number of bytes written by both engines.
+   */
+  ssize_t copy(int flags, int *unsupported, ssize_t *splicedLen) {
+    int fds[2];
+    pthread_t sender;
+    Sender s;
+    int outFD = open(devname, O_WRONLY | O_TRUNC | flags);
+    CPPUNIT_ASSERT(outFD >= 0);
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    s.fd = fds[1];
+    s.buf = data;
+    s.len = DATA_SIZE;
+    s.piece = BLOCK_SIZE/2;
+    s.pause = 1000;
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&sender, NULL, senderThread, &s), 0);
+    int error = -1;
+    *unsupported = -1;
+    ssize_t totalLen = copySplice(fds[0], outFD, BLOCK_SIZE, unsupported, NULL, &error);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    *splicedLen = totalLen;
+    if (*unsupported) {
+      error = -1;
+      totalLen += copyLoop(fds[0], outFD, BLOCK_SIZE, NULL, NULL, NULL, &error);
+      CPPUNIT_ASSERT_EQUAL(error, 0);
+    }
+    pthread_join(sender, NULL);
+    close(fds[0]);
+    close(outFD);
+    return totalLen;
+  }
+
+  /**
+   * check that the device holds exactly the data.
+   */
+  void checkDevice() {
+    char buf[DATA_SIZE+1];
+    struct stat statbuf;
+    CPPUNIT_ASSERT_EQUAL(stat(devname, &statbuf), 0);
+    CPPUNIT_ASSERT_EQUAL(statbuf.st_size, (off_t)DATA_SIZE);
+    int fd = open(devname, O_RDONLY);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(read(fd, buf, sizeof(buf)), (ssize_t)DATA_SIZE);
+    close(fd);
+    CPPUNIT_ASSERT(memcmp(buf, data, DATA_SIZE) == 0);
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-SpliceEngine-XXXXXX");
+    close(mkstemp(devname));
+    for (int i=0; i<DATA_SIZE; i++) {
+      data[i] = (char)(i*19 + i/4096);
+    }
+  }
+
+  void tearDown() {
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test copySplice() into a regular file
+   */
+  void testSplice() {
+    int unsupported;
+    ssize_t splicedLen;
+    CPPUNIT_ASSERT_EQUAL(copy(0, &unsupported, &splicedLen), (ssize_t)DATA_SIZE);
+    if (!unsupported) {
+      CPPUNIT_ASSERT_EQUAL(splicedLen, (ssize_t)DATA_SIZE);
+    }
+    checkDevice();
+  }
+
+  /**
+   * test the fall back to copyLoop(): splice() refuses a file opened with
+   * O_APPEND with EINVAL after the first chunk is already in the pipe, so
+   * the pipe is drained to the file before copyLoop() continues
+   */
+  void testFallback() {
+    int unsupported;
+    ssize_t splicedLen;
+    CPPUNIT_ASSERT_EQUAL(copy(O_APPEND, &unsupported, &splicedLen), (ssize_t)DATA_SIZE);
+    CPPUNIT_ASSERT_EQUAL(unsupported, 1);
+    /* what was drained from the pipe, copyLoop() wrote the rest */
+    CPPUNIT_ASSERT(splicedLen > 0);
+    CPPUNIT_ASSERT(splicedLen < (ssize_t)DATA_SIZE);
+    checkDevice();
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETSpliceEngineTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
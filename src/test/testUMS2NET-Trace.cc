@@ -0,0 +1,176 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include <dirent.h>
+#include "../trace.h"
+
+class UMS2NETTraceTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETTraceTest);
+  CPPUNIT_TEST(testDisabled);
+  CPPUNIT_TEST(testTraceFormat);
+  CPPUNIT_TEST(testSessionEnd);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  /**
+   * count the occurrences of a string.
+   */
+  int count(const std::string &text, const std::string &pattern) {
+    int n = 0;
+    for (std::size_t found = text.find(pattern); found != std::string::npos; found = text.find(pattern, found + 1)) {
+      n++;
+    }
+    return n;
+  }
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test that nothing is recorded before traceEnable()
+   */
+  void testDisabled() {
+    TraceRing ring;
+    traceSessionStart(&ring, 29543);
+    CPPUNIT_ASSERT(traceRing == NULL);
+    CPPUNIT_ASSERT(ring.events == NULL);
+    traceSpan("write", 0, 1000);
+    traceSessionEnd(&ring);
+  }
+
+  /**
+   * test for traceSpan() and traceFormat() functions
+   */
+  void testTraceFormat() {
+    char dirTemplate[] = "/tmp/ums2net-trace-XXXXXX";
+    CPPUNIT_ASSERT(mkdtemp(dirTemplate) != NULL);
+    traceEnable(std::string(dirTemplate));
+    TraceRing ring;
+    traceSessionStart(&ring, 29543);
+    CPPUNIT_ASSERT(traceRing == &ring);
+
+    traceSpan("recv", 1000000, 1002500);
+    traceSpan("write", 1002500, 3002500);
+    std::vector<TraceRing *> rings(1, &ring);
+    std::string text = traceFormat(rings);
+    CPPUNIT_ASSERT(text.find("\"name\":\"port 29543\"") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("{\"name\":\"recv\",\"cat\":\"io\",\"ph\":\"X\",\"ts\":1000.000,\"dur\":2.500,") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("{\"name\":\"write\",\"cat\":\"io\",\"ph\":\"X\",\"ts\":1002.500,\"dur\":2000.000,") != std::string::npos);
+
+    /* only the newest spans are kept */
+    for (int i=0; i<TRACE_RING_EVENTS; i++) {
+      traceSpan("fsync", i, i + 1);
+    }
+    text = traceFormat(rings);
+    CPPUNIT_ASSERT_EQUAL(count(text, "\"ph\":\"X\""), TRACE_RING_EVENTS);
+    CPPUNIT_ASSERT_EQUAL(count(text, "\"name\":\"recv\""), 0);
+    CPPUNIT_ASSERT_EQUAL(count(text, "\"name\":\"fsync\""), TRACE_RING_EVENTS);
+    traceSessionEnd(&ring);
+    CPPUNIT_ASSERT(traceRing == NULL);
+    DIR *dir = opendir(dirTemplate);
+    CPPUNIT_ASSERT(dir != NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+	unlink((std::string(dirTemplate) + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(dir);
+    rmdir(dirTemplate);
+  }
+
+  /**
+   * test that traceSessionEnd() writes the trace of the session
+   */
+  void testSessionEnd() {
+    char dirTemplate[] = "/tmp/ums2net-trace-XXXXXX";
+    CPPUNIT_ASSERT(mkdtemp(dirTemplate) != NULL);
+    traceEnable(std::string(dirTemplate));
+    TraceRing ring;
+    traceSessionStart(&ring, 29544);
+    traceSpan("recv", 0, 10);
+    traceSessionEnd(&ring);
+    CPPUNIT_ASSERT(ring.events == NULL);
+
+    DIR *dir = opendir(dirTemplate);
+    CPPUNIT_ASSERT(dir != NULL);
+    std::string filename;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "ums2net-29544-", 14) == 0) {
+	filename = std::string(dirTemplate) + "/" + entry->d_name;
+      }
+    }
+    closedir(dir);
+    CPPUNIT_ASSERT(filename.length() > 0);
+    std::ifstream in(filename.c_str());
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    CPPUNIT_ASSERT(text.find("{\"traceEvents\":[") == 0);
+    CPPUNIT_ASSERT_EQUAL(count(text, "\"name\":\"recv\""), 1);
+    unlink(filename.c_str());
+    rmdir(dirTemplate);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETTraceTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../copyEngine.h"
+
+volatile int quitFlag = 0;
+
+#define BLOCK_SIZE 65536
+/* not a multiple of the block size */
+#define DATA_SIZE (BLOCK_SIZE*5 + 1234)
+
+/**
+ * The client side of a copy.
+ */
+struct Sender {
+  int fd; ///< the client end of the socket pair
+  const char *buf; ///< the data to send
+  size_t len; ///< the length of the data
+  size_t piece; ///< the data is sent in pieces of this size
+  useconds_t pause; ///< the pause after each piece
+};
+
+/**
+ * send the data and close the socket, as a client does.
+ *
+ * @param data the pointer of Sender
+ *
+ * @return NULL.
+ */
+static void* senderThread(void *data) {
+  Sender *s = (Sender *)(data);
+  size_t done = 0;
+  while (done < s->len) {
+    size_t len = s->len - done;
+    if (len > s->piece) {
+      len = s->piece;
+    }
+    ssize_t w1 = write(s->fd, s->buf + done, len);
+    if (w1 <= 0) {
+      break;
+    }
+    done += (size_t)w1;
+    if (s->pause > 0) {
+      usleep(s->pause);
+    }
+  }
+  close(s->fd);
+  return NULL;
+}
+
+class UMS2NETUringEngineTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETUringEngineTest);
+  CPPUNIT_TEST(testUring);
+  CPPUNIT_TEST(testShortRecv);
+  CPPUNIT_TEST(testShortImage);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  char data[DATA_SIZE];
+
+  /**
+   * copy the first len bytes of data to the device with copyUring().
+   *
+   * @param len the length of the image.
+   * @param piece the size of each piece the client sends.
+   * @param pause the pause of the client after each piece.
+   * @param unsupported set to 1 if io_uring is not supported.
+   *
+   * @return what copyUring() returns.
+   */
+  ssize_t copy(size_t len, size_t piece, useconds_t pause, int *unsupported) {
+    int fds[2];
+    pthread_t sender;
+    Sender s;
+    int outFD = open(devname, O_RDWR | O_TRUNC);
+    CPPUNIT_ASSERT(outFD >= 0);
+    CPPUNIT_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    s.fd = fds[1];
+    s.buf = data;
+    s.len = len;
+    s.piece = piece;
+    s.pause = pause;
+    CPPUNIT_ASSERT_EQUAL(pthread_create(&sender, NULL, senderThread, &s), 0);
+    int error = -1;
+    *unsupported = -1;
+    ssize_t totalLen = copyUring(fds[0], outFD, BLOCK_SIZE, 4, unsupported, &error);
+    if (*unsupported) {
+      /* the socket is left for copyLoop(), drain it so the sender ends */
+      char buf[BLOCK_SIZE];
+      while (read(fds[0], buf, sizeof(buf)) > 0) {
+      }
+    }
+    pthread_join(sender, NULL);
+    CPPUNIT_ASSERT_EQUAL(error, 0);
+    close(fds[0]);
+    close(outFD);
+    return totalLen;
+  }
+
+  /**
+   * check that the device holds exactly the first len bytes of data.
+   */
+  void checkDevice(size_t len) {
+    char buf[DATA_SIZE+1];
+    struct stat statbuf;
+    CPPUNIT_ASSERT_EQUAL(stat(devname, &statbuf), 0);
+    CPPUNIT_ASSERT_EQUAL(statbuf.st_size, (off_t)len);
+    int fd = open(devname, O_RDONLY);
+    CPPUNIT_ASSERT(fd >= 0);
+    CPPUNIT_ASSERT_EQUAL(read(fd, buf, sizeof(buf)), (ssize_t)len);
+    close(fd);
+    CPPUNIT_ASSERT(memcmp(buf, data, len) == 0);
+  }
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-UringEngine-XXXXXX");
+    close(mkstemp(devname));
+    for (int i=0; i<DATA_SIZE; i++) {
+      data[i] = (char)(i*17 + i/4096);
+    }
+  }
+
+  void tearDown() {
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test copyUring() with a client which sends at once
+   */
+  void testUring() {
+    int unsupported;
+    ssize_t totalLen = copy(DATA_SIZE, DATA_SIZE, 0, &unsupported);
+    if (unsupported) {
+      /* io_uring_setup() failed, copyLoop() takes over in ums2net */
+      CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)0);
+      return;
+    }
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)DATA_SIZE);
+    checkDevice(DATA_SIZE);
+  }
+
+  /**
+   * test copyUring() with a client which sends small pieces, so the
+   * receives come back short and are queued again
+   */
+  void testShortRecv() {
+    int unsupported;
+    ssize_t totalLen = copy(DATA_SIZE, 3000, 1000, &unsupported);
+    if (unsupported) {
+      return;
+    }
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)DATA_SIZE);
+    checkDevice(DATA_SIZE);
+  }
+
+  /**
+   * test images which fit in one block or end on a block boundary
+   */
+  void testShortImage() {
+    int unsupported;
+    ssize_t totalLen = copy(100, 100, 0, &unsupported);
+    if (unsupported) {
+      return;
+    }
+    CPPUNIT_ASSERT_EQUAL(totalLen, (ssize_t)100);
+    checkDevice(100);
+
+    CPPUNIT_ASSERT_EQUAL(copy(BLOCK_SIZE*2, BLOCK_SIZE/2, 1000, &unsupported), (ssize_t)(BLOCK_SIZE*2));
+    checkDevice(BLOCK_SIZE*2);
+
+    CPPUNIT_ASSERT_EQUAL(copy(0, 1, 0, &unsupported), (ssize_t)0);
+    checkDevice(0);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETUringEngineTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../workerPool.h"
+
+static pthread_mutex_t countLock = PTHREAD_MUTEX_INITIALIZER;
+static int running = 0;
+static int maxRunning = 0;
+static int done = 0;
+static int pinned = 0;
+
+/**
+ * a session which takes a while.
+ */
+static void* fakeSession(void *data) {
+  (void)data;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  pthread_mutex_lock(&countLock);
+  running++;
+  if (running > maxRunning) {
+    maxRunning = running;
+  }
+  if (CPU_COUNT(&cpus) == 1) {
+    pinned++;
+  }
+  pthread_mutex_unlock(&countLock);
+  usleep(20000);
+  pthread_mutex_lock(&countLock);
+  running--;
+  done++;
+  pthread_mutex_unlock(&countLock);
+  return NULL;
+}
+
+class UMS2NETWorkerPoolTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETWorkerPoolTest);
+  CPPUNIT_TEST(testPool);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() {
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for workerPoolStart(), workerPoolSubmit() and workerPoolStop()
+   */
+  void testPool() {
+    CPPUNIT_ASSERT_EQUAL(workerPoolRunning(), 0);
+    CPPUNIT_ASSERT_EQUAL(workerPoolStart(2), 0);
+    CPPUNIT_ASSERT_EQUAL(workerPoolRunning(), 1);
+    for (int i=0; i<6; i++) {
+      /* a node which has no worker is served by any of them */
+      workerPoolSubmit(fakeSession, NULL, (i % 2 == 0) ? -1 : 99);
+    }
+    /* the queued sessions are served before the pool stops */
+    workerPoolStop();
+    CPPUNIT_ASSERT_EQUAL(workerPoolRunning(), 0);
+    CPPUNIT_ASSERT_EQUAL(done, 6);
+    CPPUNIT_ASSERT_EQUAL(maxRunning, 2);
+    CPPUNIT_ASSERT_EQUAL(pinned, 6);
+  }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETWorkerPoolTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../writeback.h"
+
+class UMS2NETWritebackTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETWritebackTest);
+  CPPUNIT_TEST(testWritebackInit);
+  CPPUNIT_TEST(testWritebackAdd);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char *devname;
+  int devFD;
+
+public:
+  void setUp() {
+    devname = strdup("ums2net-testUMS2NET-Writeback-XXXXXX");
+    devFD = mkstemp(devname);
+  }
+
+  void tearDown() {
+    close(devFD);
+    unlink(devname);
+    free(devname);
+  }
+
+protected:
+  /**
+   * test for writebackInit() function
+   */
+  void testWritebackInit() {
+    Writeback wb;
+    int pipeFDs[2];
+    CPPUNIT_ASSERT_EQUAL(writebackInit(&wb, devFD, 0), -1);
+    CPPUNIT_ASSERT_EQUAL(writebackInit(&wb, devFD, 1024), 0);
+    CPPUNIT_ASSERT_EQUAL(wb.window, (off_t)(1024*1024));
+    CPPUNIT_ASSERT_EQUAL(writebackInit(&wb, devFD, 64*1024*1024), 0);
+    CPPUNIT_ASSERT_EQUAL(wb.window, (off_t)(16*1024*1024));
+    /* only files go through the page cache */
+    CPPUNIT_ASSERT_EQUAL(pipe(pipeFDs), 0);
+    CPPUNIT_ASSERT_EQUAL(writebackInit(&wb, pipeFDs[1], 1024), -1);
+    close(pipeFDs[0]);
+    close(pipeFDs[1]);
+  }
+
+  /**
+   * test for writebackAdd() and writebackFinish() functions
+   */
+  void testWritebackAdd() {
+    Writeback wb;
+    const size_t chunkSize = 256*1024;
+    char *buf = (char *)malloc(chunkSize);
+    memset(buf, 0x5a, chunkSize);
+    CPPUNIT_ASSERT_EQUAL(writebackInit(&wb, devFD, 2*1024*1024), 0);
+    for (int i=0; i<24; i++) {
+      CPPUNIT_ASSERT_EQUAL(write(devFD, buf, chunkSize), (ssize_t)chunkSize);
+      CPPUNIT_ASSERT_EQUAL(writebackAdd(&wb, (off_t)chunkSize), 0);
+      if (wb.enabled) {
+	/* never more than the limit and one window behind */
+	CPPUNIT_ASSERT(wb.offset - wb.completed <= wb.dirtyLimit + wb.window);
+	CPPUNIT_ASSERT(wb.submitted <= wb.offset);
+	CPPUNIT_ASSERT(wb.completed <= wb.submitted);
+      }
+    }
+    CPPUNIT_ASSERT_EQUAL(wb.offset, (off_t)(24*chunkSize));
+    if (wb.enabled) {
+      CPPUNIT_ASSERT(wb.completed > 0);
+    }
+    CPPUNIT_ASSERT_EQUAL(writebackFinish(&wb), 0);
+    if (wb.enabled) {
+      CPPUNIT_ASSERT_EQUAL(wb.completed, wb.offset);
+    }
+    free(buf);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETWritebackTest);
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstring>
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/BriefTestProgressListener.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/XmlOutputter.h>
+#include "../zeroBlock.h"
+
+class UMS2NETZeroBlockTest : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(UMS2NETZeroBlockTest);
+  CPPUNIT_TEST(testIsZeroBlock);
+  CPPUNIT_TEST(testParseZeroPolicy);
+  CPPUNIT_TEST_SUITE_END();
+
+private:
+  char buf[4096+64];
+
+public:
+  void setUp() {
+    memset(buf, 0, sizeof(buf));
+  }
+
+  void tearDown() {
+  }
+
+protected:
+  /**
+   * test for isZeroBlock() function
+   */
+  void testIsZeroBlock() {
+    CPPUNIT_ASSERT_EQUAL(isZeroBlock(buf, 0), 1);
+    CPPUNIT_ASSERT_EQUAL(isZeroBlock(buf, 4096), 1);
+
+    /* a non-zero byte anywhere, at any alignment and length */
+    for (int offset=0; offset<16; offset++) {
+      for (int len=1; len<300; len+=37) {
+	for (int i=0; i<len; i++) {
+	  CPPUNIT_ASSERT_EQUAL(isZeroBlock(&(buf[offset]), len), 1);
+	  buf[offset+i] = 1;
+	  CPPUNIT_ASSERT_EQUAL(isZeroBlock(&(buf[offset]), len), 0);
+	  buf[offset+i] = 0;
+	}
+      }
+    }
+
+    buf[4095] = (char)0x80;
+    CPPUNIT_ASSERT_EQUAL(isZeroBlock(buf, 4096), 0);
+    CPPUNIT_ASSERT_EQUAL(isZeroBlock(buf, 4095), 1);
+  }
+
+  /**
+   * test for parseZeroPolicy() function
+   */
+  void testParseZeroPolicy() {
+    int policy = -1;
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string("write"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)ZERO_WRITE);
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string("skip"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)ZERO_SKIP);
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string("zeroout"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)ZERO_ZEROOUT);
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string("discard"), &policy), 1);
+    CPPUNIT_ASSERT_EQUAL(policy, (int)ZERO_DISCARD);
+
+    policy = -1;
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string(""), &policy), 0);
+    CPPUNIT_ASSERT_EQUAL(parseZeroPolicy(std::string("sparse"), &policy), 0);
+    CPPUNIT_ASSERT_EQUAL(policy, -1);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UMS2NETZeroBlockTest);
+
+int main(int argc, char* argv[]) {
+    // informs test-listener about testresults
+    CPPUNIT_NS::TestResult testresult;
+
+    // register listener for collecting the test-results
+    CPPUNIT_NS::TestResultCollector collectedresults;
+    testresult.addListener (&collectedresults);
+
+    // register listener for per-test progress output
+    CPPUNIT_NS::BriefTestProgressListener progress;
+    testresult.addListener (&progress);
+
+    // insert test-suite at test-runner by registry
+    CPPUNIT_NS::TestRunner testrunner;
+    testrunner.addTest (CPPUNIT_NS::TestFactoryRegistry::getRegistry().makeTest ());
+    testrunner.run(testresult);
+
+    // output results in compiler-format
+    CPPUNIT_NS::CompilerOutputter compileroutputter(&collectedresults, std::cerr);
+    compileroutputter.write ();
+ 
+    // return 0 if tests were successful
+    return collectedresults.wasSuccessful() ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+__thread TraceRing *traceRing = NULL;
+
+static bool enabled = false;
+static std::string traceDir;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<TraceRing *> registry;
+
+/**
+ * turn tracing on. The spans of each session are written to the
+ * directory when it ends.
+ *
+ * @param dir the directory of the trace files.
+ */
+void traceEnable(const std::string &dir) {
+  traceDir = dir;
+  enabled = true;
+}
+
+/**
+ * tell whether tracing is on.
+ *
+ * @return true if tracing is on.
+ */
+bool traceEnabled() {
+  return enabled;
+}
+
+/**
+ * start tracing the session of this thread, if tracing is on.
+ *
+ * @param ring the ring of the session, it must live until
+ *        traceSessionEnd().
+ * @param port the TCP port of the session.
+ */
+void traceSessionStart(TraceRing *ring, int port) {
+  memset(ring, 0, sizeof(*ring));
+  if (!enabled) {
+    return;
+  }
+  ring->events = (TraceEvent *)malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+  if (ring->events == NULL) {
+    syslog(LOG_ERR, "Malloc trace buffer for port %d failed", port);
+    return;
+  }
+  ring->port = port;
+  ring->tid = (int)syscall(SYS_gettid);
+  ring->started = (long long)time(NULL);
+  pthread_mutex_lock(&registryLock);
+  registry.insert(ring);
+  pthread_mutex_unlock(&registryLock);
+  traceRing = ring;
+}
+
+/**
+ * write a trace to a file.
+ *
+ * @param filename the name of the file.
+ * @param text the trace.
+ */
+static void traceWrite(const std::string &filename, const std::string &text) {
+  FILE *fp = fopen(filename.c_str(), "w");
+  if (fp == NULL || fwrite(text.data(), 1, text.size(), fp) != text.size()) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot write trace %s (%s)", filename.c_str(), errstr);
+  } else {
+    syslog(LOG_INFO, "Trace written to %s", filename.c_str());
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+}
+
+/**
+ * stop tracing the session of this thread and write its spans to
+ * ums2net-<port>-<start time>-<tid>.json in the trace directory.
+ *
+ * @param ring the ring of the session.
+ */
+void traceSessionEnd(TraceRing *ring) {
+  if (ring->events == NULL) {
+    return;
+  }
+  traceRing = NULL;
+  pthread_mutex_lock(&registryLock);
+  registry.erase(ring);
+  pthread_mutex_unlock(&registryLock);
+
+  std::vector<TraceRing *> rings(1, ring);
+  std::stringstream filename;
+  filename << traceDir << "/ums2net-" << ring->port << "-" << ring->started << "-" << ring->tid << ".json";
+  traceWrite(filename.str(), traceFormat(rings));
+  free(ring->events);
+  ring->events = NULL;
+}
+
+/**
+ * format a time in nanoseconds as the microseconds of a trace.
+ *
+ * @param out the stream.
+ * @param nsec the time in nanoseconds.
+ */
+static void formatMicroseconds(std::stringstream &out, long long nsec) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld.%03lld", nsec / 1000, nsec % 1000);
+  out << buf;
+}
+
+/**
+ * format the spans in the Chrome trace event format, which is read by
+ * chrome://tracing and Perfetto. Each session is one thread.
+ *
+ * The rings may be written while they are read. The spans which may have
+ * been overwritten during the copy are dropped.
+ *
+ * @param rings the rings.
+ *
+ * @return the trace as JSON.
+ */
+std::string traceFormat(const std::vector<TraceRing *> &rings) {
+  std::stringstream out;
+  int pid = (int)getpid();
+  bool first = true;
+  out << "{\"traceEvents\":[";
+  for (int i=0; i<(int)rings.size(); i++) {
+    TraceRing *ring = rings[i];
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << ring->tid
+	<< ",\"args\":{\"name\":\"port " << ring->port << "\"}}";
+
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long begin = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+    std::vector<TraceEvent> copy;
+    copy.reserve((size_t)(head - begin));
+    for (unsigned long long n=begin; n<head; n++) {
+      TraceEvent *event = &ring->events[n & (TRACE_RING_EVENTS - 1)];
+      TraceEvent e;
+      e.name = __atomic_load_n(&event->name, __ATOMIC_RELAXED);
+      e.start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+      e.dur = __atomic_load_n(&event->dur, __ATOMIC_RELAXED);
+      copy.push_back(e);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    unsigned long long after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned long long valid = (after > TRACE_RING_EVENTS) ? after - TRACE_RING_EVENTS : 0;
+
+    for (unsigned long long n=begin; n<head; n++) {
+      if (n < valid) {
+	continue;
+      }
+      TraceEvent *e = &copy[(size_t)(n - begin)];
+      out << ",\n{\"name\":\"" << e->name << "\",\"cat\":\"io\",\"ph\":\"X\",\"ts\":";
+      formatMicroseconds(out, e->start);
+      out << ",\"dur\":";
+      formatMicroseconds(out, e->dur);
+      out << ",\"pid\":" << pid << ",\"tid\":" << ring->tid << "}";
+    }
+  }
+  out << "\n]}\n";
+  return out.str();
+}
+
+/**
+ * write the spans of all the sessions being served to
+ * ums2net-<pid>-<time>.json in the trace directory.
+ */
+void traceDumpAll() {
+  if (!enabled) {
+    return;
+  }
+  std::stringstream filename;
+  filename << traceDir << "/ums2net-" << (int)getpid() << "-" << (long long)time(NULL) << ".json";
+  /* the lock keeps the rings from being freed while they are read */
+  pthread_mutex_lock(&registryLock);
+  std::vector<TraceRing *> rings(registry.begin(), registry.end());
+  std::string text = traceFormat(rings);
+  pthread_mutex_unlock(&registryLock);
+  traceWrite(filename.str(), text);
+}
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_TRACE_HEAD1_H
+#define _HEADER_UMS2NET_TRACE_HEAD1_H
+
+#include <string>
+#include <vector>
+
+/** the number of spans kept per session, a power of 2 */
+#define TRACE_RING_EVENTS 65536
+
+/**
+ * one timed span.
+ */
+struct TraceEvent {
+  const char *name; ///< a static string, e.g. "recv"
+  long long start; ///< monotonic start time in nanoseconds
+  long long dur; ///< duration in nanoseconds
+};
+
+/**
+ * the spans of one session. Only the session thread writes them; when
+ * the ring is full the oldest spans are overwritten, so the memory of a
+ * session is bounded.
+ */
+struct TraceRing {
+  int port; ///< TCP port of the session
+  int tid; ///< thread id of the session
+  long long started; ///< wall clock time the session started, in seconds
+  TraceEvent *events; ///< TRACE_RING_EVENTS spans
+  unsigned long long head; ///< number of spans recorded so far
+};
+
+extern __thread TraceRing *traceRing;
+
+/**
+ * record a span of the session of this thread. It is a single test when
+ * tracing is disabled.
+ *
+ * @param name the name of the span, a static string.
+ * @param start the monotonic start time in nanoseconds.
+ * @param end the monotonic end time in nanoseconds.
+ */
+static inline void traceSpan(const char *name, long long start, long long end) {
+  TraceRing *ring = traceRing;
+  if (ring == NULL) {
+    return;
+  }
+  unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  TraceEvent *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+  __atomic_store_n(&event->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&event->dur, end - start, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void traceEnable(const std::string &dir);
+bool traceEnabled();
+void traceSessionStart(TraceRing *ring, int port);
+void traceSessionEnd(TraceRing *ring);
+std::string traceFormat(const std::vector<TraceRing *> &rings);
+void traceDumpAll();
+
+#endif /* _HEADER_UMS2NET_TRACE_HEAD1_H */
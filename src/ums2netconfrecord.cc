@@ -17,6 +17,7 @@
 
 #include <string>
 #include <sstream>
+#include <climits>
 #include "ums2netconfrecord.h"
 
 /**
@@ -25,7 +26,38 @@
  * @param port the TCP port
  * @param ddParameter the string of the parameter in dd operand format.
  */ 
-UMS2NETConfRecord::UMS2NETConfRecord(int port, std::string &ddParameter) : port(port), ddParameter(ddParameter) {
+UMS2NETConfRecord::UMS2NETConfRecord(int port, std::string &ddParameter) : UMS2NETConfRecord(port, port, ddParameter) {
+}
+
+/**
+ * UMS2NETConfRecord constructor for a range of TCP ports
+ *
+ * The operands are split here once, so the sessions do not parse the
+ * string again.
+ *
+ * @param port the first TCP port
+ * @param lastPort the last TCP port
+ * @param ddParameter the string of the parameter in dd operand format.
+ */ 
+UMS2NETConfRecord::UMS2NETConfRecord(int port, int lastPort, std::string &ddParameter) : port(port), lastPort(lastPort), ddParameter(ddParameter) {
+  std::istringstream iss(ddParameter);
+  std::string token;
+  while (std::getline(iss, token, ' ')) {
+    parameterVector.push_back(token);
+  }
+  std::string delimEqual("=");
+  for (int i=0; i<(int)parameterVector.size(); i++) {
+    std::size_t found = parameterVector[i].find(delimEqual);
+    if (found == std::string::npos) {
+      continue;
+    }
+    std::string k1 = parameterVector[i].substr(0,found);
+    std::string v1 = parameterVector[i].substr(found+1);
+    if (k1.length() <= 0) {
+      continue;
+    }
+    parameterMap[k1] = v1;
+  }
 }
 
 /**
@@ -37,6 +69,15 @@ int UMS2NETConfRecord::getPort() const {
   return port;
 }
 
+/**
+ * get the last TCP port number of a range
+ *
+ * @return the last TCP port number, the same as getPort() without a range
+ */
+int UMS2NETConfRecord::getLastPort() const {
+  return lastPort;
+}
+
 /**
  * get parameter string
  *
@@ -49,42 +90,233 @@ std::string UMS2NETConfRecord::getDDParameter() const {
 /**
  * get parameter vector
  *
- * the parameter string is parsed and will split into vector
+ * the parameter string is split into vector when the record is made
  *
  * @return the vector of parameters
  */
-std::vector<std::string> UMS2NETConfRecord::getDDParameterVector() const {
+const std::vector<std::string>& UMS2NETConfRecord::getDDParameterVector() const {
+  return parameterVector;
+}
+
+/**
+ * get parameter map
+ *
+ * the parameter string is split into map (key, value) when the record is
+ * made
+ *
+ * @return the map of parameters
+ */
+const std::map<std::string, std::string>& UMS2NETConfRecord::getDDParameterMap() const {
+  return parameterMap;
+}
+
+/**
+ * get all the values of an operand
+ *
+ * An operand such as of= may be given more than once. getDDParameterMap()
+ * only keeps the last value.
+ *
+ * @param key the name of the operand
+ *
+ * @return the values in the order they are given
+ */
+std::vector<std::string> UMS2NETConfRecord::getDDParameterValues(const std::string &key) const {
   std::vector<std::string> ret;
-  std::istringstream iss(ddParameter);
-  std::string token;
-  while (std::getline(iss, token, ' ')) {
-    ret.push_back(token);
+  std::string prefix = key + std::string("=");
+  for (int i=0; i<(int)parameterVector.size(); i++) {
+    if (parameterVector[i].compare(0, prefix.length(), prefix) == 0) {
+      ret.push_back(parameterVector[i].substr(prefix.length()));
+    }
   }
   return ret;
 }
 
 /**
- * get parameter map
+ * get the device pattern of a record
  *
- * the parameter string is parsed and will split into map (key, value)
+ * @return the if= or of= value which is a glob pattern, "" if there is none
+ */
+std::string UMS2NETConfRecord::getDevicePattern() const {
+  for (int i=0; i<(int)parameterVector.size(); i++) {
+    const std::string &token = parameterVector[i];
+    if (token.compare(0, 3, "if=") == 0 || token.compare(0, 3, "of=") == 0) {
+      if (isDevicePattern(token.substr(3))) {
+	return token.substr(3);
+      }
+    }
+  }
+  return std::string("");
+}
+
+/**
+ * check if a record stands for ports which are bound to devices as they
+ * appear, rather than for one port.
  *
- * @return the map of parameters
+ * @return 1 if it has a port range or a device pattern, 0 otherwise
  */
-std::map<std::string, std::string> UMS2NETConfRecord::getDDParameterMap() const {
-  std::map<std::string, std::string> ret;
-  std::vector<std::string> parametersV = getDDParameterVector();
-  std::string delimEqual("=");
-  for (int i=0; i<(int)parametersV.size(); i++) {
-    std::size_t found = parametersV[i].find(delimEqual);
-    if (found == std::string::npos) {
+int UMS2NETConfRecord::isTemplate() const {
+  return lastPort != port || !getDevicePattern().empty();
+}
+
+/**
+ * make the record of one port from a template.
+ *
+ * @param boundPort the TCP port
+ * @param path the device which matches the pattern
+ *
+ * @return the record with the pattern replaced by the device
+ */
+UMS2NETConfRecord UMS2NETConfRecord::bindDevice(int boundPort, const std::string &path) const {
+  std::string pattern = getDevicePattern();
+  std::string bound;
+  for (int i=0; i<(int)parameterVector.size(); i++) {
+    std::string token = parameterVector[i];
+    if (!pattern.empty() && token.length() == pattern.length() + 3 &&
+	(token.compare(0, 3, "if=") == 0 || token.compare(0, 3, "of=") == 0) &&
+	token.compare(3, std::string::npos, pattern) == 0) {
+      token = token.substr(0, 3) + path;
+    }
+    if (i > 0) {
+      bound += " ";
+    }
+    bound += token;
+  }
+  return UMS2NETConfRecord(boundPort, bound);
+}
+
+/**
+ * check the operands once, when the config is read.
+ *
+ * Numbers must be valid, there may be one device pattern and only its last
+ * path component may have wildcards. Unknown operands are reported but
+ * kept.
+ *
+ * @param error the reason is stored here if the record is not valid.
+ * @param warnings the problems which do not make the record invalid are
+ *        added here.
+ *
+ * @return 1 if the record is valid, 0 otherwise
+ */
+int UMS2NETConfRecord::validate(std::string &error, std::vector<std::string> &warnings) const {
+  static const char *numberOperands[] = {
+    "bs", "ckptint", "count", "dirty", "hubmax", "hubrate", "lagtime", "nbuf",
+    "pipesz", "qd", "skip", "threads", "wait",
+  };
+  static const char *otherOperands[] = {
+    "busy", "checkpoint", "checksum", "comp", "compare", "engine", "format",
+    "hubgroup", "if", "index", "lag", "of", "verify", "zero",
+  };
+  if (port <= 0 || lastPort < port || lastPort > 65535) {
+    error = std::string("bad TCP port range");
+    return 0;
+  }
+  int patterns = 0;
+  for (int i=0; i<(int)parameterVector.size(); i++) {
+    const std::string &token = parameterVector[i];
+    if (token.empty()) {
       continue;
     }
-    std::string k1 = parametersV[i].substr(0,found);
-    std::string v1 = parametersV[i].substr(found+1);
-    if (k1.length() <= 0) {
+    std::size_t found = token.find('=');
+    if (found == std::string::npos || found == 0) {
+      warnings.push_back(std::string("ignore ") + token);
       continue;
     }
-    ret[k1] = v1;
+    std::string key = token.substr(0, found);
+    std::string value = token.substr(found + 1);
+    int known = 0;
+    for (int j=0; j<(int)(sizeof(numberOperands)/sizeof(numberOperands[0])); j++) {
+      if (key.compare(numberOperands[j]) == 0) {
+	long long number;
+	if (!parseDDNumber(value, &number)) {
+	  error = std::string("bad number ") + token;
+	  return 0;
+	}
+	known = 1;
+      }
+    }
+    for (int j=0; j<(int)(sizeof(otherOperands)/sizeof(otherOperands[0])); j++) {
+      if (key.compare(otherOperands[j]) == 0) {
+	known = 1;
+      }
+    }
+    if (!known) {
+      warnings.push_back(std::string("unknown operand ") + token);
+    }
+    if ((key.compare("if") == 0 || key.compare("of") == 0) && isDevicePattern(value)) {
+      if (isDevicePattern(value.substr(0, value.rfind('/') + 1))) {
+	error = std::string("wildcards are only allowed in the file name of ") + token;
+	return 0;
+      }
+      patterns++;
+    }
   }
-  return ret;
+  if (patterns > 1) {
+    error = std::string("more than one device pattern");
+    return 0;
+  }
+  if (lastPort != port && patterns == 0) {
+    error = std::string("a TCP port range needs a device pattern");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * parse a number in dd operand format.
+ *
+ * The number may be followed by a multiplicative suffix as in dd:
+ * c=1, w=2, b=512, kB=1000, K=1024, MB=1000*1000, M=1024*1024,
+ * GB=1000*1000*1000 and G=1024*1024*1024.
+ *
+ * @param str the string to be parsed.
+ * @param value the parsed value is stored here on success.
+ *
+ * @return 1 if success, 0 if the string is not a valid number.
+ */
+int parseDDNumber(const std::string &str, long long *value) {
+  static const struct {
+    const char *suffix;
+    long long multiplier;
+  } suffixes[] = {
+    { "", 1LL },
+    { "c", 1LL },
+    { "w", 2LL },
+    { "b", 512LL },
+    { "kB", 1000LL },
+    { "K", 1024LL },
+    { "MB", 1000LL*1000LL },
+    { "M", 1024LL*1024LL },
+    { "GB", 1000LL*1000LL*1000LL },
+    { "G", 1024LL*1024LL*1024LL },
+  };
+  std::size_t pos = 0;
+  while (pos < str.length() && str[pos] >= '0' && str[pos] <= '9') {
+    pos++;
+  }
+  if (pos == 0 || pos > 18) {
+    return 0;
+  }
+  long long number = std::stoll(str.substr(0, pos));
+  std::string suffix = str.substr(pos);
+  for (int i=0; i<(int)(sizeof(suffixes)/sizeof(suffixes[0])); i++) {
+    if (suffix.compare(suffixes[i].suffix) == 0) {
+      if (number > LLONG_MAX / suffixes[i].multiplier) {
+	return 0;
+      }
+      *value = number * suffixes[i].multiplier;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * check if a device path is a glob pattern.
+ *
+ * @param path the device path.
+ *
+ * @return 1 if it has any of the wildcards *, ? and [, 0 otherwise.
+ */
+int isDevicePattern(const std::string &path) {
+  return path.find_first_of("*?[") != std::string::npos;
 }
@@ -28,15 +28,28 @@
  */
 class UMS2NETConfRecord {
  private:
-  int port; ///< TCP port
+  int port; ///< TCP port, the first one of a range
+  int lastPort; ///< the last TCP port of a range, port if there is no range
   std::string ddParameter; ///< parameters in dd operand format.
+  std::vector<std::string> parameterVector; ///< ddParameter split at load
+  std::map<std::string, std::string> parameterMap; ///< ddParameter split at load
 
  public:
   UMS2NETConfRecord(int, std::string &);
+  UMS2NETConfRecord(int, int, std::string &);
   int getPort() const;
+  int getLastPort() const;
   std::string getDDParameter() const;
-  std::vector<std::string> getDDParameterVector() const;
-  std::map<std::string, std::string> getDDParameterMap() const;
+  const std::vector<std::string>& getDDParameterVector() const;
+  const std::map<std::string, std::string>& getDDParameterMap() const;
+  std::vector<std::string> getDDParameterValues(const std::string &) const;
+  std::string getDevicePattern() const;
+  int isTemplate() const;
+  UMS2NETConfRecord bindDevice(int, const std::string &) const;
+  int validate(std::string &, std::vector<std::string> &) const;
 };
 
+int parseDDNumber(const std::string &, long long *);
+int isDevicePattern(const std::string &);
+
 #endif /* _HEADER_UMS2NETCONFRECORD_HEAD1_H */
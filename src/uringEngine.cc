@@ -0,0 +1,551 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <deque>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "main.h"
+#include "copyEngine.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hubScheduler.h"
+#include "include/config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+
+/** user_data of the cancel request, never a slot index */
+#define URING_CANCEL_DATA (~0ULL)
+
+/**
+ * The mapped rings of one io_uring instance.
+ */
+struct UringRing {
+  int fd; ///< the io_uring file descriptor
+  void *sqRing; ///< mapping of the submission ring
+  size_t sqRingSize; ///< size of sqRing
+  void *cqRing; ///< mapping of the completion ring, may equal sqRing
+  size_t cqRingSize; ///< size of cqRing
+  struct io_uring_sqe *sqes; ///< the submission queue entries
+  size_t sqesSize; ///< size of sqes
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+  unsigned toSubmit; ///< entries queued since the last io_uring_enter()
+};
+
+/**
+ * One buffer of copyUring() and the block it currently holds.
+ */
+struct UringSlot {
+  char *buf; ///< the buffer
+  off_t offset; ///< where the block goes on the device
+  ssize_t len; ///< number of valid bytes in buf
+  ssize_t done; ///< number of bytes already written
+  long long queued; ///< when the receive or the first write was queued
+};
+
+/**
+ * create an io_uring and map its rings.
+ *
+ * @param ring the ring to be set up.
+ * @param entries the number of submission queue entries.
+ *
+ * @return 0 on success, -errno on error.
+ */
+static int uringSetup(UringRing *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return -errno;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) {
+      ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->cqRingSize = ring->sqRingSize;
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    int errsv = errno;
+    close(ring->fd);
+    return -errsv;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+      int errsv = errno;
+      munmap(ring->sqRing, ring->sqRingSize);
+      close(ring->fd);
+      return -errsv;
+    }
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    int errsv = errno;
+    if (ring->cqRing != ring->sqRing) {
+      munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    return -errsv;
+  }
+
+  char *sq = (char *)ring->sqRing;
+  char *cq = (char *)ring->cqRing;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+/**
+ * unmap the rings and close the io_uring.
+ *
+ * @param ring the ring.
+ */
+static void uringTeardown(UringRing *ring) {
+  munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing != ring->sqRing) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+}
+
+/**
+ * get the next free submission queue entry.
+ *
+ * The caller never has more requests in flight than the ring has entries,
+ * so the submission queue cannot be full.
+ *
+ * @param ring the ring.
+ *
+ * @return the cleared entry.
+ */
+static struct io_uring_sqe *uringGetSQE(UringRing *ring) {
+  unsigned tail = *ring->sqTail;
+  unsigned index = tail & *ring->sqMask;
+  struct io_uring_sqe *sqe = &(ring->sqes[index]);
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqArray[index] = index;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ring->toSubmit++;
+  return sqe;
+}
+
+/**
+ * submit the queued entries and wait for at least one completion.
+ *
+ * @param ring the ring.
+ *
+ * @return 0 on success, -errno on error.
+ */
+static int uringSubmitAndWait(UringRing *ring) {
+  while (1) {
+    int result = (int)syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (result < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -errno;
+    }
+    ring->toSubmit -= (unsigned)result;
+    return 0;
+  }
+}
+
+/**
+ * queue a receive of what is missing of the block in a slot.
+ *
+ * @param ring the ring.
+ * @param slots the slots.
+ * @param index the slot to receive into.
+ * @param sockFD the socket, or its index in the registered files.
+ * @param sqeFlags IOSQE_FIXED_FILE if files are registered.
+ * @param bufSize the size of each block.
+ */
+static void uringQueueRecv(UringRing *ring, std::vector<UringSlot> &slots, int index, int sockFD, unsigned char sqeFlags, int bufSize) {
+  UringSlot *slot = &(slots[index]);
+  struct io_uring_sqe *sqe = uringGetSQE(ring);
+  if (slot->len == 0) {
+    slot->queued = metricsNow();
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->flags = sqeFlags;
+  sqe->fd = sockFD;
+  sqe->addr = (unsigned long)(slot->buf + slot->len);
+  sqe->len = (unsigned)(bufSize - slot->len);
+  sqe->msg_flags = MSG_WAITALL;
+  sqe->user_data = ((unsigned long long)index << 1);
+}
+
+/**
+ * cancel the receive in flight and wait until the kernel has finished it.
+ *
+ * @param ring the ring.
+ * @param index the slot being received into.
+ *
+ * @return the result of the receive, -ECANCELED if it was cancelled, or
+ * -errno if the ring failed and the receive may still be in flight.
+ */
+static int uringCancelRecv(UringRing *ring, int index) {
+  unsigned long long recvData = ((unsigned long long)index << 1);
+  struct io_uring_sqe *sqe = uringGetSQE(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = recvData;
+  sqe->user_data = URING_CANCEL_DATA;
+
+  while (1) {
+    int result = uringSubmitAndWait(ring);
+    if (result < 0) {
+      return result;
+    }
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    int found = 0;
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &(ring->cqes[head & *ring->cqMask]);
+      if (cqe->user_data == recvData) {
+	found = 1;
+	result = cqe->res;
+      }
+      head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    if (found) {
+      return result;
+    }
+  }
+}
+
+/**
+ * queue a write of what is left of the block in a slot.
+ *
+ * @param ring the ring.
+ * @param slots the slots.
+ * @param index the slot to be written.
+ * @param outFD the device, or its index in the registered files.
+ * @param sqeFlags IOSQE_FIXED_FILE if files are registered.
+ * @param fixedBuffers 1 if the slot buffers are registered.
+ */
+static void uringQueueWrite(UringRing *ring, std::vector<UringSlot> &slots, int index, int outFD, unsigned char sqeFlags, int fixedBuffers) {
+  UringSlot *slot = &(slots[index]);
+  struct io_uring_sqe *sqe = uringGetSQE(ring);
+  sqe->opcode = fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->flags = sqeFlags;
+  sqe->fd = outFD;
+  sqe->off = (unsigned long long)(slot->offset + slot->done);
+  sqe->addr = (unsigned long)(slot->buf + slot->done);
+  sqe->len = (unsigned)(slot->len - slot->done);
+  if (fixedBuffers) {
+    sqe->buf_index = (unsigned short)index;
+  }
+  sqe->user_data = ((unsigned long long)index << 1) | 1ULL;
+}
+
+/**
+ * copy data from socket to device with io_uring.
+ *
+ * One receive is kept in flight on the socket. Every received block is
+ * written at its own offset, so up to queueDepth device writes are
+ * outstanding while the next block is received. The buffers and the two
+ * file descriptors are registered with the ring when the kernel allows it.
+ *
+ * A short receive does not end the stream: MSG_WAITALL is not honoured by
+ * every kernel and a signal can cut a receive short, so the rest of the
+ * block is received again. Only a receive of 0 bytes is the end of stream.
+ *
+ * If the kernel has no io_uring or cannot receive on it, *unsupported is set
+ * to 1 before anything is taken from the socket, once no receive is left in
+ * flight, and the caller should continue with copyLoop().
+ *
+ * @param clientSocket the socket which is connected to the client.
+ * @param outFD the file descriptor of the device.
+ * @param bufSize the size of each block.
+ * @param queueDepth the maximum number of outstanding device writes.
+ * @param unsupported set to 1 if io_uring is not supported, otherwise 0.
+ * @param error set to 1 if the copy stops before the end of the data,
+ *        otherwise 0.
+ *
+ * @return the number of bytes written to the device.
+ */
+ssize_t copyUring(int clientSocket, int outFD, int bufSize, int queueDepth, int *unsupported, int *error) {
+  UringRing ring;
+  std::vector<UringSlot> slots;
+  std::deque<int> freeSlots;
+  ssize_t totalLen = 0;
+  int result;
+
+  *unsupported = 0;
+  *error = 0;
+  if (queueDepth < 1) {
+    queueDepth = 1;
+  }
+
+  /* writes are positioned, so start where the file position is now */
+  off_t offset = lseek(outFD, 0, SEEK_CUR);
+  if (offset < 0) {
+    *unsupported = 1;
+    return 0;
+  }
+
+  result = uringSetup(&ring, (unsigned)(queueDepth + 1));
+  if (result < 0) {
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(-result, errbuf, sizeof(errbuf));
+    syslog(LOG_DEBUG, "Cannot set up io_uring (%s)", errstr);
+    *unsupported = 1;
+    return 0;
+  }
+
+  /* allocate one buffer per outstanding write plus the one being received */
+  std::vector<struct iovec> iovecs;
+  for (int i=0; i<queueDepth+1; i++) {
+    UringSlot slot;
+    slot.buf = (char *)malloc(sizeof(char)*bufSize);
+    if (slot.buf == NULL) {
+      syslog(LOG_ERR, "Malloc buffer for %d bytes failed", bufSize);
+      break;
+    }
+    slot.offset = 0;
+    slot.len = 0;
+    slot.done = 0;
+    slots.push_back(slot);
+    freeSlots.push_back(i);
+    struct iovec iov;
+    iov.iov_base = slot.buf;
+    iov.iov_len = bufSize;
+    iovecs.push_back(iov);
+  }
+  if ((int)slots.size() < queueDepth+1) {
+    for (int i=0; i<(int)slots.size(); i++) {
+      free(slots[i].buf);
+    }
+    uringTeardown(&ring);
+    *error = 1;
+    return 0;
+  }
+
+  /* register buffers and files. Failures here only cost some overhead. */
+  int fixedBuffers = 0;
+  unsigned char sqeFlags = 0;
+  int sockFD = clientSocket;
+  int devFD = outFD;
+  result = (int)syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size());
+  if (result == 0) {
+    fixedBuffers = 1;
+  } else {
+    syslog(LOG_DEBUG, "Cannot register io_uring buffers (%s)", strerror(errno));
+  }
+  int files[2] = { clientSocket, outFD };
+  result = (int)syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2U);
+  if (result == 0) {
+    sqeFlags = IOSQE_FIXED_FILE;
+    sockFD = 0;
+    devFD = 1;
+  } else {
+    syslog(LOG_DEBUG, "Cannot register io_uring files (%s)", strerror(errno));
+  }
+
+  int receiving = -1;
+  int inflightWrites = 0;
+  int eof = 0;
+  int ended = 0;
+  int writeError = 0;
+  ssize_t receivedLen = 0;
+  while (1) {
+    if (!eof && !writeError && !quitFlag && receiving < 0 && !freeSlots.empty()) {
+      receiving = freeSlots.front();
+      freeSlots.pop_front();
+      slots[receiving].len = 0;
+      uringQueueRecv(&ring, slots, receiving, sockFD, sqeFlags, bufSize);
+    }
+    if (receiving < 0 && inflightWrites == 0) {
+      break;
+    }
+
+    result = uringSubmitAndWait(&ring);
+    if (result < 0) {
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(-result, errbuf, sizeof(errbuf));
+      syslog(LOG_ERR, "io_uring_enter() failed (%s)", errstr);
+      if (receivedLen == 0) {
+	/* without data there are no writes, only the receive can be pending */
+	if (receiving < 0 || ring.toSubmit > 0) {
+	  *unsupported = 1;
+	} else {
+	  result = uringCancelRecv(&ring, receiving);
+	  if (result == -ECANCELED || result == -EINTR || result == -EINVAL || result == -EOPNOTSUPP) {
+	    *unsupported = 1;
+	  } else {
+	    syslog(LOG_ERR, "Cannot fall back from io_uring, the receive did not cancel (%d)", result);
+	  }
+	}
+      }
+      break;
+    }
+
+    /* reap completions */
+    unsigned head = *ring.cqHead;
+    unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe *cqe = &(ring.cqes[head & *ring.cqMask]);
+      int index = (int)(cqe->user_data >> 1);
+      int isWrite = (int)(cqe->user_data & 1ULL);
+      int res = cqe->res;
+      head++;
+
+      if (!isWrite) {
+	if (res == -EINTR || res == -EAGAIN) {
+	  /* keep what was received and ask for the rest again */
+	  uringQueueRecv(&ring, slots, index, sockFD, sqeFlags, bufSize);
+	  continue;
+	} else if (res < 0) {
+	  /* only one receive is ever in flight, so none is left to drain */
+	  if (receivedLen == 0 && (res == -EINVAL || res == -EOPNOTSUPP)) {
+	    *unsupported = 1;
+	  } else {
+	    char errbuf[1024];
+	    char *errstr;
+	    errstr = strerror_r(-res, errbuf, sizeof(errbuf));
+	    syslog(LOG_DEBUG, "read from client socket ended (%s)", errstr);
+	    metricsError(METRICS_ERROR_RECV);
+	  }
+	  eof = 1;
+	} else if (res == 0) {
+	  syslog(LOG_DEBUG, "read from client socket ended");
+	  eof = 1;
+	  ended = 1;
+	} else {
+	  receivedLen += res;
+	  slots[index].len += res;
+	  if (slots[index].len < bufSize && !quitFlag) {
+	    uringQueueRecv(&ring, slots, index, sockFD, sqeFlags, bufSize);
+	    continue;
+	  }
+	}
+	receiving = -1;
+	if (slots[index].len == 0 || writeError || *unsupported) {
+	  freeSlots.push_back(index);
+	  continue;
+	}
+	long long received = metricsNow();
+	metricsAddRecv(slots[index].len, received - slots[index].queued);
+	traceSpan("recv", slots[index].queued, received);
+	slots[index].offset = offset;
+	slots[index].done = 0;
+	slots[index].queued = received;
+	offset += slots[index].len;
+	uringQueueWrite(&ring, slots, index, devFD, sqeFlags, fixedBuffers);
+	inflightWrites++;
+      } else {
+	if (res == -EINTR || res == -EAGAIN) {
+	  uringQueueWrite(&ring, slots, index, devFD, sqeFlags, fixedBuffers);
+	  continue;
+	} else if (res <= 0) {
+	  if (!writeError) {
+	    char errbuf[1024];
+	    char *errstr;
+	    errstr = strerror_r(res < 0 ? -res : EIO, errbuf, sizeof(errbuf));
+	    syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+	    metricsError(METRICS_ERROR_WRITE);
+	  }
+	  writeError = 1;
+	  inflightWrites--;
+	  freeSlots.push_back(index);
+	  continue;
+	}
+	totalLen += res;
+	slots[index].done += res;
+	if (slots[index].done < slots[index].len) {
+	  uringQueueWrite(&ring, slots, index, devFD, sqeFlags, fixedBuffers);
+	  continue;
+	}
+	long long written = metricsNow();
+	metricsAddWrite(slots[index].len, written - slots[index].queued);
+	traceSpan("write", slots[index].queued, written);
+	hubThrottle(slots[index].len);
+	inflightWrites--;
+	freeSlots.push_back(index);
+      }
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+    if (*unsupported) {
+      break;
+    }
+  }
+
+  /* stopped by a failure or by a signal before the end of the data */
+  if (!*unsupported && (writeError || !ended)) {
+    *error = 1;
+  }
+
+  /* leave the file position after the data, as write() would have */
+  lseek(outFD, offset, SEEK_SET);
+
+  uringTeardown(&ring);
+  for (int i=0; i<(int)slots.size(); i++) {
+    free(slots[i].buf);
+  }
+  return totalLen;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+ssize_t copyUring(int clientSocket, int outFD, int bufSize, int queueDepth, int *unsupported, int *error) {
+  *unsupported = 1;
+  *error = 0;
+  return 0;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,281 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+
+#include "verifier.h"
+#include "checksum.h"
+
+/**
+ * read one chunk back from the device.
+ *
+ * The read is widened to 4096-byte boundaries, which are a multiple of the
+ * logical block size of all common devices, so that O_DIRECT accepts any
+ * chunk offset. If the device cannot be read with O_DIRECT, the chunk is
+ * not compared at all, since a buffered read may come from the page cache.
+ *
+ * @param v the verifier.
+ * @param chunk the chunk.
+ *
+ * @return 1 if the device holds the same data, 0 if not, -1 if the chunk
+ * cannot be verified.
+ */
+static int verifyChunk(Verifier *v, const VerifyChunk &chunk) {
+  if (!v->direct) {
+    return -1;
+  }
+  off_t start = (chunk.offset / v->alignment) * v->alignment;
+  size_t skip = (size_t)(chunk.offset - start);
+  size_t need = skip + chunk.len;
+  size_t len = ((need + v->alignment - 1) / v->alignment) * v->alignment;
+  size_t done = 0;
+  while (done < need) {
+    ssize_t r1 = pread(v->fd, v->buf + done, len - done, start + (off_t)done);
+    if (r1 < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r1 < 0 && errno == EINVAL) {
+      syslog(LOG_WARNING, "Cannot read back with O_DIRECT, the rest is not verified");
+      v->direct = 0;
+      return -1;
+    }
+    if (r1 <= 0) {
+      if (r1 < 0) {
+	int errsv = errno;
+	char errbuf[1024];
+	char *errstr;
+	errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+	syslog(LOG_ERR, "Cannot read back offset %lld (%s)", (long long)(start + (off_t)done), errstr);
+      }
+      return 0;
+    }
+    done += (size_t)r1;
+  }
+  return crc32c(0, v->buf + skip, chunk.len) == chunk.crc;
+}
+
+/**
+ * the reading thread of a Verifier.
+ *
+ * @param data the pointer of Verifier
+ *
+ * @return NULL.
+ */
+static void* verifierThread(void *data) {
+  Verifier *v = (Verifier *)(data);
+  while (1) {
+    pthread_mutex_lock(&v->mutex);
+    while (!v->stop && (v->chunks.empty()
+			|| v->chunks.front().offset + (off_t)v->chunks.front().len > v->writtenOffset)) {
+      pthread_cond_wait(&v->cond, &v->mutex);
+    }
+    if (v->chunks.empty()) {
+      pthread_mutex_unlock(&v->mutex);
+      break;
+    }
+    VerifyChunk chunk = v->chunks.front();
+    v->chunks.pop_front();
+    pthread_mutex_unlock(&v->mutex);
+
+    int same = verifyChunk(v, chunk);
+
+    pthread_mutex_lock(&v->mutex);
+    if (same < 0) {
+      v->unverified += (long long)chunk.len;
+    } else if (same) {
+      v->verified += (long long)chunk.len;
+    } else {
+      if (v->firstMismatch < 0) {
+	v->firstMismatch = chunk.offset;
+      }
+      v->mismatched += (long long)chunk.len;
+    }
+    pthread_mutex_unlock(&v->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * start reading back the device behind the writer.
+ *
+ * @param v the verifier.
+ * @param devFilename the device path, opened again for reading.
+ * @param offset where the incoming data starts on the device.
+ * @param chunkSize the size of each read.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int verifierStart(Verifier *v, const std::string &devFilename, off_t offset, size_t chunkSize) {
+  v->direct = 1;
+  v->fd = open(devFilename.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+  if (v->fd < 0 && errno == EINVAL) {
+    syslog(LOG_WARNING, "Cannot open %s with O_DIRECT, the data is not verified", devFilename.c_str());
+    v->direct = 0;
+    v->fd = open(devFilename.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (v->fd < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    syslog(LOG_ERR, "Cannot open %s for verification (%s)", devFilename.c_str(), errstr);
+    return -1;
+  }
+  v->alignment = 4096;
+  v->chunkSize = chunkSize;
+  v->writtenOffset = offset;
+  v->stop = 0;
+  v->current.offset = offset;
+  v->current.len = 0;
+  v->current.crc = 0;
+  v->verified = 0;
+  v->mismatched = 0;
+  v->unverified = 0;
+  v->firstMismatch = -1;
+  void *buf = NULL;
+  /* room for an unaligned chunk widened at both ends */
+  if (posix_memalign(&buf, v->alignment, chunkSize + 2*v->alignment) != 0) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", (int)chunkSize);
+    close(v->fd);
+    return -1;
+  }
+  v->buf = (char *)buf;
+  pthread_mutex_init(&v->mutex, NULL);
+  pthread_cond_init(&v->cond, NULL);
+  int result = pthread_create(&v->thread, NULL, verifierThread, v);
+  if (result != 0) {
+    syslog(LOG_ERR, "Cannot create verify thread (%s)", strerror(result));
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->mutex);
+    free(v->buf);
+    close(v->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * queue a complete chunk for the thread.
+ *
+ * @param v the verifier.
+ */
+static void verifierQueue(Verifier *v) {
+  pthread_mutex_lock(&v->mutex);
+  v->chunks.push_back(v->current);
+  pthread_mutex_unlock(&v->mutex);
+  v->current.offset += (off_t)v->current.len;
+  v->current.len = 0;
+  v->current.crc = 0;
+}
+
+/**
+ * add the next incoming data.
+ *
+ * The data is cut into chunks aligned to the chunk size from the start
+ * offset, and the CRC32C of each chunk is kept until it is read back.
+ *
+ * @param v the verifier.
+ * @param buf the data which is written after the previous one.
+ * @param len the length of the data.
+ */
+void verifierAdd(Verifier *v, const char *buf, size_t len) {
+  while (len > 0) {
+    size_t n = v->chunkSize - v->current.len;
+    if (n > len) {
+      n = len;
+    }
+    v->current.crc = crc32c(v->current.crc, buf, n);
+    v->current.len += n;
+    buf += n;
+    len -= n;
+    if (v->current.len == v->chunkSize) {
+      verifierQueue(v);
+    }
+  }
+}
+
+/**
+ * pass over data which is not written to the device.
+ *
+ * Used for blocks which are skipped or discarded, as the device may not
+ * read them back as zeros. The chunk being added ends before them and
+ * they are counted as unverified.
+ *
+ * @param v the verifier.
+ * @param len the length of the data.
+ */
+void verifierSkip(Verifier *v, size_t len) {
+  if (v->current.len > 0) {
+    verifierQueue(v);
+  }
+  v->current.offset += (off_t)len;
+  pthread_mutex_lock(&v->mutex);
+  v->unverified += (long long)len;
+  pthread_mutex_unlock(&v->mutex);
+}
+
+/**
+ * tell the thread how far the device is written.
+ *
+ * @param v the verifier.
+ * @param offset the device holds the data before this offset.
+ */
+void verifierWritten(Verifier *v, off_t offset) {
+  pthread_mutex_lock(&v->mutex);
+  if (offset > v->writtenOffset) {
+    v->writtenOffset = offset;
+    if (!v->chunks.empty() && v->chunks.front().offset + (off_t)v->chunks.front().len <= offset) {
+      pthread_cond_broadcast(&v->cond);
+    }
+  }
+  pthread_mutex_unlock(&v->mutex);
+}
+
+/**
+ * read back the rest of the data and stop the thread.
+ *
+ * Must be called after the writer has finished the device.
+ *
+ * @param v the verifier.
+ *
+ * @return 0 if all the data is on the device, -1 if not.
+ */
+int verifierStop(Verifier *v) {
+  if (v->current.len > 0) {
+    verifierQueue(v);
+  }
+  pthread_mutex_lock(&v->mutex);
+  v->stop = 1;
+  pthread_cond_broadcast(&v->cond);
+  pthread_mutex_unlock(&v->mutex);
+  pthread_join(v->thread, NULL);
+  pthread_cond_destroy(&v->cond);
+  pthread_mutex_destroy(&v->mutex);
+  free(v->buf);
+  close(v->fd);
+  return (v->mismatched == 0) ? 0 : -1;
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_VERIFIER_HEAD1_H
+#define _HEADER_UMS2NET_VERIFIER_HEAD1_H
+
+#include <deque>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * A range of the device and the CRC32C of the data written to it.
+ */
+struct VerifyChunk {
+  off_t offset; ///< the device offset
+  size_t len; ///< the length
+  uint32_t crc; ///< the CRC32C of the data sent by the client
+};
+
+/**
+ * Reads back what the writer has written, a few chunks behind it, and
+ * compares it with the CRC32C of the incoming data.
+ *
+ * The writer cuts the data into chunks with verifierAdd() and tells the
+ * thread how far the device is written with verifierWritten(). The thread
+ * reads every chunk that is completely written with its own O_DIRECT file
+ * descriptor, so the data comes from the device and not the page cache.
+ * Data which is not written, or cannot be read with O_DIRECT, is counted
+ * as unverified instead.
+ */
+struct Verifier {
+  pthread_t thread; ///< the reading thread
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int fd; ///< the device, opened for reading
+  size_t chunkSize; ///< the size of each chunk
+  int alignment; ///< the alignment of O_DIRECT reads
+  int direct; ///< 1 while fd can be read with O_DIRECT
+  char *buf; ///< the aligned read buffer
+  std::deque<VerifyChunk> chunks; ///< chunks waiting to be read back
+  off_t writtenOffset; ///< the device holds the data before this offset
+  int stop; ///< set when no more chunks are added
+  VerifyChunk current; ///< the chunk being added
+  long long verified; ///< bytes read back and matched
+  long long mismatched; ///< bytes read back and differing
+  long long unverified; ///< bytes not written or not read back
+  off_t firstMismatch; ///< the offset of the first differing chunk, -1 if none
+};
+
+int verifierStart(Verifier *v, const std::string &devFilename, off_t offset, size_t chunkSize);
+void verifierAdd(Verifier *v, const char *buf, size_t len);
+void verifierSkip(Verifier *v, size_t len);
+void verifierWritten(Verifier *v, off_t offset);
+int verifierStop(Verifier *v);
+
+#endif /* _HEADER_UMS2NET_VERIFIER_HEAD1_H */
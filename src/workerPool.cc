@@ -0,0 +1,285 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sched.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "workerPool.h"
+
+/**
+ * A session waiting for a worker.
+ */
+struct WorkerJob {
+  void *(*run)(void *); ///< the function which serves the session
+  void *arg; ///< its argument
+  int node; ///< the NUMA node to run on, -1 for any
+};
+
+/**
+ * A thread of the pool, pinned to one CPU.
+ */
+struct Worker {
+  pthread_t thread; ///< the thread
+  int cpu; ///< the CPU it runs on
+  int node; ///< the NUMA node of the CPU
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static std::deque<WorkerJob> jobs;
+static std::vector<Worker> workers;
+static std::map<int, int> idleWorkers; ///< idle workers by NUMA node
+static std::map<int, int> cpuNodes; ///< NUMA node by CPU
+static int running = 0;
+
+/**
+ * find the NUMA node of every CPU which this process may run on.
+ *
+ * @param nodes the node of each CPU is stored here, 0 if the system has
+ *        no NUMA information.
+ */
+static void readCPUNodes(std::map<int, int> &nodes) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    return;
+  }
+  for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    int node = 0;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != NULL) {
+	if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+	  node = atoi(entry->d_name + 4);
+	  break;
+	}
+      }
+      closedir(dir);
+    }
+    nodes[cpu] = node;
+  }
+}
+
+/**
+ * take the next session for a worker.
+ *
+ * A session goes to a worker on its NUMA node. It goes to a worker of
+ * another node only when its own node has no idle worker, so it does not
+ * wait while the pool has room. Called with the lock held.
+ *
+ * @param self the worker.
+ * @param job the session is stored here.
+ *
+ * @return 1 if a session is taken, 0 if there is none for this worker.
+ */
+static int takeJob(const Worker *self, WorkerJob *job) {
+  for (std::deque<WorkerJob>::iterator it=jobs.begin(); it!=jobs.end(); ++it) {
+    int local = (it->node < 0 || it->node == self->node);
+    std::map<int, int>::iterator idle = idleWorkers.find(it->node);
+    if (local || !running || idle == idleWorkers.end() || idle->second == 0) {
+      *job = *it;
+      jobs.erase(it);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * the thread of a worker, which serves one session after another.
+ *
+ * @param data the Worker.
+ *
+ * @return NULL.
+ */
+static void* workerThread(void *data) {
+  Worker *self = (Worker *)data;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(self->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    syslog(LOG_WARNING, "Cannot pin a worker to CPU %d", self->cpu);
+  }
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    WorkerJob job;
+    if (!takeJob(self, &job)) {
+      if (!running) {
+	break;
+      }
+      pthread_cond_wait(&ready, &lock);
+      continue;
+    }
+    /* the others may take what this one has left */
+    idleWorkers[self->node]--;
+    if (!jobs.empty()) {
+      pthread_cond_broadcast(&ready);
+    }
+    pthread_mutex_unlock(&lock);
+    /* the buffers of the session are touched first here, so they are
+       allocated on the node of the worker */
+    job.run(job.arg);
+    pthread_mutex_lock(&lock);
+    idleWorkers[self->node]++;
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/**
+ * start a pool of workers which serve the sessions.
+ *
+ * The workers are spread over the NUMA nodes in turn and each one is
+ * pinned to a CPU of its node. At most as many sessions as workers are
+ * served at once; the others wait in a queue.
+ *
+ * @param count the number of workers.
+ *
+ * @return 0 on success, -1 if each session has its own thread.
+ */
+int workerPoolStart(int count) {
+  readCPUNodes(cpuNodes);
+  if (count <= 0 || cpuNodes.empty()) {
+    return -1;
+  }
+  std::map<int, std::vector<int> > nodeCPUs;
+  for (std::map<int, int>::iterator it=cpuNodes.begin(); it!=cpuNodes.end(); ++it) {
+    nodeCPUs[it->second].push_back(it->first);
+  }
+  std::vector<int> nodes;
+  for (std::map<int, std::vector<int> >::iterator it=nodeCPUs.begin(); it!=nodeCPUs.end(); ++it) {
+    nodes.push_back(it->first);
+  }
+
+  workers.resize(count);
+  for (int i=0; i<count; i++) {
+    int node = nodes[i % nodes.size()];
+    const std::vector<int> &cpus = nodeCPUs[node];
+    workers[i].node = node;
+    workers[i].cpu = cpus[(i / nodes.size()) % cpus.size()];
+    idleWorkers[node]++;
+  }
+  running = 1;
+  for (int i=0; i<count; i++) {
+    int result = pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]);
+    if (result != 0) {
+      syslog(LOG_ERR, "Cannot create worker thread (%s), %d workers", strerror(result), i);
+      pthread_mutex_lock(&lock);
+      for (int j=i; j<count; j++) {
+	idleWorkers[workers[j].node]--;
+      }
+      pthread_mutex_unlock(&lock);
+      workers.resize(i);
+      break;
+    }
+  }
+  if (workers.empty()) {
+    running = 0;
+    return -1;
+  }
+  syslog(LOG_INFO, "%d workers on %d NUMA nodes", (int)workers.size(), (int)nodes.size());
+  return 0;
+}
+
+/**
+ * check if the sessions are served by the pool.
+ *
+ * @return 1 if the pool is running, 0 otherwise.
+ */
+int workerPoolRunning() {
+  return running;
+}
+
+/**
+ * queue a session for the pool.
+ *
+ * @param run the function which serves the session.
+ * @param arg its argument.
+ * @param node the NUMA node of its device, -1 if unknown.
+ */
+void workerPoolSubmit(void *(*run)(void *), void *arg, int node) {
+  WorkerJob job;
+  job.run = run;
+  job.arg = arg;
+  job.node = node;
+  pthread_mutex_lock(&lock);
+  int idle = 0;
+  for (std::map<int, int>::iterator it=idleWorkers.begin(); it!=idleWorkers.end(); ++it) {
+    idle += it->second;
+  }
+  if (idle <= (int)jobs.size()) {
+    syslog(LOG_INFO, "All %d workers are busy, queue a session behind %d others", (int)workers.size(), (int)jobs.size());
+  }
+  jobs.push_back(job);
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * stop the pool once the queued sessions are served.
+ */
+void workerPoolStop() {
+  pthread_mutex_lock(&lock);
+  int wasRunning = running;
+  running = 0;
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&lock);
+  if (!wasRunning) {
+    return;
+  }
+  for (int i=0; i<(int)workers.size(); i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  workers.clear();
+  idleWorkers.clear();
+}
+
+/**
+ * find the NUMA node of the network card which a client came from.
+ *
+ * @param socket the socket which is connected to the client.
+ *
+ * @return the node of the CPU which took its packets, -1 if unknown.
+ */
+int workerPoolSocketNode(int socket) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0) {
+    return -1;
+  }
+  std::map<int, int>::iterator it = cpuNodes.find(cpu);
+  return it == cpuNodes.end() ? -1 : it->second;
+}
@@ -0,0 +1,27 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_WORKER_POOL_HEAD1_H
+#define _HEADER_UMS2NET_WORKER_POOL_HEAD1_H
+
+int workerPoolStart(int workers);
+int workerPoolRunning();
+void workerPoolSubmit(void *(*run)(void *), void *arg, int node);
+void workerPoolStop();
+int workerPoolSocketNode(int socket);
+
+#endif /* _HEADER_UMS2NET_WORKER_POOL_HEAD1_H */
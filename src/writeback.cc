@@ -0,0 +1,157 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "writeback.h"
+#include "metrics.h"
+#include "trace.h"
+
+/**
+ * initialize a Writeback for a device.
+ *
+ * The window is a quarter of the dirty limit, but at least 1 MiB.
+ *
+ * @param wb the writeback.
+ * @param fd the device, positioned where the data starts.
+ * @param dirtyLimit bytes which may be in the page cache, 0 to disable.
+ *
+ * @return 0 on success, -1 if writeback is not controlled for this device.
+ */
+int writebackInit(Writeback *wb, int fd, off_t dirtyLimit) {
+  struct stat statbuf;
+  wb->fd = fd;
+  wb->dirtyLimit = dirtyLimit;
+  wb->window = dirtyLimit / 4;
+  if (wb->window < 1024*1024) {
+    wb->window = 1024*1024;
+  }
+  wb->offset = lseek(fd, 0, SEEK_CUR);
+  wb->submitted = wb->offset;
+  wb->completed = wb->offset;
+  wb->enabled = 0;
+  if (dirtyLimit <= 0 || wb->offset < 0) {
+    return -1;
+  }
+  if (fstat(fd, &statbuf) != 0 || !(S_ISBLK(statbuf.st_mode) || S_ISREG(statbuf.st_mode))) {
+    return -1;
+  }
+  if ((fcntl(fd, F_GETFL) & O_DIRECT) != 0) {
+    /* nothing goes through the page cache */
+    return -1;
+  }
+  wb->enabled = 1;
+  return 0;
+}
+
+/**
+ * call sync_file_range() and disable the writeback if it is not supported.
+ *
+ * @param wb the writeback.
+ * @param start the start of the range.
+ * @param len the length of the range.
+ * @param flags the SYNC_FILE_RANGE_* flags.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int writebackSync(Writeback *wb, off_t start, off_t len, unsigned int flags) {
+  int result;
+  long long syncStart = metricsNow();
+  do {
+    result = sync_file_range(wb->fd, start, len, flags);
+  } while (result < 0 && errno == EINTR);
+  traceSpan("sync_file_range", syncStart, metricsNow());
+  if (result < 0) {
+    int errsv = errno;
+    char errbuf[1024];
+    char *errstr;
+    errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+    if (errsv == EINVAL || errsv == ENOSYS || errsv == ESPIPE) {
+      syslog(LOG_INFO, "sync_file_range() is not supported (%s), leave writeback to the kernel", errstr);
+      wb->enabled = 0;
+      return 0;
+    }
+    syslog(LOG_ERR, "Cannot write back to the device (%s)", errstr);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * account for data the writer has passed.
+ *
+ * Blocks the writer has skipped are passed like written ones; syncing a
+ * range which has no dirty pages costs nothing.
+ *
+ * @param wb the writeback.
+ * @param len the number of bytes the writer has moved on.
+ *
+ * @return 0 on success, -1 if the data cannot be written to the device.
+ */
+int writebackAdd(Writeback *wb, off_t len) {
+  wb->offset += len;
+  if (!wb->enabled || wb->offset - wb->submitted < wb->window) {
+    return 0;
+  }
+  /* start writeback of the new window, without waiting */
+  if (writebackSync(wb, wb->submitted, wb->offset - wb->submitted, SYNC_FILE_RANGE_WRITE) < 0) {
+    return -1;
+  }
+  wb->submitted = wb->offset;
+  /* wait for the old windows and drop them from the page cache */
+  while (wb->enabled && wb->submitted - wb->completed > wb->dirtyLimit) {
+    off_t len1 = wb->window;
+    if (writebackSync(wb, wb->completed, len1,
+		      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+      return -1;
+    }
+    posix_fadvise(wb->fd, wb->completed, len1, POSIX_FADV_DONTNEED);
+    wb->completed += len1;
+  }
+  return 0;
+}
+
+/**
+ * write all the data of the session to the device and drop it from the
+ * page cache.
+ *
+ * @param wb the writeback.
+ *
+ * @return 0 on success, -1 if the data cannot be written to the device.
+ */
+int writebackFinish(Writeback *wb) {
+  if (!wb->enabled || wb->offset <= wb->completed) {
+    return 0;
+  }
+  if (writebackSync(wb, wb->completed, wb->offset - wb->completed,
+		    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+    return -1;
+  }
+  posix_fadvise(wb->fd, wb->completed, wb->offset - wb->completed, POSIX_FADV_DONTNEED);
+  wb->submitted = wb->offset;
+  wb->completed = wb->offset;
+  return 0;
+}
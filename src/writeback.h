@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_WRITEBACK_HEAD1_H
+#define _HEADER_UMS2NET_WRITEBACK_HEAD1_H
+
+#include <sys/types.h>
+
+/**
+ * Streams the dirty pages of a buffered session to the device behind the
+ * writer, so that the page cache holds at most dirtyLimit bytes of it.
+ *
+ * Writeback of every window of written data is started at once with
+ * sync_file_range(). When more than dirtyLimit bytes are not yet on the
+ * device, the writer waits for the oldest window, which is then dropped
+ * from the page cache.
+ */
+struct Writeback {
+  int fd; ///< the device
+  off_t window; ///< bytes written between two sync_file_range() calls
+  off_t dirtyLimit; ///< bytes which may be in the page cache
+  off_t offset; ///< the device offset the writer has reached
+  off_t submitted; ///< writeback is started up to this offset
+  off_t completed; ///< the data is on the device up to this offset
+  int enabled; ///< 0 if the device does not support sync_file_range()
+};
+
+int writebackInit(Writeback *wb, int fd, off_t dirtyLimit);
+int writebackAdd(Writeback *wb, off_t len);
+int writebackFinish(Writeback *wb);
+
+#endif /* _HEADER_UMS2NET_WRITEBACK_HEAD1_H */
@@ -0,0 +1,460 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "zeroBlock.h"
+
+/**
+ * check a buffer for zeros one machine word at a time.
+ *
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ *
+ * @return 1 if all bytes are zero, otherwise 0.
+ */
+static int isZeroBlockGeneric(const char *buf, size_t len) {
+  size_t i = 0;
+  while (i < len && ((uintptr_t)(buf + i) % sizeof(uint64_t)) != 0) {
+    if (buf[i] != 0) {
+      return 0;
+    }
+    i++;
+  }
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    if (*(const uint64_t *)(buf + i) != 0) {
+      return 0;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * check a buffer for zeros 64 bytes at a time with SSE2.
+ *
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ *
+ * @return 1 if all bytes are zero, otherwise 0.
+ */
+__attribute__((target("sse2")))
+static int isZeroBlockSSE2(const char *buf, size_t len) {
+  size_t i = 0;
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 64 <= len; i += 64) {
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+					  _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+			     _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+					  _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+      return 0;
+    }
+  }
+  return isZeroBlockGeneric(buf + i, len - i);
+}
+
+/**
+ * check a buffer for zeros 128 bytes at a time with AVX2.
+ *
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ *
+ * @return 1 if all bytes are zero, otherwise 0.
+ */
+__attribute__((target("avx2")))
+static int isZeroBlockAVX2(const char *buf, size_t len) {
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+						_mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+						_mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+    if (!_mm256_testz_si256(v, v)) {
+      return 0;
+    }
+  }
+  return isZeroBlockGeneric(buf + i, len - i);
+}
+#endif
+
+typedef int (*IsZeroBlockFunc)(const char *, size_t);
+
+/**
+ * pick the fastest implementation of isZeroBlock() for this CPU.
+ *
+ * @return the implementation.
+ */
+static IsZeroBlockFunc selectIsZeroBlock() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return isZeroBlockAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return isZeroBlockSSE2;
+  }
+#endif
+  return isZeroBlockGeneric;
+}
+
+/**
+ * check if a buffer contains only zeros.
+ *
+ * The implementation is chosen at the first call by the CPU features.
+ *
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ *
+ * @return 1 if all bytes are zero, otherwise 0.
+ */
+int isZeroBlock(const char *buf, size_t len) {
+  static const IsZeroBlockFunc func = selectIsZeroBlock();
+  /* most data blocks can be rejected by the first byte */
+  if (len > 0 && buf[0] != 0) {
+    return 0;
+  }
+  return func(buf, len);
+}
+
+/**
+ * parse the value of the zero= operand.
+ *
+ * @param str the value: write, skip, zeroout or discard.
+ * @param policy the ZeroPolicy is stored here on success.
+ *
+ * @return 1 if success, 0 if the value is unknown.
+ */
+int parseZeroPolicy(const std::string &str, int *policy) {
+  static const struct {
+    const char *name;
+    int policy;
+  } policies[] = {
+    { "write", ZERO_WRITE },
+    { "skip", ZERO_SKIP },
+    { "zeroout", ZERO_ZEROOUT },
+    { "discard", ZERO_DISCARD },
+  };
+  for (int i=0; i<(int)(sizeof(policies)/sizeof(policies[0])); i++) {
+    if (str.compare(policies[i].name) == 0) {
+      *policy = policies[i].policy;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * write a buffer to the device completely.
+ *
+ * @param outFD the device.
+ * @param buf the buffer.
+ * @param len the length of the buffer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int writeAll(int outFD, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w1 = write(outFD, buf, len);
+    if (w1 < 0) {
+      int errsv = errno;
+      if (errsv == EINTR) {
+	continue;
+      }
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_DEBUG, "write to device ended (%s)", errstr);
+      return -1;
+    }
+    buf += w1;
+    len -= (size_t)w1;
+  }
+  return 0;
+}
+
+/**
+ * write zeros over a range of the device.
+ *
+ * Used when BLKZEROOUT or BLKDISCARD cannot be applied to the range.
+ *
+ * @param w the writer.
+ * @param start the start of the range.
+ * @param len the length of the range.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int writeZeros(ZeroWriter *w, off_t start, off_t len) {
+  const size_t chunkSize = 1024*1024;
+  void *zeros = NULL;
+  /* aligned, so that it also works with O_DIRECT */
+  if (posix_memalign(&zeros, 4096, chunkSize) != 0) {
+    syslog(LOG_ERR, "Malloc buffer for %d bytes failed", (int)chunkSize);
+    return -1;
+  }
+  memset(zeros, 0, chunkSize);
+  int result = 0;
+  if (lseek(w->outFD, start, SEEK_SET) < 0) {
+    result = -1;
+  }
+  while (result == 0 && len > 0) {
+    size_t l1 = (len < (off_t)chunkSize) ? (size_t)len : chunkSize;
+    result = writeAll(w->outFD, (const char *)zeros, l1);
+    len -= (off_t)l1;
+  }
+  free(zeros);
+  return result;
+}
+
+/**
+ * act on the pending zero range by the policy.
+ *
+ * @param w the writer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int zeroWriterFlush(ZeroWriter *w) {
+  int result = 0;
+  if (w->zeroLen == 0) {
+    return 0;
+  }
+  if (w->policy == ZERO_ZEROOUT || w->policy == ZERO_DISCARD) {
+    uint64_t range[2] = { (uint64_t)w->zeroStart, (uint64_t)w->zeroLen };
+    unsigned long request = (w->policy == ZERO_ZEROOUT) ? BLKZEROOUT : BLKDISCARD;
+    if (ioctl(w->outFD, request, range) < 0) {
+      int errsv = errno;
+      char errbuf[1024];
+      char *errstr;
+      errstr = strerror_r(errsv, errbuf, sizeof(errbuf));
+      syslog(LOG_INFO, "%s is not supported by the device (%s), write zero blocks instead",
+	     (w->policy == ZERO_ZEROOUT) ? "BLKZEROOUT" : "BLKDISCARD", errstr);
+      result = writeZeros(w, w->zeroStart, w->zeroLen);
+      w->zeroTotal -= w->zeroLen;
+      w->policy = ZERO_WRITE;
+    }
+  }
+  if (result < 0 && w->index != NULL) {
+    blockIndexUpdate(w->index, w->zeroStart, (size_t)w->zeroLen, 0);
+  }
+  if (result == 0 && lseek(w->outFD, w->offset, SEEK_SET) < 0) {
+    result = -1;
+  }
+  w->zeroLen = 0;
+  w->seekPending = 0;
+  return result;
+}
+
+/**
+ * initialize a ZeroWriter.
+ *
+ * ZERO_ZEROOUT and ZERO_DISCARD need a block device; for other files they
+ * behave as ZERO_WRITE.
+ *
+ * @param w the writer.
+ * @param outFD the device, positioned where the data starts.
+ * @param policy the ZeroPolicy.
+ */
+void zeroWriterInit(ZeroWriter *w, int outFD, int policy) {
+  struct stat statbuf;
+  w->outFD = outFD;
+  w->policy = policy;
+  w->offset = lseek(outFD, 0, SEEK_CUR);
+  w->zeroStart = 0;
+  w->zeroLen = 0;
+  w->zeroTotal = 0;
+  w->compare = NULL;
+  w->index = NULL;
+  w->checksum = NULL;
+  w->verify = NULL;
+  w->checkpoint = NULL;
+  w->sameTotal = 0;
+  w->seekPending = 0;
+  if (w->offset < 0) {
+    w->offset = 0;
+    w->policy = ZERO_WRITE;
+  }
+  if ((w->policy == ZERO_ZEROOUT || w->policy == ZERO_DISCARD)
+      && (fstat(outFD, &statbuf) != 0 || !S_ISBLK(statbuf.st_mode))) {
+    syslog(LOG_INFO, "Not a block device, zero blocks are written");
+    w->policy = ZERO_WRITE;
+  }
+}
+
+/**
+ * write one block to the device, or skip it.
+ *
+ * A zero block is only recorded in the pending range. BLKZEROOUT and
+ * BLKDISCARD work on 512-byte sectors, so blocks which are not sector
+ * aligned are always written.
+ *
+ * @param w the writer.
+ * @param buf the block.
+ * @param len the length of the block.
+ *
+ * @return len on success, -1 on error.
+ */
+static ssize_t zeroWriterWriteBlock(ZeroWriter *w, const char *buf, size_t len) {
+  uint64_t hash = 0;
+  int same = 0;
+  if (w->compare != NULL) {
+    /* always called, so that the read-ahead stays in step */
+    same = compareReaderMatch(w->compare, buf, len);
+  }
+  if (w->index != NULL) {
+    hash = blockHash(buf, len);
+    if (!same) {
+      same = blockIndexMatch(w->index, w->offset, len, hash);
+    }
+  }
+  if (same) {
+    if (zeroWriterFlush(w) < 0) {
+      return -1;
+    }
+    if (w->index != NULL) {
+      blockIndexUpdate(w->index, w->offset, len, hash);
+    }
+    w->offset += (off_t)len;
+    w->sameTotal += (long long)len;
+    w->seekPending = 1;
+    return (ssize_t)len;
+  }
+  int eligible = (w->policy != ZERO_WRITE);
+  if (eligible && w->policy != ZERO_SKIP) {
+    eligible = (w->offset % 512 == 0) && (len % 512 == 0);
+  }
+  if (eligible && isZeroBlock(buf, len)) {
+    if (w->zeroLen == 0) {
+      w->zeroStart = w->offset;
+    }
+    w->zeroLen += (off_t)len;
+    w->zeroTotal += (long long)len;
+    if (w->index != NULL) {
+      /* skipped and discarded blocks may not read back as zeros */
+      blockIndexUpdate(w->index, w->offset, len, (w->policy == ZERO_ZEROOUT) ? hash : 0);
+    }
+    w->offset += (off_t)len;
+    return (ssize_t)len;
+  }
+  if (zeroWriterFlush(w) < 0) {
+    return -1;
+  }
+  if (w->seekPending) {
+    if (lseek(w->outFD, w->offset, SEEK_SET) < 0) {
+      return -1;
+    }
+    w->seekPending = 0;
+  }
+  if (writeAll(w->outFD, buf, len) < 0) {
+    if (w->index != NULL) {
+      blockIndexUpdate(w->index, w->offset, len, 0);
+    }
+    return -1;
+  }
+  if (w->index != NULL) {
+    blockIndexUpdate(w->index, w->offset, len, hash);
+  }
+  w->offset += (off_t)len;
+  return (ssize_t)len;
+}
+
+/**
+ * write one block to the device.
+ *
+ * Every block is added to the checksum, whether it is written or not.
+ * Blocks which are skipped or discarded are passed over by the verifier,
+ * all others are added to it. A checkpoint is saved every interval bytes.
+ *
+ * @param w the writer.
+ * @param buf the block.
+ * @param len the length of the block.
+ *
+ * @return len on success, -1 on error.
+ */
+ssize_t zeroWriterWrite(ZeroWriter *w, const char *buf, size_t len) {
+  if (w->checksum != NULL) {
+    checksumUpdate(w->checksum, buf, len);
+  }
+  long long zeroTotal = w->zeroTotal;
+  ssize_t result = zeroWriterWriteBlock(w, buf, len);
+  if (w->verify != NULL) {
+    if (w->zeroTotal > zeroTotal && (w->policy == ZERO_SKIP || w->policy == ZERO_DISCARD)) {
+      verifierSkip(w->verify, len);
+    } else {
+      verifierAdd(w->verify, buf, len);
+    }
+  }
+  /* the pending zero range is not on the device yet */
+  off_t written = (w->zeroLen > 0) ? w->zeroStart : w->offset;
+  if (result >= 0 && w->verify != NULL) {
+    verifierWritten(w->verify, written);
+  }
+  if (result >= 0 && w->checkpoint != NULL && written - w->checkpoint->durable >= w->checkpoint->interval) {
+    checkpointSave(w->checkpoint, written);
+  }
+  return result;
+}
+
+/**
+ * act on the last zero range and leave the file position after the data.
+ *
+ * If a regular file ends with skipped blocks, it is extended to its full
+ * size as dd conv=sparse does.
+ *
+ * @param w the writer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int zeroWriterFinish(ZeroWriter *w) {
+  struct stat statbuf;
+  if (zeroWriterFlush(w) < 0) {
+    return -1;
+  }
+  if (w->seekPending && lseek(w->outFD, w->offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  if (fstat(w->outFD, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size < w->offset) {
+    if (ftruncate(w->outFD, w->offset) < 0) {
+      return -1;
+    }
+  }
+  if (w->verify != NULL) {
+    verifierWritten(w->verify, w->offset);
+  }
+  return 0;
+}
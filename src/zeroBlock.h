@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2017 Linaro
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADER_UMS2NET_ZERO_BLOCK_HEAD1_H
+#define _HEADER_UMS2NET_ZERO_BLOCK_HEAD1_H
+
+#include <string>
+#include <sys/types.h>
+
+#include "compareReader.h"
+#include "blockIndex.h"
+#include "checksum.h"
+#include "verifier.h"
+#include "checkpoint.h"
+
+/**
+ * What to do with a block that contains only zeros.
+ */
+enum ZeroPolicy {
+  ZERO_WRITE = 0, ///< write it like any other block
+  ZERO_SKIP, ///< seek over it (dd conv=sparse)
+  ZERO_ZEROOUT, ///< zero the range with BLKZEROOUT
+  ZERO_DISCARD, ///< discard the range with BLKDISCARD
+};
+
+/**
+ * Writes blocks to the device, handling zero blocks by a ZeroPolicy.
+ *
+ * Adjacent zero blocks are merged into one range, which is only acted on
+ * when a non-zero block follows or zeroWriterFinish() is called. If compare
+ * or index is set, blocks which are already on the device are not written
+ * at all. If checksum or verify is set, every block is passed to it. If
+ * checkpoint is set, the device is synced and the offset saved regularly.
+ */
+struct ZeroWriter {
+  int outFD; ///< the device
+  int policy; ///< the ZeroPolicy
+  off_t offset; ///< the device offset of the next block
+  off_t zeroStart; ///< start of the pending zero range
+  off_t zeroLen; ///< length of the pending zero range
+  long long zeroTotal; ///< bytes not written because they were zero
+  CompareReader *compare; ///< if not NULL, the device is read ahead
+  BlockIndex *index; ///< if not NULL, the hashes of the device blocks
+  Checksum *checksum; ///< if not NULL, the checksum of the data
+  Verifier *verify; ///< if not NULL, the device is read back
+  Checkpoint *checkpoint; ///< if not NULL, the progress is saved
+  long long sameTotal; ///< bytes not written because they were the same
+  int seekPending; ///< the file position is behind offset
+};
+
+int isZeroBlock(const char *buf, size_t len);
+int parseZeroPolicy(const std::string &, int *);
+void zeroWriterInit(ZeroWriter *w, int outFD, int policy);
+ssize_t zeroWriterWrite(ZeroWriter *w, const char *buf, size_t len);
+int zeroWriterFinish(ZeroWriter *w);
+
+#endif /* _HEADER_UMS2NET_ZERO_BLOCK_HEAD1_H */